@@ -0,0 +1,442 @@
+#ifndef compact_graph_dom_hpp
+#define compact_graph_dom_hpp
+
+#include "graph_dom.hpp"
+#include "typed_data_interner.hpp"
+
+#include <string_view>
+
+/*
+Compact alternative to GraphDOM for large graphs, taking tens of bytes
+per edge rather than kilobytes:
+
+- Devices are numbered in the order they were loaded. Ids are packed into one
+  character buffer, and types are a small index into deviceTypes.
+- Edges are stored in CSR form grouped by destination device, and refer to
+  source devices by number and pins by their index within the device type.
+- Properties and state (of devices and edges) are interned, so each distinct
+  value is stored once and referred to by a 32-bit index.
+- Metadata is only kept if asked for when building, and then only for the
+  devices and edges that have any.
+
+Unlike GraphDOM it is built in one go by CompactGraphDOMBuilder, and is then
+read-only. Lookup by id uses a sorted index built when the graph is finished.
+*/
+struct CompactGraphDOM
+{
+    using device_index_t = uint32_t;
+    using data_index_t = uint32_t;
+
+    struct Edge
+    {
+        device_index_t srcDevice;
+        uint16_t dstPin;     // Index within the destination device type
+        uint16_t srcPin;     // Index within the source device type
+        int32_t sendIndex;
+        data_index_t properties;
+        data_index_t state;
+    };
+
+    GraphTypePtr graphType;
+    std::string id;
+    TypedDataPtr properties;
+    rapidjson::Document metadata;
+
+    std::vector<DeviceTypePtr> deviceTypes;
+
+    // Per device
+    std::vector<char> idChars;
+    std::vector<uint64_t> idOffsets{0}; // Device i has chars [idOffsets[i],idOffsets[i+1])
+    std::vector<uint16_t> deviceTypeIndices;
+    std::vector<data_index_t> deviceProperties;
+    std::vector<data_index_t> deviceState;
+    std::vector<device_index_t> sortedDevices; // Device indices in id order
+
+    // Edges into device i are edges[edgeOffsets[i]..edgeOffsets[i+1])
+    std::vector<uint64_t> edgeOffsets;
+    std::vector<Edge> edges;
+
+    // Only the devices and edges with metadata appear
+    robin_hood::unordered_map<uint64_t,rapidjson::Document> deviceMetadata;
+    robin_hood::unordered_map<uint64_t,rapidjson::Document> edgeMetadata; // By position in edges
+
+    TypedDataInterner payloads{POETSHashAlgorithm::Fast};
+
+    size_t device_count() const
+    { return deviceTypeIndices.size(); }
+
+    size_t edge_count() const
+    { return edges.size(); }
+
+    std::string_view device_id(device_index_t i) const
+    { return std::string_view(idChars.data()+idOffsets[i], idOffsets[i+1]-idOffsets[i]); }
+
+    const DeviceTypePtr &device_type(device_index_t i) const
+    { return deviceTypes[deviceTypeIndices[i]]; }
+
+    const TypedDataPtr &payload(data_index_t i) const
+    { return payloads.indexToEntry(i)->data; }
+
+    const TypedDataPtr &device_properties(device_index_t i) const
+    { return payload(deviceProperties[i]); }
+
+    const TypedDataPtr &device_state(device_index_t i) const
+    { return payload(deviceState[i]); }
+
+    const InputPinPtr &edge_dst_pin(device_index_t dst, const Edge &e) const
+    { return device_type(dst)->getInput(e.dstPin); }
+
+    const OutputPinPtr &edge_src_pin(const Edge &e) const
+    { return device_type(e.srcDevice)->getOutput(e.srcPin); }
+
+    // Returns -1 if there is no such device
+    int64_t find_device(std::string_view id) const
+    {
+        auto it=std::lower_bound(sortedDevices.begin(), sortedDevices.end(), id, [&](device_index_t a, std::string_view b){
+            return device_id(a) < b;
+        });
+        if(it==sortedDevices.end() || device_id(*it)!=id){
+            return -1;
+        }
+        return *it;
+    }
+
+    // Approximate, ignoring allocator overheads and the graph type
+    size_t memory_usage() const
+    {
+        size_t acc=idChars.capacity() + idOffsets.capacity()*sizeof(uint64_t)
+            + deviceTypeIndices.capacity()*sizeof(uint16_t)
+            + (deviceProperties.capacity()+deviceState.capacity())*sizeof(data_index_t)
+            + sortedDevices.capacity()*sizeof(device_index_t)
+            + edgeOffsets.capacity()*sizeof(uint64_t)
+            + edges.capacity()*sizeof(Edge);
+        for(unsigned i=0; i<payloads.size(); i++){
+            const auto &p=payloads.indexToEntry(i)->data;
+            acc += sizeof(TypedDataInterner::entry_t) + (p ? p.payloadSize()+sizeof(typed_data_t) : 0);
+        }
+        return acc;
+    }
+};
+
+
+class CompactGraphDOMBuilder
+    : public GraphLoadEvents
+{
+private:
+    bool m_keepMetadata;
+
+    robin_hood::unordered_map<const DeviceType*,uint16_t> m_typeIndices;
+
+    // Edges are collected in arrival order, then sorted into CSR at the end
+    std::vector<CompactGraphDOM::device_index_t> m_edgeDsts;
+    std::vector<CompactGraphDOM::Edge> m_edges;
+    robin_hood::unordered_map<uint64_t,rapidjson::Document> m_edgeMetadata;
+
+    CompactGraphDOM::data_index_t intern(const TypedDataPtr &p)
+    {
+        size_t index=g.payloads.intern(p)->index;
+        if(index>=0xFFFFFFFFull){
+            throw std::runtime_error("CompactGraphDOM : too many distinct payloads.");
+        }
+        return index;
+    }
+
+    bool has_metadata(const rapidjson::Document &d) const
+    { return m_keepMetadata && d.IsObject() && d.MemberCount()>0; }
+
+    void finish()
+    {
+        size_t n=g.device_count();
+
+        g.sortedDevices.resize(n);
+        for(size_t i=0; i<n; i++){
+            g.sortedDevices[i]=i;
+        }
+        std::sort(g.sortedDevices.begin(), g.sortedDevices.end(), [&](uint32_t a, uint32_t b){
+            return g.device_id(a) < g.device_id(b);
+        });
+        for(size_t i=1; i<n; i++){
+            if(g.device_id(g.sortedDevices[i-1])==g.device_id(g.sortedDevices[i])){
+                throw std::runtime_error("Duplicate device id");
+            }
+        }
+
+        g.edgeOffsets.assign(n+1, 0);
+        for(auto d : m_edgeDsts){
+            g.edgeOffsets[d+1]++;
+        }
+        for(size_t i=0; i<n; i++){
+            g.edgeOffsets[i+1]+=g.edgeOffsets[i];
+        }
+        std::vector<uint64_t> pos(g.edgeOffsets.begin(), g.edgeOffsets.end()-1);
+        g.edges.resize(m_edges.size());
+        for(size_t i=0; i<m_edges.size(); i++){
+            uint64_t j=pos[m_edgeDsts[i]]++;
+            g.edges[j]=m_edges[i];
+            auto it=m_edgeMetadata.find(i);
+            if(it!=m_edgeMetadata.end()){
+                g.edgeMetadata.insert({j, std::move(it->second)});
+            }
+        }
+        std::vector<CompactGraphDOM::device_index_t>().swap(m_edgeDsts);
+        std::vector<CompactGraphDOM::Edge>().swap(m_edges);
+        m_edgeMetadata.clear();
+
+        // Edges into each device are in arrival order, so duplicates needn't be adjacent
+        std::vector<uint64_t> keys;
+        for(size_t d=0; d<n; d++){
+            keys.clear();
+            for(uint64_t j=g.edgeOffsets[d]; j<g.edgeOffsets[d+1]; j++){
+                const auto &e=g.edges[j];
+                keys.push_back( (uint64_t(e.srcDevice)<<32) | (uint32_t(e.srcPin)<<16) | e.dstPin );
+            }
+            std::sort(keys.begin(), keys.end());
+            if(std::adjacent_find(keys.begin(), keys.end())!=keys.end()){
+                throw std::runtime_error("Duplicate edge id.");
+            }
+        }
+    }
+
+public:
+    CompactGraphDOM g;
+
+    CompactGraphDOMBuilder(bool keepMetadata=false)
+        : m_keepMetadata(keepMetadata)
+    {}
+
+    bool parseMetaData() const override
+    { return m_keepMetadata; }
+
+    uint64_t onBeginGraphInstance(
+        const GraphTypePtr &graph,
+        const std::string &id,
+        const TypedDataPtr &properties,
+        rapidjson::Document &&metadata
+    ) override {
+        g.graphType=graph;
+        g.id=id;
+        g.properties=properties;
+        g.metadata=std::move(metadata);
+        return 17;
+    }
+
+    uint64_t onDeviceInstance
+    (
+        uint64_t graphInst,
+        const DeviceTypePtr &dt,
+        const std::string &id,
+        const TypedDataPtr &properties,
+        const TypedDataPtr &state,
+        rapidjson::Document &&metadata=rapidjson::Document()
+    ) override {
+        auto index=g.device_count();
+        if(index>=0xFFFFFFFFull){
+            throw std::runtime_error("CompactGraphDOM : too many devices.");
+        }
+
+        auto it=m_typeIndices.find(dt.get());
+        if(it==m_typeIndices.end()){
+            if(g.deviceTypes.size()>=0xFFFF){
+                throw std::runtime_error("CompactGraphDOM : too many device types.");
+            }
+            it=m_typeIndices.insert({dt.get(), uint16_t(g.deviceTypes.size())}).first;
+            g.deviceTypes.push_back(dt);
+        }
+
+        g.idChars.insert(g.idChars.end(), id.begin(), id.end());
+        g.idOffsets.push_back(g.idChars.size());
+        g.deviceTypeIndices.push_back(it->second);
+        g.deviceProperties.push_back(intern(properties));
+        g.deviceState.push_back(intern(state));
+        if(has_metadata(metadata)){
+            g.deviceMetadata.insert({index, std::move(metadata)});
+        }
+        return index;
+    }
+
+    void onEdgeInstance
+    (
+        uint64_t graphInst,
+        uint64_t dstDevInst, const DeviceTypePtr &dstDevType, const InputPinPtr &dstPin,
+        uint64_t srcDevInst,  const DeviceTypePtr &srcDevType, const OutputPinPtr &srcPin,
+        int sendIndex, // -1 if it is not indexed pin, or if index is not explicitly specified
+        const TypedDataPtr &properties,
+        const TypedDataPtr &state,
+        rapidjson::Document &&metadata=rapidjson::Document()
+    ) override {
+        if(dstDevInst>=g.device_count() || srcDevInst>=g.device_count()){
+            throw std::runtime_error("CompactGraphDOM : edge refers to unknown device.");
+        }
+        if(dstPin->getIndex()>0xFFFF || srcPin->getIndex()>0xFFFF){
+            throw std::runtime_error("CompactGraphDOM : pin index too large.");
+        }
+        if(has_metadata(metadata)){
+            m_edgeMetadata.insert({m_edges.size(), std::move(metadata)});
+        }
+        m_edgeDsts.push_back(dstDevInst);
+        m_edges.push_back(CompactGraphDOM::Edge{
+            CompactGraphDOM::device_index_t(srcDevInst),
+            uint16_t(dstPin->getIndex()), uint16_t(srcPin->getIndex()),
+            sendIndex,
+            intern(properties), intern(state)
+        });
+    }
+
+    void onEndGraphInstance(uint64_t graphInst) override
+    {
+        finish();
+    }
+};
+
+
+/* Same checks as validate_graph(const GraphDOM&). Device and pin types are
+   stored by index into the device type, so are always owned by it, and
+   duplicate ids and edges are rejected while building. */
+inline void validate_graph(const CompactGraphDOM &graph)
+{
+    auto check_valid_id=[&](std::string_view id)
+    {
+        if(id.empty()){
+            throw GraphValidationError("Found an empty device id.");
+        }
+        if(!isalpha(id.front())){
+            throw GraphValidationError("Found invalid id : "+std::string(id));
+        }
+        for(unsigned i=1; i<id.size(); i++){
+            if(!(isalnum(id[i]) || (id[i]=='_'))){
+                throw GraphValidationError("Found invalid id : "+std::string(id));
+            }
+        }
+    };
+
+    auto check_valid_data=[&](const TypedDataSpecPtr &spec, const TypedDataPtr &value, const char *name)
+    {
+        if(value){
+            if(value.payloadSize() != spec->payloadSize()){
+                std::stringstream tmp;
+                tmp<<"Invalid data size for "<<name<<", expected "<<spec->payloadSize()<<", got "<<value.payloadSize();
+                throw GraphValidationError(tmp.str());
+            }
+        }
+    };
+
+    GraphTypePtr gt=graph.graphType;
+    if(!gt){
+        throw GraphValidationError("No graphType.");
+    }
+    check_valid_id(graph.id);
+    check_valid_data(gt->getPropertiesSpec(), graph.properties, "graph properties");
+
+    for(const auto &dt : graph.deviceTypes){
+        DeviceTypePtr ref=gt->getDeviceType(dt->getId());
+        if(!ref){
+            throw GraphValidationError("No device type with id "+dt->getId()+" in graph.");
+        }
+        if(ref!=dt){
+            throw GraphValidationError("Different DeviceType pointers, event though ids match - this method requires pointer equality.");
+        }
+    }
+
+    for(CompactGraphDOM::device_index_t d=0; d<graph.device_count(); d++){
+        const auto &dt=graph.device_type(d);
+        try{
+            check_valid_id(graph.device_id(d));
+            check_valid_data(dt->getPropertiesSpec(), graph.device_properties(d), "properties");
+            check_valid_data(dt->getStateSpec(), graph.device_state(d), "state");
+        }catch(const GraphValidationError &e){
+            throw GraphValidationError("While processing device "+std::string(graph.device_id(d))+" : "+e.what());
+        }
+
+        for(uint64_t j=graph.edgeOffsets[d]; j<graph.edgeOffsets[d+1]; j++){
+            const auto &e=graph.edges[j];
+            const auto &dst_p=graph.edge_dst_pin(d, e);
+            const auto &src_p=graph.edge_src_pin(e);
+            try{
+                check_valid_data(dst_p->getPropertiesSpec(), graph.payload(e.properties), "properties");
+                check_valid_data(dst_p->getStateSpec(), graph.payload(e.state), "state");
+            }catch(const GraphValidationError &ex){
+                std::string edge=std::string(graph.device_id(d))+":"+dst_p->getName()+"-"+std::string(graph.device_id(e.srcDevice))+":"+src_p->getName();
+                throw GraphValidationError("While processing edge "+edge+" : "+ex.what());
+            }
+        }
+    }
+}
+
+/* Devices are written in id order, as GraphDOM does. Edges are written
+   grouped by destination device in the same order, rather than sorted by
+   source, so the file can differ from GraphDOM's though the graph is the same. */
+inline void save_impl(CompactGraphDOM &g, GraphLoadEvents *events, bool destroy_graph)
+{
+    bool doMetadata=events->parseMetaData();
+
+    auto meta=[=](robin_hood::unordered_map<uint64_t,rapidjson::Document> &m, uint64_t i) -> rapidjson::Document
+    {
+        rapidjson::Document ret;
+        if(doMetadata){
+            auto it=m.find(i);
+            if(it!=m.end()){
+                if(destroy_graph){
+                    ret=std::move(it->second);
+                }else{
+                    ret.CopyFrom(it->second, ret.GetAllocator());
+                }
+            }
+        }
+        return ret;
+    };
+
+    rapidjson::Document graphMeta;
+    if(doMetadata){
+        if(destroy_graph){
+            graphMeta=std::move(g.metadata);
+        }else{
+            graphMeta.CopyFrom(g.metadata, graphMeta.GetAllocator());
+        }
+    }
+
+    events->onGraphType(g.graphType);
+    auto gid=events->onBeginGraphInstance(g.graphType, g.id, g.properties, std::move(graphMeta));
+
+    std::vector<uint64_t> indices(g.device_count());
+
+    events->onBeginDeviceInstances(gid);
+    for(auto d : g.sortedDevices){
+        indices[d]=events->onDeviceInstance(gid,
+            g.device_type(d), std::string(g.device_id(d)),
+            g.device_properties(d), g.device_state(d),
+            meta(g.deviceMetadata, d)
+        );
+    }
+    events->onEndDeviceInstances(gid);
+
+    events->onBeginEdgeInstances(gid);
+    for(auto d : g.sortedDevices){
+        for(uint64_t j=g.edgeOffsets[d]; j<g.edgeOffsets[d+1]; j++){
+            const auto &e=g.edges[j];
+            const auto &dstPin=g.edge_dst_pin(d, e);
+            const auto &srcPin=g.edge_src_pin(e);
+            events->onEdgeInstance(gid,
+                indices[d], dstPin->getDeviceType(), dstPin,
+                indices[e.srcDevice], srcPin->getDeviceType(), srcPin,
+                e.sendIndex,
+                g.payload(e.properties), g.payload(e.state),
+                meta(g.edgeMetadata, j)
+            );
+        }
+    }
+    events->onEndEdgeInstances(gid);
+
+    events->onEndGraphInstance(gid);
+}
+
+inline void save(CompactGraphDOM &&g, GraphLoadEvents *events)
+{
+    save_impl(g, events, true);
+}
+
+inline void save(const CompactGraphDOM &g, GraphLoadEvents *events)
+{
+    save_impl(const_cast<CompactGraphDOM&>(g), events, false);
+}
+
+#endif
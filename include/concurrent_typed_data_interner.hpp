@@ -0,0 +1,325 @@
+#ifndef concurrent_typed_data_interner_hpp
+#define concurrent_typed_data_interner_hpp
+
+#include "graph_core.hpp"
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdio>
+
+/* Interner for typed data that can be shared between threads and holds
+   millions of values cheaply.
+
+   - The hash space is split into 2^shardBits shards by the top bits of the
+     payload hash, each with its own mutex, so threads only contend when they
+     intern values landing in the same shard.
+   - Each shard has an open-addressing (linear probing) table of (hash,entry)
+     pairs, so lookups that miss on the hash never touch the payload.
+   - Entries live in append-only arenas owned by the shard: a small header
+     followed by a complete typed_data_t image. Entries never move, so the
+     pointers handed out stay valid for the life of the interner.
+   - Every entry gets a compact 32-bit index, (local << shardBits) | shard,
+     and indexToEntry looks that up without taking any locks.
+
+   Null pointers are interned as their own entry, distinct from an empty
+   payload.
+*/
+class ConcurrentTypedDataInterner
+{
+public:
+    typedef uint32_t index_t;
+
+    struct entry_t
+    {
+        uint64_t hash;
+        index_t index;
+        uint32_t size; // Total size of the typed_data_t image, or 0 for null
+
+        // Points into the arena, so must not be modified or reference counted
+        const typed_data_t *get() const
+        { return size ? (const typed_data_t*)(this+1) : nullptr; }
+
+        const uint8_t *payloadPtr() const
+        { return size ? get()->payloadPtr() : nullptr; }
+
+        size_t payloadSize() const
+        { return size ? size-sizeof(typed_data_t) : 0; }
+
+        // Returns a fresh unique copy, e.g. as the starting point of a new state
+        TypedDataPtr clone() const
+        {
+            if(!size){
+                return TypedDataPtr();
+            }
+            typed_data_t *p=(typed_data_t*)malloc(size);
+            memcpy((void*)p, get(), size);
+            p->_ref_count=0;
+            return TypedDataPtr(p);
+        }
+    };
+    static_assert(sizeof(entry_t)%8==0, "Entry header must keep the typed_data_t image 8-byte aligned.");
+
+    struct memory_usage_t
+    {
+        size_t entries=0;
+        size_t payloadBytes=0;   // Sum of payload sizes
+        size_t entryBytes=0;     // Entry headers plus typed_data_t images, as stored
+        size_t arenaBytes=0;     // Allocated arena blocks
+        size_t tableBytes=0;     // Open addressing tables
+        size_t directoryBytes=0; // Index to entry directories
+
+        size_t totalBytes() const
+        { return arenaBytes+tableBytes+directoryBytes; }
+    };
+private:
+    static const unsigned ARENA_FIRST_BLOCK_BYTES=1<<12;
+    static const unsigned ARENA_MAX_BLOCK_BYTES=1<<18;
+    static const unsigned INITIAL_TABLE_SIZE=16;
+    static const unsigned DIR_FIRST_LOG2=8;  // Chunk k of the directory holds 2^(k+DIR_FIRST_LOG2) entries
+    static const unsigned DIR_MAX_CHUNKS=32;
+
+    struct slot_t
+    {
+        uint64_t hash;
+        const entry_t *entry; // nullptr if empty
+    };
+
+    struct alignas(64) shard_t
+    {
+        std::mutex mutex;
+
+        std::vector<slot_t> table;
+        size_t count=0;
+
+        std::vector<std::unique_ptr<uint64_t[]>> blocks;
+        uint8_t *arenaPos=nullptr;
+        size_t arenaLeft=0;
+        size_t arenaBytes=0;
+        size_t entryBytes=0;
+        size_t payloadBytes=0;
+
+        // Written under the mutex before any index in the chunk is handed out
+        std::atomic<const entry_t **> directory[DIR_MAX_CHUNKS];
+
+        shard_t()
+        {
+            for(auto &d : directory){
+                d.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~shard_t()
+        {
+            for(auto &d : directory){
+                delete [] d.load(std::memory_order_relaxed);
+            }
+        }
+    };
+
+    POETSHashAlgorithm m_algorithm;
+    unsigned m_shardBits;
+    std::unique_ptr<shard_t[]> m_shards;
+    std::atomic<size_t> m_size;
+
+    static void directory_position(size_t local, unsigned &chunk, size_t &offset)
+    {
+        size_t j=local+(size_t(1)<<DIR_FIRST_LOG2);
+        unsigned msb=0;
+        while(j>>(msb+1)){
+            msb++;
+        }
+        chunk=msb-DIR_FIRST_LOG2;
+        offset=j-(size_t(1)<<msb);
+    }
+
+    static bool equal(const entry_t *e, const typed_data_t *p, uint32_t size)
+    {
+        if(e->size!=size){
+            return false;
+        }
+        if(!size){
+            return true;
+        }
+        return 0==memcmp(e->get()->payloadPtr(), p->payloadPtr(), size-sizeof(typed_data_t));
+    }
+
+    unsigned shard_of(uint64_t hash) const
+    { return m_shardBits ? unsigned(hash>>(64-m_shardBits)) : 0; }
+
+    uint8_t *arena_alloc(shard_t &s, size_t bytes)
+    {
+        bytes=(bytes+7)&~size_t(7);
+        if(bytes > s.arenaLeft){
+            // Blocks double up to a limit, so lightly used shards stay small
+            size_t blockBytes=std::min<size_t>(ARENA_MAX_BLOCK_BYTES, std::max<size_t>(ARENA_FIRST_BLOCK_BYTES, s.arenaBytes));
+            blockBytes=std::max<size_t>(blockBytes, bytes);
+            s.blocks.emplace_back(new uint64_t[blockBytes/8]);
+            s.arenaPos=(uint8_t*)s.blocks.back().get();
+            s.arenaLeft=blockBytes;
+            s.arenaBytes+=blockBytes;
+        }
+        uint8_t *res=s.arenaPos;
+        s.arenaPos+=bytes;
+        s.arenaLeft-=bytes;
+        return res;
+    }
+
+    static void table_insert(std::vector<slot_t> &table, uint64_t hash, const entry_t *entry)
+    {
+        size_t mask=table.size()-1;
+        size_t i=hash&mask;
+        while(table[i].entry){
+            i=(i+1)&mask;
+        }
+        table[i].hash=hash;
+        table[i].entry=entry;
+    }
+
+    static void table_grow(shard_t &s)
+    {
+        std::vector<slot_t> bigger(s.table.size()*2, slot_t{0,nullptr});
+        for(const auto &slot : s.table){
+            if(slot.entry){
+                table_insert(bigger, slot.hash, slot.entry);
+            }
+        }
+        s.table.swap(bigger);
+    }
+
+    const entry_t *intern_impl(const typed_data_t *p)
+    {
+        uint32_t size=p ? p->_total_size_bytes : 0;
+        uint64_t hash=p ? POETSHashBytes(m_algorithm, p->payloadPtr(), p->payloadSize())
+                        : POETSHashBytes(m_algorithm, nullptr, 0);
+
+        unsigned shardIndex=shard_of(hash);
+        shard_t &s=m_shards[shardIndex];
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        size_t mask=s.table.size()-1;
+        size_t i=hash&mask;
+        while(s.table[i].entry){
+            if(s.table[i].hash==hash && equal(s.table[i].entry, p, size)){
+                return s.table[i].entry;
+            }
+            i=(i+1)&mask;
+        }
+
+        size_t local=s.count;
+        if( (uint64_t(local+1) << m_shardBits) > (uint64_t(1)<<32) ){
+            throw std::runtime_error("ConcurrentTypedDataInterner : index space exhausted.");
+        }
+
+        unsigned chunk;
+        size_t offset;
+        directory_position(local, chunk, offset);
+        const entry_t **dir=s.directory[chunk].load(std::memory_order_relaxed);
+        if(!dir){
+            dir=new const entry_t *[size_t(1)<<(chunk+DIR_FIRST_LOG2)];
+            s.directory[chunk].store(dir, std::memory_order_release);
+        }
+
+        entry_t *e=(entry_t*)arena_alloc(s, sizeof(entry_t)+size);
+        e->hash=hash;
+        e->index=index_t( (local<<m_shardBits) | shardIndex );
+        e->size=size;
+        if(size){
+            typed_data_t *img=(typed_data_t*)(e+1);
+            memcpy((void*)img, (const void*)p, size);
+            img->_ref_count=0;
+            s.payloadBytes+=size-sizeof(typed_data_t);
+        }
+        s.entryBytes+=sizeof(entry_t)+size;
+
+        dir[offset]=e;
+        s.table[i].hash=hash;
+        s.table[i].entry=e;
+        s.count++;
+        m_size.fetch_add(1, std::memory_order_relaxed);
+
+        // Keep the load factor under 0.7 so probe sequences stay short
+        if(s.count*10 >= s.table.size()*7){
+            table_grow(s);
+        }
+        return e;
+    }
+public:
+    ConcurrentTypedDataInterner(POETSHashAlgorithm algorithm=POETSHashAlgorithm::Fast, unsigned shardBits=6)
+        : m_algorithm(algorithm)
+        , m_shardBits(shardBits)
+        , m_size(0)
+    {
+        if(shardBits>16){
+            throw std::runtime_error("ConcurrentTypedDataInterner : too many shards.");
+        }
+        m_shards.reset(new shard_t[size_t(1)<<shardBits]);
+        for(unsigned i=0; i<(1u<<shardBits); i++){
+            m_shards[i].table.assign(INITIAL_TABLE_SIZE, slot_t{0,nullptr});
+        }
+    }
+
+    ConcurrentTypedDataInterner(const ConcurrentTypedDataInterner &)=delete;
+    ConcurrentTypedDataInterner &operator=(const ConcurrentTypedDataInterner &)=delete;
+
+    POETSHashAlgorithm getAlgorithm() const
+    { return m_algorithm; }
+
+    // Thread-safe. The returned entry is owned by the interner.
+    const entry_t *intern(const TypedDataPtr &o)
+    { return intern_impl(o.get()); }
+
+    const entry_t *intern(const typed_data_t *p)
+    { return intern_impl(p); }
+
+    index_t internToIndex(const TypedDataPtr &o)
+    { return intern_impl(o.get())->index; }
+
+    /* Lock-free. The index must have come from this interner, and been
+       passed to this thread with the usual synchronisation. */
+    const entry_t *indexToEntry(index_t index) const
+    {
+        unsigned shardIndex=index & ((1u<<m_shardBits)-1);
+        unsigned chunk;
+        size_t offset;
+        directory_position(index>>m_shardBits, chunk, offset);
+        const entry_t **dir=m_shards[shardIndex].directory[chunk].load(std::memory_order_acquire);
+        assert(dir);
+        return dir[offset];
+    }
+
+    size_t size() const
+    { return m_size.load(std::memory_order_relaxed); }
+
+    memory_usage_t memoryUsage() const
+    {
+        memory_usage_t res;
+        for(unsigned i=0; i<(1u<<m_shardBits); i++){
+            shard_t &s=m_shards[i];
+            std::lock_guard<std::mutex> lock(s.mutex);
+            res.entries+=s.count;
+            res.payloadBytes+=s.payloadBytes;
+            res.entryBytes+=s.entryBytes;
+            res.arenaBytes+=s.arenaBytes;
+            res.tableBytes+=s.table.size()*sizeof(slot_t);
+            for(unsigned c=0; c<DIR_MAX_CHUNKS; c++){
+                if(s.directory[c].load(std::memory_order_relaxed)){
+                    res.directoryBytes+=(size_t(1)<<(c+DIR_FIRST_LOG2))*sizeof(entry_t*);
+                }
+            }
+        }
+        return res;
+    }
+
+    void printMemoryReport(FILE *dst) const
+    {
+        auto m=memoryUsage();
+        fprintf(dst, "Interner: entries=%zu, payload=%zu bytes, stored=%zu bytes, arena=%zu bytes, table=%zu bytes, directory=%zu bytes, total=%zu bytes (%.1f bytes/entry)\n",
+            m.entries, m.payloadBytes, m.entryBytes, m.arenaBytes, m.tableBytes, m.directoryBytes, m.totalBytes(),
+            m.entries ? m.totalBytes()/double(m.entries) : 0.0
+        );
+    }
+};
+
+#endif
@@ -12,6 +12,13 @@
 #include <queue>
 #include <thread>
 
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+
 struct external_message_t
 {
   bool isMulticast;
@@ -27,6 +34,9 @@ class ExternalConnection
 private:
   
 public:
+  virtual ~ExternalConnection()
+  {}
+
   virtual void onExternalEdgeInstance(
     const char *dstDevId, unsigned dstDevAddress, const DeviceTypePtr &dstDevType, const InputPinPtr &dstInput,
     const char *srcDevId, unsigned srcDevAddress, const DeviceTypePtr &srcDevType, const OutputPinPtr &srcOutput
@@ -42,6 +52,10 @@ public:
     const external_message_t &msg
   ) =0;
 
+  //! Push any messages that have been batched up by write out to the other side
+  virtual void flush()
+  {}
+
   // Return true if more messages might come down the wire at some point
   virtual bool isReadOpen() =0;
 
@@ -61,6 +75,7 @@ class JSONExternalConnection
 private:
   FILE *m_dst;
   FILE *m_src;
+  bool m_ownsStreams;
 
 
   std::vector<std::pair<std::string,DeviceTypePtr> > m_deviceAddressToIdAndType;
@@ -74,20 +89,55 @@ private:
   std::queue<external_message_t> m_readerQueue;
 
 public:
-  JSONExternalConnection(FILE *src, FILE *dst)
+  /*! If ownsStreams is true the streams are closed when the connection is
+      destroyed. The source can only be closed once the reader thread has
+      stopped, so if it is not a socket (which can be shut down to wake the
+      reader) and the reader is still blocked, the source is left open. */
+  JSONExternalConnection(FILE *src, FILE *dst, bool ownsStreams=false)
     : m_dst(dst)
     , m_src(src)
+    , m_ownsStreams(ownsStreams)
+    , m_readerThread(nullptr)
     , m_readerThreadRunning(false)
   {
   }
 
   ~JSONExternalConnection()
   {
-    // TODO: this is quite thread unsafe
-    if(m_readerThreadRunning){
-        // THis causes a terminate() for obvious reasons when
-        // the main thread shuts normally. Just letting the thing die.
-      //m_readerThread->join();
+    if(!m_ownsStreams){
+      // TODO: this is quite thread unsafe
+      if(m_readerThreadRunning){
+          // THis causes a terminate() for obvious reasons when
+          // the main thread shuts normally. Just letting the thing die.
+        //m_readerThread->join();
+      }
+      return;
+    }
+
+    if(m_dst){
+      fclose(m_dst);
+    }
+    if(m_src){
+      bool running;
+      {
+        std::unique_lock<std::mutex> lock_guard(m_mutex);
+        running=m_readerThreadRunning;
+      }
+      struct stat st;
+      bool isSocket = fstat(fileno(m_src), &st)==0 && S_ISSOCK(st.st_mode);
+      if(running && isSocket){
+        shutdown(fileno(m_src), SHUT_RD);
+        running=false;
+      }
+      if(!running){
+        if(m_readerThread){
+          m_readerThread->join();
+          delete m_readerThread;
+        }
+        fclose(m_src);
+      }else{
+        m_readerThread->detach();
+      }
     }
   }
 
@@ -122,6 +172,7 @@ public:
           d.ParseStream<rapidjson::kParseStopWhenDoneFlag>(is);
           if(d.HasParseError()){
             if(d.GetParseError()==rapidjson::kParseErrorDocumentEmpty){
+              std::lock_guard<std::mutex> lock(m_mutex);
               m_readerThreadRunning=false;
               break; // End of stream
             }
@@ -236,6 +287,11 @@ public:
     fputc('\n', m_dst);
   }
 
+  void flush() override
+  {
+    fflush(m_dst);
+  }
+
   virtual bool isReadOpen() override
   {
       std::unique_lock<std::mutex> lock_guard(m_mutex);
@@ -257,4 +313,395 @@ public:
   }
 };
 
+
+/* Binary framed version of the external protocol. Devices and pins are
+  identified by number (device address = order the device was loaded in, pin
+  index within the device type), and payloads are sent as raw bytes, so nothing
+  needs to be parsed or formatted. Messages are batched into frames:
+
+    frame   := u32 frameBytes (not including this word), u32 messageCount, message*
+    message := binary_external_message_header_t, payload[payloadBytes], zero padding to 4 bytes
+
+  All fields are in host byte order, as both ends are expected to be on the
+  same machine (pipes or Unix domain sockets). Frames are limited to
+  MAX_FRAME_BYTES including the length word, and a peer that announces a
+  bigger frame is treated as broken rather than buffered.
+
+  Unlike JSONExternalConnection there is no reader thread. canRead does a
+  non-blocking read of whatever is available, and splits complete frames into
+  messages.
+*/
+#pragma pack(push,1)
+struct binary_external_message_header_t
+{
+  static const uint8_t FLAG_MULTICAST = 1;
+  static const uint32_t NO_ADDRESS = 0xFFFFFFFFul;
+
+  uint8_t flags;
+  uint8_t _pad_;
+  uint16_t payloadBytes;
+  uint32_t srcDev;
+  uint32_t srcPort;
+  uint32_t dstDev;  // NO_ADDRESS if multicast
+  uint32_t dstPort; // NO_ADDRESS if multicast
+};
+#pragma pack(pop)
+
+class BinaryExternalConnection
+  : public ExternalConnection
+{
+public:
+  static const unsigned MAX_FRAME_BYTES = 65536;
+  static const unsigned MAX_MESSAGES_PER_FRAME = 4096;
+  static const unsigned READ_CHUNK_BYTES = 65536;
+
+private:
+  int m_srcFd;
+  int m_dstFd;
+
+  std::vector<DeviceTypePtr> m_addressToType;
+
+  std::vector<uint8_t> m_writeFrame; // Always starts with 8 byte frame header
+  unsigned m_writeCount=0;
+
+  std::vector<uint8_t> m_readBuffer;
+  size_t m_readBegin=0;
+  bool m_readEOF=false;
+
+  std::vector<external_message_t> m_readReady;
+  size_t m_readPos=0;
+
+  void onExternalRelatedInstance(const DeviceTypePtr &dt, unsigned devAddress)
+  {
+    if(devAddress >= m_addressToType.size()){
+      m_addressToType.resize(devAddress+1);
+    }
+    m_addressToType[devAddress]=dt;
+  }
+
+  void writeAll(const uint8_t *data, size_t size)
+  {
+    while(size>0){
+      ssize_t done=::write(m_dstFd, data, size);
+      if(done<0){
+        if(errno==EINTR){
+          continue;
+        }
+        throw std::runtime_error("BinaryExternalConnection : error while writing to external.");
+      }
+      data+=done;
+      size-=done;
+    }
+  }
+
+  static uint32_t get_u32(const uint8_t *p)
+  {
+    uint32_t res;
+    memcpy(&res, p, 4);
+    return res;
+  }
+
+  void parseFrame(const uint8_t *p, const uint8_t *end)
+  {
+    if(end-p < 4){
+      throw std::runtime_error("BinaryExternalConnection : truncated frame.");
+    }
+    unsigned count=get_u32(p);
+    p+=4;
+    for(unsigned i=0; i<count; i++){
+      binary_external_message_header_t hdr;
+      if(end-p < (ptrdiff_t)sizeof(hdr)){
+        throw std::runtime_error("BinaryExternalConnection : truncated message header.");
+      }
+      memcpy(&hdr, p, sizeof(hdr));
+      p+=sizeof(hdr);
+      unsigned padded=(hdr.payloadBytes+3)&~3u;
+      if(end-p < (ptrdiff_t)padded){
+        throw std::runtime_error("BinaryExternalConnection : truncated message payload.");
+      }
+
+      if(hdr.srcDev>=m_addressToType.size() || !m_addressToType[hdr.srcDev]){
+        throw std::runtime_error("BinaryExternalConnection : message from unknown device address.");
+      }
+      const auto &srcType=m_addressToType[hdr.srcDev];
+      if(hdr.srcPort>=srcType->getOutputCount()){
+        throw std::runtime_error("BinaryExternalConnection : message from unknown output pin.");
+      }
+      const auto &spec=srcType->getOutput(hdr.srcPort)->getMessageType()->getMessageSpec();
+      if(spec->payloadSize()!=hdr.payloadBytes){
+        throw std::runtime_error("BinaryExternalConnection : payload size does not match message type.");
+      }
+
+      if(m_readPos==m_readReady.size()){
+        m_readReady.clear();
+        m_readPos=0;
+      }
+      m_readReady.emplace_back();
+      auto &msg=m_readReady.back();
+      msg.isMulticast=(hdr.flags&binary_external_message_header_t::FLAG_MULTICAST)!=0;
+      msg.srcDev=hdr.srcDev;
+      msg.srcPort=hdr.srcPort;
+      msg.dstDev=hdr.dstDev;
+      msg.dstPort=hdr.dstPort;
+      msg.data=spec->create();
+      if(hdr.payloadBytes){
+        memcpy(msg.data.payloadPtr(), p, hdr.payloadBytes);
+      }
+      p+=padded;
+    }
+    if(p!=end){
+      throw std::runtime_error("BinaryExternalConnection : frame size does not match contents.");
+    }
+  }
+
+  //! Read whatever is available without blocking, and split out complete frames
+  void pump()
+  {
+    if(m_readEOF || m_srcFd==-1){
+      return;
+    }
+
+    while(1){
+      struct pollfd pfd={m_srcFd, POLLIN, 0};
+      int r=poll(&pfd, 1, 0);
+      if(r<0 && errno==EINTR){
+        continue;
+      }
+      if(r<=0){
+        break;
+      }
+
+      size_t used=m_readBuffer.size();
+      m_readBuffer.resize(used+READ_CHUNK_BYTES);
+      ssize_t got=::read(m_srcFd, &m_readBuffer[used], READ_CHUNK_BYTES);
+      if(got<0){
+        m_readBuffer.resize(used);
+        if(errno==EINTR){
+          continue;
+        }
+        throw std::runtime_error("BinaryExternalConnection : error while reading from external.");
+      }
+      m_readBuffer.resize(used+got);
+      if(got==0){
+        m_readEOF=true;
+      }
+      break;
+    }
+
+    while(m_readBuffer.size()-m_readBegin >= 4){
+      uint32_t frameBytes=get_u32(&m_readBuffer[m_readBegin]);
+      if(4+(size_t)frameBytes > MAX_FRAME_BYTES){
+        throw std::runtime_error("BinaryExternalConnection : frame of "+std::to_string(frameBytes)+" bytes is larger than the maximum.");
+      }
+      if(m_readBuffer.size()-m_readBegin < 4+(size_t)frameBytes){
+        break;
+      }
+      const uint8_t *p=&m_readBuffer[m_readBegin+4];
+      parseFrame(p, p+frameBytes);
+      m_readBegin+=4+frameBytes;
+    }
+
+    // Shuffle any partial frame down to the start
+    if(m_readBegin>0){
+      m_readBuffer.erase(m_readBuffer.begin(), m_readBuffer.begin()+m_readBegin);
+      m_readBegin=0;
+    }
+
+    if(m_readEOF && !m_readBuffer.empty()){
+      throw std::runtime_error("BinaryExternalConnection : stream ended in the middle of a frame.");
+    }
+  }
+
+public:
+  /*! Either fd can be -1, in which case that direction is not used. The connection
+      does not take ownership of the fds. */
+  BinaryExternalConnection(int srcFd, int dstFd)
+    : m_srcFd(srcFd)
+    , m_dstFd(dstFd)
+  {
+    m_writeFrame.resize(8);
+  }
+
+  ~BinaryExternalConnection()
+  {
+    if(m_writeCount>0 && m_dstFd!=-1){
+      try{
+        flush();
+      }catch(...){
+        // Nothing to be done if the other side has gone
+      }
+    }
+  }
+
+  void onExternalEdgeInstance(
+    const char *, unsigned dstDevAddress, const DeviceTypePtr &dstDevType, const InputPinPtr &,
+    const char *, unsigned srcDevAddress, const DeviceTypePtr &srcDevType, const OutputPinPtr &
+  )  override
+  {
+    onExternalRelatedInstance(dstDevType, dstDevAddress);
+    onExternalRelatedInstance(srcDevType, srcDevAddress);
+  }
+
+  void startPump() override
+  {}
+
+  bool canWrite() override
+  { return m_dstFd!=-1; }
+
+  void write(const external_message_t &msg) override
+  {
+    assert(m_dstFd!=-1);
+
+    binary_external_message_header_t hdr;
+    hdr.flags=msg.isMulticast ? binary_external_message_header_t::FLAG_MULTICAST : 0;
+    hdr._pad_=0;
+    hdr.payloadBytes=msg.data ? msg.data.payloadSize() : 0;
+    hdr.srcDev=msg.srcDev;
+    hdr.srcPort=msg.srcPort;
+    hdr.dstDev=msg.isMulticast ? binary_external_message_header_t::NO_ADDRESS : msg.dstDev;
+    hdr.dstPort=msg.isMulticast ? binary_external_message_header_t::NO_ADDRESS : msg.dstPort;
+
+    unsigned padded=(hdr.payloadBytes+3)&~3u;
+    if(8+sizeof(hdr)+padded > MAX_FRAME_BYTES){
+      throw std::runtime_error("BinaryExternalConnection : message is too large for a frame.");
+    }
+    if(m_writeFrame.size()+sizeof(hdr)+padded > MAX_FRAME_BYTES){
+      flush();
+    }
+
+    size_t pos=m_writeFrame.size();
+    m_writeFrame.resize(pos+sizeof(hdr)+padded, 0);
+    memcpy(&m_writeFrame[pos], &hdr, sizeof(hdr));
+    if(hdr.payloadBytes){
+      memcpy(&m_writeFrame[pos+sizeof(hdr)], msg.data.payloadPtr(), hdr.payloadBytes);
+    }
+    if(++m_writeCount >= MAX_MESSAGES_PER_FRAME){
+      flush();
+    }
+  }
+
+  void flush() override
+  {
+    if(m_writeCount==0){
+      return;
+    }
+    uint32_t frameBytes=m_writeFrame.size()-4;
+    memcpy(&m_writeFrame[0], &frameBytes, 4);
+    memcpy(&m_writeFrame[4], &m_writeCount, 4);
+    writeAll(&m_writeFrame[0], m_writeFrame.size());
+    m_writeFrame.resize(8);
+    m_writeCount=0;
+  }
+
+  bool isReadOpen() override
+  {
+    return m_readPos<m_readReady.size() || (m_srcFd!=-1 && !m_readEOF);
+  }
+
+  bool canRead() override
+  {
+    if(m_readPos<m_readReady.size()){
+      return true;
+    }
+    pump();
+    return m_readPos<m_readReady.size();
+  }
+
+  void read(external_message_t &msg) override
+  {
+    assert(m_readPos<m_readReady.size());
+    msg=std::move(m_readReady[m_readPos++]);
+  }
+};
+
+//! Listen on a Unix domain socket at path and accept exactly one connection
+inline int acceptExternalUnixSocket(const std::string &path)
+{
+  struct sockaddr_un addr;
+  if(path.size()+1 > sizeof(addr.sun_path)){
+    throw std::runtime_error("Unix socket path is too long : "+path);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+
+  int s=socket(AF_UNIX, SOCK_STREAM, 0);
+  if(s==-1){
+    throw std::runtime_error("Couldn't create unix socket.");
+  }
+  unlink(path.c_str());
+  if(bind(s, (struct sockaddr*)&addr, sizeof(addr))!=0 || listen(s, 1)!=0){
+    close(s);
+    throw std::runtime_error("Couldn't listen on unix socket "+path);
+  }
+  int c=accept(s, nullptr, nullptr);
+  close(s);
+  unlink(path.c_str());
+  if(c==-1){
+    throw std::runtime_error("Couldn't accept connection on unix socket "+path);
+  }
+  return c;
+}
+
+//! Connect to a Unix domain socket at path
+inline int connectExternalUnixSocket(const std::string &path)
+{
+  struct sockaddr_un addr;
+  if(path.size()+1 > sizeof(addr.sun_path)){
+    throw std::runtime_error("Unix socket path is too long : "+path);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+
+  int s=socket(AF_UNIX, SOCK_STREAM, 0);
+  if(s==-1){
+    throw std::runtime_error("Couldn't create unix socket.");
+  }
+  if(connect(s, (struct sockaddr*)&addr, sizeof(addr))!=0){
+    close(s);
+    throw std::runtime_error("Couldn't connect to unix socket "+path);
+  }
+  return s;
+}
+
+/*! Create a connection of the given mode ("json" or "binary") over the given fds.
+    JSON mode is mainly there for debugging, as it is human readable.
+    In both modes the caller keeps ownership of the fds. */
+inline std::shared_ptr<ExternalConnection> createExternalConnection(const std::string &mode, int srcFd, int dstFd)
+{
+  if(mode=="binary"){
+    return std::make_shared<BinaryExternalConnection>(srcFd, dstFd);
+  }else if(mode=="json"){
+    // The streams get their own fds, so closing them leaves the caller's fds alone
+    auto open_stream=[](int fd, const char *fdMode) -> FILE * {
+      if(fd==-1){
+        return nullptr;
+      }
+      int copy=dup(fd);
+      FILE *res = copy==-1 ? nullptr : fdopen(copy, fdMode);
+      if(!res){
+        if(copy!=-1){
+          close(copy);
+        }
+        throw std::runtime_error("Couldn't open streams for JSON external connection.");
+      }
+      return res;
+    };
+    FILE *src=open_stream(srcFd, "r");
+    FILE *dst=nullptr;
+    try{
+      dst=open_stream(dstFd, "w");
+    }catch(...){
+      if(src){
+        fclose(src);
+      }
+      throw;
+    }
+    return std::make_shared<JSONExternalConnection>(src, dst, true);
+  }else{
+    throw std::runtime_error("Unknown external connection mode '"+mode+"', expected json or binary.");
+  }
+}
+
 #endif
\ No newline at end of file
@@ -311,6 +311,17 @@ public:
     return hash.getHash();
   }
 
+  /* Only the FNV1a algorithm gives the same value as payloadHash(). A null
+     pointer hashes the same as an empty payload. */
+  uint64_t payloadHash(POETSHashAlgorithm alg) const
+  {
+    if(m_p){
+      return POETSHashBytes(alg, payloadPtr(), payloadSize());
+    }else{
+      return POETSHashBytes(alg, nullptr, 0);
+    }
+  }
+
   // null pointers compare less than non-null
   bool operator < (const DataPtr &o) const
   {
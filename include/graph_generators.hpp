@@ -0,0 +1,563 @@
+#ifndef graph_generators_hpp
+#define graph_generators_hpp
+
+#include "graph_core.hpp"
+#include "graph_persist.hpp"
+#include "graph_provider_helpers.hpp"
+#include "graph_persist_dom_reader.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <cstdlib>
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Synthetic graph instances generated in-process, straight into a GraphLoadEvents.
+
+   This does the same job as the python generators in apps/, but skips writing
+   and re-parsing XML, which dominates for very large graphs. A generator is
+   selected with a spec like "clock_tree:6,2,100", which is the generator name
+   followed by its (positional) parameters, which follow the same order as the
+   python script for the same app. Missing parameters take defaults.
+
+   Generators must be deterministic for given parameters (any randomness is
+   seeded from a parameter), so that different consumers can each generate
+   the same graph independently, e.g. to write several formats in parallel.
+
+   More generators can be added from shared objects which export
+   registerGraphGenerators (see below), listed in the environment variable
+   POETS_GRAPH_GENERATOR_PATH separated by ':'.
+*/
+
+class GraphGenerator
+{
+public:
+  virtual ~GraphGenerator()
+  {}
+
+  //! Name used in specs, e.g. "clock_tree"
+  virtual std::string name() const=0;
+
+  //! Id of the graph type the instances use
+  virtual std::string graphTypeId() const=0;
+
+  //! Where to find the graph type if no provider has it, relative to the graph_schema root
+  virtual std::string graphTypePath() const=0;
+
+  //! Human readable parameter list, e.g. "depth=4,branching=2,max_ticks=100"
+  virtual std::string parameters() const=0;
+
+  //! Sends one complete graph instance to events, including onGraphType
+  virtual void generate(const GraphTypePtr &graphType, const std::vector<std::string> &params, GraphLoadEvents *events) const=0;
+
+protected:
+  //! A scalar within some typed data, found once so that setting it per device is just a memcpy
+  struct field_t
+  {
+    TypedDataSpecPtr spec;
+    TypedDataSpecElement::sub_element_position pos;
+  };
+
+  static field_t field(const TypedDataSpecPtr &spec, const std::string &name)
+  {
+    if(!spec){
+      throw std::runtime_error("Generator expected a member called '"+name+"', but there is no spec.");
+    }
+    return field_t{spec, spec->getTupleElement()->findSubElementPosition(name)};
+  }
+
+  template<class T>
+  static void set(TypedDataPtr &data, const field_t &f, T value)
+  {
+    f.spec->getTupleElement()->setScalarSubElement(f.pos, data.payloadSize(), data.payloadPtr(), value);
+  }
+
+  template<class T>
+  static T param(const std::vector<std::string> &params, unsigned index, T def)
+  {
+    if(index>=params.size() || params[index].empty()){
+      return def;
+    }
+    char *end=0;
+    double v=strtod(params[index].c_str(), &end);
+    if(*end){
+      throw std::runtime_error("Couldn't parse generator parameter '"+params[index]+"'");
+    }
+    return (T)v;
+  }
+};
+typedef std::shared_ptr<GraphGenerator> GraphGeneratorPtr;
+
+
+/* The tree built by apps/clock_tree/create_clock_tree_instance.py. Parameters
+   are depth, branching and max_ticks. */
+class GraphGeneratorClockTree
+  : public GraphGenerator
+{
+private:
+  struct ctx_t
+  {
+    uint64_t g;
+    GraphLoadEvents *events;
+    unsigned d, b;
+    DeviceTypePtr rootType, branchType, leafType;
+    TypedDataPtr fanoutProps;
+    std::vector<uint64_t> ids; // In creation order
+    size_t next=0;
+  };
+
+  void create_devices(ctx_t &c, const std::string &prefix, unsigned depth) const
+  {
+    if(depth==0){
+      c.ids.push_back(c.events->onDeviceInstance(c.g, c.leafType, prefix+"_leaf", TypedDataPtr(), TypedDataPtr()));
+    }else{
+      const auto &dt = depth==c.d ? c.rootType : c.branchType;
+      c.ids.push_back(c.events->onDeviceInstance(c.g, dt, prefix, c.fanoutProps, TypedDataPtr()));
+      for(unsigned i=0; i<c.b; i++){
+        create_devices(c, prefix+"_"+std::to_string(i), depth-1);
+      }
+    }
+  }
+
+  // Walks in the same order as create_devices, so the position in c.ids is the same
+  void create_edges(ctx_t &c, size_t parent, const DeviceTypePtr &parentType, unsigned depth) const
+  {
+    size_t self=c.next++;
+    const auto &dt = depth==0 ? c.leafType : depth==c.d ? c.rootType : c.branchType;
+    if(depth!=c.d){
+      c.events->onEdgeInstance(c.g, c.ids[self], dt, dt->getInput("tick_in"), c.ids[parent], parentType, parentType->getOutput("tick_out"), -1, TypedDataPtr(), TypedDataPtr());
+      c.events->onEdgeInstance(c.g, c.ids[parent], parentType, parentType->getInput("ack_in"), c.ids[self], dt, dt->getOutput("ack_out"), -1, TypedDataPtr(), TypedDataPtr());
+    }
+    if(depth>0){
+      for(unsigned i=0; i<c.b; i++){
+        create_edges(c, self, dt, depth-1);
+      }
+    }
+  }
+public:
+  std::string name() const override
+  { return "clock_tree"; }
+
+  std::string graphTypeId() const override
+  { return "clock_tree"; }
+
+  std::string graphTypePath() const override
+  { return "apps/clock_tree/clock_tree_graph_type.xml"; }
+
+  std::string parameters() const override
+  { return "depth=4,branching=2,max_ticks=100"; }
+
+  void generate(const GraphTypePtr &graphType, const std::vector<std::string> &params, GraphLoadEvents *events) const override
+  {
+    ctx_t c;
+    c.events=events;
+    c.d=param<unsigned>(params, 0, 4);
+    c.b=param<unsigned>(params, 1, 2);
+    unsigned maxTicks=param<unsigned>(params, 2, 100);
+    if(c.d<1 || c.b<1){
+      throw std::runtime_error("clock_tree needs depth and branching of at least 1.");
+    }
+
+    c.rootType=graphType->getDeviceType("root");
+    c.branchType=graphType->getDeviceType("branch");
+    c.leafType=graphType->getDeviceType("leaf");
+
+    // Every root and branch has the same properties, so they can share one copy
+    c.fanoutProps=c.branchType->getPropertiesSpec()->create();
+    set(c.fanoutProps, field(c.branchType->getPropertiesSpec(), "fanout"), (uint32_t)c.b);
+
+    auto graphProps=graphType->getPropertiesSpec()->create();
+    set(graphProps, field(graphType->getPropertiesSpec(), "max_ticks"), (uint32_t)maxTicks);
+
+    events->onGraphType(graphType);
+    c.g=events->onBeginGraphInstance(graphType, "clock_"+std::to_string(c.d)+"_"+std::to_string(c.b), graphProps, rapidjson::Document());
+
+    events->onBeginDeviceInstances(c.g);
+    create_devices(c, "root", c.d);
+    events->onEndDeviceInstances(c.g);
+
+    events->onBeginEdgeInstances(c.g);
+    create_edges(c, 0, c.rootType, c.d);
+    events->onEndEdgeInstances(c.g);
+
+    events->onEndGraphInstance(c.g);
+  }
+};
+
+/* The random graph built by apps/storm/create_storm_instance.py. Parameters
+   are n, d and w, then a seed for the random connections. Each node sends
+   credit along a ring, and to d random nodes within the following w. Note
+   that the python script takes w from the same argument as d. */
+class GraphGeneratorStorm
+  : public GraphGenerator
+{
+public:
+  std::string name() const override
+  { return "storm"; }
+
+  std::string graphTypeId() const override
+  { return "storm"; }
+
+  std::string graphTypePath() const override
+  { return "apps/storm/storm_graph_type.xml"; }
+
+  std::string parameters() const override
+  { return "n=16,d=n/2,w=n,seed=1"; }
+
+  void generate(const GraphTypePtr &graphType, const std::vector<std::string> &params, GraphLoadEvents *events) const override
+  {
+    unsigned n=param<unsigned>(params, 0, 16);
+    unsigned d=param<unsigned>(params, 1, n/2);
+    unsigned w=param<unsigned>(params, 2, n);
+    uint64_t seed=param<uint64_t>(params, 3, 1);
+    if(n<2 || d>w || w>n){
+      throw std::runtime_error("storm needs n>=2 and d <= w <= n.");
+    }
+
+    auto nodeType=graphType->getDeviceType("node");
+    auto spec=nodeType->getPropertiesSpec();
+    auto fDegree=field(spec, "degree");
+    auto fIsRoot=field(spec, "isRoot");
+
+    // All nodes except the root have the same properties
+    auto props=spec->create();
+    set(props, fDegree, (uint32_t)d);
+    auto rootProps=props.clone();
+    set(rootProps, fIsRoot, (uint32_t)1);
+
+    events->onGraphType(graphType);
+    uint64_t g=events->onBeginGraphInstance(graphType, "storm_"+std::to_string(n)+"_"+std::to_string(d)+"_"+std::to_string(w), TypedDataPtr(), rapidjson::Document());
+
+    std::vector<uint64_t> ids(n);
+    events->onBeginDeviceInstances(g);
+    for(unsigned i=0; i<n; i++){
+      ids[i]=events->onDeviceInstance(g, nodeType, "n"+std::to_string(i), i==0 ? rootProps : props, TypedDataPtr());
+    }
+    events->onEndDeviceInstances(g);
+
+    auto credit=nodeType->getInput("credit");
+    auto narrow=nodeType->getOutput("narrow");
+    auto wide=nodeType->getOutput("wide");
+
+    // Partial Fisher-Yates over a persistent permutation, so each sample is O(d)
+    std::mt19937_64 rng(seed);
+    std::vector<unsigned> perm(w);
+    for(unsigned i=0; i<w; i++){
+      perm[i]=i;
+    }
+
+    events->onBeginEdgeInstances(g);
+    for(unsigned i=0; i<n; i++){
+      events->onEdgeInstance(g, ids[(i+1)%n], nodeType, credit, ids[i], nodeType, narrow, -1, TypedDataPtr(), TypedDataPtr());
+      for(unsigned j=0; j<d; j++){
+        unsigned k=j+(unsigned)(rng()%(w-j));
+        std::swap(perm[j], perm[k]);
+        events->onEdgeInstance(g, ids[(i+perm[j])%n], nodeType, credit, ids[i], nodeType, wide, -1, TypedDataPtr(), TypedDataPtr());
+      }
+    }
+    events->onEndEdgeInstances(g);
+
+    events->onEndGraphInstance(g);
+  }
+};
+
+/* The n x n grid built by apps/gals_heat/create_gals_heat_instance.py.
+   Parameters are n, then a seed for the initial values. */
+class GraphGeneratorGalsHeat
+  : public GraphGenerator
+{
+public:
+  std::string name() const override
+  { return "gals_heat"; }
+
+  std::string graphTypeId() const override
+  { return "gals_heat"; }
+
+  std::string graphTypePath() const override
+  { return "apps/gals_heat/gals_heat_graph_type.xml"; }
+
+  std::string parameters() const override
+  { return "n=16,seed=1"; }
+
+  void generate(const GraphTypePtr &graphType, const std::vector<std::string> &params, GraphLoadEvents *events) const override
+  {
+    unsigned n=param<unsigned>(params, 0, 16);
+    uint64_t seed=param<uint64_t>(params, 1, 1);
+    if(n<3){
+      throw std::runtime_error("gals_heat needs n>=3.");
+    }
+
+    double h=1.0/n;
+    double alpha=1;
+    double dt=h*h / (4*alpha) * 0.5;
+    double weightOther = dt*alpha/(h*h);
+    double weightSelf = (1.0 - 4*weightOther);
+
+    auto cellType=graphType->getDeviceType("cell");
+    auto dirichletType=graphType->getDeviceType("dirichlet_variable");
+    auto exitType=graphType->getDeviceType("exit_node");
+
+    auto cellSpec=cellType->getPropertiesSpec();
+    auto fIv=field(cellSpec, "iv"), fNhood=field(cellSpec, "nhood"), fWSelf=field(cellSpec, "wSelf");
+    auto dirSpec=dirichletType->getPropertiesSpec();
+    auto fBias=field(dirSpec, "bias"), fAmplitude=field(dirSpec, "amplitude"), fPhase=field(dirSpec, "phase");
+    auto fFrequency=field(dirSpec, "frequency"), fNeighbours=field(dirSpec, "neighbours");
+
+    auto cellIn=cellType->getInput("in");
+    auto edgeProps=cellIn->getPropertiesSpec()->create();
+    set(edgeProps, field(cellIn->getPropertiesSpec(), "w"), (float)weightOther);
+
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> urand(0.0, 1.0);
+
+    events->onGraphType(graphType);
+    uint64_t g=events->onBeginGraphInstance(graphType, "heat_"+std::to_string(n)+"_"+std::to_string(n), graphType->getPropertiesSpec()->create(), rapidjson::Document());
+
+    const uint64_t NONE=~0ull;
+    std::vector<uint64_t> ids(size_t(n)*n, NONE);
+    std::vector<DeviceTypePtr> types(size_t(n)*n);
+    std::vector<size_t> order; // Positions in creation order, for the exit node edges
+
+    events->onBeginDeviceInstances(g);
+    for(unsigned x=0; x<n; x++){
+      for(unsigned y=0; y<n; y++){
+        bool edgeX = x==0 || x==n-1;
+        bool edgeY = y==0 || y==n-1;
+        std::string suffix=std::to_string(x)+"_"+std::to_string(y);
+        size_t pos=size_t(x)*n+y;
+        if(x==n/2 && y==n/2){
+          auto props=dirSpec->create();
+          set(props, fBias, 0.0f);
+          set(props, fAmplitude, 1.0f);
+          set(props, fPhase, 1.5f);
+          set(props, fFrequency, (float)(100*dt));
+          set(props, fNeighbours, (uint32_t)4);
+          ids[pos]=events->onDeviceInstance(g, dirichletType, "v_"+suffix, props, TypedDataPtr());
+          types[pos]=dirichletType;
+        }else if(edgeX != edgeY){
+          auto props=dirSpec->create();
+          set(props, fBias, 0.0f);
+          set(props, fAmplitude, 1.0f);
+          set(props, fPhase, 1.0f);
+          set(props, fFrequency, (float)(70*dt*((x/(double)n)+(y/(double)n))));
+          set(props, fNeighbours, (uint32_t)1);
+          ids[pos]=events->onDeviceInstance(g, dirichletType, "v_"+suffix, props, TypedDataPtr());
+          types[pos]=dirichletType;
+        }else if(!(edgeX || edgeY)){
+          auto props=cellSpec->create();
+          set(props, fIv, (float)(urand(rng)*2-1));
+          set(props, fNhood, (uint32_t)4);
+          set(props, fWSelf, (float)weightSelf);
+          ids[pos]=events->onDeviceInstance(g, cellType, "c_"+suffix, props, TypedDataPtr());
+          types[pos]=cellType;
+        }else{
+          continue;
+        }
+        order.push_back(pos);
+      }
+    }
+    auto exitProps=exitType->getPropertiesSpec()->create();
+    set(exitProps, field(exitType->getPropertiesSpec(), "fanin"), (uint32_t)order.size());
+    uint64_t finished=events->onDeviceInstance(g, exitType, "finished", exitProps, TypedDataPtr());
+    events->onEndDeviceInstances(g);
+
+    events->onBeginEdgeInstances(g);
+    auto add_channel=[&](unsigned x, unsigned y, int dx, int dy){
+      size_t dst=size_t(x)*n+y;
+      size_t src=size_t((x+dx+n)%n)*n+((y+dy+n)%n);
+      const auto &dstType=types[dst];
+      const auto &srcType=types[src];
+      bool isCell = dstType==cellType;
+      events->onEdgeInstance(g, ids[dst], dstType, dstType->getInput("in"), ids[src], srcType, srcType->getOutput("out"), -1, isCell ? edgeProps : TypedDataPtr(), TypedDataPtr());
+    };
+    for(unsigned x=0; x<n; x++){
+      for(unsigned y=0; y<n; y++){
+        bool edgeX = x==0 || x==n-1;
+        bool edgeY = y==0 || y==n-1;
+        if(edgeX && edgeY){
+          continue;
+        }
+        if(y!=0 && !edgeX){
+          add_channel(x,y, 0, -1);
+        }
+        if(x!=n-1 && !edgeY){
+          add_channel(x,y, +1, 0);
+        }
+        if(y!=n-1 && !edgeX){
+          add_channel(x,y, 0, +1);
+        }
+        if(x!=0 && !edgeY){
+          add_channel(x,y, -1, 0);
+        }
+      }
+    }
+    auto done=exitType->getInput("done");
+    for(size_t pos : order){
+      const auto &st=types[pos];
+      events->onEdgeInstance(g, finished, exitType, done, ids[pos], st, st->getOutput("finished"), -1, TypedDataPtr(), TypedDataPtr());
+    }
+    events->onEndEdgeInstances(g);
+
+    events->onEndGraphInstance(g);
+  }
+};
+
+
+class GraphGeneratorRegistry;
+
+/*! Entry point exposed by shared objects that provide extra generators. */
+extern "C" void registerGraphGenerators(GraphGeneratorRegistry *registry);
+
+class GraphGeneratorRegistry
+{
+private:
+  std::mutex m_mutex;
+  std::map<std::string,GraphGeneratorPtr> m_generators;
+
+  GraphGeneratorRegistry()
+  {
+    registerGenerator(std::make_shared<GraphGeneratorClockTree>());
+    registerGenerator(std::make_shared<GraphGeneratorStorm>());
+    registerGenerator(std::make_shared<GraphGeneratorGalsHeat>());
+
+    const char *searchPath=getenv("POETS_GRAPH_GENERATOR_PATH");
+    if(searchPath){
+      std::string path(searchPath);
+      size_t begin=0;
+      while(begin<=path.size()){
+        size_t end=path.find(':', begin);
+        if(end==std::string::npos){
+          end=path.size();
+        }
+        if(end>begin){
+          loadPlugin(path.substr(begin, end-begin));
+        }
+        begin=end+1;
+      }
+    }
+  }
+public:
+  static GraphGeneratorRegistry &instance()
+  {
+    static GraphGeneratorRegistry registry;
+    return registry;
+  }
+
+  void registerGenerator(GraphGeneratorPtr generator)
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_generators[generator->name()]=generator;
+  }
+
+  void loadPlugin(const std::string &path)
+  {
+    void *lib=dlopen(path.c_str(), RTLD_NOW|RTLD_LOCAL);
+    if(lib==0){
+      throw std::runtime_error("Couldn't load graph generator plugin '"+path+"' : "+dlerror());
+    }
+    void *entry=dlsym(lib, "registerGraphGenerators");
+    if(entry==0){
+      throw std::runtime_error("Couldn't find registerGraphGenerators entry point in '"+path+"'");
+    }
+    typedef void (*entry_func_t)(GraphGeneratorRegistry *);
+    ((entry_func_t)entry)(this);
+  }
+
+  GraphGeneratorPtr lookup(const std::string &name)
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    auto it=m_generators.find(name);
+    if(it==m_generators.end()){
+      throw std::runtime_error("Unknown graph generator '"+name+"'");
+    }
+    return it->second;
+  }
+
+  std::vector<GraphGeneratorPtr> generators()
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    std::vector<GraphGeneratorPtr> res;
+    for(const auto &kv : m_generators){
+      res.push_back(kv.second);
+    }
+    return res;
+  }
+};
+
+//! Splits "name:a,b,c" into the name and parameters
+inline std::pair<std::string,std::vector<std::string>> parseGraphGeneratorSpec(const std::string &spec)
+{
+  auto colon=spec.find(':');
+  std::string name=spec.substr(0, colon);
+  std::vector<std::string> params;
+  if(colon!=std::string::npos){
+    std::string rest=spec.substr(colon+1);
+    size_t begin=0;
+    while(begin<=rest.size()){
+      size_t end=rest.find(',', begin);
+      if(end==std::string::npos){
+        end=rest.size();
+      }
+      params.push_back(rest.substr(begin, end-begin));
+      begin=end+1;
+    }
+  }
+  return {name, params};
+}
+
+/* Finds the graph type for a generator. A provider in the registry is used if
+   there is one, so that simulators get compiled handlers, otherwise the XML is
+   loaded from the graph_schema root. The root is POETS_GRAPH_SCHEMA_DIR if
+   set, else the current directory or the parent of the executable's directory. */
+inline GraphTypePtr findGraphGeneratorGraphType(Registry *registry, const GraphGenerator &generator)
+{
+  if(registry){
+    try{
+      return registry->lookupGraphType(generator.graphTypeId());
+    }catch(const unknown_graph_type_error &){
+      // pass, try to load from xml
+    }
+  }
+
+  std::vector<std::string> roots;
+  if(getenv("POETS_GRAPH_SCHEMA_DIR")){
+    roots.push_back(getenv("POETS_GRAPH_SCHEMA_DIR"));
+  }
+  roots.push_back(".");
+  char exe[4096];
+  ssize_t len=readlink("/proc/self/exe", exe, sizeof(exe)-1);
+  if(len>0){
+    std::string dir(exe, len);
+    dir=dir.substr(0, dir.rfind('/'));
+    roots.push_back(dir+"/..");
+  }
+
+  for(const auto &r : roots){
+    std::string path=r+"/"+generator.graphTypePath();
+    struct stat st;
+    if(stat(path.c_str(), &st)==0){
+      return loadGraphType(filepath(path));
+    }
+  }
+  throw std::runtime_error("Couldn't find graph type "+generator.graphTypePath()+" for generator "+generator.name()+" (try setting POETS_GRAPH_SCHEMA_DIR).");
+}
+
+//! Generate a graph from a spec like "clock_tree:6,2,100", in place of loading it from a file.
+inline void generateGraph(Registry *registry, const std::string &spec, GraphLoadEvents *events)
+{
+  auto parsed=parseGraphGeneratorSpec(spec);
+  auto generator=GraphGeneratorRegistry::instance().lookup(parsed.first);
+  auto graphType=findGraphGeneratorGraphType(registry, *generator);
+  generator->generate(graphType, parsed.second, events);
+}
+
+#endif
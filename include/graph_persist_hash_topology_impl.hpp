@@ -5,76 +5,151 @@
 #include <cstdint>
 #include <cstring>
 #include <cmath>
+#include <sstream>
 
 #include "graph_persist.hpp"
+#include "poets_hash.hpp"
 
 #include "xml_pull_parser.hpp"
 
+/* Hashes the topology of a graph instance independently of the order that
+   devices and edges appear in, so the same graph written in a different
+   order or format (v3, v4, base85) gives the same hash.
+
+   Each device and edge gets its own 128-bit hash, from two independently
+   seeded POETSFastHash streams over its fields, and these are combined by
+   addition mod 2^128. Edges are identified by the hashes of the device ids
+   and the pin names at each end rather than by device index. Because the
+   combination is commutative and associative, hashes of disjoint parts of a
+   graph can be computed separately (e.g. on different threads) and combined
+   with merge(). onEdgeInstance can only find the ids of devices this
+   instance has seen, so a part that has edges but not the devices at their
+   ends must add them with add_edge, passing hash_id of each end's id.
+
+   Elements are also summed into 2^bucketBits buckets chosen by the hash of
+   a device id (for edges, the destination device), so two graphs can be
+   compared bucket by bucket to narrow down where they differ.
+*/
 class GraphPersistHashTopology
     : public GraphLoadEvents
 {
 public:
   using hash_acc_t = unsigned __int128;
 
-private:
-  static const hash_acc_t P=(hash_acc_t(0x0000000001000000ull)<<64)+0x000000000000013Bull;
-  static const hash_acc_t O=(hash_acc_t(0x6c62272e07bb0142ull)<<64)+0x62b821756295c58dull;
-
-  hash_acc_t hash_binary(hash_acc_t acc, size_t n, const void *p)
+  struct bucket_t
   {
-    const char *begin=(const char *)p;
-    const char *end=begin+n;
-
-    while(begin<end){
-      ptrdiff_t nn=std::min(ptrdiff_t(8), end-begin);
-      uint64_t v=0;
-      memcpy(&v, begin, nn);
-      auto hi=acc>>64;
-      acc=(acc ^ v) * P + hi;
-      begin+=nn;
+    hash_acc_t devices_full_hash=0;
+    hash_acc_t edges_full_hash=0;
+    unsigned device_count=0;
+    unsigned edge_count=0;
+
+    bool operator==(const bucket_t &o) const
+    {
+      return devices_full_hash==o.devices_full_hash && edges_full_hash==o.edges_full_hash
+        && device_count==o.device_count && edge_count==o.edge_count;
     }
+  };
 
-    return acc;
-  }
-
-  hash_acc_t hash_uint64(hash_acc_t acc, uint64_t value)
+  // Hashes the fields of one element
+  class element_hasher_t
   {
-    auto hi=acc>>64;
-    return (acc ^ value) * P + (acc>>64);
-  }
+  private:
+    POETSFastHash m_lo{0x243f6a8885a308d3ull};
+    POETSFastHash m_hi{0x13198a2e03707344ull};
+  public:
+    void add_binary(const void *p, size_t n)
+    {
+      m_lo.add((const uint8_t*)p, n);
+      m_hi.add((const uint8_t*)p, n);
+    }
 
-  hash_acc_t hash_string(hash_acc_t acc, const std::string &id)
-  {
-    return hash_binary(acc, id.size(), id.data());
-  }
+    void add_uint64(uint64_t x)
+    { add_binary(&x, 8); }
 
-  hash_acc_t hash_typed_data(hash_acc_t acc, const TypedDataSpecPtr &spec, TypedDataPtr data)
-  {
-    if(!data){
-      data=spec->create();
+    // Length prefixed, so adjacent strings can't run into each other
+    void add_string(const std::string &s)
+    {
+      add_uint64(s.size());
+      add_binary(s.data(), s.size());
     }
-    if(data){
-      return hash_binary(acc, data.payloadSize(), data.payloadPtr());
-    }else{
-      return acc;
+
+    void add_typed_data(const TypedDataSpecPtr &spec, TypedDataPtr data)
+    {
+      if(!data && spec){
+        data=spec->create();
+      }
+      if(data){
+        add_uint64(data.payloadSize());
+        add_binary(data.payloadPtr(), data.payloadSize());
+      }else{
+        add_uint64(0);
+      }
     }
-  }
 
+    hash_acc_t get() const
+    { return (hash_acc_t(m_hi.getHash())<<64) | m_lo.getHash(); }
+  };
+
+private:
   GraphTypePtr m_graph_type;
   std::string m_graph_instance_id;
-  hash_acc_t m_header_hash = O;
-  hash_acc_t m_devices_full_hash = O;
-  hash_acc_t m_devices_ids_hash = O;
-  hash_acc_t m_edges_full_hash = O;
-  hash_acc_t m_edges_connection_hash = O;
+  hash_acc_t m_header_hash = 0;
+  hash_acc_t m_devices_full_hash = 0;
+  hash_acc_t m_devices_ids_hash = 0;
+  hash_acc_t m_edges_full_hash = 0;
+  hash_acc_t m_edges_connection_hash = 0;
 
   unsigned m_device_count=0;
   unsigned m_edge_count=0;
 
+  unsigned m_bucket_bits;
+  std::vector<bucket_t> m_buckets;
+
+  // Hash of each device's id by index, as edges refer to devices by index
+  std::vector<uint64_t> m_device_id_hashes;
+
+  bucket_t &bucket_of(uint64_t idHash)
+  { return m_buckets[m_bucket_bits ? (idHash>>(64-m_bucket_bits)) : 0]; }
+
 public:
+  GraphPersistHashTopology(unsigned bucketBits=0)
+    : m_bucket_bits(bucketBits)
+    , m_buckets(size_t(1)<<bucketBits)
+  {
+    if(bucketBits>24){
+      throw std::runtime_error("GraphPersistHashTopology : too many buckets.");
+    }
+  }
+
+  static uint64_t hash_id(const std::string &id)
+  { return POETSFastHash::hash(id.data(), id.size()); }
+
   hash_acc_t get_hash() const
   { return m_header_hash*19937 + 31 * m_devices_full_hash+ m_edges_full_hash; }
 
+  const std::vector<bucket_t> &get_buckets() const
+  { return m_buckets; }
+
+  /* Adds in the devices and edges hashed by another instance, which must have
+     the same header and number of buckets. The parts must not overlap. */
+  void merge(const GraphPersistHashTopology &o)
+  {
+    if(o.m_header_hash!=m_header_hash || o.m_buckets.size()!=m_buckets.size()){
+      throw std::runtime_error("GraphPersistHashTopology : can't merge hashes of different graphs.");
+    }
+    m_devices_full_hash += o.m_devices_full_hash;
+    m_devices_ids_hash += o.m_devices_ids_hash;
+    m_edges_full_hash += o.m_edges_full_hash;
+    m_edges_connection_hash += o.m_edges_connection_hash;
+    m_device_count += o.m_device_count;
+    m_edge_count += o.m_edge_count;
+    for(unsigned i=0; i<m_buckets.size(); i++){
+      m_buckets[i].devices_full_hash += o.m_buckets[i].devices_full_hash;
+      m_buckets[i].edges_full_hash += o.m_buckets[i].edges_full_hash;
+      m_buckets[i].device_count += o.m_buckets[i].device_count;
+      m_buckets[i].edge_count += o.m_buckets[i].edge_count;
+    }
+  }
 
   virtual uint64_t onBeginGraphInstance(
     const GraphTypePtr &graph,
@@ -83,9 +158,11 @@ public:
     rapidjson::Document &&metadata
   ){
     m_graph_type=graph;
-    
-    m_header_hash=hash_string(m_header_hash, graph->getId());
-    m_header_hash=hash_typed_data(m_header_hash, graph->getPropertiesSpec(), properties);
+
+    element_hasher_t acc;
+    acc.add_string(graph->getId());
+    acc.add_typed_data(graph->getPropertiesSpec(), properties);
+    m_header_hash=acc.get();
 
     return 0;
   }
@@ -100,15 +177,22 @@ public:
    rapidjson::Document &&metadata=rapidjson::Document()
   )
   {
-    hash_acc_t acc=O;
-    acc=hash_string(acc, dt->getId());
-    acc=hash_string(acc,id);
-    m_devices_ids_hash += acc;
+    uint64_t idHash=hash_id(id);
+    m_device_id_hashes.push_back(idHash);
+
+    element_hasher_t acc;
+    acc.add_string(dt->getId());
+    acc.add_string(id);
+    m_devices_ids_hash += acc.get();
 
-    acc=hash_typed_data(acc, dt->getPropertiesSpec(), properties);
-    acc=hash_typed_data(acc, dt->getStateSpec(), state);
+    acc.add_typed_data(dt->getPropertiesSpec(), properties);
+    acc.add_typed_data(dt->getStateSpec(), state);
+    hash_acc_t full=acc.get();
+    m_devices_full_hash += full;
 
-    m_devices_full_hash += acc;
+    auto &b=bucket_of(idHash);
+    b.devices_full_hash += full;
+    b.device_count++;
 
     return m_device_count++;
   }
@@ -123,18 +207,39 @@ public:
    const TypedDataPtr &state,
     rapidjson::Document &&metadata=rapidjson::Document()
   ){
-    hash_acc_t acc=O;
-    acc=hash_uint64(acc, dstDevInst);
-    acc=hash_uint64(acc, dstPin->getIndex());
-    acc=hash_uint64(acc, srcDevInst);
-    acc=hash_uint64(acc, srcPin->getIndex());
-    acc=hash_uint64(acc, (uint64_t)(int64_t)sendIndex);
-    m_edges_connection_hash += acc;
-
-    acc=hash_typed_data(acc, dstPin->getPropertiesSpec(), properties);
-    acc=hash_typed_data(acc, dstPin->getStateSpec(), state);
+    add_edge(
+      m_device_id_hashes.at(dstDevInst), dstPin,
+      m_device_id_hashes.at(srcDevInst), srcPin,
+      sendIndex, properties, state
+    );
+  }
 
-    m_edges_full_hash += acc;
+  // Adds an edge with endpoints given by hash_id of the device ids, which
+  // needn't have been seen by this instance
+  void add_edge
+  (
+   uint64_t dstIdHash, const InputPinPtr &dstPin,
+   uint64_t srcIdHash, const OutputPinPtr &srcPin,
+   int sendIndex,
+   const TypedDataPtr &properties,
+   const TypedDataPtr &state
+  ){
+    element_hasher_t acc;
+    acc.add_uint64(dstIdHash);
+    acc.add_string(dstPin->getName());
+    acc.add_uint64(srcIdHash);
+    acc.add_string(srcPin->getName());
+    acc.add_uint64((uint64_t)(int64_t)sendIndex);
+    m_edges_connection_hash += acc.get();
+
+    acc.add_typed_data(dstPin->getPropertiesSpec(), properties);
+    acc.add_typed_data(dstPin->getStateSpec(), state);
+    hash_acc_t full=acc.get();
+    m_edges_full_hash += full;
+
+    auto &b=bucket_of(dstIdHash);
+    b.edges_full_hash += full;
+    b.edge_count++;
 
     m_edge_count++;
   }
@@ -162,12 +267,20 @@ public:
 
   std::string report(const GraphPersistHashTopology &ho){
     std::stringstream acc;
+    report_diff(acc, m_header_hash, ho.m_header_hash, "header");
     report_diff_val(acc, m_device_count, ho.m_device_count, "device_count");
     report_diff(acc, m_devices_ids_hash, ho.m_devices_ids_hash, "device_ids_hash");
     report_diff(acc, m_devices_full_hash, ho.m_devices_full_hash, "device_full_hash");
     report_diff_val(acc, m_edge_count, ho.m_edge_count, "edge_count");
     report_diff(acc, m_edges_connection_hash, ho.m_edges_connection_hash, "edges_connection_hash");
     report_diff(acc, m_edges_full_hash, ho.m_edges_full_hash, "edges_full_hash");
+    if(m_buckets.size()>1 && m_buckets.size()==ho.m_buckets.size()){
+      unsigned diffs=0;
+      for(unsigned i=0; i<m_buckets.size(); i++){
+        diffs += !(m_buckets[i]==ho.m_buckets[i]);
+      }
+      acc<<"  "<<diffs<<" of "<<m_buckets.size()<<" buckets differ\n";
+    }
     return acc.str();
   }
 };
@@ -177,8 +290,8 @@ bool check_graph_instances_topologically_similar(
     std::string path2,
     bool throw_on_mismatch
 ){
-  GraphPersistHashTopology h1;
-  GraphPersistHashTopology h2;
+  GraphPersistHashTopology h1(8);
+  GraphPersistHashTopology h2(8);
 
   loadGraphPull(nullptr, path1, &h1);
   loadGraphPull(nullptr, path2, &h2);
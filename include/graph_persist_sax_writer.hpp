@@ -10,6 +10,10 @@ struct sax_writer_options
   bool sanity=true;
 };
 
+// Only the v3 writer has anywhere to put the metadata of each device and edge
+inline bool sax_writer_keeps_instance_metadata(const sax_writer_options &options)
+{ return options.format=="v3"; }
+
 /* To get an implementation of this, either #include "graph_persist_sax_writer_impl.hpp",
    or link against graph_persist_sax_writer.o
 */
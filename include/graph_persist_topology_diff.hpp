@@ -0,0 +1,525 @@
+#ifndef graph_persist_topology_diff_hpp
+#define graph_persist_topology_diff_hpp
+
+#include "graph_persist.hpp"
+#include "poets_hash.hpp"
+
+#include "xml_pull_parser.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <cassert>
+#include <queue>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+/* Sorts (key,value) records by key when there may be more than fit in memory.
+
+   Records are buffered until the buffer reaches the memory budget, then the
+   buffer is sorted in parallel and spilled to an anonymous temporary file as
+   a sorted run. Runs are merged in tiers, as in an LSM tree: once MERGE_FAN_IN
+   runs build up in a tier they are merged into one run in the next tier, so
+   each record is rewritten about log(runs)/log(MERGE_FAN_IN) times and the
+   number of open files stays small. Once all records are added, the remaining
+   runs are k-way merged and read back in key order with next(). If nothing
+   was spilled the records are just sorted in memory. Records with equal keys
+   come back in the order added.
+
+   The value must be trivially copyable, as it is written to disk as bytes. */
+template<class TValue>
+class ExternalRecordSorter
+{
+public:
+  struct record_t
+  {
+    std::string key;
+    TValue value;
+  };
+
+private:
+  // Number of runs in a tier which are merged into one run of the next tier
+  static const unsigned MERGE_FAN_IN=16;
+
+  struct file_closer_t
+  {
+    void operator()(FILE *f) const
+    { fclose(f); }
+  };
+  typedef std::unique_ptr<FILE,file_closer_t> file_ptr_t;
+
+  struct run_reader_t
+  {
+    file_ptr_t file;
+    record_t current;
+
+    bool read()
+    {
+      uint32_t len;
+      if(1!=fread(&len, sizeof(len), 1, file.get())){
+        return false;
+      }
+      current.key.resize(len);
+      if(len!=fread(&current.key[0], 1, len, file.get())){
+        throw std::runtime_error("ExternalRecordSorter : truncated run.");
+      }
+      if(1!=fread(&current.value, sizeof(TValue), 1, file.get())){
+        throw std::runtime_error("ExternalRecordSorter : truncated run.");
+      }
+      return true;
+    }
+  };
+
+  size_t m_memoryBytes;
+  unsigned m_threads;
+  std::string m_tempDir;
+
+  std::vector<record_t> m_buffer;
+  size_t m_bufferBytes=0;
+  // m_tiers[i] holds runs that have been through i merges. Every run in a
+  // tier holds records added before those in lower tiers.
+  std::vector<std::vector<file_ptr_t>> m_tiers;
+  uint64_t m_count=0;
+
+  bool m_finished=false;
+  size_t m_bufferPos=0;
+  std::vector<run_reader_t> m_readers;
+  std::priority_queue<std::pair<const std::string*,unsigned>, std::vector<std::pair<const std::string*,unsigned>>, std::function<bool(const std::pair<const std::string*,unsigned>&,const std::pair<const std::string*,unsigned>&)>> m_heap;
+
+  static bool less(const record_t &a, const record_t &b)
+  { return a.key < b.key; }
+
+  file_ptr_t create_temp_file() const
+  {
+    std::string path=m_tempDir+"/poets_sort_XXXXXX";
+    int fd=mkstemp(&path[0]);
+    if(fd<0){
+      throw std::runtime_error("ExternalRecordSorter : couldn't create temporary file in '"+m_tempDir+"'.");
+    }
+    // The file disappears when closed, even if we don't exit cleanly
+    unlink(path.c_str());
+    FILE *f=fdopen(fd, "w+b");
+    if(!f){
+      close(fd);
+      throw std::runtime_error("ExternalRecordSorter : couldn't open temporary file.");
+    }
+    return file_ptr_t(f);
+  }
+
+  static void write_record(FILE *f, const record_t &r)
+  {
+    uint32_t len=r.key.size();
+    if( 1!=fwrite(&len, sizeof(len), 1, f)
+        || len!=fwrite(r.key.data(), 1, len, f)
+        || 1!=fwrite(&r.value, sizeof(TValue), 1, f) ){
+      throw std::runtime_error("ExternalRecordSorter : couldn't write to temporary file (disk full?).");
+    }
+  }
+
+  /* Sorts chunks of the buffer on separate threads, then merges pairs of
+     neighbouring chunks in parallel until there is one. */
+  void parallel_sort()
+  {
+    size_t n=m_buffer.size();
+    unsigned chunks=(n < 65536) ? 1 : m_threads;
+    std::vector<size_t> bounds;
+    for(unsigned i=0; i<=chunks; i++){
+      bounds.push_back(n*i/chunks);
+    }
+
+    auto run=[&](unsigned tasks, std::function<void(unsigned)> f){
+      if(tasks==1){
+        f(0);
+        return;
+      }
+      std::vector<std::thread> workers;
+      for(unsigned i=0; i<tasks; i++){
+        workers.emplace_back(f, i);
+      }
+      for(auto &w : workers){
+        w.join();
+      }
+    };
+
+    run(chunks, [&](unsigned i){
+      std::stable_sort(m_buffer.begin()+bounds[i], m_buffer.begin()+bounds[i+1], less);
+    });
+
+    while(bounds.size()>2){
+      std::vector<size_t> next;
+      unsigned pairs=(bounds.size()-1)/2;
+      run(pairs, [&](unsigned i){
+        std::inplace_merge(m_buffer.begin()+bounds[2*i], m_buffer.begin()+bounds[2*i+1], m_buffer.begin()+bounds[2*i+2], less);
+      });
+      for(unsigned i=0; i<bounds.size(); i+=2){
+        next.push_back(bounds[i]);
+      }
+      if(next.back()!=n){
+        next.push_back(n);
+      }
+      bounds.swap(next);
+    }
+  }
+
+  void spill()
+  {
+    parallel_sort();
+    auto f=create_temp_file();
+    for(const auto &r : m_buffer){
+      write_record(f.get(), r);
+    }
+    m_buffer.clear();
+    m_buffer.shrink_to_fit();
+    m_bufferBytes=0;
+    add_run(0, std::move(f));
+  }
+
+  void add_run(unsigned tier, file_ptr_t run)
+  {
+    if(m_tiers.size()<=tier){
+      m_tiers.resize(tier+1);
+    }
+    m_tiers[tier].push_back(std::move(run));
+    if(m_tiers[tier].size()<MERGE_FAN_IN){
+      return;
+    }
+
+    std::vector<file_ptr_t> runs;
+    runs.swap(m_tiers[tier]);
+    start_merge(runs);
+    auto merged=create_temp_file();
+    record_t r;
+    while(next_merged(r)){
+      write_record(merged.get(), r);
+    }
+    m_readers.clear();
+    add_run(tier+1, std::move(merged));
+  }
+
+  // Runs must be in the order their records were added, for stability
+  void start_merge(std::vector<file_ptr_t> &runs)
+  {
+    m_readers.clear();
+    m_readers.resize(runs.size());
+    m_heap=decltype(m_heap)([](const std::pair<const std::string*,unsigned> &a, const std::pair<const std::string*,unsigned> &b){
+      int c=a.first->compare(*b.first);
+      return c!=0 ? c>0 : a.second>b.second;
+    });
+    for(unsigned i=0; i<runs.size(); i++){
+      rewind(runs[i].get());
+      m_readers[i].file=std::move(runs[i]);
+      if(m_readers[i].read()){
+        m_heap.push({&m_readers[i].current.key, i});
+      }
+    }
+    runs.clear();
+  }
+
+  bool next_merged(record_t &r)
+  {
+    if(m_heap.empty()){
+      return false;
+    }
+    unsigned i=m_heap.top().second;
+    m_heap.pop();
+    r=std::move(m_readers[i].current);
+    if(m_readers[i].read()){
+      m_heap.push({&m_readers[i].current.key, i});
+    }
+    return true;
+  }
+
+public:
+  ExternalRecordSorter(size_t memoryBytes=size_t(64)<<20, unsigned threads=0, const std::string &tempDir=std::string())
+    : m_memoryBytes(std::max<size_t>(memoryBytes, 1<<16))
+    , m_threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency()))
+    , m_tempDir(tempDir)
+  {
+    if(m_tempDir.empty()){
+      const char *tmp=getenv("TMPDIR");
+      m_tempDir=tmp ? tmp : "/tmp";
+    }
+  }
+
+  uint64_t size() const
+  { return m_count; }
+
+  // Runs currently on disk, which is less than the number spilled once tiers merge
+  unsigned getSpilledRunCount() const
+  {
+    unsigned n=0;
+    for(const auto &t : m_tiers){
+      n+=t.size();
+    }
+    return n;
+  }
+
+  void add(std::string &&key, const TValue &value)
+  {
+    assert(!m_finished);
+    m_bufferBytes += sizeof(record_t) + (key.capacity()>15 ? key.capacity() : 0);
+    m_buffer.push_back(record_t{std::move(key), value});
+    m_count++;
+    if(m_bufferBytes >= m_memoryBytes){
+      spill();
+    }
+  }
+
+  // No more records can be added after this
+  void finish()
+  {
+    assert(!m_finished);
+    m_finished=true;
+    if(m_tiers.empty()){
+      parallel_sort();
+    }else{
+      if(!m_buffer.empty()){
+        spill();
+      }
+      // Oldest records are in the highest tier
+      std::vector<file_ptr_t> runs;
+      for(unsigned i=m_tiers.size(); i>0; i--){
+        for(auto &f : m_tiers[i-1]){
+          runs.push_back(std::move(f));
+        }
+      }
+      m_tiers.clear();
+      start_merge(runs);
+    }
+  }
+
+  // Returns the records in key order, then false
+  bool next(record_t &r)
+  {
+    assert(m_finished);
+    if(!m_readers.empty()){
+      return next_merged(r);
+    }
+    if(m_bufferPos < m_buffer.size()){
+      r=std::move(m_buffer[m_bufferPos++]);
+      return true;
+    }
+    return false;
+  }
+};
+
+
+/* Reduces a graph instance as it loads to a stream of device records
+   (id -> type, properties hash, state hash) and edge records
+   (endpoints -> send index, properties hash, state hash), each sorted by key
+   using ExternalRecordSorter. Missing properties/state hash the same as the
+   defaults, as in GraphPersistHashTopology.
+
+   Edge keys are made from the device ids at each end, so the ids of all
+   devices are kept in memory, packed one after the other, until the instance
+   ends. The memory budget only covers the sorters, so resident memory is
+   still O(devices), though only a few bytes per device more than the ids. */
+class GraphTopologyDigest
+  : public GraphLoadEvents
+{
+public:
+  struct device_value_t
+  {
+    uint64_t type;
+    uint64_t properties;
+    uint64_t state;
+  };
+
+  struct edge_value_t
+  {
+    int64_t sendIndex;
+    uint64_t properties;
+    uint64_t state;
+  };
+
+  ExternalRecordSorter<device_value_t> devices;
+  ExternalRecordSorter<edge_value_t> edges;
+
+  /* Edge keys are srcDevice,srcPin,dstDevice,dstPin separated by 0 bytes, so
+     they sort in the same order as GraphDOM::EdgeKey. This turns one into
+     the usual dst:pin-src:pin form. */
+  static std::string edge_key_to_id(const std::string &key)
+  {
+    std::string parts[4];
+    size_t pos=0;
+    for(unsigned i=0; i<4; i++){
+      size_t end=(i<3) ? key.find('\0', pos) : key.size();
+      parts[i]=key.substr(pos, end-pos);
+      pos=end+1;
+    }
+    return parts[2]+":"+parts[3]+"-"+parts[0]+":"+parts[1];
+  }
+
+private:
+  std::vector<char> m_idChars;
+  std::vector<uint64_t> m_idOffsets;
+
+  static uint64_t hash_string(const std::string &s)
+  { return POETSFastHash::hash(s.data(), s.size()); }
+
+  static uint64_t hash_typed_data(const TypedDataSpecPtr &spec, TypedDataPtr data)
+  {
+    if(!data && spec){
+      data=spec->create();
+    }
+    if(data){
+      return POETSFastHash::hash(data.payloadPtr(), data.payloadSize());
+    }else{
+      return POETSFastHash::hash(nullptr, 0);
+    }
+  }
+
+  std::string device_id(uint64_t index) const
+  { return std::string(m_idChars.data()+m_idOffsets.at(index), m_idOffsets.at(index+1)-m_idOffsets[index]); }
+
+public:
+  // The budget is shared between the device and edge sorters
+  GraphTopologyDigest(size_t memoryBytes=size_t(256)<<20, unsigned threads=0, const std::string &tempDir=std::string())
+    : devices(memoryBytes/4, threads, tempDir)
+    , edges(3*(memoryBytes/4), threads, tempDir)
+  {
+    m_idOffsets.push_back(0);
+  }
+
+  uint64_t onDeviceInstance(
+    uint64_t graphInst,
+    const DeviceTypePtr &dt,
+    const std::string &id,
+    const TypedDataPtr &properties,
+    const TypedDataPtr &state,
+    rapidjson::Document &&metadata
+  ) override
+  {
+    m_idChars.insert(m_idChars.end(), id.begin(), id.end());
+    m_idOffsets.push_back(m_idChars.size());
+
+    devices.add(std::string(id), device_value_t{
+      hash_string(dt->getId()),
+      hash_typed_data(dt->getPropertiesSpec(), properties),
+      hash_typed_data(dt->getStateSpec(), state)
+    });
+    return m_idOffsets.size()-2;
+  }
+
+  void onEdgeInstance(
+    uint64_t graphInst,
+    uint64_t dstDevInst, const DeviceTypePtr &dstDevType, const InputPinPtr &dstPin,
+    uint64_t srcDevInst,  const DeviceTypePtr &srcDevType, const OutputPinPtr &srcPin,
+    int sendIndex,
+    const TypedDataPtr &properties,
+    const TypedDataPtr &state,
+    rapidjson::Document &&metadata
+  ) override
+  {
+    std::string key=device_id(srcDevInst);
+    key.push_back('\0');
+    key+=srcPin->getName();
+    key.push_back('\0');
+    key+=device_id(dstDevInst);
+    key.push_back('\0');
+    key+=dstPin->getName();
+
+    edges.add(std::move(key), edge_value_t{
+      sendIndex,
+      hash_typed_data(dstPin->getPropertiesSpec(), properties),
+      hash_typed_data(dstPin->getStateSpec(), state)
+    });
+  }
+
+  void onEndGraphInstance(uint64_t graphInst) override
+  {
+    // Only edges need the ids
+    std::vector<char>().swap(m_idChars);
+    std::vector<uint64_t>().swap(m_idOffsets);
+    devices.finish();
+    edges.finish();
+  }
+};
+
+
+struct streaming_diff_options_t
+{
+  size_t memoryBytes=size_t(1)<<30; // Split between the two graphs
+  unsigned threads=0;
+  std::string tempDir;
+  bool showEqual=false;               // Print "= device" lines for matching devices
+};
+
+/* Compares two graph instances by device id and edge endpoints, without
+   holding either graph in memory. Differences are printed to dst in the same
+   form as topologically_diff_graph_instances, with "<" for things only in
+   ref, ">" for things only in got, and "<>" for things in both with
+   different types, properties, or state. As only hashes are kept, the
+   differing values aren't printed. Returns the number of differences. */
+inline unsigned diff_graph_instances_streaming(Registry *registry, const filepath &refPath, const filepath &gotPath, const streaming_diff_options_t &options=streaming_diff_options_t(), FILE *dst=stderr)
+{
+  GraphTopologyDigest ref(options.memoryBytes/2, options.threads, options.tempDir);
+  loadGraphPull(registry, refPath, &ref);
+
+  GraphTopologyDigest got(options.memoryBytes/2, options.threads, options.tempDir);
+  loadGraphPull(registry, gotPath, &got);
+
+  unsigned differences=0;
+
+  if(ref.devices.size()!=got.devices.size()){
+    fprintf(dst, "Ref has %llu devices, while got has %llu\n", (unsigned long long)ref.devices.size(), (unsigned long long)got.devices.size());
+    differences++;
+  }
+  if(ref.edges.size()!=got.edges.size()){
+    fprintf(dst, "Ref has %llu edges, while got has %llu\n", (unsigned long long)ref.edges.size(), (unsigned long long)got.edges.size());
+    differences++;
+  }
+
+  // Walks two sorted streams, calling diff on matching keys
+  auto merge=[&](auto &refSorter, auto &gotSorter, const char *kind, auto toId, auto diff){
+    typename std::remove_reference<decltype(refSorter)>::type::record_t r, g;
+    bool hasR=refSorter.next(r), hasG=gotSorter.next(g);
+    while(hasR || hasG){
+      if(hasR && (!hasG || r.key < g.key)){
+        fprintf(dst, "< %s %s\n", kind, toId(r.key).c_str());
+        differences++;
+        hasR=refSorter.next(r);
+      }else if(hasG && (!hasR || g.key < r.key)){
+        fprintf(dst, "> %s %s\n", kind, toId(g.key).c_str());
+        differences++;
+        hasG=gotSorter.next(g);
+      }else{
+        diff(toId(r.key), r.value, g.value);
+        hasR=refSorter.next(r);
+        hasG=gotSorter.next(g);
+      }
+    }
+  };
+
+  auto diffHash=[&](const std::string &id, uint64_t a, uint64_t b, const char *attr){
+    if(a!=b){
+      fprintf(dst, "<> Thing %s %s\n", id.c_str(), attr);
+      differences++;
+    }
+  };
+
+  merge(ref.devices, got.devices, "device", [](const std::string &k){ return k; },
+    [&](const std::string &id, const GraphTopologyDigest::device_value_t &a, const GraphTopologyDigest::device_value_t &b){
+      if(options.showEqual){
+        fprintf(dst, "= device %s\n", id.c_str());
+      }
+      diffHash(id, a.type, b.type, "type");
+      diffHash(id, a.properties, b.properties, "properties");
+      diffHash(id, a.state, b.state, "state");
+    }
+  );
+
+  merge(ref.edges, got.edges, "edge", GraphTopologyDigest::edge_key_to_id,
+    [&](const std::string &id, const GraphTopologyDigest::edge_value_t &a, const GraphTopologyDigest::edge_value_t &b){
+      diffHash(id, a.sendIndex, b.sendIndex, "sendIndex");
+      diffHash(id, a.properties, b.properties, "properties");
+      diffHash(id, a.state, b.state, "state");
+    }
+  );
+
+  return differences;
+}
+
+#endif
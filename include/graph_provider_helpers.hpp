@@ -4,6 +4,7 @@
 #include "fenv_control.hpp"
 
 #include "graph.hpp"
+#include "typed_data_codec.hpp"
 
 #include <unordered_map>
 #include <cassert>
@@ -109,19 +110,28 @@ inline std::string float_to_string(double x)
 }
 
 
+/* Conversions to and from text go through a TypedDataCodec compiled from the
+   spec, rather than walking the element tree. Define POETS_TYPED_DATA_INTERPRETED
+   to go back to the element tree, e.g. to compare against it. */
 class TypedDataSpecImpl
   : public TypedDataSpec
 {
 private:
   TypedDataSpecElementTuplePtr m_type;
+  TypedDataCodec m_codec;
   unsigned m_payloadSize;
   unsigned m_totalSize;
 
   std::vector<char> m_default;
   mutable TypedDataPtr m_defaultShared;
+
+  // A null value stands for the default
+  const char *payload_or_default(const TypedDataPtr &data) const
+  { return data ? (const char *)data.payloadPtr() : (m_default.empty() ? nullptr : &m_default[0]); }
 public:
   TypedDataSpecImpl(TypedDataSpecElementTuplePtr elt=makeTuple("_", {}))
     : m_type(elt)
+    , m_codec(elt)
     , m_payloadSize(elt->getPayloadSize())
     , m_totalSize(elt->getPayloadSize()+sizeof(typed_data_t))
   {
@@ -206,12 +216,20 @@ public:
   {
     TypedDataPtr res=create();
     if(elt){
+#ifndef POETS_TYPED_DATA_INTERPRETED
+      if(auto text=elt->get_child_text()){
+        // Contains the members of the object, but not the enclosing braces
+        Glib::ustring content=text->get_content();
+        m_codec.JSONToBinary(content.c_str(), (char*)res.payloadPtr(), m_payloadSize, true);
+      }
+#else
       std::string text="{"+elt->get_child_text()->get_content()+"}";
       rapidjson::Document document;
       document.Parse(text.c_str());
       assert(document.IsObject());
 
       m_type->JSONToBinary(document, (char*)res.payloadPtr(), m_payloadSize);
+#endif
     }
     return res;
   }
@@ -223,6 +241,9 @@ public:
 
   virtual std::string toJSON(const TypedDataPtr &data) const override
   {
+#ifndef POETS_TYPED_DATA_INTERPRETED
+    return m_codec.binaryToJSON(payload_or_default(data), m_payloadSize);
+#else
     rapidjson::Document doc;
     auto v=m_type->binaryToJSON((char*)data.payloadPtr(), data.payloadSize(), doc.GetAllocator());
 
@@ -230,6 +251,7 @@ public:
     rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
     v.Accept(writer);
     return std::string(buffer.GetString());
+#endif
   }
 
   virtual void addDataHash(const TypedDataPtr &data, POETSHash &hash) const
@@ -239,16 +261,31 @@ public:
 
   std::string toXmlV4ValueSpec(const TypedDataPtr &data, int formatMinorVersion=0) const override
   {
+#ifndef POETS_TYPED_DATA_INTERPRETED
+    if(formatMinorVersion!=0){
+      throw std::runtime_error("formatMinorVersion!=0");
+    }
+    return m_codec.binaryToXmlV4Value(payload_or_default(data), m_payloadSize);
+#else
     std::stringstream acc;
     m_type->binaryToXmlV4Value((const char *)data.payloadPtr(), data.payloadSize(), acc, formatMinorVersion);
     return acc.str();
+#endif
   }
 
   TypedDataPtr loadXmlV4ValueSpec(const std::string &value, int formatMinorVersion=0) const override
   {
+#ifndef POETS_TYPED_DATA_INTERPRETED
+    if(formatMinorVersion!=0){
+      throw std::runtime_error("formatMinorVersion!=0");
+    }
+    TypedDataPtr res=create();
+    m_codec.xmlV4ValueToBinary(value.c_str(), (char *)res.payloadPtr(), m_payloadSize);
+#else
     std::stringstream src(value);
     TypedDataPtr res=create();
     m_type->xmlV4ValueToBinary(src, (char *)res.payloadPtr(), res.payloadSize(), true, formatMinorVersion);
+#endif
     return res;
   }
 
@@ -0,0 +1,420 @@
+#ifndef graph_static_analysis_hpp
+#define graph_static_analysis_hpp
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+/* Static metrics that relate to how fast a graph instance will simulate,
+   computed over a compact CSR form of the graph:
+
+   - in/out degree histograms per device, and fanout histograms per output pin
+   - edge-cut and communication volume for a given device partition
+   - reuse distance of the destination device addresses touched by deliveries
+   - bytes touched per message delivery
+
+   Everything apart from the reuse distance (which is inherently sequential)
+   is split over threads by device range, with per-thread partial results
+   combined at the end, so results don't depend on the thread count. Inputs
+   are checked before any threads start, so errors surface as exceptions on
+   the calling thread.
+
+   Pins are identified by global indices chosen by the caller, e.g. a base
+   index per device type plus the pin index within the type.
+*/
+class GraphStaticAnalysis
+{
+public:
+    struct edge_t
+    {
+        uint32_t src;
+        uint32_t dst;
+        uint32_t srcPin; // Global output pin index
+        uint32_t dstPin; // Global input pin index
+    };
+
+    /* Edges grouped by sending device then output pin. Each (device,pin)
+       with at least one edge is a "send", which delivers to the edges
+       targets[sendOffsets[s]..sendOffsets[s+1]). */
+    struct graph_t
+    {
+        uint32_t deviceCount=0;
+        std::vector<uint64_t> deviceSendOffsets; // Sends of device d are [deviceSendOffsets[d],deviceSendOffsets[d+1])
+        std::vector<uint32_t> sendPins;
+        std::vector<uint64_t> sendOffsets;
+        std::vector<uint32_t> targets;
+        std::vector<uint32_t> targetPins;
+
+        uint64_t edgeCount() const
+        { return targets.size(); }
+    };
+
+    // Values below 16 get their own bucket, then buckets are powers of two
+    typedef std::map<uint64_t,uint64_t> histogram_t;
+
+    static uint64_t histogram_bucket(uint64_t x)
+    {
+        if(x<16){
+            return x;
+        }
+        uint64_t b=16;
+        while(b*2 <= x){
+            b*=2;
+        }
+        return b;
+    }
+
+    static std::string histogram_label(uint64_t bucket)
+    {
+        if(bucket<16){
+            return std::to_string(bucket);
+        }
+        return std::to_string(bucket)+"-"+std::to_string(2*bucket-1);
+    }
+
+    struct degree_stats_t
+    {
+        histogram_t inDegree;
+        histogram_t outDegree;
+        std::vector<histogram_t> fanoutByOutputPin; // Only sends with at least one edge
+    };
+
+    struct partition_stats_t
+    {
+        unsigned partitions=0;
+        uint64_t minSize=0;
+        uint64_t maxSize=0;
+        uint64_t cutEdges=0;
+        // Sum over sends of the number of other partitions they deliver to
+        uint64_t communicationVolume=0;
+        // Largest communication volume sent out of any one partition
+        uint64_t maxPartitionVolume=0;
+    };
+
+    struct reuse_stats_t
+    {
+        uint64_t accesses=0;
+        uint64_t cold=0;           // First touch of a device
+        double meanDistance=0;     // Over the accesses that aren't cold
+        histogram_t histogram;
+    };
+
+    struct bytes_stats_t
+    {
+        double message=0;   // Mean message payload per delivery
+        double edge=0;      // Mean edge properties and state
+        double device=0;    // Mean destination device properties and state
+        double total() const
+        { return message+edge+device; }
+    };
+
+private:
+    unsigned m_threads;
+
+    template<class F>
+    void parallel_for(size_t n, F f) const
+    {
+        unsigned chunks=(n < 4096) ? 1 : m_threads;
+        if(chunks==1){
+            f(size_t(0), n, 0u);
+            return;
+        }
+        std::vector<std::thread> workers;
+        for(unsigned c=0; c<chunks; c++){
+            size_t begin=n*c/chunks, end=n*(c+1)/chunks;
+            workers.emplace_back([=,&f](){ f(begin, end, c); });
+        }
+        for(auto &w : workers){
+            w.join();
+        }
+    }
+
+    unsigned chunk_count(size_t n) const
+    { return (n < 4096) ? 1 : m_threads; }
+
+    static void merge_into(histogram_t &dst, const histogram_t &src)
+    {
+        for(const auto &kv : src){
+            dst[kv.first]+=kv.second;
+        }
+    }
+
+public:
+    GraphStaticAnalysis(unsigned threads=0)
+        : m_threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency()))
+    {}
+
+    static graph_t build(uint32_t deviceCount, std::vector<edge_t> &&edges)
+    {
+        graph_t g;
+        g.deviceCount=deviceCount;
+
+        // Counting sort by source, then order each source's edges by pin
+        std::vector<uint64_t> offsets(deviceCount+1, 0);
+        for(const auto &e : edges){
+            if(e.src>=deviceCount || e.dst>=deviceCount){
+                throw std::runtime_error("GraphStaticAnalysis : edge refers to unknown device.");
+            }
+            offsets[e.src+1]++;
+        }
+        for(uint32_t i=0; i<deviceCount; i++){
+            offsets[i+1]+=offsets[i];
+        }
+        std::vector<edge_t> sorted(edges.size());
+        {
+            std::vector<uint64_t> pos(offsets.begin(), offsets.end()-1);
+            for(const auto &e : edges){
+                sorted[pos[e.src]++]=e;
+            }
+        }
+        std::vector<edge_t>().swap(edges);
+
+        g.deviceSendOffsets.reserve(deviceCount+1);
+        g.sendOffsets.push_back(0);
+        g.targets.reserve(sorted.size());
+        g.targetPins.reserve(sorted.size());
+        for(uint32_t d=0; d<deviceCount; d++){
+            g.deviceSendOffsets.push_back(g.sendPins.size());
+            auto begin=sorted.begin()+offsets[d], end=sorted.begin()+offsets[d+1];
+            std::stable_sort(begin, end, [](const edge_t &a, const edge_t &b){ return a.srcPin < b.srcPin; });
+            for(auto it=begin; it!=end; ++it){
+                if(it==begin || it->srcPin!=(it-1)->srcPin){
+                    if(it!=begin){
+                        g.sendOffsets.push_back(g.targets.size());
+                    }
+                    g.sendPins.push_back(it->srcPin);
+                }
+                g.targets.push_back(it->dst);
+                g.targetPins.push_back(it->dstPin);
+            }
+            if(begin!=end){
+                g.sendOffsets.push_back(g.targets.size());
+            }
+        }
+        g.deviceSendOffsets.push_back(g.sendPins.size());
+        return g;
+    }
+
+    degree_stats_t degrees(const graph_t &g, unsigned outputPinCount) const
+    {
+        for(uint32_t p : g.sendPins){
+            if(p>=outputPinCount){
+                throw std::runtime_error("GraphStaticAnalysis : output pin index out of range.");
+            }
+        }
+
+        degree_stats_t res;
+        res.fanoutByOutputPin.resize(outputPinCount);
+
+        // In-degrees are scattered, so they are counted with relaxed atomics
+        // into one shared array rather than an array per thread.
+        std::unique_ptr<std::atomic<uint32_t>[]> in(new std::atomic<uint32_t>[g.deviceCount]);
+        for(uint32_t d=0; d<g.deviceCount; d++){
+            in[d].store(0, std::memory_order_relaxed);
+        }
+
+        unsigned chunks=chunk_count(g.deviceCount);
+        std::vector<degree_stats_t> partial(chunks);
+        parallel_for(g.deviceCount, [&](size_t begin, size_t end, unsigned c){
+            auto &p=partial[c];
+            p.fanoutByOutputPin.resize(outputPinCount);
+            for(size_t d=begin; d<end; d++){
+                uint64_t out=0;
+                for(uint64_t s=g.deviceSendOffsets[d]; s<g.deviceSendOffsets[d+1]; s++){
+                    uint64_t fanout=g.sendOffsets[s+1]-g.sendOffsets[s];
+                    p.fanoutByOutputPin[g.sendPins[s]][histogram_bucket(fanout)]++;
+                    out+=fanout;
+                    for(uint64_t e=g.sendOffsets[s]; e<g.sendOffsets[s+1]; e++){
+                        in[g.targets[e]].fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+                p.outDegree[histogram_bucket(out)]++;
+            }
+        });
+
+        std::vector<histogram_t> inHist(chunks);
+        parallel_for(g.deviceCount, [&](size_t begin, size_t end, unsigned c){
+            for(size_t d=begin; d<end; d++){
+                inHist[c][histogram_bucket(in[d].load(std::memory_order_relaxed))]++;
+            }
+        });
+
+        for(unsigned c=0; c<chunks; c++){
+            merge_into(res.inDegree, inHist[c]);
+            merge_into(res.outDegree, partial[c].outDegree);
+            for(unsigned p=0; p<outputPinCount; p++){
+                merge_into(res.fanoutByOutputPin[p], partial[c].fanoutByOutputPin[p]);
+            }
+        }
+        return res;
+    }
+
+    partition_stats_t partition(const graph_t &g, const std::vector<uint32_t> &part, unsigned partitions) const
+    {
+        if(part.size()!=g.deviceCount){
+            throw std::runtime_error("GraphStaticAnalysis : partition has the wrong number of devices.");
+        }
+        partition_stats_t res;
+        res.partitions=partitions;
+        for(uint32_t p : part){
+            if(p>=partitions){
+                throw std::runtime_error("GraphStaticAnalysis : partition index out of range.");
+            }
+        }
+
+        struct partial_t
+        {
+            uint64_t cut=0;
+            uint64_t volume=0;
+            std::vector<uint64_t> sizes;
+            std::vector<uint64_t> volumes;
+        };
+        unsigned chunks=chunk_count(g.deviceCount);
+        std::vector<partial_t> partial(chunks);
+        parallel_for(g.deviceCount, [&](size_t begin, size_t end, unsigned c){
+            auto &p=partial[c];
+            p.sizes.assign(partitions, 0);
+            p.volumes.assign(partitions, 0);
+            std::vector<uint64_t> seen(partitions, UINT64_MAX); // Last send to deliver to each partition
+            for(size_t d=begin; d<end; d++){
+                uint32_t home=part[d];
+                p.sizes[home]++;
+                for(uint64_t s=g.deviceSendOffsets[d]; s<g.deviceSendOffsets[d+1]; s++){
+                    for(uint64_t e=g.sendOffsets[s]; e<g.sendOffsets[s+1]; e++){
+                        uint32_t other=part[g.targets[e]];
+                        if(other!=home){
+                            p.cut++;
+                            if(seen[other]!=s){
+                                seen[other]=s;
+                                p.volume++;
+                                p.volumes[home]++;
+                            }
+                        }
+                    }
+                }
+            }
+        });
+
+        std::vector<uint64_t> sizes(partitions, 0), volumes(partitions, 0);
+        for(const auto &p : partial){
+            res.cutEdges+=p.cut;
+            res.communicationVolume+=p.volume;
+            for(unsigned i=0; i<partitions; i++){
+                sizes[i]+=p.sizes[i];
+                volumes[i]+=p.volumes[i];
+            }
+        }
+        if(partitions){
+            res.minSize=*std::min_element(sizes.begin(), sizes.end());
+            res.maxSize=*std::max_element(sizes.begin(), sizes.end());
+            res.maxPartitionVolume=*std::max_element(volumes.begin(), volumes.end());
+        }
+        return res;
+    }
+
+    // Consecutive blocks of clusterSize devices, in load order
+    static std::vector<uint32_t> clusters(uint32_t deviceCount, uint32_t clusterSize, unsigned &partitions)
+    {
+        clusterSize=std::max<uint32_t>(1, clusterSize);
+        partitions=(uint64_t(deviceCount)+clusterSize-1)/clusterSize;
+        std::vector<uint32_t> res(deviceCount);
+        for(uint32_t i=0; i<deviceCount; i++){
+            res[i]=i/clusterSize;
+        }
+        return res;
+    }
+
+    /* The trace is the destination of every delivery, taking sends in device
+       then pin order, which is roughly what a simulator sweeping the devices
+       does. The reuse distance of an access is the number of distinct devices
+       touched since the last access to the same device, computed exactly with
+       a Fenwick tree over the trace positions. */
+    reuse_stats_t reuse_distance(const graph_t &g) const
+    {
+        reuse_stats_t res;
+        uint64_t n=g.edgeCount();
+        res.accesses=n;
+
+        std::vector<uint32_t> tree(n+1, 0);
+        auto add=[&](uint64_t i, int32_t v){
+            for(i++; i<=n; i+=i&(0-i)){
+                tree[i]+=v;
+            }
+        };
+        auto prefix=[&](uint64_t i) -> uint64_t { // Sum of [0,i)
+            uint64_t acc=0;
+            for(; i>0; i-=i&(0-i)){
+                acc+=tree[i];
+            }
+            return acc;
+        };
+
+        std::vector<uint64_t> last(g.deviceCount, UINT64_MAX);
+        double sum=0;
+        for(uint64_t t=0; t<n; t++){
+            uint32_t dev=g.targets[t];
+            uint64_t prev=last[dev];
+            if(prev==UINT64_MAX){
+                res.cold++;
+            }else{
+                uint64_t dist=prefix(t)-prefix(prev+1);
+                res.histogram[histogram_bucket(dist)]++;
+                sum+=dist;
+                add(prev, -1);
+            }
+            add(t, +1);
+            last[dev]=t;
+        }
+        if(n>res.cold){
+            res.meanDistance=sum/(n-res.cold);
+        }
+        return res;
+    }
+
+    /* inputPinMessageBytes etc. are indexed by global input pin. */
+    bytes_stats_t bytes_per_delivery(const graph_t &g,
+        const std::vector<uint32_t> &inputPinMessageBytes,
+        const std::vector<uint32_t> &inputPinEdgeBytes,
+        const std::vector<uint32_t> &inputPinDeviceBytes
+    ) const
+    {
+        bytes_stats_t res;
+        uint64_t n=g.edgeCount();
+        if(n==0){
+            return res;
+        }
+        for(uint32_t p : g.targetPins){
+            if(p>=inputPinMessageBytes.size() || p>=inputPinEdgeBytes.size() || p>=inputPinDeviceBytes.size()){
+                throw std::runtime_error("GraphStaticAnalysis : input pin index out of range.");
+            }
+        }
+
+        unsigned chunks=chunk_count(n);
+        std::vector<uint64_t> msg(chunks,0), edge(chunks,0), dev(chunks,0);
+        parallel_for(n, [&](size_t begin, size_t end, unsigned c){
+            for(size_t e=begin; e<end; e++){
+                uint32_t p=g.targetPins[e];
+                msg[c]+=inputPinMessageBytes[p];
+                edge[c]+=inputPinEdgeBytes[p];
+                dev[c]+=inputPinDeviceBytes[p];
+            }
+        });
+        for(unsigned c=0; c<chunks; c++){
+            res.message+=msg[c];
+            res.edge+=edge[c];
+            res.device+=dev[c];
+        }
+        res.message/=n;
+        res.edge/=n;
+        res.device/=n;
+        return res;
+    }
+};
+
+#endif
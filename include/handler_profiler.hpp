@@ -0,0 +1,285 @@
+#ifndef handler_profiler_hpp
+#define handler_profiler_hpp
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Counts calls to device handlers, broken down by device type, handler kind
+   and pin, and times a sample of them.
+
+   Simulators only use this when compiled with POETS_HANDLER_PROFILER defined,
+   and otherwise don't include it at all, so it costs nothing in normal builds.
+
+   Each thread that records anything gets its own block of counters, so the
+   hot path is a thread_local lookup and some relaxed loads and stores. One
+   call in every 2^POETS_HANDLER_PROFILER_SAMPLE_SHIFT per thread is timed with
+   rdtsc (or steady_clock on other architectures), and the total time for a
+   slot is estimated by scaling up the sampled time by calls/sampled.
+*/
+
+#ifndef POETS_HANDLER_PROFILER_SAMPLE_SHIFT
+#define POETS_HANDLER_PROFILER_SAMPLE_SHIFT 4
+#endif
+
+class HandlerProfiler
+{
+public:
+    enum handler_kind_t{
+        Recv,
+        Send,
+        Compute,  // Device ran compute (device idle) rather than sending
+        NoAction, // Handler was called, but device had nothing to do
+        HardwareIdle
+    };
+
+    static const char *kind_name(handler_kind_t kind)
+    {
+        switch(kind){
+        case Recv: return "recv";
+        case Send: return "send";
+        case Compute: return "compute";
+        case NoAction: return "none";
+        case HardwareIdle: return "hardware_idle";
+        default: return "?";
+        }
+    }
+
+    struct row_t
+    {
+        std::string device_type;
+        handler_kind_t kind;
+        std::string pin; // Empty for handlers not attached to a pin
+        uint64_t calls;
+        uint64_t sampled;
+        double sampled_secs;
+
+        double estimated_secs() const
+        { return sampled ? sampled_secs*calls/sampled : 0.0; }
+
+        std::string key() const
+        { return pin.empty() ? device_type+"/"+kind_name(kind) : device_type+"/"+kind_name(kind)+"/"+pin; }
+    };
+
+private:
+    struct slot_t
+    {
+        std::string device_type;
+        handler_kind_t kind;
+        std::string pin;
+    };
+
+    struct device_type_t
+    {
+        unsigned base;
+        unsigned input_count;
+        unsigned output_count;
+    };
+
+    struct slot_counters_t
+    {
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> sampled;
+        std::atomic<uint64_t> ticks;
+    };
+
+    struct thread_counters_t
+    {
+        uint64_t countdown=0;
+        std::unique_ptr<slot_counters_t[]> slots;
+    };
+
+    std::vector<slot_t> m_slots;
+    std::vector<device_type_t> m_deviceTypes;
+
+    std::mutex m_threadsMutex;
+    std::vector<std::unique_ptr<thread_counters_t>> m_threads;
+
+    // Distinguishes profilers in thread-local lookups, even if one is allocated where an old one was
+    unsigned m_id;
+    static unsigned next_id()
+    {
+        static std::atomic<unsigned> id(0);
+        return ++id;
+    }
+
+    uint64_t m_beginTicks;
+    std::chrono::steady_clock::time_point m_beginTime;
+
+    static uint64_t ticks()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    void add_slot(const std::string &device_type, handler_kind_t kind, const std::string &pin)
+    {
+        m_slots.push_back(slot_t{device_type, kind, pin});
+    }
+
+    thread_counters_t &local()
+    {
+        static thread_local unsigned t_owner=0;
+        static thread_local thread_counters_t *t_counters=nullptr;
+        if(t_owner!=m_id){
+            auto counters=std::make_unique<thread_counters_t>();
+            counters->slots.reset(new slot_counters_t[m_slots.size()]());
+            std::lock_guard<std::mutex> lk(m_threadsMutex);
+            t_counters=counters.get();
+            t_owner=m_id;
+            m_threads.push_back(std::move(counters));
+        }
+        return *t_counters;
+    }
+
+    static void bump(std::atomic<uint64_t> &x, uint64_t v)
+    {
+        // Only the owning thread writes, so no need for an atomic add
+        x.store(x.load(std::memory_order_relaxed)+v, std::memory_order_relaxed);
+    }
+
+    double secs_per_tick() const
+    {
+        uint64_t t=ticks()-m_beginTicks;
+        double secs=std::chrono::duration<double>(std::chrono::steady_clock::now()-m_beginTime).count();
+        return t ? secs/t : 0.0;
+    }
+public:
+    HandlerProfiler()
+        : m_id(next_id())
+        , m_beginTicks(ticks())
+        , m_beginTime(std::chrono::steady_clock::now())
+    {}
+
+    HandlerProfiler(const HandlerProfiler &)=delete;
+    HandlerProfiler &operator=(const HandlerProfiler &)=delete;
+
+    //! Device types must all be added before anything is recorded. Returns the index of the type.
+    unsigned add_device_type(const std::string &id, const std::vector<std::string> &inputs, const std::vector<std::string> &outputs)
+    {
+        if(!m_threads.empty()){
+            throw std::runtime_error("HandlerProfiler : device types must be added before recording.");
+        }
+        device_type_t dt{(unsigned)m_slots.size(), (unsigned)inputs.size(), (unsigned)outputs.size()};
+        for(const auto &p : inputs){
+            add_slot(id, Recv, p);
+        }
+        for(const auto &p : outputs){
+            add_slot(id, Send, p);
+        }
+        add_slot(id, Compute, "");
+        add_slot(id, NoAction, "");
+        add_slot(id, HardwareIdle, "");
+        m_deviceTypes.push_back(dt);
+        return m_deviceTypes.size()-1;
+    }
+
+    unsigned recv_slot(unsigned device_type, unsigned pin) const
+    { return m_deviceTypes[device_type].base+pin; }
+
+    unsigned send_slot(unsigned device_type, unsigned pin) const
+    { return m_deviceTypes[device_type].base+m_deviceTypes[device_type].input_count+pin; }
+
+    //! Slot for the outcome of a send-or-compute handler, using the sprovider action convention (-2 none, -1 compute, else output pin)
+    unsigned action_slot(unsigned device_type, int action) const
+    {
+        const auto &dt=m_deviceTypes[device_type];
+        if(action>=0){
+            return dt.base+dt.input_count+action;
+        }
+        return dt.base+dt.input_count+dt.output_count+(action==-1 ? 0 : 1);
+    }
+
+    unsigned hardware_idle_slot(unsigned device_type) const
+    { return m_deviceTypes[device_type].base+m_deviceTypes[device_type].input_count+m_deviceTypes[device_type].output_count+2; }
+
+    //! Call just before a handler. Returns a start time if this call is sampled, else zero.
+    uint64_t begin()
+    {
+        auto &l=local();
+        if(l.countdown){
+            l.countdown--;
+            return 0;
+        }
+        l.countdown=(1u<<POETS_HANDLER_PROFILER_SAMPLE_SHIFT)-1;
+        return ticks() | 1; // Make sure a sample is never confused with zero
+    }
+
+    //! Call just after a handler, once the slot is known.
+    void end(uint64_t start, unsigned slot)
+    {
+        auto &c=local().slots[slot];
+        bump(c.calls, 1);
+        if(start){
+            bump(c.sampled, 1);
+            bump(c.ticks, ticks()-start);
+        }
+    }
+
+    //! Sums over all threads. Can be called while other threads are still recording, in which case it is approximate.
+    std::vector<row_t> report()
+    {
+        double spt=secs_per_tick();
+
+        std::vector<row_t> res;
+        for(const auto &s : m_slots){
+            res.push_back(row_t{s.device_type, s.kind, s.pin, 0, 0, 0.0});
+        }
+
+        std::lock_guard<std::mutex> lk(m_threadsMutex);
+        for(const auto &t : m_threads){
+            for(unsigned i=0; i<m_slots.size(); i++){
+                const auto &c=t->slots[i];
+                res[i].calls += c.calls.load(std::memory_order_relaxed);
+                res[i].sampled += c.sampled.load(std::memory_order_relaxed);
+                res[i].sampled_secs += c.ticks.load(std::memory_order_relaxed)*spt;
+            }
+        }
+
+        res.erase(std::remove_if(res.begin(), res.end(), [](const row_t &r){ return r.calls==0; }), res.end());
+        std::sort(res.begin(), res.end(), [](const row_t &a, const row_t &b){
+            return a.estimated_secs() > b.estimated_secs();
+        });
+        return res;
+    }
+
+    //! Writes rows as CSV, with a header, most expensive first.
+    static void write_csv(FILE *dst, const std::vector<row_t> &rows)
+    {
+        fprintf(dst, "device_type,handler,pin,calls,sampled,sampled_secs,estimated_secs,estimated_nsecs_per_call\n");
+        for(const auto &r : rows){
+            fprintf(dst, "%s,%s,%s,%llu,%llu,%g,%g,%g\n",
+                r.device_type.c_str(), kind_name(r.kind), r.pin.c_str(),
+                (unsigned long long)r.calls, (unsigned long long)r.sampled,
+                r.sampled_secs, r.estimated_secs(), r.sampled ? 1e9*r.sampled_secs/r.sampled : 0.0
+            );
+        }
+    }
+
+    //! Sends each row through a (thing,sub_thing,value) stats logger.
+    static void stats_log(const std::function<void(const std::string &, const std::string &, const std::string &)> &log, const std::vector<row_t> &rows)
+    {
+        for(const auto &r : rows){
+            log("handler_profile_calls", r.key(), std::to_string(r.calls));
+            log("handler_profile_sampled", r.key(), std::to_string(r.sampled));
+            log("handler_profile_secs", r.key(), std::to_string(r.estimated_secs()));
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,1218 @@
+#ifndef inproc_ring_connection_hpp
+#define inproc_ring_connection_hpp
+
+#include "poets_protocol/InProcessBinaryUpstreamConnection.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Transports used to connect simulators to externals.
+
+   InProcExternalServer is the simulator-facing side of an
+   InProcessBinaryUpstreamConnection. It holds the hooks that the simulator
+   fills in (address mapping, properties, fanout), plus the interface the
+   simulator uses to move messages across. epoch_sim has a mutex+queue
+   implementation, and this file provides the ring based ones:
+
+   - InProcRingConnection : two lock-free single-producer single-consumer rings
+     of fixed size slots. Both directions are batched: a send only becomes visible
+     when the batch fills or is flushed, and recv pulls everything that is available
+     in one go.
+
+   - The same rings can be placed in a memfd or POSIX shared-memory segment. The
+     simulator creates the segment with InProcRingConnection::create_shm, and
+     another process attaches with ShmRingClient, which implements the client side
+     of InProcessBinaryUpstreamConnection directly over the mapped memory. The
+     client's connect request is passed back through the segment, so the simulator
+     checks it exactly as it would for an in-process external.
+
+   Each message is copied once into a ring slot by the producer, and the consumer
+   reads it from the slot.
+
+   Blocking waits are done by polling with back-off, as that works the same
+   across processes and it only happens when one side is idle.
+*/
+
+class InProcExternalServer
+  : public InProcessBinaryUpstreamConnection
+{
+public:
+  std::function<void(const std::string &graph_type,const std::string &graph_instance,const std::vector<std::pair<std::string,std::string>> &owned)> m_connect;
+  std::function<size_t (size_t cbBuffer, void *pBuffer)> m_getGraphProperties;
+  std::function<size_t(poets_device_address_t address, size_t cbBuffer, void *pBuffer)> m_getDeviceProperties;
+
+  std::function<poets_device_address_t(const std::string &s)> m_idToAddress;
+  std::function<std::string(poets_device_address_t)> m_addressToId;
+  std::function<void(poets_endpoint_address_t,std::vector<poets_endpoint_address_t>&)> m_endpointToFanout;
+
+  // Used for connection and halt hand-over. Implementations may also use
+  // it for the data path.
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  bool m_connected=false;
+
+  unsigned m_logLevel=2;
+
+  // Simulator-side interface
+
+  //! Queue a message from an internal endpoint to the externals. May be buffered until flush_posted.
+  virtual void post_message(poets_endpoint_address_t address, const uint8_t *payload, unsigned size, unsigned sendIndex) =0;
+
+  //! Make any posted messages visible to the client.
+  virtual void flush_posted()
+  {}
+
+  //! Call f(address,payload,size,sendIndex) for all messages currently sent by the client. Returns the number of messages.
+  virtual unsigned drain_incoming(const std::function<void(poets_endpoint_address_t,const uint8_t*,unsigned,unsigned)> &f) =0;
+
+  //! Block until the client has sent at least one message.
+  virtual void wait_for_client_to_send() =0;
+
+  //! Block while too many posted messages are waiting for the client.
+  virtual void wait_for_client_to_drain() =0;
+
+  virtual void set_halt_message(const halt_message_type &halt) =0;
+
+  //! Block until the client calls connect
+  virtual void wait_for_connect()
+  {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_cond.wait(lk, [&]{ return m_connected; });
+  }
+
+  ////////////////////////////////////
+  // Client interface
+
+  void connect(
+      const std::string &graph_type,
+      const std::string &graph_instance,
+      const std::vector<std::pair<std::string,std::string>> &owned
+  ) override {
+    if(!m_connect){
+      throw std::runtime_error("connect was called twice.");
+    }
+    m_connect(graph_type, graph_instance, owned);
+    m_connect=nullptr;
+
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_connected=true;
+    m_cond.notify_all();
+  }
+
+  size_t get_graph_properties(size_t cbBuffer, void *pBuffer) override
+  { return m_getGraphProperties(cbBuffer, pBuffer); }
+
+  size_t get_device_properties(poets_device_address_t address, size_t cbBuffer, void *pBuffer) override
+  { return m_getDeviceProperties(address, cbBuffer, pBuffer); }
+
+  poets_device_address_t get_device_address(const std::string &id) override
+  { return m_idToAddress(id); }
+
+  std::string get_device_id(poets_device_address_t address) override
+  { return m_addressToId(address); }
+
+  void get_endpoint_destinations(poets_endpoint_address_t source, std::vector<poets_endpoint_address_t> &destinations) override
+  { m_endpointToFanout(source, destinations); }
+
+  void external_log(
+      int level,
+      const char *msg,
+      ...
+  ) override {
+    if(level < (int)m_logLevel){
+      va_list va;
+      va_start(va, msg);
+      vfprintf(stderr, msg, va);
+      va_end(va);
+      fputs("\n", stderr);
+    }
+  }
+};
+
+
+/* Header at the start of every slot. The payload follows directly after. */
+struct ring_slot_header_t
+{
+  uint64_t address;
+  uint32_t sendIndex;
+  uint32_t size;
+};
+
+/* Shared control block of a ring. The two indices are on separate cache
+   lines so that producer and consumer do not fight over them. */
+struct ring_control_t
+{
+  uint32_t capacity;    // Number of slots, always a power of two
+  uint32_t slotStride;  // Bytes per slot, including ring_slot_header_t
+  uint32_t slotsOffset; // Offset of first slot from this control block
+  uint32_t _pad_;
+
+  alignas(64) std::atomic<uint64_t> head; // Next sequence number to be written
+  alignas(64) std::atomic<uint64_t> tail; // Next sequence number to be read
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Ring indices must be lock-free to live in shared memory.");
+
+/* A view over a ring_control_t and its slots. The view holds a cached copy of
+   the other side's index, so the shared line is only touched when the cached
+   value says the ring is full (producer) or empty (consumer).
+
+   There must be exactly one producer view and one consumer view per ring.
+*/
+class spsc_ring
+{
+private:
+  ring_control_t *m_control=nullptr;
+  uint8_t *m_slots=nullptr;
+  uint64_t m_mask=0;
+  uint32_t m_stride=0;
+
+  uint64_t m_local=0;  // Our own index (head for producer, tail for consumer)
+  uint64_t m_cached=0; // Last seen value of the other side's index
+
+public:
+  static uint32_t stride_for_payload(unsigned maxPayload)
+  { return (sizeof(ring_slot_header_t)+maxPayload+15) & ~15u; }
+
+  static size_t bytes_required(unsigned capacity, unsigned maxPayload)
+  {
+    size_t ctrl=(sizeof(ring_control_t)+63) & ~size_t(63);
+    return ctrl + size_t(capacity)*stride_for_payload(maxPayload);
+  }
+
+  //! Initialise a fresh ring in the given (suitably aligned) memory
+  static ring_control_t *format(void *base, unsigned capacity, unsigned maxPayload)
+  {
+    if(capacity==0 || (capacity&(capacity-1))){
+      throw std::runtime_error("Ring capacity must be a non-zero power of two.");
+    }
+    ring_control_t *control=new (base) ring_control_t();
+    control->capacity=capacity;
+    control->slotStride=stride_for_payload(maxPayload);
+    control->slotsOffset=(sizeof(ring_control_t)+63) & ~size_t(63);
+    control->head.store(0, std::memory_order_relaxed);
+    control->tail.store(0, std::memory_order_relaxed);
+    return control;
+  }
+
+  spsc_ring()
+  {}
+
+  spsc_ring(ring_control_t *control)
+    : m_control(control)
+    , m_slots(((uint8_t*)control)+control->slotsOffset)
+    , m_mask(control->capacity-1)
+    , m_stride(control->slotStride)
+  {}
+
+  unsigned capacity() const
+  { return m_mask+1; }
+
+  unsigned max_payload() const
+  { return m_stride-sizeof(ring_slot_header_t); }
+
+  ring_slot_header_t *slot(uint64_t seq) const
+  { return (ring_slot_header_t*)(m_slots + (seq&m_mask)*m_stride); }
+
+  static uint8_t *payload(ring_slot_header_t *s)
+  { return (uint8_t*)(s+1); }
+
+  static const uint8_t *payload(const ring_slot_header_t *s)
+  { return (const uint8_t*)(s+1); }
+
+  ///////////////////////////////////////////
+  // Producer side
+
+  void attach_producer()
+  {
+    m_local=m_control->head.load(std::memory_order_relaxed);
+    m_cached=m_control->tail.load(std::memory_order_acquire);
+  }
+
+  //! Number of slots that can be written without blocking (may under-estimate)
+  unsigned write_space(bool refresh=true)
+  {
+    uint64_t used=m_local-m_cached;
+    if(used > m_mask && refresh){
+      m_cached=m_control->tail.load(std::memory_order_acquire);
+      used=m_local-m_cached;
+    }
+    return (unsigned)(m_mask+1-used);
+  }
+
+  //! The i'th slot after the last published one. Caller must have checked write_space.
+  ring_slot_header_t *write_slot(unsigned i)
+  { return slot(m_local+i); }
+
+  //! Make the next n slots visible to the consumer
+  void publish(unsigned n)
+  {
+    m_local+=n;
+    m_control->head.store(m_local, std::memory_order_release);
+  }
+
+  uint64_t published() const
+  { return m_local; }
+
+  ///////////////////////////////////////////
+  // Consumer side
+
+  void attach_consumer()
+  {
+    m_local=m_control->tail.load(std::memory_order_relaxed);
+    m_cached=m_control->head.load(std::memory_order_acquire);
+  }
+
+  //! Number of slots that can be read (may under-estimate if refresh is false)
+  unsigned read_available(bool refresh=true)
+  {
+    if(m_cached==m_local && refresh){
+      m_cached=m_control->head.load(std::memory_order_acquire);
+    }
+    return (unsigned)(m_cached-m_local);
+  }
+
+  const ring_slot_header_t *read_slot(unsigned i) const
+  { return slot(m_local+i); }
+
+  //! Return the next n slots to the producer
+  void release(unsigned n)
+  {
+    m_local+=n;
+    m_control->tail.store(m_local, std::memory_order_release);
+  }
+
+  //! True if the consumer has read everything the producer has published
+  bool drained() const
+  { return m_control->tail.load(std::memory_order_acquire)==m_control->head.load(std::memory_order_acquire); }
+};
+
+
+/* Layout of a ring segment. All offsets are relative to the segment start.
+   The directory is only used when the segment is shared with another
+   process, as an in-process client can just call back into the simulator. */
+struct ring_segment_header_t
+{
+  static const uint64_t MAGIC = 0x50455453524e4732ull; // "POETSRNG2"-ish
+
+  enum State : uint32_t {
+    CREATED = 0,
+    READY = 1,      // Directory written by the server, client may attach
+    CONNECT_REQUESTED = 2, // Client has written a connect request
+    CONNECTED = 3,  // Server accepted the connect request
+    HALTED = 4,     // Halt message is valid
+    REJECTED = 5    // Server rejected the connect request, reason is in the connect area
+  };
+
+  uint64_t magic;
+  uint64_t totalSize;
+  uint32_t ext2intOffset;
+  uint32_t int2extOffset;
+  uint32_t directoryOffset;    // Packed ring_directory_entry_t records
+  uint32_t directorySize;
+  uint32_t directoryCount;
+  uint32_t graphPropertiesOffset;
+  uint32_t graphPropertiesSize;
+  uint32_t connectOffset;      // Connect request from the client, or rejection reason from the server
+  uint32_t connectSize;
+  uint32_t connectUsed;
+  uint32_t _pad_;
+  std::atomic<uint32_t> state;
+  halt_message_type halt;
+};
+
+struct ring_directory_entry_t
+{
+  uint32_t address;
+  uint32_t idLength;  // Not including null terminator
+  uint32_t propertiesOffset; // Relative to segment start
+  uint32_t propertiesSize;
+  uint32_t stride;    // Bytes to the next entry
+  // char id[idLength+1] follows
+};
+
+
+/* Memory backing a pair of rings. Either a heap allocation, or a shared
+   mapping. */
+class ring_segment
+{
+private:
+  uint8_t *m_base=nullptr;
+  size_t m_size=0;
+  bool m_mapped=false;
+  int m_fd=-1;
+  std::string m_shmName; // Non-empty if we created a named segment, so we unlink it
+
+  static size_t align64(size_t x)
+  { return (x+63) & ~size_t(63); }
+
+  ring_segment(const ring_segment &) = delete;
+  ring_segment &operator=(const ring_segment &) = delete;
+
+  static ring_segment_header_t *layout(uint8_t *base, size_t totalSize, unsigned capacity, unsigned maxPayload, size_t directoryBytes, size_t connectBytes)
+  {
+    auto *h=new (base) ring_segment_header_t();
+    h->magic=ring_segment_header_t::MAGIC;
+    h->totalSize=totalSize;
+    size_t off=align64(sizeof(ring_segment_header_t));
+    h->ext2intOffset=off;
+    spsc_ring::format(base+off, capacity, maxPayload);
+    off=align64(off+spsc_ring::bytes_required(capacity, maxPayload));
+    h->int2extOffset=off;
+    spsc_ring::format(base+off, capacity, maxPayload);
+    off=align64(off+spsc_ring::bytes_required(capacity, maxPayload));
+    h->directoryOffset=off;
+    h->directorySize=directoryBytes;
+    h->directoryCount=0;
+    off=align64(off+directoryBytes);
+    h->connectOffset=off;
+    h->connectSize=connectBytes;
+    h->connectUsed=0;
+    h->graphPropertiesOffset=0;
+    h->graphPropertiesSize=0;
+    h->state.store(ring_segment_header_t::CREATED, std::memory_order_release);
+    return h;
+  }
+
+public:
+  static size_t bytes_required(unsigned capacity, unsigned maxPayload, size_t directoryBytes, size_t connectBytes)
+  {
+    return align64(sizeof(ring_segment_header_t))
+      + 2*align64(spsc_ring::bytes_required(capacity, maxPayload))
+      + align64(directoryBytes)
+      + align64(connectBytes);
+  }
+
+  ring_segment()
+  {}
+
+  ~ring_segment()
+  {
+    if(m_mapped){
+      munmap(m_base, m_size);
+    }else{
+      delete[] m_base;
+    }
+    if(m_fd!=-1){
+      close(m_fd);
+    }
+    if(!m_shmName.empty()){
+      shm_unlink(m_shmName.c_str());
+    }
+  }
+
+  void create_heap(unsigned capacity, unsigned maxPayload)
+  {
+    assert(!m_base);
+    m_size=bytes_required(capacity, maxPayload, 0, 0);
+    m_base=new uint8_t[m_size+64];
+    // new[] only promises alignof(max_align_t)
+    uint8_t *aligned=(uint8_t*)align64((uintptr_t)m_base);
+    layout(aligned, m_size, capacity, maxPayload, 0, 0);
+    // Keep the raw pointer for delete[], and remember the offset in the header
+    m_alignedBase=aligned;
+  }
+
+  /*! Create a shared segment. If name is empty, then an anonymous memfd is used
+      and the fd must be passed to the other process (e.g. via /proc/<pid>/fd/<n>).
+      Otherwise a POSIX shared memory object called name is created. */
+  void create_shm(const std::string &name, unsigned capacity, unsigned maxPayload, size_t directoryBytes, size_t connectBytes)
+  {
+    assert(!m_base);
+    m_size=bytes_required(capacity, maxPayload, directoryBytes, connectBytes);
+    if(name.empty()){
+      m_fd=memfd_create("poets_ring", 0);
+      if(m_fd==-1){
+        throw std::runtime_error("memfd_create failed.");
+      }
+    }else{
+      m_fd=shm_open(name.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600);
+      if(m_fd==-1){
+        throw std::runtime_error("Couldn't create shared memory segment "+name+" (does it already exist?)");
+      }
+      m_shmName=name;
+    }
+    if(ftruncate(m_fd, m_size)!=0){
+      throw std::runtime_error("Couldn't size shared memory segment.");
+    }
+    void *p=mmap(nullptr, m_size, PROT_READ|PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if(p==MAP_FAILED){
+      throw std::runtime_error("Couldn't map shared memory segment.");
+    }
+    m_base=(uint8_t*)p;
+    m_alignedBase=m_base;
+    m_mapped=true;
+    layout(m_base, m_size, capacity, maxPayload, directoryBytes, connectBytes);
+  }
+
+  //! Attach to an existing segment, given either a shm name or a path such as /proc/<pid>/fd/<n>
+  void attach_shm(const std::string &nameOrPath)
+  {
+    assert(!m_base);
+    if(!nameOrPath.empty() && nameOrPath[0]=='/' && nameOrPath.find('/',1)!=std::string::npos){
+      m_fd=open(nameOrPath.c_str(), O_RDWR);
+    }else{
+      m_fd=shm_open(nameOrPath.c_str(), O_RDWR, 0);
+    }
+    if(m_fd==-1){
+      throw std::runtime_error("Couldn't open shared memory segment "+nameOrPath);
+    }
+    struct stat st;
+    if(fstat(m_fd, &st)!=0 || (size_t)st.st_size < sizeof(ring_segment_header_t)){
+      throw std::runtime_error("Shared memory segment "+nameOrPath+" is too small.");
+    }
+    m_size=st.st_size;
+    void *p=mmap(nullptr, m_size, PROT_READ|PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if(p==MAP_FAILED){
+      throw std::runtime_error("Couldn't map shared memory segment.");
+    }
+    m_base=(uint8_t*)p;
+    m_alignedBase=m_base;
+    m_mapped=true;
+    if(header()->magic!=ring_segment_header_t::MAGIC || header()->totalSize!=m_size){
+      throw std::runtime_error("Shared memory segment "+nameOrPath+" is not a POETS ring segment.");
+    }
+  }
+
+  int fd() const
+  { return m_fd; }
+
+  uint8_t *base() const
+  { return m_alignedBase; }
+
+  ring_segment_header_t *header() const
+  { return (ring_segment_header_t*)m_alignedBase; }
+
+  ring_control_t *ext2int() const
+  { return (ring_control_t*)(m_alignedBase+header()->ext2intOffset); }
+
+  ring_control_t *int2ext() const
+  { return (ring_control_t*)(m_alignedBase+header()->int2extOffset); }
+
+  uint8_t *connect_area() const
+  { return m_alignedBase+header()->connectOffset; }
+
+private:
+  uint8_t *m_alignedBase=nullptr;
+};
+
+
+/* Polling wait with back-off. Spins briefly, then yields (which matters when
+   the machine is over-subscribed), then sleeps for increasing amounts up to
+   about a millisecond. */
+template<class TPred>
+bool ring_poll_until(TPred pred, uint64_t timeoutMicroSeconds=0)
+{
+  auto start=std::chrono::steady_clock::now();
+  unsigned sleepUs=1;
+  for(unsigned i=0; ; i++){
+    if(pred()){
+      return true;
+    }
+    if(timeoutMicroSeconds){
+      auto waited=std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-start).count();
+      if((uint64_t)waited >= timeoutMicroSeconds){
+        return pred();
+      }
+    }
+    if(i<16){
+      // spin
+    }else if(i<1024){
+      std::this_thread::yield();
+    }else{
+      std::this_thread::sleep_for(std::chrono::microseconds(sleepUs));
+      sleepUs=std::min(1000u, sleepUs*2);
+    }
+  }
+}
+
+
+/* The data path that the client (external) side sees. It writes to
+   ext2int and reads from int2ext. Sends accumulate until either a batch fills,
+   flush is called, or the client blocks in wait_until. Receives grab as
+   many slots as are available, and release them back in one go. */
+class ring_client_port
+{
+private:
+  ring_segment_header_t *m_header=nullptr;
+  spsc_ring m_send;
+  spsc_ring m_recv;
+
+  unsigned m_sendPending=0;  // Written but not published
+  unsigned m_sendSpace=0;    // Known free slots, including pending ones
+
+  unsigned m_recvAvailable=0; // Slots known to be readable
+  unsigned m_recvConsumed=0;  // Slots read but not yet released
+
+  halt_message_type m_halt;
+  bool m_haltValid=false;
+
+public:
+  static const unsigned SEND_BATCH = 64;
+
+  void attach(const ring_segment &seg)
+  {
+    m_header=seg.header();
+    m_send=spsc_ring(seg.ext2int());
+    m_send.attach_producer();
+    m_recv=spsc_ring(seg.int2ext());
+    m_recv.attach_consumer();
+  }
+
+  bool can_send()
+  {
+    if(m_sendPending < m_sendSpace){
+      return true;
+    }
+    m_sendSpace=m_send.write_space();
+    return m_sendPending < m_sendSpace;
+  }
+
+  bool send(poets_endpoint_address_t source, const uint8_t *payload, unsigned size, unsigned sendIndex)
+  {
+    if(!can_send()){
+      return false;
+    }
+    if(size > m_send.max_payload()){
+      throw std::runtime_error("Message payload is larger than the ring slot size.");
+    }
+    auto *s=m_send.write_slot(m_sendPending);
+    s->address=source.value;
+    s->sendIndex=sendIndex;
+    s->size=size;
+    memcpy(spsc_ring::payload(s), payload, size);
+    if(++m_sendPending >= SEND_BATCH){
+      flush();
+    }
+    return true;
+  }
+
+  void flush()
+  {
+    if(m_sendPending){
+      m_send.publish(m_sendPending);
+      m_sendSpace-=m_sendPending;
+      m_sendPending=0;
+    }
+  }
+
+  void release_recv()
+  {
+    if(m_recvConsumed){
+      m_recv.release(m_recvConsumed);
+      m_recvAvailable-=m_recvConsumed;
+      m_recvConsumed=0;
+    }
+  }
+
+  bool can_recv()
+  {
+    if(m_recvConsumed < m_recvAvailable){
+      return true;
+    }
+    release_recv();
+    m_recvAvailable=m_recv.read_available();
+    return m_recvAvailable>0;
+  }
+
+  //! Returns a pointer to the next message, which is valid until the next call to recv or can_recv
+  const ring_slot_header_t *recv()
+  {
+    if(!can_recv()){
+      return nullptr;
+    }
+    return m_recv.read_slot(m_recvConsumed++);
+  }
+
+  const halt_message_type *get_terminate_message()
+  {
+    if(!m_haltValid && m_header->state.load(std::memory_order_acquire)==ring_segment_header_t::HALTED){
+      m_halt=m_header->halt;
+      m_haltValid=true;
+    }
+    return m_haltValid ? &m_halt : nullptr;
+  }
+
+  unsigned ready_events()
+  {
+    using Events = InProcessBinaryUpstreamConnection::Events;
+    unsigned res=0;
+    if(can_send()){
+      res |= Events::CAN_SEND;
+    }
+    if(can_recv()){
+      res |= Events::CAN_RECV;
+    }
+    if(get_terminate_message()){
+      res |= Events::TERMINATED;
+    }
+    return res;
+  }
+
+  InProcessBinaryUpstreamConnection::Events wait_until(InProcessBinaryUpstreamConnection::Events events, uint64_t timeoutMicroSeconds)
+  {
+    using Events = InProcessBinaryUpstreamConnection::Events;
+    unsigned res=0;
+    if(events==0){
+      return Events(ready_events());
+    }
+    flush();
+    release_recv();
+    uint64_t timeout=(events&Events::TIMEOUT) ? timeoutMicroSeconds : 0;
+    bool hit=ring_poll_until([&](){
+      res=ready_events();
+      return (res&events)!=0;
+    }, timeout);
+    if(!hit){
+      res |= Events::TIMEOUT;
+    }
+    return Events(res);
+  }
+};
+
+
+/* Connect request passed from a ShmRingClient to the server through the
+   connect area: the graph type and instance patterns, then the owned
+   (id,type pattern) pairs, all as length-prefixed strings. */
+struct ring_connect_request
+{
+  std::string graphType;
+  std::string graphInstance;
+  std::vector<std::pair<std::string,std::string>> owned;
+
+  static size_t encoded_size(const std::string &s)
+  { return 4+s.size(); }
+
+  size_t encoded_size() const
+  {
+    size_t acc=encoded_size(graphType)+encoded_size(graphInstance)+4;
+    for(const auto &o : owned){
+      acc+=encoded_size(o.first)+encoded_size(o.second);
+    }
+    return acc;
+  }
+
+  void encode(uint8_t *p) const
+  {
+    auto put_u32=[&](uint32_t x){ memcpy(p, &x, 4); p+=4; };
+    auto put_str=[&](const std::string &s){ put_u32(s.size()); memcpy(p, s.data(), s.size()); p+=s.size(); };
+    put_str(graphType);
+    put_str(graphInstance);
+    put_u32(owned.size());
+    for(const auto &o : owned){
+      put_str(o.first);
+      put_str(o.second);
+    }
+  }
+
+  void decode(const uint8_t *p, size_t n)
+  {
+    const uint8_t *end=p+n;
+    auto get_u32=[&]() -> uint32_t {
+      if(end-p < 4){
+        throw std::runtime_error("Truncated connect request in shared memory segment.");
+      }
+      uint32_t x;
+      memcpy(&x, p, 4);
+      p+=4;
+      return x;
+    };
+    auto get_str=[&]() -> std::string {
+      uint32_t len=get_u32();
+      if(size_t(end-p) < len){
+        throw std::runtime_error("Truncated connect request in shared memory segment.");
+      }
+      std::string res((const char*)p, len);
+      p+=len;
+      return res;
+    };
+    graphType=get_str();
+    graphInstance=get_str();
+    uint32_t count=get_u32();
+    owned.clear();
+    for(uint32_t i=0; i<count; i++){
+      auto id=get_str();
+      auto type=get_str();
+      owned.emplace_back(std::move(id), std::move(type));
+    }
+  }
+};
+
+
+/* Server side of a ring transport. If created with create_heap the client is
+   expected to be in the same process, and is given a reference to this object.
+   If created with create_shm, then another process attaches with ShmRingClient.
+*/
+class InProcRingConnection
+  : public InProcExternalServer
+{
+private:
+  ring_segment m_segment;
+  bool m_shared=false;
+
+  // Server view of the rings
+  spsc_ring m_post;  // int2ext, producer
+  spsc_ring m_drain; // ext2int, consumer
+  unsigned m_postPending=0;
+  unsigned m_postSpace=0;
+
+  // Client view, only used for in-process clients
+  ring_client_port m_client;
+
+  void attach_server()
+  {
+    m_post=spsc_ring(m_segment.int2ext());
+    m_post.attach_producer();
+    m_drain=spsc_ring(m_segment.ext2int());
+    m_drain.attach_consumer();
+  }
+
+public:
+  static const unsigned DEFAULT_CAPACITY = 65536;
+  static const unsigned DEFAULT_MAX_PAYLOAD = 64;
+  static const unsigned MIN_CONNECT_BYTES = 4096;
+  static const unsigned MAX_TYPE_PATTERN_BYTES = 64;
+
+  InProcRingConnection()
+  {}
+
+  //! Rings for an external in the same process
+  void create_heap(unsigned capacity=DEFAULT_CAPACITY, unsigned maxPayload=DEFAULT_MAX_PAYLOAD)
+  {
+    m_segment.create_heap(capacity, maxPayload);
+    attach_server();
+    m_client.attach(m_segment);
+    m_segment.header()->state.store(ring_segment_header_t::READY, std::memory_order_release);
+  }
+
+  /*! Rings for an external in another process. The directory of external ids and their
+      properties, plus the graph properties, is written so that the client can answer
+      get_device_address/get_device_id/get_*_properties without calling back.
+      The segment is not marked as READY until publish_directory is called.
+      connectBytes is the space for the client's connect request (see connect_bytes). */
+  void create_shm(const std::string &name, size_t directoryBytes, size_t connectBytes, unsigned capacity=DEFAULT_CAPACITY, unsigned maxPayload=DEFAULT_MAX_PAYLOAD)
+  {
+    m_segment.create_shm(name, capacity, maxPayload, directoryBytes, connectBytes);
+    m_shared=true;
+    attach_server();
+  }
+
+  //! Bytes needed in the directory for the given externals and graph properties
+  static size_t directory_bytes(const std::vector<std::pair<std::string,size_t>> &idsAndPropertySizes, size_t graphPropertiesSize)
+  {
+    size_t acc=(graphPropertiesSize+7)&~size_t(7);
+    for(const auto &ip : idsAndPropertySizes){
+      acc+=(sizeof(ring_directory_entry_t)+ip.first.size()+1+7)&~size_t(7);
+      acc+=(ip.second+7)&~size_t(7);
+    }
+    return acc;
+  }
+
+  //! Space for a connect request owning all the given externals, allowing for type patterns and rejection messages
+  static size_t connect_bytes(const std::vector<std::pair<std::string,size_t>> &idsAndPropertySizes)
+  {
+    size_t acc=MIN_CONNECT_BYTES;
+    for(const auto &ip : idsAndPropertySizes){
+      acc+=8+ip.first.size()+MAX_TYPE_PATTERN_BYTES;
+    }
+    return acc;
+  }
+
+  struct directory_entry
+  {
+    poets_device_address_t address;
+    std::string id;
+    std::vector<uint8_t> properties;
+  };
+
+  void publish_directory(const std::vector<directory_entry> &externals, const std::vector<uint8_t> &graphProperties)
+  {
+    assert(m_shared);
+    auto *h=m_segment.header();
+    uint8_t *base=m_segment.base();
+    size_t off=h->directoryOffset;
+    size_t end=h->directoryOffset+h->directorySize;
+
+    auto reserve=[&](size_t n) -> uint8_t *{
+      size_t an=(n+7)&~size_t(7);
+      if(off+an > end){
+        throw std::runtime_error("Shared memory directory is too small.");
+      }
+      uint8_t *res=base+off;
+      off+=an;
+      return res;
+    };
+
+    h->graphPropertiesSize=graphProperties.size();
+    uint8_t *gp=reserve(graphProperties.size());
+    h->graphPropertiesOffset=gp-base;
+    if(!graphProperties.empty()){
+      memcpy(gp, &graphProperties[0], graphProperties.size());
+    }
+
+    for(const auto &e : externals){
+      size_t entryBytes=sizeof(ring_directory_entry_t)+e.id.size()+1;
+      uint8_t *pe=reserve(entryBytes);
+      uint8_t *pp=reserve(e.properties.size());
+      auto *de=(ring_directory_entry_t*)pe;
+      de->address=e.address.value;
+      de->idLength=e.id.size();
+      de->propertiesOffset=pp-base;
+      de->propertiesSize=e.properties.size();
+      de->stride=pp-pe; // Properties are directly after the entry
+      memcpy(pe+sizeof(ring_directory_entry_t), e.id.c_str(), e.id.size()+1);
+      if(!e.properties.empty()){
+        memcpy(pp, &e.properties[0], e.properties.size());
+      }
+      de->stride+= (e.properties.size()+7)&~size_t(7);
+      h->directoryCount++;
+    }
+
+    h->state.store(ring_segment_header_t::READY, std::memory_order_release);
+  }
+
+  const ring_segment &segment() const
+  { return m_segment; }
+
+  bool is_shared() const
+  { return m_shared; }
+
+  void wait_for_connect() override
+  {
+    if(!m_shared){
+      InProcExternalServer::wait_for_connect();
+      return;
+    }
+    auto *h=m_segment.header();
+    ring_poll_until([&](){
+      return h->state.load(std::memory_order_acquire)>=ring_segment_header_t::CONNECT_REQUESTED;
+    });
+
+    // Apply the same checks as an in-process connect. On failure the reason
+    // is passed back to the client before the simulator gives up.
+    try{
+      if(h->connectUsed > h->connectSize){
+        throw std::runtime_error("Connect request is larger than the connect area.");
+      }
+      ring_connect_request req;
+      req.decode(m_segment.connect_area(), h->connectUsed);
+      InProcExternalServer::connect(req.graphType, req.graphInstance, req.owned);
+    }catch(std::exception &e){
+      std::string msg=e.what();
+      msg.resize(std::min<size_t>(msg.size(), h->connectSize));
+      memcpy(m_segment.connect_area(), msg.data(), msg.size());
+      h->connectUsed=msg.size();
+      h->state.store(ring_segment_header_t::REJECTED, std::memory_order_release);
+      throw;
+    }
+    h->state.store(ring_segment_header_t::CONNECTED, std::memory_order_release);
+  }
+
+  ////////////////////////////////////////
+  // Simulator side
+
+  void post_message(poets_endpoint_address_t address, const uint8_t *payload, unsigned size, unsigned sendIndex) override
+  {
+    if(m_postPending==m_postSpace){
+      flush_posted();
+      m_postSpace=m_post.write_space();
+      if(m_postSpace==0){
+        wait_for_client_to_drain();
+        m_postSpace=m_post.write_space();
+      }
+    }
+    if(size > m_post.max_payload()){
+      throw std::runtime_error("Message payload is larger than the ring slot size.");
+    }
+    auto *s=m_post.write_slot(m_postPending++);
+    s->address=address.value;
+    s->sendIndex=sendIndex;
+    s->size=size;
+    memcpy(spsc_ring::payload(s), payload, size);
+  }
+
+  void flush_posted() override
+  {
+    if(m_postPending){
+      m_post.publish(m_postPending);
+      m_postSpace-=m_postPending;
+      m_postPending=0;
+    }
+  }
+
+  unsigned drain_incoming(const std::function<void(poets_endpoint_address_t,const uint8_t*,unsigned,unsigned)> &f) override
+  {
+    unsigned n=m_drain.read_available();
+    for(unsigned i=0; i<n; i++){
+      const auto *s=m_drain.read_slot(i);
+      f(poets_endpoint_address_t{s->address}, spsc_ring::payload(s), s->size, s->sendIndex);
+    }
+    if(n){
+      m_drain.release(n);
+    }
+    return n;
+  }
+
+  void wait_for_client_to_send() override
+  {
+    flush_posted();
+    ring_poll_until([&](){ return m_drain.read_available()>0; });
+  }
+
+  void wait_for_client_to_drain() override
+  {
+    flush_posted();
+    if(m_post.write_space()>0){
+      return;
+    }
+    if(m_logLevel>2){
+      fprintf(stderr, "Simulator is waiting for external to drain messages.\n");
+    }
+    ring_poll_until([&](){ return m_post.write_space()>0; });
+  }
+
+  void set_halt_message(const halt_message_type &halt) override
+  {
+    flush_posted();
+    auto *h=m_segment.header();
+    h->halt=halt;
+    h->state.store(ring_segment_header_t::HALTED, std::memory_order_release);
+  }
+
+  ////////////////////////////////////////
+  // In-process client side
+
+  bool can_send() override
+  { return m_client.can_send(); }
+
+  bool send(
+      poets_endpoint_address_t source,
+      std::vector<uint8_t> &payload,
+      unsigned sendIndex = UINT_MAX
+  ) override {
+    return m_client.send(source, payload.empty() ? nullptr : &payload[0], payload.size(), sendIndex);
+  }
+
+  void flush() override
+  { m_client.flush(); }
+
+  bool can_recv() override
+  { return m_client.can_recv(); }
+
+  bool recv(
+      poets_endpoint_address_t &source,
+      std::vector<uint8_t> &payload,
+      unsigned &sendIndex
+  ) override {
+    const auto *s=m_client.recv();
+    if(!s){
+      return false;
+    }
+    source=poets_endpoint_address_t{s->address};
+    sendIndex=s->sendIndex;
+    payload.assign(spsc_ring::payload(s), spsc_ring::payload(s)+s->size);
+    return true;
+  }
+
+  const halt_message_type *get_terminate_message() override
+  { return m_client.get_terminate_message(); }
+
+  Events wait_until(
+      Events events,
+      uint64_t timeoutMicroSeconds = 0
+  ) override {
+    return m_client.wait_until(events, timeoutMicroSeconds);
+  }
+};
+
+
+/* Client side of a shared-memory ring segment, for use in a different process
+   to the simulator. Address and property queries are answered from the
+   directory written by the server. Fanout queries are not available, as the
+   server does not publish its edge lists. */
+class ShmRingClient
+  : public InProcessBinaryUpstreamConnection
+{
+private:
+  ring_segment m_segment;
+  ring_client_port m_port;
+
+  std::unordered_map<std::string,const ring_directory_entry_t*> m_idToEntry;
+  std::unordered_map<uint32_t,const ring_directory_entry_t*> m_addressToEntry;
+
+  unsigned m_logLevel;
+
+public:
+  ShmRingClient(const std::string &nameOrPath, unsigned logLevel=2)
+    : m_logLevel(logLevel)
+  {
+    m_segment.attach_shm(nameOrPath);
+    auto *h=m_segment.header();
+    ring_poll_until([&](){ return h->state.load(std::memory_order_acquire)>=ring_segment_header_t::READY; });
+
+    const uint8_t *p=m_segment.base()+h->directoryOffset+((h->graphPropertiesSize+7)&~size_t(7));
+    for(unsigned i=0; i<h->directoryCount; i++){
+      auto *e=(const ring_directory_entry_t*)p;
+      std::string id((const char*)(e+1), e->idLength);
+      m_idToEntry[id]=e;
+      m_addressToEntry[e->address]=e;
+      p+=e->stride;
+    }
+
+    m_port.attach(m_segment);
+  }
+
+  //! Direct access to the next received message, which avoids copying into a vector
+  const ring_slot_header_t *recv_in_place()
+  { return m_port.recv(); }
+
+  //! Send without going through a vector
+  bool send(poets_endpoint_address_t source, const uint8_t *payload, unsigned size, unsigned sendIndex=UINT_MAX)
+  { return m_port.send(source, payload, size, sendIndex); }
+
+  void connect(
+      const std::string &graph_type,
+      const std::string &graph_instance,
+      const std::vector<std::pair<std::string,std::string>> &owned
+  ) override {
+    // The server checks the request, including type and instance patterns,
+    // just as it would for an in-process connect.
+    ring_connect_request req{graph_type, graph_instance, owned};
+    auto *h=m_segment.header();
+    size_t n=req.encoded_size();
+    if(n > h->connectSize){
+      throw std::runtime_error("Connect request is too large for the shared memory segment.");
+    }
+    req.encode(m_segment.connect_area());
+    h->connectUsed=n;
+    h->state.store(ring_segment_header_t::CONNECT_REQUESTED, std::memory_order_release);
+
+    ring_poll_until([&](){ return h->state.load(std::memory_order_acquire)>=ring_segment_header_t::CONNECTED; });
+    if(h->state.load(std::memory_order_acquire)==ring_segment_header_t::REJECTED){
+      std::string reason((const char*)m_segment.connect_area(), std::min<size_t>(h->connectUsed, h->connectSize));
+      throw std::runtime_error("Simulator rejected connection : "+reason);
+    }
+  }
+
+  size_t get_graph_properties(size_t cbBuffer, void *pBuffer) override
+  {
+    auto *h=m_segment.header();
+    if(cbBuffer < h->graphPropertiesSize){
+      throw std::runtime_error("Buffer is too small");
+    }
+    memcpy(pBuffer, m_segment.base()+h->graphPropertiesOffset, h->graphPropertiesSize);
+    return h->graphPropertiesSize;
+  }
+
+  size_t get_device_properties(poets_device_address_t address, size_t cbBuffer, void *pBuffer) override
+  {
+    auto it=m_addressToEntry.find(address.value);
+    if(it==m_addressToEntry.end()){
+      throw std::runtime_error("Device address is not an external.");
+    }
+    if(cbBuffer < it->second->propertiesSize){
+      throw std::runtime_error("Buffer is too small");
+    }
+    memcpy(pBuffer, m_segment.base()+it->second->propertiesOffset, it->second->propertiesSize);
+    return it->second->propertiesSize;
+  }
+
+  poets_device_address_t get_device_address(const std::string &id) override
+  {
+    auto it=m_idToEntry.find(id);
+    if(it==m_idToEntry.end()){
+      throw std::runtime_error("Unknown device/external instance id "+id);
+    }
+    return poets_device_address_t{it->second->address};
+  }
+
+  std::string get_device_id(poets_device_address_t address) override
+  {
+    auto it=m_addressToEntry.find(address.value);
+    if(it==m_addressToEntry.end()){
+      throw std::runtime_error("Device address is not an external.");
+    }
+    return std::string((const char*)(it->second+1), it->second->idLength);
+  }
+
+  void get_endpoint_destinations(poets_endpoint_address_t, std::vector<poets_endpoint_address_t> &) override
+  {
+    throw std::runtime_error("get_endpoint_destinations is not available over a shared memory connection.");
+  }
+
+  bool can_send() override
+  { return m_port.can_send(); }
+
+  bool send(
+      poets_endpoint_address_t source,
+      std::vector<uint8_t> &payload,
+      unsigned sendIndex = UINT_MAX
+  ) override {
+    return m_port.send(source, payload.empty() ? nullptr : &payload[0], payload.size(), sendIndex);
+  }
+
+  void flush() override
+  { m_port.flush(); }
+
+  bool can_recv() override
+  { return m_port.can_recv(); }
+
+  bool recv(
+      poets_endpoint_address_t &source,
+      std::vector<uint8_t> &payload,
+      unsigned &sendIndex
+  ) override {
+    const auto *s=m_port.recv();
+    if(!s){
+      return false;
+    }
+    source=poets_endpoint_address_t{s->address};
+    sendIndex=s->sendIndex;
+    payload.assign(spsc_ring::payload(s), spsc_ring::payload(s)+s->size);
+    return true;
+  }
+
+  const halt_message_type *get_terminate_message() override
+  { return m_port.get_terminate_message(); }
+
+  Events wait_until(
+      Events events,
+      uint64_t timeoutMicroSeconds = 0
+  ) override {
+    return m_port.wait_until(events, timeoutMicroSeconds);
+  }
+
+  void external_log(
+      int level,
+      const char *msg,
+      ...
+  ) override {
+    if(level < (int)m_logLevel){
+      va_list va;
+      va_start(va, msg);
+      vfprintf(stderr, msg, va);
+      va_end(va);
+      fputs("\n", stderr);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,816 @@
+#ifndef multilevel_partitioner_hpp
+#define multilevel_partitioner_hpp
+
+#include <vector>
+#include <algorithm>
+#include <queue>
+#include <thread>
+#include <random>
+#include <stdexcept>
+#include <functional>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+
+/* Multilevel k-way graph partitioner in the style of METIS, with no external
+   dependencies so it can be used anywhere metis isn't available.
+
+   - The graph is held as an undirected CSR with node and edge weights.
+   - Coarsening uses heavy-edge matching. Matches are found by rounds of
+     proposals: each unmatched node proposes its heaviest eligible edge, with
+     ties broken by a hash of the edge, and an edge is matched when both ends
+     propose it. Every decision only reads the previous round, so nodes are
+     processed in parallel and the result doesn't depend on the thread count.
+   - The coarsest graph is partitioned by greedy graph growing from several
+     seeds (tried in parallel), keeping the best cut.
+   - While uncoarsening, each level is refined by parallel greedy passes (gains
+     computed in parallel, then applied in order of gain with re-checking),
+     followed by a boundary FM pass which can climb out of local minima and
+     rolls back to the best cut seen.
+
+   The balance limit is enforced rather than being a target: every partition
+   weighs at most max(floor(total*(1+imbalance)/k), ceil(total/k)+maxNode-1),
+   where maxNode is the heaviest node of the input graph. The second term only
+   matters when the nodes are too lumpy for the first to be achievable.
+
+   For a given seed the partition is the same whatever the number of threads.
+*/
+class MultilevelPartitioner
+{
+public:
+    typedef int64_t weight_t;
+
+    struct csr_graph_t
+    {
+        std::vector<uint64_t> offsets; // Node i has neighbours adj[offsets[i]..offsets[i+1])
+        std::vector<uint32_t> adj;
+        std::vector<weight_t> adjWeight;
+        std::vector<weight_t> nodeWeight;
+
+        unsigned size() const
+        { return nodeWeight.size(); }
+
+        weight_t totalNodeWeight() const
+        {
+            weight_t acc=0;
+            for(auto w : nodeWeight){
+                acc+=w;
+            }
+            return acc;
+        }
+    };
+
+    struct edge_t
+    {
+        uint32_t a;
+        uint32_t b;
+        weight_t weight;
+    };
+
+    /* Builds an undirected graph from directed edges. Self loops are dropped, and
+       the weights of all edges between a pair of nodes (in either direction)
+       are summed, so the cut of the result equals the weight of directed edges
+       crossing partitions. If nodeWeights is empty every node has weight 1. */
+    static csr_graph_t buildUndirected(unsigned nNodes, std::vector<edge_t> edges, const std::vector<weight_t> &nodeWeights=std::vector<weight_t>())
+    {
+        csr_graph_t g;
+        if(nodeWeights.empty()){
+            g.nodeWeight.assign(nNodes, 1);
+        }else{
+            if(nodeWeights.size()!=nNodes){
+                throw std::runtime_error("MultilevelPartitioner : wrong number of node weights.");
+            }
+            g.nodeWeight=nodeWeights;
+        }
+
+        std::vector<edge_t> both;
+        both.reserve(edges.size()*2);
+        for(const auto &e : edges){
+            if(e.a>=nNodes || e.b>=nNodes){
+                throw std::runtime_error("MultilevelPartitioner : edge refers to non-existent node.");
+            }
+            if(e.a==e.b){
+                continue;
+            }
+            both.push_back(e);
+            both.push_back(edge_t{e.b,e.a,e.weight});
+        }
+        edges.clear();
+        edges.shrink_to_fit();
+        std::sort(both.begin(), both.end(), [](const edge_t &x, const edge_t &y){
+            return x.a<y.a || (x.a==y.a && x.b<y.b);
+        });
+
+        g.offsets.assign(nNodes+1, 0);
+        for(unsigned i=0; i<both.size(); i++){
+            if(i>0 && both[i].a==both[i-1].a && both[i].b==both[i-1].b){
+                g.adjWeight.back()+=both[i].weight;
+            }else{
+                g.adj.push_back(both[i].b);
+                g.adjWeight.push_back(both[i].weight);
+                g.offsets[both[i].a+1]++;
+            }
+        }
+        for(unsigned i=0; i<nNodes; i++){
+            g.offsets[i+1]+=g.offsets[i];
+        }
+        return g;
+    }
+
+    struct options_t
+    {
+        unsigned partitions=2;
+        unsigned threads=0;         // 0 means std::thread::hardware_concurrency
+        double imbalance=0.03;      // Allowed excess over the average partition weight (enforced, see above)
+        uint64_t seed=1;
+        unsigned coarsenTo=0;       // Stop coarsening at this many nodes; 0 chooses from the partition count
+        unsigned initialTries=8;    // Number of seeds for initial partitioning
+        unsigned refinePasses=8;    // Maximum greedy passes per level
+        unsigned logLevel=0;
+    };
+
+    struct result_t
+    {
+        std::vector<uint32_t> part;
+        std::vector<weight_t> partWeights;
+        weight_t cut=0;
+        unsigned levels=0;
+    };
+
+    static weight_t calcCut(const csr_graph_t &g, const std::vector<uint32_t> &part)
+    {
+        weight_t acc=0;
+        for(unsigned v=0; v<g.size(); v++){
+            for(uint64_t i=g.offsets[v]; i<g.offsets[v+1]; i++){
+                if(part[v]!=part[g.adj[i]]){
+                    acc+=g.adjWeight[i];
+                }
+            }
+        }
+        return acc/2;
+    }
+
+    static result_t partition(const csr_graph_t &graph, const options_t &options)
+    {
+        MultilevelPartitioner mp(options);
+        return mp.run(graph);
+    }
+
+private:
+    static constexpr uint32_t NONE=0xFFFFFFFFul;
+
+    options_t m_options;
+    unsigned m_threads;
+    unsigned m_k;
+
+    MultilevelPartitioner(const options_t &options)
+        : m_options(options)
+    {
+        m_threads=options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+        m_k=options.partitions;
+        if(m_k<1){
+            throw std::runtime_error("MultilevelPartitioner : need at least one partition.");
+        }
+    }
+
+    /* Splits [0,n) into contiguous chunks, one per thread. f(begin,end,chunk).
+       Small ranges are run inline, as it isn't worth starting threads. */
+    template<class F>
+    void parallel_for(size_t n, F f, unsigned chunks=0) const
+    {
+        if(chunks==0){
+            chunks=(n < 4096) ? 1 : m_threads;
+        }
+        chunks=std::max(1u, std::min<unsigned>(chunks, std::max<size_t>(n,1)));
+        if(chunks==1){
+            f(size_t(0), n, 0u);
+            return;
+        }
+        std::vector<std::thread> workers;
+        for(unsigned c=0; c<chunks; c++){
+            size_t begin=n*c/chunks, end=n*(c+1)/chunks;
+            workers.emplace_back([=,&f](){ f(begin, end, c); });
+        }
+        for(auto &w : workers){
+            w.join();
+        }
+    }
+
+    static uint64_t mix(uint64_t x)
+    {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdull;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ull;
+        x ^= x >> 33;
+        return x;
+    }
+
+    // Symmetric in (a,b), so both ends of an edge agree on its tie-break
+    uint64_t edge_key(uint32_t a, uint32_t b, unsigned round) const
+    {
+        if(a>b){
+            std::swap(a,b);
+        }
+        return mix( (uint64_t(a)<<32 | b) ^ mix(m_options.seed*0x9E3779B97F4A7C15ull + round) );
+    }
+
+    struct level_t
+    {
+        csr_graph_t graph;
+        std::vector<uint32_t> cmap; // Map from nodes of the next finer graph to nodes of this one
+    };
+
+    //////////////////////////////////////////////////////////////////////
+    // Coarsening
+
+    std::vector<uint32_t> match_heavy_edges(const csr_graph_t &g, weight_t maxNodeWeight) const
+    {
+        unsigned n=g.size();
+        std::vector<uint32_t> match(n, NONE);
+        std::vector<uint32_t> proposal(n, NONE);
+
+        for(unsigned round=0; round<8; round++){
+            parallel_for(n, [&](size_t begin, size_t end, unsigned){
+                for(size_t v=begin; v<end; v++){
+                    proposal[v]=NONE;
+                    if(match[v]!=NONE){
+                        continue;
+                    }
+                    weight_t bestW=-1;
+                    uint64_t bestKey=0;
+                    for(uint64_t i=g.offsets[v]; i<g.offsets[v+1]; i++){
+                        uint32_t u=g.adj[i];
+                        if(match[u]!=NONE || g.nodeWeight[v]+g.nodeWeight[u] > maxNodeWeight){
+                            continue;
+                        }
+                        weight_t w=g.adjWeight[i];
+                        if(w<bestW){
+                            continue;
+                        }
+                        uint64_t key=edge_key(v,u,round);
+                        if(w>bestW || key>bestKey){
+                            bestW=w;
+                            bestKey=key;
+                            proposal[v]=u;
+                        }
+                    }
+                }
+            });
+
+            std::vector<unsigned> matched(m_threads, 0);
+            parallel_for(n, [&](size_t begin, size_t end, unsigned c){
+                for(size_t v=begin; v<end; v++){
+                    uint32_t u=proposal[v];
+                    if(u!=NONE && proposal[u]==v){
+                        match[v]=u;
+                        matched[c]++;
+                    }
+                }
+            });
+            unsigned total=0;
+            for(auto m : matched){
+                total+=m;
+            }
+            if(total==0){
+                break;
+            }
+        }
+
+        for(unsigned v=0; v<n; v++){
+            if(match[v]==NONE){
+                match[v]=v;
+            }
+        }
+        return match;
+    }
+
+    csr_graph_t contract(const csr_graph_t &g, const std::vector<uint32_t> &match, std::vector<uint32_t> &cmap) const
+    {
+        unsigned n=g.size();
+        cmap.assign(n, NONE);
+
+        // The lower-numbered node of each pair is the leader, and coarse nodes are numbered by leader
+        std::vector<uint32_t> leaders;
+        for(unsigned v=0; v<n; v++){
+            if(v<=match[v]){
+                cmap[v]=leaders.size();
+                leaders.push_back(v);
+            }
+        }
+        for(unsigned v=0; v<n; v++){
+            if(v>match[v]){
+                cmap[v]=cmap[match[v]];
+            }
+        }
+
+        unsigned nc=leaders.size();
+        csr_graph_t res;
+        res.nodeWeight.resize(nc);
+        res.offsets.assign(nc+1, 0);
+
+        unsigned chunks=(nc<4096) ? 1 : m_threads;
+        std::vector<std::vector<uint32_t>> chunkAdj(chunks);
+        std::vector<std::vector<weight_t>> chunkWeight(chunks);
+
+        parallel_for(nc, [&](size_t begin, size_t end, unsigned c){
+            std::vector<std::pair<uint32_t,weight_t>> acc;
+            auto &localAdj=chunkAdj[c];
+            auto &localWeight=chunkWeight[c];
+            for(size_t ci=begin; ci<end; ci++){
+                uint32_t v=leaders[ci];
+                uint32_t u=match[v];
+                acc.clear();
+                for(uint32_t x : {v,u}){
+                    for(uint64_t i=g.offsets[x]; i<g.offsets[x+1]; i++){
+                        uint32_t cy=cmap[g.adj[i]];
+                        if(cy!=ci){
+                            acc.push_back({cy, g.adjWeight[i]});
+                        }
+                    }
+                    if(u==v){
+                        break;
+                    }
+                }
+                std::sort(acc.begin(), acc.end(), [](const std::pair<uint32_t,weight_t> &a, const std::pair<uint32_t,weight_t> &b){
+                    return a.first<b.first;
+                });
+                uint64_t degree=0;
+                for(unsigned i=0; i<acc.size(); i++){
+                    if(i>0 && acc[i].first==acc[i-1].first){
+                        localWeight.back()+=acc[i].second;
+                    }else{
+                        localAdj.push_back(acc[i].first);
+                        localWeight.push_back(acc[i].second);
+                        degree++;
+                    }
+                }
+                res.offsets[ci+1]=degree;
+                res.nodeWeight[ci]=g.nodeWeight[v] + (u!=v ? g.nodeWeight[u] : 0);
+            }
+        }, chunks);
+
+        for(unsigned i=0; i<nc; i++){
+            res.offsets[i+1]+=res.offsets[i];
+        }
+        res.adj.resize(res.offsets[nc]);
+        res.adjWeight.resize(res.offsets[nc]);
+        parallel_for(nc, [&](size_t begin, size_t, unsigned c){
+            std::copy(chunkAdj[c].begin(), chunkAdj[c].end(), res.adj.begin()+res.offsets[begin]);
+            std::copy(chunkWeight[c].begin(), chunkWeight[c].end(), res.adjWeight.begin()+res.offsets[begin]);
+        }, chunks);
+
+        return res;
+    }
+
+    //////////////////////////////////////////////////////////////////////
+    // Refinement
+
+    struct state_t
+    {
+        std::vector<uint32_t> part;
+        std::vector<weight_t> partWeight;
+        weight_t limit;
+    };
+
+    /* Connectivity of v to each partition, using a scratch array of size k
+       which is left zeroed. Returns the touched partitions in parts. */
+    static void connectivity(const csr_graph_t &g, const std::vector<uint32_t> &part, uint32_t v, std::vector<weight_t> &conn, std::vector<uint32_t> &parts)
+    {
+        parts.clear();
+        for(uint64_t i=g.offsets[v]; i<g.offsets[v+1]; i++){
+            uint32_t p=part[g.adj[i]];
+            if(conn[p]==0){
+                parts.push_back(p);
+            }
+            conn[p]+=g.adjWeight[i];
+        }
+    }
+
+    struct move_t
+    {
+        weight_t gain;
+        uint32_t node;
+        uint32_t to;
+    };
+
+    /* Best move for v which keeps the destination under the limit. A move is
+       acceptable if it has positive gain, or zero gain and improves balance. */
+    static bool best_move(const csr_graph_t &g, const state_t &s, uint32_t v, std::vector<weight_t> &conn, std::vector<uint32_t> &parts, move_t &best, bool allowNegative)
+    {
+        connectivity(g, s.part, v, conn, parts);
+        uint32_t own=s.part[v];
+        weight_t internal=conn[own];
+        weight_t w=g.nodeWeight[v];
+        bool found=false;
+        for(uint32_t p : parts){
+            if(p==own || s.partWeight[p]+w > s.limit){
+                continue;
+            }
+            weight_t gain=conn[p]-internal;
+            bool better;
+            if(!found){
+                better=true;
+            }else if(gain!=best.gain){
+                better=gain>best.gain;
+            }else if(s.partWeight[p]!=s.partWeight[best.to]){
+                better=s.partWeight[p]<s.partWeight[best.to];
+            }else{
+                better=p<best.to;
+            }
+            if(better){
+                best=move_t{gain, v, p};
+                found=true;
+            }
+        }
+        for(uint32_t p : parts){
+            conn[p]=0;
+        }
+        if(!found){
+            return false;
+        }
+        if(allowNegative || best.gain>0){
+            return true;
+        }
+        return best.gain==0 && s.partWeight[best.to]+w < s.partWeight[own];
+    }
+
+    void apply_move(const csr_graph_t &g, state_t &s, uint32_t v, uint32_t to) const
+    {
+        weight_t w=g.nodeWeight[v];
+        s.partWeight[s.part[v]]-=w;
+        s.partWeight[to]+=w;
+        s.part[v]=to;
+    }
+
+    unsigned greedy_pass(const csr_graph_t &g, state_t &s) const
+    {
+        unsigned n=g.size();
+        unsigned chunks=(n<4096) ? 1 : m_threads;
+        std::vector<std::vector<move_t>> chunkMoves(chunks);
+        parallel_for(n, [&](size_t begin, size_t end, unsigned c){
+            std::vector<weight_t> conn(m_k, 0);
+            std::vector<uint32_t> parts;
+            move_t m;
+            for(size_t v=begin; v<end; v++){
+                if(best_move(g, s, v, conn, parts, m, false)){
+                    chunkMoves[c].push_back(m);
+                }
+            }
+        }, chunks);
+
+        std::vector<move_t> moves;
+        for(auto &cm : chunkMoves){
+            moves.insert(moves.end(), cm.begin(), cm.end());
+        }
+        std::sort(moves.begin(), moves.end(), [](const move_t &a, const move_t &b){
+            return a.gain>b.gain || (a.gain==b.gain && a.node<b.node);
+        });
+
+        // Earlier moves may have changed the neighbourhood, so check again before applying
+        std::vector<weight_t> conn(m_k, 0);
+        std::vector<uint32_t> parts;
+        unsigned applied=0;
+        for(const auto &cand : moves){
+            move_t m;
+            if(best_move(g, s, cand.node, conn, parts, m, false)){
+                apply_move(g, s, m.node, m.to);
+                applied++;
+            }
+        }
+        return applied;
+    }
+
+    /* Moves nodes out of partitions over the limit, choosing the moves that
+       lose least cut, until no partition is over. While any partition is over
+       the lightest is under ceil(total/k), so limit_for guarantees that the
+       first move of each round can be applied and the loop terminates. */
+    void rebalance(const csr_graph_t &g, state_t &s) const
+    {
+        std::vector<weight_t> conn(m_k, 0);
+        std::vector<uint32_t> parts;
+        while(true){
+            bool over=false;
+            for(auto w : s.partWeight){
+                over = over || w > s.limit;
+            }
+            if(!over){
+                return;
+            }
+
+            std::vector<move_t> moves;
+            for(uint32_t v=0; v<g.size(); v++){
+                if(s.partWeight[s.part[v]] <= s.limit){
+                    continue;
+                }
+                move_t m;
+                if(best_move(g, s, v, conn, parts, m, true)){
+                    moves.push_back(m);
+                }else{
+                    // No connected partition has room, so go to the lightest one
+                    uint32_t lightest=std::min_element(s.partWeight.begin(), s.partWeight.end())-s.partWeight.begin();
+                    connectivity(g, s.part, v, conn, parts);
+                    weight_t gain=-conn[s.part[v]];
+                    for(uint32_t p : parts){
+                        conn[p]=0;
+                    }
+                    moves.push_back(move_t{gain, v, lightest});
+                }
+            }
+            std::sort(moves.begin(), moves.end(), [](const move_t &a, const move_t &b){
+                return a.gain>b.gain || (a.gain==b.gain && a.node<b.node);
+            });
+            unsigned applied=0;
+            for(const auto &m : moves){
+                uint32_t from=s.part[m.node];
+                weight_t w=g.nodeWeight[m.node];
+                if(s.partWeight[from] > s.limit && s.partWeight[m.to]+w <= s.limit && m.to!=from){
+                    apply_move(g, s, m.node, m.to);
+                    applied++;
+                }
+            }
+            if(applied==0){
+                throw std::logic_error("MultilevelPartitioner::rebalance - no move possible, limit is unachievable.");
+            }
+        }
+    }
+
+    /* Boundary FM: repeatedly makes the best move of an unlocked node, even if
+       it makes the cut worse, then rolls back to the best cut seen. */
+    void fm_pass(const csr_graph_t &g, state_t &s) const
+    {
+        unsigned n=g.size();
+        std::vector<weight_t> conn(m_k, 0);
+        std::vector<uint32_t> parts;
+        std::vector<uint32_t> version(n, 0);
+        std::vector<char> locked(n, 0);
+
+        struct entry_t
+        {
+            weight_t gain;
+            uint32_t node;
+            uint32_t to;
+            uint32_t version;
+            bool operator<(const entry_t &o) const
+            { return gain<o.gain || (gain==o.gain && node>o.node); }
+        };
+        std::priority_queue<entry_t> queue;
+
+        auto push=[&](uint32_t v){
+            move_t m;
+            if(best_move(g, s, v, conn, parts, m, true)){
+                queue.push(entry_t{m.gain, v, m.to, version[v]});
+            }
+        };
+
+        for(uint32_t v=0; v<n; v++){
+            for(uint64_t i=g.offsets[v]; i<g.offsets[v+1]; i++){
+                if(s.part[g.adj[i]]!=s.part[v]){
+                    push(v);
+                    break;
+                }
+            }
+        }
+
+        const unsigned maxBadMoves=std::max(50u, std::min(n/20, 1000u));
+        std::vector<std::pair<uint32_t,uint32_t>> history; // (node, previous partition)
+        weight_t acc=0, bestAcc=0;
+        size_t bestLength=0;
+
+        while(!queue.empty() && history.size()-bestLength < maxBadMoves){
+            entry_t e=queue.top();
+            queue.pop();
+            if(locked[e.node] || e.version!=version[e.node]){
+                continue;
+            }
+            if(s.partWeight[e.to]+g.nodeWeight[e.node] > s.limit){
+                version[e.node]++;
+                push(e.node);
+                continue;
+            }
+            history.push_back({e.node, s.part[e.node]});
+            apply_move(g, s, e.node, e.to);
+            locked[e.node]=1;
+            acc+=e.gain;
+            if(acc>bestAcc){
+                bestAcc=acc;
+                bestLength=history.size();
+            }
+            for(uint64_t i=g.offsets[e.node]; i<g.offsets[e.node+1]; i++){
+                uint32_t u=g.adj[i];
+                if(!locked[u]){
+                    version[u]++;
+                    push(u);
+                }
+            }
+        }
+
+        while(history.size()>bestLength){
+            apply_move(g, s, history.back().first, history.back().second);
+            history.pop_back();
+        }
+    }
+
+    void refine(const csr_graph_t &g, state_t &s) const
+    {
+        rebalance(g, s);
+        for(unsigned pass=0; pass<m_options.refinePasses; pass++){
+            if(greedy_pass(g, s)==0){
+                break;
+            }
+        }
+        fm_pass(g, s);
+    }
+
+    //////////////////////////////////////////////////////////////////////
+    // Initial partition
+
+    void grow_partition(const csr_graph_t &g, state_t &s, uint64_t seed) const
+    {
+        unsigned n=g.size();
+        std::mt19937_64 urng(seed);
+        s.part.assign(n, NONE);
+        s.partWeight.assign(m_k, 0);
+
+        weight_t total=g.totalNodeWeight();
+        weight_t assigned=0;
+        std::vector<weight_t> gain(n, 0);
+
+        for(uint32_t p=0; p+1<m_k; p++){
+            // Aim for an even share of what is left
+            weight_t target=(total-assigned)/(m_k-p);
+            std::priority_queue<std::pair<weight_t,uint32_t>> frontier;
+            std::vector<uint32_t> touched;
+
+            auto pick_seed=[&]() -> uint32_t {
+                uint32_t start=urng()%n;
+                for(uint32_t i=0; i<n; i++){
+                    uint32_t v=(start+i)%n;
+                    if(s.part[v]==NONE){
+                        return v;
+                    }
+                }
+                return NONE;
+            };
+
+            while(s.partWeight[p] < target){
+                uint32_t v=NONE;
+                while(!frontier.empty()){
+                    auto top=frontier.top();
+                    frontier.pop();
+                    if(s.part[top.second]==NONE && top.first==gain[top.second]){
+                        v=top.second;
+                        break;
+                    }
+                }
+                if(v==NONE){
+                    v=pick_seed();
+                    if(v==NONE){
+                        break;
+                    }
+                }
+                if(s.partWeight[p]+g.nodeWeight[v] > s.limit){
+                    break;
+                }
+                s.part[v]=p;
+                s.partWeight[p]+=g.nodeWeight[v];
+                assigned+=g.nodeWeight[v];
+                for(uint64_t i=g.offsets[v]; i<g.offsets[v+1]; i++){
+                    uint32_t u=g.adj[i];
+                    if(s.part[u]==NONE){
+                        if(gain[u]==0){
+                            touched.push_back(u);
+                        }
+                        gain[u]+=g.adjWeight[i];
+                        frontier.push({gain[u], u});
+                    }
+                }
+            }
+            for(auto u : touched){
+                gain[u]=0;
+            }
+        }
+        for(uint32_t v=0; v<n; v++){
+            if(s.part[v]==NONE){
+                s.part[v]=m_k-1;
+                s.partWeight[m_k-1]+=g.nodeWeight[v];
+            }
+        }
+    }
+
+    static weight_t max_excess(const state_t &s)
+    {
+        weight_t worst=0;
+        for(auto w : s.partWeight){
+            worst=std::max(worst, w-s.limit);
+        }
+        return worst;
+    }
+
+    state_t initial_partition(const csr_graph_t &g, weight_t limit) const
+    {
+        unsigned tries=std::max(1u, m_options.initialTries);
+        std::vector<state_t> states(tries);
+        std::vector<weight_t> cuts(tries);
+        // One try per chunk, so which thread runs a try can't affect it
+        parallel_for(tries, [&](size_t begin, size_t end, unsigned){
+            for(size_t t=begin; t<end; t++){
+                states[t].limit=limit;
+                grow_partition(g, states[t], mix(m_options.seed + 0x632BE59BD9B4E019ull*(t+1)));
+                refine(g, states[t]);
+                cuts[t]=calcCut(g, states[t].part);
+            }
+        }, std::min(tries, m_threads));
+
+        unsigned best=0;
+        for(unsigned t=1; t<tries; t++){
+            auto eb=max_excess(states[best]), et=max_excess(states[t]);
+            if(et<eb || (et==eb && cuts[t]<cuts[best])){
+                best=t;
+            }
+        }
+        return std::move(states[best]);
+    }
+
+    //////////////////////////////////////////////////////////////////////
+
+    weight_t limit_for(const csr_graph_t &g, weight_t total) const
+    {
+        weight_t avg=(total+m_k-1)/m_k;
+        weight_t limit=(weight_t)std::floor(total*(1.0+m_options.imbalance)/m_k);
+        // Coarse nodes are lumpy, so allow at least one node of slack. This
+        // also keeps the limit achievable, which rebalance relies on.
+        weight_t maxNode=0;
+        for(auto w : g.nodeWeight){
+            maxNode=std::max(maxNode, w);
+        }
+        return std::max(limit, avg+maxNode-1);
+    }
+
+    result_t run(const csr_graph_t &graph)
+    {
+        result_t res;
+        unsigned n=graph.size();
+        if(m_k==1 || n==0){
+            res.part.assign(n, 0);
+            res.partWeights.assign(m_k, 0);
+            res.partWeights[0]=graph.totalNodeWeight();
+            return res;
+        }
+
+        weight_t total=graph.totalNodeWeight();
+        unsigned coarsenTo=m_options.coarsenTo ? m_options.coarsenTo : std::max(20*m_k, 200u);
+        weight_t maxNodeWeight=std::max<weight_t>(1, (weight_t)(1.5*total/coarsenTo));
+
+        std::vector<level_t> levels;
+        const csr_graph_t *curr=&graph;
+        while(curr->size() > coarsenTo){
+            auto match=match_heavy_edges(*curr, maxNodeWeight);
+            level_t level;
+            csr_graph_t coarse=contract(*curr, match, level.cmap);
+            if(m_options.logLevel>1){
+                fprintf(stderr, "  Coarsened %u nodes to %u\n", curr->size(), coarse.size());
+            }
+            // Stop if matching has run out of steam, e.g. on star-like graphs
+            bool stalled = coarse.size() > 0.95*curr->size();
+            levels.push_back(std::move(level));
+            levels.back().graph=std::move(coarse);
+            curr=&levels.back().graph;
+            if(stalled){
+                break;
+            }
+        }
+        res.levels=levels.size();
+
+        state_t s=initial_partition(*curr, limit_for(*curr, total));
+        if(m_options.logLevel>1){
+            fprintf(stderr, "  Initial partition of %u nodes, cut=%lld\n", curr->size(), (long long)calcCut(*curr, s.part));
+        }
+
+        for(int li=(int)levels.size()-1; li>=0; li--){
+            const csr_graph_t &fine = li>0 ? levels[li-1].graph : graph;
+            const auto &cmap=levels[li].cmap;
+            std::vector<uint32_t> finePart(fine.size());
+            parallel_for(fine.size(), [&](size_t begin, size_t end, unsigned){
+                for(size_t v=begin; v<end; v++){
+                    finePart[v]=s.part[cmap[v]];
+                }
+            });
+            s.part.swap(finePart);
+            s.limit=limit_for(fine, total);
+            // Release the coarse graph now it has been projected
+            levels[li].graph=csr_graph_t();
+            refine(fine, s);
+            if(m_options.logLevel>1){
+                fprintf(stderr, "  Refined level %d (%u nodes), cut=%lld\n", li, fine.size(), (long long)calcCut(fine, s.part));
+            }
+        }
+
+        res.part=std::move(s.part);
+        res.partWeights=std::move(s.partWeight);
+        res.cut=calcCut(graph, res.part);
+        return res;
+    }
+};
+
+#endif
@@ -5,7 +5,10 @@
 
 #include "rapidjson/rapidjson.h"
 
+#include "multilevel_partitioner.hpp"
+
 #include <random>
+#include <thread>
 
 class Partitioner
     : public GraphLoadEvents
@@ -39,6 +42,7 @@ private:
         node_t *src; // Weak (non-owning) pointers
         node_t *dst;
         OutputPinPtr srcPin;
+        int sendIndex;
         InputPinPtr dstPin;
         TypedDataPtr properties;
         TypedDataPtr state;
@@ -55,6 +59,7 @@ private:
         std::vector<edge_ptr_t> inputs;
         std::vector<edge_ptr_t> outputs;
         TypedDataPtr properties;
+        TypedDataPtr state;
         rapidjson::Document metadata;
     };
 
@@ -79,7 +84,7 @@ private:
     int m_crossingWeight=1;
 
     count_t m_targetCount;
-    cost_t m_globalCost;
+    cost_t m_globalCost=0;
 
     std::mt19937 m_urng;
 
@@ -90,8 +95,11 @@ private:
     }
 
     cost_t occupancyCost(const partition_t *part) const
+    { return occupancyCost(part->nodeCount); }
+
+    cost_t occupancyCost(count_t nodeCount) const
     {
-        cost_t d=std::abs(part->nodeCount-m_targetCount);
+        cost_t d=std::abs(nodeCount-m_targetCount);
         cost_t acc=1;
         for(int i=0; i<m_imbalanceExponent; i++){
             acc=acc*d;
@@ -123,6 +131,7 @@ private:
         const DeviceTypePtr &dt,
         const std::string &id,
         const TypedDataPtr &properties,
+        const TypedDataPtr &state,
         rapidjson::Document &&metadata
     ) override
     {
@@ -139,6 +148,7 @@ private:
         n->cost=0;
         n->partition=partition;
         n->properties=properties;
+        n->state=state;
         n->metadata=std::move(metadata);
         m_nodes.push_back(std::move(n));
         partition->nodeCount++;
@@ -175,6 +185,7 @@ private:
         uint64_t gId,
         uint64_t dstDevInst, const DeviceTypePtr &dstDevType, const InputPinPtr &dstPin,
         uint64_t srcDevInst,  const DeviceTypePtr &srcDevType, const OutputPinPtr &srcPin,
+        int sendIndex,
         const TypedDataPtr &properties,
         const TypedDataPtr &state,
         rapidjson::Document &&metadata
@@ -190,7 +201,7 @@ private:
         if(src==dst)
             return;
 
-        m_edges.push_back(std::make_shared<edge_t>(edge_t{weight,src,dst,srcPin,dstPin,properties,state,std::move(metadata)}));
+        m_edges.push_back(std::make_shared<edge_t>(edge_t{weight,src,dst,srcPin,sendIndex,dstPin,properties,state,std::move(metadata)}));
         auto e=m_edges.back();
         src->outputs.push_back(e);
         dst->inputs.push_back(e);
@@ -246,6 +257,96 @@ private:
         return acc; // Total change for this node and all other nodes
     }
 
+    // Replaces all partition assignments, and recalculates the costs from scratch
+    void setPartitions(const std::vector<uint32_t> &part)
+    {
+        for(auto &p : m_partitions){
+            p->nodeCount=0;
+        }
+        for(auto &n : m_nodes){
+            n->partition=m_partitions.at(part[n->index]).get();
+            n->partition->nodeCount++;
+            n->cost=0;
+        }
+        for(const auto &e : m_edges){
+            e->src->cost += distance(e->src->partition, e->dst->partition) * e->weight;
+        }
+        m_globalCost=recalcCost();
+    }
+
+    /* State of one chain in annealParallel. Chains only see the graph through
+       a compact CSR copy, and keep their own counts and cost, so they can run
+       on any thread without sharing anything that is written. */
+    struct anneal_graph_t
+    {
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> adj;
+        std::vector<cost_t> weight;
+    };
+
+    struct anneal_chain_t
+    {
+        std::mt19937_64 urng;
+        std::vector<uint32_t> part;
+        std::vector<count_t> counts;
+        cost_t cost;
+    };
+
+    anneal_graph_t buildAnnealGraph() const
+    {
+        // Each edge appears at both ends, as moving either end changes its cost
+        anneal_graph_t g;
+        g.offsets.assign(m_nodes.size()+1, 0);
+        for(const auto &e : m_edges){
+            g.offsets[e->src->index+1]++;
+            g.offsets[e->dst->index+1]++;
+        }
+        for(unsigned i=0; i<m_nodes.size(); i++){
+            g.offsets[i+1]+=g.offsets[i];
+        }
+        g.adj.resize(g.offsets.back());
+        g.weight.resize(g.offsets.back());
+        std::vector<uint32_t> pos(g.offsets.begin(), g.offsets.end()-1);
+        for(const auto &e : m_edges){
+            unsigned s=e->src->index, d=e->dst->index;
+            g.adj[pos[s]]=d;
+            g.weight[pos[s]++]=e->weight;
+            g.adj[pos[d]]=s;
+            g.weight[pos[d]++]=e->weight;
+        }
+        return g;
+    }
+
+    void annealChain(const anneal_graph_t &g, anneal_chain_t &c, unsigned steps, double &T, double alpha) const
+    {
+        std::uniform_real_distribution<> ureal;
+        unsigned nNodes=m_nodes.size(), nParts=m_partitions.size();
+
+        for(unsigned i=0; i<steps; i++){
+            unsigned node=c.urng()%nNodes;
+            unsigned newPartition=c.urng()%nParts;
+            unsigned oldPartition=c.part[node];
+            if(newPartition!=oldPartition){
+                cost_t delta=0;
+                for(unsigned j=g.offsets[node]; j<g.offsets[node+1]; j++){
+                    unsigned other=c.part[g.adj[j]];
+                    delta += ( (other!=newPartition) - (other!=oldPartition) ) * g.weight[j];
+                }
+                delta += occupancyCost(c.counts[newPartition]+1) - occupancyCost(c.counts[newPartition]);
+                delta += occupancyCost(c.counts[oldPartition]-1) - occupancyCost(c.counts[oldPartition]);
+
+                double thresh=(delta <= 0) ? 1.0 : exp( -delta/T );
+                if( ureal(c.urng) < thresh ){
+                    c.part[node]=newPartition;
+                    c.counts[newPartition]++;
+                    c.counts[oldPartition]--;
+                    c.cost+=delta;
+                }
+            }
+            T=T*alpha;
+        }
+    }
+
 
 
 public:
@@ -326,6 +427,103 @@ public:
         }
     }
 
+    /* Multi-start version of anneal. Each chain starts from the current
+       partition with its own random stream, and they run in parallel over
+       `threads` threads (0 means all cores). The steps are split into epochs,
+       and at the end of each epoch the chains that are worse than the median
+       restart from the best chain so far. The best partition seen at any
+       epoch boundary is kept.
+
+       Each chain is run by exactly one thread per epoch, and exchanges only
+       happen between epochs, so for a given seed and number of chains the
+       result doesn't depend on the number of threads. */
+    void annealParallel(unsigned n, double prop=0.1, unsigned chains=0, unsigned threads=0, uint64_t seed=1, unsigned epochs=16)
+    {
+        if(threads==0){
+            threads=std::max(1u, std::thread::hardware_concurrency());
+        }
+        if(chains==0){
+            chains=threads;
+        }
+        threads=std::min(threads, chains);
+        epochs=std::max(1u, epochs);
+
+        double T0=10.0;
+        double Tn=00.1;
+        unsigned nn=(unsigned)ceil(n*prop);
+        double alpha=std::pow(Tn/T0, 1.0/std::max(1u,nn));
+
+        auto g=buildAnnealGraph();
+
+        std::vector<uint32_t> best(m_nodes.size());
+        std::vector<count_t> counts(m_partitions.size());
+        for(const auto &node : m_nodes){
+            best[node->index]=node->partition->index;
+        }
+        for(const auto &p : m_partitions){
+            counts[p->index]=p->nodeCount;
+        }
+        cost_t bestCost=recalcCost();
+
+        std::vector<anneal_chain_t> cs(chains);
+        for(unsigned i=0; i<chains; i++){
+            std::seed_seq ss{uint32_t(seed), uint32_t(seed>>32), i};
+            cs[i].urng.seed(ss);
+            cs[i].part=best;
+            cs[i].counts=counts;
+            cs[i].cost=bestCost;
+        }
+
+        double T=T0;
+        for(unsigned epoch=0; epoch<epochs; epoch++){
+            unsigned steps=uint64_t(nn)*(epoch+1)/epochs - uint64_t(nn)*epoch/epochs;
+
+            // Every chain starts the epoch at the same temperature
+            std::vector<double> Ts(chains, T);
+            std::vector<std::thread> workers;
+            for(unsigned t=0; t<threads; t++){
+                workers.emplace_back([&,t](){
+                    for(unsigned i=t; i<chains; i+=threads){
+                        annealChain(g, cs[i], steps, Ts[i], alpha);
+                    }
+                });
+            }
+            for(auto &w : workers){
+                w.join();
+            }
+            T=Ts[0];
+
+            // Lowest cost, then lowest index, so the choice is deterministic
+            std::vector<unsigned> order(chains);
+            for(unsigned i=0; i<chains; i++){
+                order[i]=i;
+            }
+            std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b){
+                return cs[a].cost < cs[b].cost;
+            });
+            const auto &leader=cs[order[0]];
+            if(leader.cost < bestCost){
+                bestCost=leader.cost;
+                best=leader.part;
+            }
+
+            std::cerr.precision(6);
+            std::cerr<<"  epoch "<<epoch<<" : T="<<T<<", best chain="<<order[0]<<", cost="<<leader.cost<<", worst="<<cs[order.back()].cost<<", best="<<bestCost<<"\n";
+
+            if(epoch+1<epochs){
+                for(unsigned i=(chains+1)/2; i<chains; i++){
+                    auto &c=cs[order[i]];
+                    c.part=leader.part;
+                    c.counts=leader.counts;
+                    c.cost=leader.cost;
+                }
+            }
+        }
+
+        setPartitions(best);
+        std::cerr<<"  chains="<<chains<<", threads="<<threads<<", cost="<<m_globalCost<<"\n";
+    }
+
     void annealk(unsigned n, unsigned k)
     {
         std::uniform_real_distribution<> ureal;
@@ -382,6 +580,31 @@ public:
         }
     }
     
+    /* Replaces the current partition with one from MultilevelPartitioner. Only
+       edge weights are used in the search, with balance as a hard limit of
+       (1+imbalance) times the average count, rather than via occupancyCost. */
+    void multilevel(unsigned threads=0, double imbalance=0.03, uint64_t seed=1)
+    {
+        std::vector<MultilevelPartitioner::edge_t> edges;
+        edges.reserve(m_edges.size());
+        for(const auto &e : m_edges){
+            edges.push_back(MultilevelPartitioner::edge_t{e->src->index, e->dst->index, e->weight});
+        }
+        auto graph=MultilevelPartitioner::buildUndirected(m_nodes.size(), std::move(edges));
+
+        MultilevelPartitioner::options_t options;
+        options.partitions=m_partitions.size();
+        options.threads=threads;
+        options.imbalance=imbalance;
+        options.seed=seed;
+        options.logLevel=2;
+        auto res=MultilevelPartitioner::partition(graph, options);
+
+        setPartitions(res.part);
+
+        std::cerr<<"  levels="<<res.levels<<", cut="<<res.cut<<", cost="<<m_globalCost<<"\n";
+    }
+
     template<class TAlloc>
     rapidjson::Value &GetOrAddMemberAsObject(rapidjson::Value &parent, const std::string &name, TAlloc &allocator)
     {
@@ -449,7 +672,7 @@ public:
             n->metadata.AddMember(std::move(vKey), std::move(vVal), n->metadata.GetAllocator());
             
             
-            nHandles[n->index]=dst->onDeviceInstance(gId, n->deviceType, n->id, n->properties, std::move(n->metadata));
+            nHandles[n->index]=dst->onDeviceInstance(gId, n->deviceType, n->id, n->properties, n->state, std::move(n->metadata));
         }
         dst->onEndDeviceInstances(gId);
         dst->onBeginEdgeInstances(gId);
@@ -457,8 +680,9 @@ public:
             dst->onEdgeInstance(gId, 
                 nHandles[e->dst->index], e->dst->deviceType, e->dstPin,
                 nHandles[e->src->index], e->src->deviceType, e->srcPin,
+                e->sendIndex,
                 e->properties,
-                TypedDataPtr(),
+                e->state,
                 std::move(e->metadata)
             );
         }
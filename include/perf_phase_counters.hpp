@@ -0,0 +1,338 @@
+#ifndef perf_phase_counters_hpp
+#define perf_phase_counters_hpp
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+/* Splits the time of each thread into named phases (e.g. load, step, idle),
+   and measures cycles, instructions, LLC misses and branch misses in each
+   phase using perf_event_open.
+
+   A thread has to attach() before it is counted. After that enter() switches
+   the current phase of the calling thread, and charges everything since the
+   last switch to the phase it is leaving, so the phases of a thread never
+   overlap. Each switch costs one read() of the counter group, so switches
+   should be at the granularity of a cluster step rather than a handler.
+
+   If the counters can't be opened (no kernel support, perf_event_paranoid,
+   containers, ...) then each thread falls back to just measuring wall-clock
+   time in each phase, and hardware_available() returns false.
+*/
+
+class PerfPhaseCounters
+{
+public:
+    static const unsigned NONE=~0u; // Pseudo-phase which isn't charged to anything
+
+    enum counter_t{
+        Cycles,
+        Instructions,
+        LLCMisses,
+        BranchMisses,
+        COUNTER_COUNT
+    };
+
+    static const char *counter_name(unsigned c)
+    {
+        static const char *names[COUNTER_COUNT]={"cycles","instructions","llc_misses","branch_misses"};
+        return c<COUNTER_COUNT ? names[c] : "?";
+    }
+
+    struct totals_t
+    {
+        double secs=0;
+        uint64_t counters[COUNTER_COUNT]={0,0,0,0};
+        bool valid[COUNTER_COUNT]={false,false,false,false}; // True if any thread could measure this counter
+
+        double ipc() const
+        { return counters[Cycles] ? counters[Instructions]/(double)counters[Cycles] : 0.0; }
+
+        //! Events per thousand instructions
+        double per_kinstr(counter_t c) const
+        { return counters[Instructions] ? 1000.0*counters[c]/counters[Instructions] : 0.0; }
+    };
+
+private:
+    struct thread_t
+    {
+        int fds[COUNTER_COUNT]={-1,-1,-1,-1};
+        unsigned groupIndex[COUNTER_COUNT]; // Position of each counter in a group read, if fd is open
+        unsigned groupSize=0;
+
+        unsigned current=NONE;
+        uint64_t lastNs=0;
+        uint64_t last[COUNTER_COUNT]={0,0,0,0};
+
+        // Written only by the owning thread, but read by anyone calling totals()
+        std::unique_ptr<std::atomic<uint64_t>[]> ns;
+        std::unique_ptr<std::atomic<uint64_t>[]> counts; // phase*COUNTER_COUNT+counter
+
+        ~thread_t()
+        {
+#ifdef __linux__
+            for(int fd : fds){
+                if(fd!=-1){
+                    close(fd);
+                }
+            }
+#endif
+        }
+    };
+
+    std::vector<std::string> m_phases;
+    bool m_useHardware;
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<thread_t>> m_threads;
+    std::atomic<bool> m_hardwareAvailable;
+
+    unsigned m_id;
+    static unsigned next_id()
+    {
+        static std::atomic<unsigned> id(0);
+        return ++id;
+    }
+
+    static thread_t *&local(unsigned id)
+    {
+        static thread_local unsigned t_owner=0;
+        static thread_local thread_t *t_thread=nullptr;
+        if(t_owner!=id){
+            t_owner=id;
+            t_thread=nullptr;
+        }
+        return t_thread;
+    }
+
+    static uint64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static void bump(std::atomic<uint64_t> &x, uint64_t v)
+    {
+        x.store(x.load(std::memory_order_relaxed)+v, std::memory_order_relaxed);
+    }
+
+#ifdef __linux__
+    static int open_counter(uint64_t config, int group)
+    {
+        struct perf_event_attr pe;
+        memset(&pe, 0, sizeof(pe));
+        pe.type=PERF_TYPE_HARDWARE;
+        pe.size=sizeof(pe);
+        pe.config=config;
+        pe.exclude_kernel=1; // Lets this work with perf_event_paranoid=2
+        pe.exclude_hv=1;
+        pe.read_format=PERF_FORMAT_GROUP;
+        return syscall(__NR_perf_event_open, &pe, 0 /*this thread*/, -1 /*any cpu*/, group, 0);
+    }
+
+    void open_counters(thread_t &t)
+    {
+        static const uint64_t configs[COUNTER_COUNT]={
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, // Usually means last-level cache
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+        int leader=-1;
+        for(unsigned i=0; i<COUNTER_COUNT; i++){
+            int fd=open_counter(configs[i], leader);
+            if(fd==-1){
+                if(leader==-1){
+                    return; // Nothing usable, so fall back to wall-clock
+                }
+                continue; // Other counters may still work
+            }
+            if(leader==-1){
+                leader=fd;
+            }
+            t.fds[i]=fd;
+            t.groupIndex[i]=t.groupSize++;
+        }
+        m_hardwareAvailable.store(true, std::memory_order_relaxed);
+    }
+#endif
+
+    void sample(thread_t &t, uint64_t &ns, uint64_t *counters)
+    {
+        ns=now_ns();
+#ifdef __linux__
+        if(t.groupSize){
+            uint64_t buffer[1+COUNTER_COUNT];
+            int leader=t.fds[Cycles];
+            if(read(leader, buffer, sizeof(uint64_t)*(1+t.groupSize)) > 0){
+                for(unsigned i=0; i<COUNTER_COUNT; i++){
+                    if(t.fds[i]!=-1){
+                        counters[i]=buffer[1+t.groupIndex[i]];
+                    }
+                }
+            }
+        }
+#endif
+    }
+public:
+    PerfPhaseCounters(const std::vector<std::string> &phases, bool useHardware=true)
+        : m_phases(phases)
+        , m_useHardware(useHardware)
+        , m_hardwareAvailable(false)
+        , m_id(next_id())
+    {}
+
+    PerfPhaseCounters(const PerfPhaseCounters &)=delete;
+    PerfPhaseCounters &operator=(const PerfPhaseCounters &)=delete;
+
+    const std::vector<std::string> &phases() const
+    { return m_phases; }
+
+    //! True if at least one thread managed to open hardware counters
+    bool hardware_available() const
+    { return m_hardwareAvailable.load(std::memory_order_relaxed); }
+
+    //! Start counting the calling thread, which begins in the given phase.
+    void attach(unsigned phase=NONE)
+    {
+        auto &l=local(m_id);
+        if(l){
+            enter(phase);
+            return;
+        }
+
+        auto t=std::make_unique<thread_t>();
+        t->ns.reset(new std::atomic<uint64_t>[m_phases.size()]());
+        t->counts.reset(new std::atomic<uint64_t>[m_phases.size()*COUNTER_COUNT]());
+#ifdef __linux__
+        if(m_useHardware){
+            open_counters(*t);
+        }
+#endif
+        sample(*t, t->lastNs, t->last);
+        t->current=phase;
+
+        l=t.get();
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_threads.push_back(std::move(t));
+    }
+
+    //! Switch the calling thread to a new phase, and return the phase it was in. Does nothing if the thread isn't attached.
+    unsigned enter(unsigned phase)
+    {
+        thread_t *t=local(m_id);
+        if(!t || t->current==phase){
+            return t ? phase : NONE;
+        }
+
+        uint64_t ns, counters[COUNTER_COUNT];
+        memcpy(counters, t->last, sizeof(counters));
+        sample(*t, ns, counters);
+
+        unsigned prev=t->current;
+        if(prev!=NONE){
+            bump(t->ns[prev], ns-t->lastNs);
+            for(unsigned i=0; i<COUNTER_COUNT; i++){
+                bump(t->counts[prev*COUNTER_COUNT+i], counters[i]-t->last[i]);
+            }
+        }
+        t->lastNs=ns;
+        memcpy(t->last, counters, sizeof(counters));
+        t->current=phase;
+        return prev;
+    }
+
+    //! Enters a phase for the lifetime of the object, then goes back to whatever the thread was doing before.
+    class scope
+    {
+    private:
+        PerfPhaseCounters *m_counters;
+        unsigned m_prev;
+    public:
+        scope(PerfPhaseCounters *counters, unsigned phase)
+            : m_counters(counters)
+            , m_prev(counters ? counters->enter(phase) : NONE)
+        {}
+
+        scope(const scope &)=delete;
+        scope &operator=(const scope &)=delete;
+
+        ~scope()
+        {
+            if(m_counters){
+                m_counters->enter(m_prev);
+            }
+        }
+    };
+
+    //! Sums over all threads. Phases that threads are currently in are not included until they switch.
+    std::vector<totals_t> totals()
+    {
+        std::vector<totals_t> res(m_phases.size());
+        std::lock_guard<std::mutex> lk(m_mutex);
+        for(const auto &t : m_threads){
+            for(unsigned p=0; p<m_phases.size(); p++){
+                res[p].secs += t->ns[p].load(std::memory_order_relaxed)*1e-9;
+                for(unsigned i=0; i<COUNTER_COUNT; i++){
+                    res[p].counters[i] += t->counts[p*COUNTER_COUNT+i].load(std::memory_order_relaxed);
+                    res[p].valid[i] = res[p].valid[i] || t->fds[i]!=-1;
+                }
+            }
+        }
+        return res;
+    }
+
+    //! One line summary, e.g. "step=1.2s/ipc=1.45/llc=2.1/br=3.2, idle=..." with misses per thousand instructions
+    std::string summary()
+    {
+        auto tt=totals();
+        std::string res;
+        char buffer[256];
+        for(unsigned p=0; p<m_phases.size(); p++){
+            const auto &t=tt[p];
+            if(t.secs==0){
+                continue;
+            }
+            if(!res.empty()){
+                res+=", ";
+            }
+            if(t.valid[Cycles] && t.valid[Instructions]){
+                snprintf(buffer, sizeof(buffer), "%s=%.3gs/ipc=%.2f/llc=%.2f/br=%.2f", m_phases[p].c_str(), t.secs, t.ipc(), t.per_kinstr(LLCMisses), t.per_kinstr(BranchMisses));
+            }else{
+                snprintf(buffer, sizeof(buffer), "%s=%.3gs", m_phases[p].c_str(), t.secs);
+            }
+            res+=buffer;
+        }
+        return res;
+    }
+
+    //! Sends every phase through a (thing,sub_thing,value) stats logger.
+    template<class TLog>
+    void stats_log(TLog &&log)
+    {
+        auto tt=totals();
+        for(unsigned p=0; p<m_phases.size(); p++){
+            std::string thing="perf_"+m_phases[p];
+            log(thing, "secs", std::to_string(tt[p].secs));
+            for(unsigned i=0; i<COUNTER_COUNT; i++){
+                if(tt[p].valid[i]){
+                    log(thing, counter_name(i), std::to_string(tt[p].counters[i]));
+                }
+            }
+        }
+    }
+};
+
+#endif
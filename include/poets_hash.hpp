@@ -1,4 +1,43 @@
+#ifndef poets_hash_hpp
+#define poets_hash_hpp
 
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+/* There are two hash engines:
+   - POETSHash : byte-at-a-time FNV-1a. This is what type hashes and anything
+     else that is persisted or compared across tools uses, so it must not change.
+   - POETSFastHash : word-wise hash for in-memory use (e.g. interning device state
+     in model checkers), where only consistency within one process matters.
+   Code that can use either takes a POETSHashAlgorithm.
+*/
+enum class POETSHashAlgorithm
+{
+    FNV1a,
+    Fast
+};
+
+inline const char *POETSHashAlgorithmName(POETSHashAlgorithm alg)
+{
+    switch(alg){
+    case POETSHashAlgorithm::FNV1a: return "fnv1a";
+    case POETSHashAlgorithm::Fast: return "fast";
+    default: throw std::runtime_error("Unknown hash algorithm.");
+    }
+}
+
+inline POETSHashAlgorithm parsePOETSHashAlgorithm(const std::string &name)
+{
+    if(name=="fnv1a"){
+        return POETSHashAlgorithm::FNV1a;
+    }else if(name=="fast"){
+        return POETSHashAlgorithm::Fast;
+    }else{
+        throw std::runtime_error("Unknown hash algorithm '"+name+"', expected fnv1a or fast.");
+    }
+}
 
 class POETSHash
 {
@@ -91,3 +130,213 @@ public:
     }
     
 };
+
+/* Word-wise hash in the style of xxh3/wyhash. Input is consumed in 32 byte
+   blocks spread over four independent 64-bit lanes, each doing a 32x32->64
+   multiply-accumulate, so the block loop has no carried dependency between
+   lanes and compiles to SIMD multiplies (pmuludq/vpmuludq) where available.
+   Lanes are scrambled every 16 blocks, and the lanes plus any tail (handled
+   8 bytes at a time) are folded with 64x64->128 multiplies at the end.
+
+   The result only depends on the sequence of bytes added, not on how it was
+   split between calls to add, so hash(p,n) is the same as adding p in pieces.
+   Words are read in native byte order, so hashes are not portable between
+   machines of different endianness. */
+class POETSFastHash
+{
+public:
+    typedef uint64_t hash_t;
+private:
+    static constexpr uint64_t K0=0xa0761d6478bd642full;
+    static constexpr uint64_t K1=0xe7037ed1a0b428dbull;
+    static constexpr uint64_t K2=0x8ebc6af09c88c6e3ull;
+    static constexpr uint64_t K3=0x589965cc75374cc3ull;
+    static constexpr uint64_t P32=0x9E3779B1ull;
+
+    static const unsigned BLOCK=32;
+    static const unsigned SCRAMBLE_MASK=15;
+
+    uint64_t m_acc[4];
+    uint64_t m_seed;
+    uint64_t m_total;
+    unsigned m_fill;
+    alignas(8) uint8_t m_buf[BLOCK];
+
+    static uint64_t load64(const uint8_t *p)
+    {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        return x;
+    }
+
+    static uint64_t mum(uint64_t a, uint64_t b)
+    {
+#ifdef __SIZEOF_INT128__
+        unsigned __int128 r=(unsigned __int128)a * b;
+        return uint64_t(r) ^ uint64_t(r>>64);
+#else
+        uint64_t ha=a>>32, hb=b>>32, la=uint32_t(a), lb=uint32_t(b);
+        uint64_t rh=ha*hb, rm0=ha*lb, rm1=hb*la, rl=la*lb;
+        uint64_t t=rl+(rm0<<32), c=t<rl;
+        uint64_t lo=t+(rm1<<32);
+        c+=lo<t;
+        uint64_t hi=rh+(rm0>>32)+(rm1>>32)+c;
+        return lo ^ hi;
+#endif
+    }
+
+    static void init_lanes(uint64_t acc[4], uint64_t seed)
+    {
+        acc[0]=seed+K0;
+        acc[1]=seed^K1;
+        acc[2]=seed-K2;
+        acc[3]=seed^K3;
+    }
+
+    // blocks is the number of blocks consumed before this one
+    static void consume_block(uint64_t acc[4], uint64_t blocks, const uint8_t *p)
+    {
+        static const uint64_t keys[4]={K0,K1,K2,K3};
+        uint64_t w[4], m[4];
+        for(unsigned i=0; i<4; i++){
+            w[i]=load64(p+8*i);
+            uint64_t k=w[i]^keys[i];
+            m[i]=(k&0xFFFFFFFFull)*(k>>32);
+        }
+        for(unsigned i=0; i<4; i++){
+            acc[i] += m[i] + w[i^1];
+        }
+        if( (blocks&SCRAMBLE_MASK) == SCRAMBLE_MASK ){
+            for(unsigned i=0; i<4; i++){
+                uint64_t a=acc[i];
+                a ^= a>>47;
+                a ^= keys[3-i];
+                acc[i] = a * P32;
+            }
+        }
+    }
+
+    static uint64_t finish(const uint64_t acc[4], uint64_t seed, uint64_t total, const uint8_t *tail, unsigned n)
+    {
+        uint64_t h=seed ^ (total*K1);
+        if(total>=BLOCK){
+            h ^= mum(acc[0]^K0, acc[1]^K1);
+            h += mum(acc[2]^K2, acc[3]^K3);
+        }
+        while(n>=8){
+            h=mum(load64(tail)^K1, h^K0);
+            tail+=8;
+            n-=8;
+        }
+        if(n){
+            uint64_t w=0;
+            memcpy(&w, tail, n);
+            h=mum(w^K2, h^K3^n);
+        }
+        return mum(h^K0, (h>>29)^K1^total);
+    }
+public:
+    explicit POETSFastHash(uint64_t seed=0)
+        : m_seed(seed)
+        , m_total(0)
+        , m_fill(0)
+    {
+        init_lanes(m_acc, seed);
+    }
+
+    // One-shot hash of a buffer, without copying through the internal buffer
+    static hash_t hash(const void *data, size_t n, uint64_t seed=0)
+    {
+        const uint8_t *p=(const uint8_t*)data;
+        uint64_t acc[4];
+        init_lanes(acc, seed);
+        uint64_t blocks=0;
+        size_t left=n;
+        while(left>=BLOCK){
+            consume_block(acc, blocks++, p);
+            p+=BLOCK;
+            left-=BLOCK;
+        }
+        return finish(acc, seed, n, p, left);
+    }
+
+    hash_t getHash() const
+    { return finish(m_acc, m_seed, m_total, m_buf, m_fill); }
+
+    void add(const uint8_t *x, size_t s)
+    {
+        uint64_t blocks=m_total/BLOCK;
+        m_total+=s;
+        if(m_fill){
+            unsigned todo=BLOCK-m_fill;
+            if(s<todo){
+                memcpy(m_buf+m_fill, x, s);
+                m_fill+=s;
+                return;
+            }
+            memcpy(m_buf+m_fill, x, todo);
+            consume_block(m_acc, blocks++, m_buf);
+            m_fill=0;
+            x+=todo;
+            s-=todo;
+        }
+        while(s>=BLOCK){
+            consume_block(m_acc, blocks++, x);
+            x+=BLOCK;
+            s-=BLOCK;
+        }
+        memcpy(m_buf, x, s);
+        m_fill=s;
+    }
+
+    void add(uint8_t x)
+    { add(&x, 1); }
+
+    void add(uint16_t x)
+    { add((const uint8_t*)&x, 2); }
+
+    void add(uint32_t x)
+    { add((const uint8_t*)&x, 4); }
+
+    void add(uint64_t x)
+    { add((const uint8_t*)&x, 8); }
+
+    void add(int8_t x)
+    { add( (uint8_t)x ); }
+
+    void add(int16_t x)
+    { add( (uint16_t)x ); }
+
+    void add(int32_t x)
+    { add( (uint32_t)x ); }
+
+    void add(int64_t x)
+    { add( (uint64_t)x ); }
+
+    void add(float x)
+    { add((const uint8_t*)&x, 4); }
+
+    void add(double x)
+    { add((const uint8_t*)&x, 8); }
+
+    void add(const char *x)
+    { add((const uint8_t*)x, strlen(x)); }
+};
+
+inline uint64_t POETSHashBytes(POETSHashAlgorithm alg, const void *data, size_t n)
+{
+    switch(alg){
+    case POETSHashAlgorithm::FNV1a:
+    {
+        POETSHash hash;
+        hash.add((const uint8_t*)data, n);
+        return hash.getHash();
+    }
+    case POETSHashAlgorithm::Fast:
+        return POETSFastHash::hash(data, n);
+    default:
+        throw std::runtime_error("Unknown hash algorithm.");
+    }
+}
+
+#endif
@@ -15,6 +15,10 @@
 #include <stack>
 #include <random>
 
+#ifdef POETS_HANDLER_PROFILER
+#include "handler_profiler.hpp"
+#endif
+
 template<class T>
 class FIFOSet
 {
@@ -523,6 +527,10 @@ private:
         bool isExternal; // == type->isExternal(); Cache here for performance
 
         uint32_t RTS;
+
+#ifdef POETS_HANDLER_PROFILER
+        unsigned profileTypeIndex;
+#endif
     };
 
     struct OrchestratorServicesBase
@@ -699,6 +707,12 @@ private:
 
     std::shared_ptr<LogWriter> m_logWriter;
     uint64_t m_logIdUnq=0;
+    uint64_t m_receiveCount=0;
+
+#ifdef POETS_HANDLER_PROFILER
+    HandlerProfiler m_profiler;
+    std::vector<DeviceTypePtr> m_profileTypes; // Index in here is the profiler device type index
+#endif
     uint64_t m_barrierIdUnq=0;
 
     uint64_t make_log_id()
@@ -738,6 +752,18 @@ public:
         m_logLevel=level;
     }
 
+    uint64_t getReceiveCount() const
+    {
+        return m_receiveCount;
+    }
+
+#ifdef POETS_HANDLER_PROFILER
+    std::vector<HandlerProfiler::row_t> getHandlerProfile()
+    {
+        return m_profiler.report();
+    }
+#endif
+
 
     /////////////////////////////////////////////////////////////////////////////////////////////
     // GraphLoadEvents
@@ -754,6 +780,20 @@ public:
         }
 
         m_graphProperties=properties;
+
+#ifdef POETS_HANDLER_PROFILER
+        for(const auto &dt : graph->getDeviceTypes()){
+            std::vector<std::string> inputs, outputs;
+            for(const auto &p : dt->getInputs()){
+                inputs.push_back(p->getName());
+            }
+            for(const auto &p : dt->getOutputs()){
+                outputs.push_back(p->getName());
+            }
+            m_profiler.add_device_type(dt->getId(), inputs, outputs);
+            m_profileTypes.push_back(dt);
+        }
+#endif
         return 1;
     }
 
@@ -782,6 +822,9 @@ public:
         dev.properties=properties;
         dev.state=state.clone(); // Bit of a waste of time, but loading only
         dev.isExternal=dt->isExternal();
+#ifdef POETS_HANDLER_PROFILER
+        dev.profileTypeIndex=std::find(m_profileTypes.begin(), m_profileTypes.end(), dt)-m_profileTypes.begin();
+#endif
         
         for(auto & pin : dt->getOutputs()){
             dev.outputPins.emplace_back(output_pin_t{
@@ -1020,8 +1063,12 @@ public:
 
         assert(!device.type->isExternal()); // External deliveries need to be managed... externally
 
+        m_receiveCount++;
         ReceiveServicesHandler services(this, &edge);
-        
+
+#ifdef POETS_HANDLER_PROFILER
+        uint64_t prof=m_profiler.begin();
+#endif
         edge.inputPin->onReceive(
             &services,
 			m_graphProperties.get(),
@@ -1031,6 +1078,9 @@ public:
 			edge.state.get(),
 			payload.get()
         );
+#ifdef POETS_HANDLER_PROFILER
+        m_profiler.end(prof, m_profiler.recv_slot(device.profileTypeIndex, edge.route.destDevicePin));
+#endif
 
         readyToSend=device.type->calcReadyToSend(
             &services,
@@ -1133,6 +1183,9 @@ public:
         unsigned sendIndex=-1;
         unsigned *sendIndexPtr=pin.isIndexedSend ? &sendIndex : nullptr;
 
+#ifdef POETS_HANDLER_PROFILER
+        uint64_t prof=m_profiler.begin();
+#endif
         pin.pin->onSend(
             &services,
 			m_graphProperties.get(),
@@ -1142,6 +1195,9 @@ public:
             &doSend,
             sendIndexPtr
         );
+#ifdef POETS_HANDLER_PROFILER
+        m_profiler.end(prof, m_profiler.send_slot(device.profileTypeIndex, sourcePortIndex));
+#endif
 
         readyToSend=device.type->calcReadyToSend(
             &services,
@@ -1190,13 +1246,19 @@ public:
             assert( !device.RTS );
 
             HardwareIdleServicesHandler services(this, &device);
-            
+
+#ifdef POETS_HANDLER_PROFILER
+            uint64_t prof=m_profiler.begin();
+#endif
             device.type->onHardwareIdle(
                 &services,
                 m_graphProperties.get(),
                 device.properties.get(),
                 device.state.get()
             );
+#ifdef POETS_HANDLER_PROFILER
+            m_profiler.end(prof, m_profiler.hardware_idle_slot(device.profileTypeIndex));
+#endif
 
             device.RTS=device.type->calcReadyToSend(
                 &services,
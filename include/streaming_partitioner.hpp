@@ -0,0 +1,417 @@
+#ifndef streaming_partitioner_hpp
+#define streaming_partitioner_hpp
+
+#include "graph_persist.hpp"
+
+#include <functional>
+#include <cmath>
+
+/* One-pass partitioner which assigns devices as the graph streams past, so
+   the graph never has to be held in memory.
+
+   All devices arrive before any edges, so decisions are made on the edge
+   stream. Consecutive edges with the same destination are collected, then
+   the destination is placed using its already-placed sources. Sources that
+   are still unplaced remember the destination's partition as a hint, which is
+   used if they never get a run of their own (e.g. devices with no inputs).
+   Files that list edges grouped by destination (as most generators do) give
+   the best results, but any order works. Devices with no edges are placed at
+   the end on the lightest partition.
+
+   Placement is either:
+   - LDG (linear deterministic greedy): maximise n_p * (1 - |P_p|/C)
+   - Fennel: maximise n_p - alpha*gamma*|P_p|^(gamma-1), with gamma=1.5 and
+     alpha=sqrt(k)*m/n^1.5, where m is estimated from the edges seen so far.
+   where n_p is the number of placed neighbours in partition p, and C is a
+   hard capacity of (1+imbalance)*n/k. Ties go to the smaller partition.
+
+   Each placement is reported to the consumer (if any) as it happens, and
+   getPartition gives the result once the graph has ended. State is two
+   32-bit values per device, plus the in-edges of the current destination.
+*/
+class StreamingPartitioner
+  : public GraphLoadEvents
+{
+public:
+  enum Method
+  {
+    LDG,
+    Fennel
+  };
+
+  // Called with the device index (order of arrival) and partition
+  typedef std::function<void(uint64_t device, unsigned partition)> consumer_t;
+
+  static Method parseMethod(const std::string &name)
+  {
+    if(name=="ldg"){
+      return LDG;
+    }else if(name=="fennel"){
+      return Fennel;
+    }else{
+      throw std::runtime_error("Unknown streaming partition method '"+name+"', expected ldg or fennel.");
+    }
+  }
+
+private:
+  static constexpr uint32_t UNASSIGNED=0xFFFFFFFFul;
+
+  unsigned m_k;
+  Method m_method;
+  double m_imbalance;
+  consumer_t m_consumer;
+
+  std::vector<uint32_t> m_part;
+  std::vector<uint32_t> m_hint;
+  std::vector<uint64_t> m_sizes;
+  uint64_t m_capacity=0;
+
+  uint64_t m_edges=0;
+  uint64_t m_runs=0;
+
+  uint64_t m_runDst=UINT64_MAX;
+  std::vector<uint64_t> m_runSrcs;
+  std::vector<double> m_conn;
+
+  void place(uint64_t device, unsigned p)
+  {
+    m_part[device]=p;
+    m_sizes[p]++;
+    if(m_consumer){
+      m_consumer(device, p);
+    }
+  }
+
+  unsigned choose(const std::vector<uint64_t> &neighbours)
+  {
+    std::fill(m_conn.begin(), m_conn.end(), 0.0);
+    for(auto u : neighbours){
+      auto p=m_part[u];
+      if(p!=UNASSIGNED){
+        m_conn[p]+=1;
+      }
+    }
+
+    double alpha=0;
+    if(m_method==Fennel){
+      double n=m_part.size();
+      // Most channels have a partner going the other way, so count undirected pairs
+      double m=m_runs ? 0.5*double(m_edges)*n/m_runs : 0.0;
+      alpha=std::sqrt(double(m_k)) * m / std::pow(n, 1.5);
+    }
+
+    unsigned best=UNASSIGNED;
+    double bestScore=0;
+    for(unsigned p=0; p<m_k; p++){
+      if(m_sizes[p]>=m_capacity){
+        continue;
+      }
+      double score;
+      if(m_method==LDG){
+        score=m_conn[p] * (1.0 - double(m_sizes[p])/m_capacity);
+      }else{
+        score=m_conn[p] - alpha * 1.5 * std::sqrt(double(m_sizes[p]));
+      }
+      if(best==UNASSIGNED || score>bestScore || (score==bestScore && m_sizes[p]<m_sizes[best])){
+        best=p;
+        bestScore=score;
+      }
+    }
+    if(best==UNASSIGNED){
+      throw std::logic_error("StreamingPartitioner : all partitions are full.");
+    }
+    return best;
+  }
+
+  void flush_run()
+  {
+    if(m_runDst==UINT64_MAX){
+      return;
+    }
+    m_runs++;
+    if(m_part[m_runDst]==UNASSIGNED){
+      place(m_runDst, choose(m_runSrcs));
+    }
+    for(auto s : m_runSrcs){
+      if(m_part[s]==UNASSIGNED && m_hint[s]==UNASSIGNED){
+        m_hint[s]=m_part[m_runDst];
+      }
+    }
+    m_runDst=UINT64_MAX;
+    m_runSrcs.clear();
+  }
+
+  void place_remaining()
+  {
+    flush_run();
+    for(uint64_t i=0; i<m_part.size(); i++){
+      if(m_part[i]==UNASSIGNED){
+        unsigned p=m_hint[i];
+        if(p==UNASSIGNED || m_sizes[p]>=m_capacity){
+          p=std::min_element(m_sizes.begin(), m_sizes.end())-m_sizes.begin();
+        }
+        place(i, p);
+      }
+    }
+  }
+
+public:
+  StreamingPartitioner(unsigned nPartitions, Method method=Fennel, double imbalance=0.05, consumer_t consumer=consumer_t())
+    : m_k(nPartitions)
+    , m_method(method)
+    , m_imbalance(imbalance)
+    , m_consumer(consumer)
+  {
+    if(m_k<1){
+      throw std::runtime_error("StreamingPartitioner : need at least one partition.");
+    }
+  }
+
+  unsigned getPartitionCount() const
+  { return m_k; }
+
+  uint64_t getDeviceCount() const
+  { return m_part.size(); }
+
+  unsigned getPartition(uint64_t device) const
+  {
+    auto p=m_part.at(device);
+    if(p==UNASSIGNED){
+      throw std::runtime_error("StreamingPartitioner : device has not been placed yet.");
+    }
+    return p;
+  }
+
+  const std::vector<uint64_t> &getPartitionSizes() const
+  { return m_sizes; }
+
+  uint64_t onBeginGraphInstance(const GraphTypePtr &graph, const std::string &id, const TypedDataPtr &properties, rapidjson::Document &&metadata) override
+  {
+    m_part.clear();
+    m_hint.clear();
+    m_sizes.assign(m_k, 0);
+    m_conn.assign(m_k, 0.0);
+    m_edges=0;
+    m_runs=0;
+    m_runDst=UINT64_MAX;
+    m_runSrcs.clear();
+    return 0;
+  }
+
+  uint64_t onDeviceInstance(uint64_t gId, const DeviceTypePtr &dt, const std::string &id, const TypedDataPtr &properties, const TypedDataPtr &state, rapidjson::Document &&metadata) override
+  {
+    m_part.push_back(UNASSIGNED);
+    m_hint.push_back(UNASSIGNED);
+    return m_part.size()-1;
+  }
+
+  void onEndDeviceInstances(uint64_t gId) override
+  {
+    uint64_t n=m_part.size();
+    m_capacity=std::max<uint64_t>(1, (uint64_t)std::ceil( (1.0+m_imbalance) * n / m_k ));
+    // Rounding must still leave room for everything
+    m_capacity=std::max<uint64_t>(m_capacity, (n+m_k-1)/m_k);
+  }
+
+  void onEdgeInstance(uint64_t gId, uint64_t dstDevInst, const DeviceTypePtr &dstDevType, const InputPinPtr &dstPin,
+    uint64_t srcDevInst, const DeviceTypePtr &srcDevType, const OutputPinPtr &srcPin, int sendIndex,
+    const TypedDataPtr &properties, const TypedDataPtr &state, rapidjson::Document &&metadata) override
+  {
+    m_edges++;
+    if(dstDevInst!=m_runDst){
+      flush_run();
+      m_runDst=dstDevInst;
+    }
+    if(srcDevInst!=dstDevInst){
+      m_runSrcs.push_back(srcDevInst);
+    }
+  }
+
+  void onEndEdgeInstances(uint64_t gId) override
+  {
+    place_remaining();
+  }
+
+  void onEndGraphInstance(uint64_t gId) override
+  {
+    // Graphs with no edge section never see onEndEdgeInstances
+    place_remaining();
+  }
+};
+
+
+/* Forwards a graph to dst, adding a partition to the metadata of each device,
+   in the same form as tools/partition_graph_with_metis.py: the graph gets
+   "dt10.partitions.<k>" : { "counts":[...], "key":key } and an entry in
+   "device.keys", and each device gets key:partition. queue_sim picks this up
+   when run with k threads.
+
+   The partition comes from a function of the device index, so it can replay a
+   StreamingPartitioner result on a second pass over the same source. It also
+   counts the edges that cross partitions, and can list device assignments. */
+class PartitionMetadataWriter
+  : public GraphLoadEvents
+{
+private:
+  GraphLoadEvents *m_dst;
+  unsigned m_k;
+  std::function<unsigned(uint64_t)> m_partitionOf;
+  std::vector<uint64_t> m_counts;
+  FILE *m_assignments;
+
+  std::string m_key;
+  std::vector<uint32_t> m_devicePartitions;
+  uint64_t m_deviceCount=0;
+  uint64_t m_edgeCount=0;
+  uint64_t m_cutCount=0;
+
+  std::vector<uint64_t> m_dstIds;
+
+  static std::string createKey(rapidjson::Document &meta)
+  {
+    auto &alloc=meta.GetAllocator();
+    if(!meta.HasMember("device.keys")){
+      meta.AddMember("device.keys", rapidjson::Value(rapidjson::kObjectType), alloc);
+    }
+    auto &keys=meta["device.keys"];
+    if(!keys.IsObject()){
+      throw std::runtime_error("Corrupt device.keys metadata.");
+    }
+    unsigned i=0;
+    std::string key;
+    while(true){
+      key="k"+std::to_string(i);
+      if(!keys.HasMember(key.c_str())){
+        break;
+      }
+      i++;
+    }
+    return key;
+  }
+public:
+  PartitionMetadataWriter(GraphLoadEvents *dst, unsigned nPartitions, std::function<unsigned(uint64_t)> partitionOf, const std::vector<uint64_t> &counts, FILE *assignments=nullptr)
+    : m_dst(dst)
+    , m_k(nPartitions)
+    , m_partitionOf(partitionOf)
+    , m_counts(counts)
+    , m_assignments(assignments)
+  {}
+
+  uint64_t getEdgeCount() const
+  { return m_edgeCount; }
+
+  uint64_t getCutEdgeCount() const
+  { return m_cutCount; }
+
+  bool parseMetaData() const override
+  { return m_dst!=nullptr; }
+
+  void onGraphType(const GraphTypePtr &graph) override
+  {
+    if(m_dst){
+      m_dst->onGraphType(graph);
+    }
+  }
+
+  uint64_t onBeginGraphInstance(const GraphTypePtr &graph, const std::string &id, const TypedDataPtr &properties, rapidjson::Document &&metadata) override
+  {
+    m_deviceCount=0;
+    m_edgeCount=0;
+    m_cutCount=0;
+    m_devicePartitions.clear();
+    m_dstIds.clear();
+    if(!m_dst){
+      return 0;
+    }
+
+    if(!metadata.IsObject()){
+      metadata.SetObject();
+    }
+    auto &alloc=metadata.GetAllocator();
+    std::string tag="dt10.partitions."+std::to_string(m_k);
+    m_key=createKey(metadata);
+    metadata["device.keys"].AddMember(rapidjson::Value(m_key.c_str(), alloc), rapidjson::Value(tag.c_str(), alloc), alloc);
+
+    rapidjson::Value counts(rapidjson::kArrayType);
+    for(auto c : m_counts){
+      counts.PushBack(rapidjson::Value(uint64_t(c)), alloc);
+    }
+    rapidjson::Value info(rapidjson::kObjectType);
+    info.AddMember("counts", std::move(counts), alloc);
+    info.AddMember("key", rapidjson::Value(m_key.c_str(), alloc), alloc);
+    if(metadata.HasMember(tag.c_str())){
+      metadata.RemoveMember(tag.c_str());
+    }
+    metadata.AddMember(rapidjson::Value(tag.c_str(), alloc), std::move(info), alloc);
+
+    return m_dst->onBeginGraphInstance(graph, id, properties, std::move(metadata));
+  }
+
+  void onBeginDeviceInstances(uint64_t gId) override
+  {
+    if(m_dst){
+      m_dst->onBeginDeviceInstances(gId);
+    }
+  }
+
+  uint64_t onDeviceInstance(uint64_t gId, const DeviceTypePtr &dt, const std::string &id, const TypedDataPtr &properties, const TypedDataPtr &state, rapidjson::Document &&metadata) override
+  {
+    uint64_t index=m_deviceCount++;
+    unsigned p=m_partitionOf(index);
+    m_devicePartitions.push_back(p);
+    if(m_assignments){
+      fprintf(m_assignments, "%s %u\n", id.c_str(), p);
+    }
+    if(m_dst){
+      if(!metadata.IsObject()){
+        metadata.SetObject();
+      }
+      metadata.AddMember(rapidjson::Value(m_key.c_str(), metadata.GetAllocator()), rapidjson::Value(p), metadata.GetAllocator());
+      m_dstIds.push_back(m_dst->onDeviceInstance(gId, dt, id, properties, state, std::move(metadata)));
+    }
+    return index;
+  }
+
+  void onEndDeviceInstances(uint64_t gId) override
+  {
+    if(m_dst){
+      m_dst->onEndDeviceInstances(gId);
+    }
+  }
+
+  void onBeginEdgeInstances(uint64_t gId) override
+  {
+    if(m_dst){
+      m_dst->onBeginEdgeInstances(gId);
+    }
+  }
+
+  void onEdgeInstance(uint64_t gId, uint64_t dstDevInst, const DeviceTypePtr &dstDevType, const InputPinPtr &dstPin,
+    uint64_t srcDevInst, const DeviceTypePtr &srcDevType, const OutputPinPtr &srcPin, int sendIndex,
+    const TypedDataPtr &properties, const TypedDataPtr &state, rapidjson::Document &&metadata) override
+  {
+    m_edgeCount++;
+    if(m_devicePartitions[dstDevInst]!=m_devicePartitions[srcDevInst]){
+      m_cutCount++;
+    }
+    if(m_dst){
+      m_dst->onEdgeInstance(gId, m_dstIds[dstDevInst], dstDevType, dstPin, m_dstIds[srcDevInst], srcDevType, srcPin, sendIndex, properties, state, std::move(metadata));
+    }
+  }
+
+  void onEndEdgeInstances(uint64_t gId) override
+  {
+    if(m_dst){
+      m_dst->onEndEdgeInstances(gId);
+    }
+  }
+
+  void onEndGraphInstance(uint64_t gId) override
+  {
+    if(m_dst){
+      m_dst->onEndGraphInstance(gId);
+    }
+  }
+};
+
+#endif
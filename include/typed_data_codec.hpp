@@ -0,0 +1,995 @@
+#ifndef typed_data_codec_hpp
+#define typed_data_codec_hpp
+
+#include "typed_data_spec.hpp"
+
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <memory>
+
+/* A TypedDataSpecElementTuple compiled down into a flat program, so that values
+   can be converted between binary and text without walking the element tree.
+
+   The element tree goes through a virtual call per element, builds a rapidjson
+   Document for JSON, and uses iostreams for XML v4 values. This happens for
+   every loaded property, logged event, and snapshot, so it adds up. The codec
+   instead runs a single loop over the program, reading and writing the payload
+   bytes and a text buffer directly.
+
+   Each op is one element of the spec, in depth-first order. Arrays of scalars
+   are a single op, while tuples and arrays of anything else are a begin/end pair
+   wrapping their members (for an array, the one member is the element type).
+   Offsets are relative to the enclosing tuple or array element.
+
+   The text produced is the same as the element tree produces. For JSON this
+   means the layout of rapidjson::PrettyWriter, with default members of tuples
+   and trailing default elements of arrays left out. Parsing accepts anything
+   the element tree accepts, and also C integer suffixes within arrays.
+*/
+
+class TypedDataCodec
+{
+public:
+    typedef TypedDataSpecElement::ScalarType ScalarType;
+
+    enum op_kind_t
+    {
+        Op_Scalar,
+        Op_ScalarArray,
+        Op_BeginTuple,
+        Op_EndTuple,
+        Op_BeginArray,
+        Op_EndArray
+    };
+
+    struct op_t
+    {
+        op_kind_t kind;
+        ScalarType type;    // Scalar type for Op_Scalar and Op_ScalarArray
+        unsigned offset;    // Offset within the enclosing tuple or array element
+        unsigned size;      // Total bytes covered by the element
+        unsigned count;     // Number of elements in an array
+        unsigned stride;    // Size of each element in an array
+        unsigned match;     // For begin/end, the index of the matching end/begin
+        std::string name;   // Member name within a tuple, empty for array elements
+        std::string jsonKey; // Pre-formatted JSON key, e.g. "\"x\": "
+        unsigned defaultOffset;    // Default value of the element within m_defaults
+        unsigned eltDefaultOffset; // Default value of a single array element within m_defaults
+    };
+
+private:
+    std::vector<op_t> m_ops;
+    std::vector<char> m_defaults;
+    unsigned m_payloadSize;
+    unsigned m_maxDepth;
+
+    struct frame_t
+    {
+        const char *base;   // Base of the current tuple or array element
+        unsigned index;     // Current element within an array
+        unsigned count;     // Number of elements to visit in an array, or zero for a tuple
+        unsigned stride;    // Size of each element in an array
+        bool first;         // No members written yet
+    };
+
+    // Avoids an allocation per conversion for all reasonable specs
+    class frame_stack
+    {
+    private:
+        frame_t m_local[16];
+        std::unique_ptr<frame_t[]> m_heap;
+    public:
+        frame_t *frames;
+
+        frame_stack(unsigned depth)
+        {
+            if(depth<=16){
+                frames=m_local;
+            }else{
+                m_heap.reset(new frame_t[depth]);
+                frames=m_heap.get();
+            }
+        }
+    };
+
+    static ScalarType scalar_type(const TypedDataSpecElementScalar *s)
+    {
+        return TypedDataSpecElementScalar::typeNameToScalarType(s->getTypeName(), {});
+    }
+
+    unsigned add_default(const TypedDataSpecElement *e)
+    {
+        unsigned off=m_defaults.size();
+        m_defaults.resize(off+e->getPayloadSize());
+        if(e->getPayloadSize()){
+            e->createBinaryDefault(&m_defaults[off], e->getPayloadSize());
+        }
+        return off;
+    }
+
+    void compile(const TypedDataSpecElement *e, unsigned offset, const std::string &name, unsigned depth)
+    {
+        m_maxDepth=std::max(m_maxDepth, depth);
+
+        op_t op;
+        op.type=TypedDataSpecElement::ScalarType_uint8_t;
+        op.offset=offset;
+        op.size=e->getPayloadSize();
+        op.count=0;
+        op.stride=0;
+        op.match=0;
+        op.name=name;
+        op.jsonKey=name.empty() ? std::string() : "\""+name+"\": ";
+        op.defaultOffset=add_default(e);
+        op.eltDefaultOffset=0;
+
+        if(auto s=dynamic_cast<const TypedDataSpecElementScalar*>(e)){
+            op.kind=Op_Scalar;
+            op.type=scalar_type(s);
+            m_ops.push_back(op);
+        }else if(auto t=dynamic_cast<const TypedDataSpecElementTuple*>(e)){
+            unsigned begin=m_ops.size();
+            op.kind=Op_BeginTuple;
+            m_ops.push_back(op);
+            unsigned off=0;
+            for(const auto &child : *t){
+                compile(child.get(), off, child->getName(), depth+1);
+                off+=child->getPayloadSize();
+            }
+            op.kind=Op_EndTuple;
+            op.match=begin;
+            m_ops[begin].match=m_ops.size();
+            m_ops.push_back(op);
+        }else if(auto a=dynamic_cast<const TypedDataSpecElementArray*>(e)){
+            auto elt=a->getElementType();
+            op.count=a->getElementCount();
+            op.stride=elt->getPayloadSize();
+            op.eltDefaultOffset=add_default(elt.get());
+            if(auto s=dynamic_cast<const TypedDataSpecElementScalar*>(elt.get())){
+                op.kind=Op_ScalarArray;
+                op.type=scalar_type(s);
+                m_ops.push_back(op);
+            }else{
+                unsigned begin=m_ops.size();
+                op.kind=Op_BeginArray;
+                m_ops.push_back(op);
+                compile(elt.get(), 0, std::string(), depth+1);
+                op.kind=Op_EndArray;
+                op.match=begin;
+                m_ops[begin].match=m_ops.size();
+                m_ops.push_back(op);
+            }
+        }else{
+            throw std::runtime_error("TypedDataCodec - Unsupported element type for "+e->getName());
+        }
+    }
+
+    const char *default_of(const op_t &op) const
+    { return m_defaults.empty() ? nullptr : &m_defaults[op.defaultOffset]; }
+
+    const char *elt_default_of(const op_t &op) const
+    { return m_defaults.empty() ? nullptr : &m_defaults[op.eltDefaultOffset]; }
+
+    static bool is_equal(const char *a, const char *b, unsigned n)
+    { return n==0 || !memcmp(a, b, n); }
+
+    //! Number of elements left when trailing default elements are trimmed
+    unsigned json_array_length(const op_t &op, const char *p) const
+    {
+        const char *def=elt_default_of(op);
+        unsigned n=op.count;
+        while(n>0 && is_equal(p+(n-1)*op.stride, def, op.stride)){
+            n--;
+        }
+        return n;
+    }
+
+    static void check_size(const char *what, size_t got, size_t expected)
+    {
+        if(got!=expected){
+            throw std::runtime_error(std::string(what)+" - incorrect binary size of "+std::to_string(got)+", expected "+std::to_string(expected));
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////
+    // Scalar formatting
+
+    template<class T>
+    static T load(const char *p)
+    {
+        T val;
+        memcpy(&val, p, sizeof(T));
+        return val;
+    }
+
+    template<class T>
+    static void append_int(std::string &dst, T val)
+    {
+        char buffer[24];
+        auto res=std::to_chars(buffer, buffer+sizeof(buffer), val);
+        dst.append(buffer, res.ptr);
+    }
+
+    static void append_exponent(std::string &dst, int k)
+    {
+        if(k<0){
+            dst.push_back('-');
+            k=-k;
+        }
+        append_int(dst, k);
+    }
+
+    /* Same output as rapidjson::Writer::WriteDouble: shortest digits that round-trip,
+       laid out by rapidjson's Prettify, e.g. 1.0, 0.001, 1e30, 1.5e-7.
+       rapidjson refuses to write non-finite values, so these use JSON5 names. */
+    static void append_json_double(std::string &dst, double v)
+    {
+        if(std::isnan(v)){
+            dst+="NaN";
+            return;
+        }
+        if(std::isinf(v)){
+            dst+= v<0 ? "-Infinity" : "Infinity";
+            return;
+        }
+        if(v==0){
+            dst+= std::signbit(v) ? "-0.0" : "0.0";
+            return;
+        }
+
+        // Get the shortest round-trip digits in the form d.ddde[+-]x
+        char buffer[40];
+        int len=0;
+        for(int prec=1; prec<=17; prec++){
+            len=snprintf(buffer, sizeof(buffer), "%.*e", prec-1, v);
+            if(strtod(buffer, nullptr)==v){
+                break;
+            }
+        }
+
+        const char *p=buffer, *end=buffer+len;
+        if(*p=='-'){
+            dst.push_back('-');
+            p++;
+        }
+        char digits[20];
+        int n=0;
+        while(p<end && *p!='e'){
+            if(*p!='.'){
+                digits[n++]=*p;
+            }
+            p++;
+        }
+        int e=atoi(p+1);
+        while(n>1 && digits[n-1]=='0'){
+            n--;
+        }
+
+        int kk=e+1; // Position of the decimal point relative to the digits
+        int k=kk-n;
+        if(0<=k && kk<=21){
+            dst.append(digits, n);
+            dst.append(k, '0');
+            dst+=".0";
+        }else if(0<kk && kk<=21){
+            dst.append(digits, kk);
+            dst.push_back('.');
+            dst.append(digits+kk, n-kk);
+        }else if(-6<kk && kk<=0){
+            dst+="0.";
+            dst.append(-kk, '0');
+            dst.append(digits, n);
+        }else if(n==1){
+            dst.push_back(digits[0]);
+            dst.push_back('e');
+            append_exponent(dst, kk-1);
+        }else{
+            dst.push_back(digits[0]);
+            dst.push_back('.');
+            dst.append(digits+1, n-1);
+            dst.push_back('e');
+            append_exponent(dst, kk-1);
+        }
+    }
+
+    static void append_json_scalar(std::string &dst, ScalarType type, const char *p)
+    {
+        switch(type){
+        case TypedDataSpecElement::ScalarType_uint8_t: append_int(dst, (unsigned)load<uint8_t>(p)); break;
+        case TypedDataSpecElement::ScalarType_uint16_t: append_int(dst, (unsigned)load<uint16_t>(p)); break;
+        case TypedDataSpecElement::ScalarType_uint32_t: append_int(dst, load<uint32_t>(p)); break;
+        case TypedDataSpecElement::ScalarType_uint64_t: append_int(dst, load<uint64_t>(p)); break;
+
+        case TypedDataSpecElement::ScalarType_int8_t: append_int(dst, (int)load<int8_t>(p)); break;
+        case TypedDataSpecElement::ScalarType_int16_t: append_int(dst, (int)load<int16_t>(p)); break;
+        case TypedDataSpecElement::ScalarType_int32_t: append_int(dst, load<int32_t>(p)); break;
+        case TypedDataSpecElement::ScalarType_int64_t: append_int(dst, load<int64_t>(p)); break;
+
+        case TypedDataSpecElement::ScalarType_float: append_json_double(dst, load<float>(p)); break;
+        case TypedDataSpecElement::ScalarType_double: append_json_double(dst, load<double>(p)); break;
+
+        case TypedDataSpecElement::ScalarType_char: append_int(dst, (int)load<char>(p)); break;
+
+        case TypedDataSpecElement::ScalarType_half: throw std::runtime_error("Half not implemented yet.");
+        default: throw std::runtime_error("Unknown or not implemented type.");
+        }
+    }
+
+    static void append_xml_v4_scalar(std::string &dst, ScalarType type, const char *p)
+    {
+        char buffer[40];
+        switch(type){
+        case TypedDataSpecElement::ScalarType_uint8_t: append_int(dst, (unsigned)load<uint8_t>(p)); break;
+        case TypedDataSpecElement::ScalarType_uint16_t: append_int(dst, (unsigned)load<uint16_t>(p)); break;
+        case TypedDataSpecElement::ScalarType_uint32_t: append_int(dst, load<uint32_t>(p)); break;
+        case TypedDataSpecElement::ScalarType_uint64_t:{
+            uint64_t v=load<uint64_t>(p);
+            append_int(dst, v);
+            if(v!=0){
+                dst+="ull";
+            }
+            break;
+        }
+
+        case TypedDataSpecElement::ScalarType_int8_t: append_int(dst, (int)load<int8_t>(p)); break;
+        case TypedDataSpecElement::ScalarType_int16_t: append_int(dst, (int)load<int16_t>(p)); break;
+        case TypedDataSpecElement::ScalarType_int32_t: append_int(dst, load<int32_t>(p)); break;
+        case TypedDataSpecElement::ScalarType_int64_t:{
+            int64_t v=load<int64_t>(p);
+            append_int(dst, v);
+            if(v!=0){
+                dst+="ll";
+            }
+            break;
+        }
+
+        case TypedDataSpecElement::ScalarType_float:
+            dst.append(buffer, snprintf(buffer, sizeof(buffer), "%.9e", (double)load<float>(p)));
+            break;
+        case TypedDataSpecElement::ScalarType_double:
+            dst.append(buffer, snprintf(buffer, sizeof(buffer), "%.17e", load<double>(p)));
+            break;
+
+        case TypedDataSpecElement::ScalarType_half: throw std::runtime_error("Half not implemented yet.");
+        case TypedDataSpecElement::ScalarType_char: throw std::runtime_error("TODO: Is char actually a legal type for v4?");
+        default: throw std::runtime_error("Unknown or not implemented type.");
+        }
+    }
+
+    ///////////////////////////////////////////////////////////////////
+    // Scalar parsing. The text is always nul terminated.
+
+    static const char *skip_ws(const char *p)
+    {
+        while(*p==' ' || *p=='\t' || *p=='\n' || *p=='\r' || *p=='\f' || *p=='\v'){
+            p++;
+        }
+        return p;
+    }
+
+    template<class T>
+    static void store(char *p, T val)
+    {
+        memcpy(p, &val, sizeof(T));
+    }
+
+    template<class T>
+    static const char *parse_int(const char *p, char *dst)
+    {
+        p=skip_ws(p);
+        if(*p=='+'){
+            p++;
+        }
+        const char *end=p+strlen(p);
+        T val;
+        if(std::is_signed<T>::value){
+            int64_t v;
+            auto res=std::from_chars(p, end, v);
+            if(res.ec==std::errc::result_out_of_range || (res.ec==std::errc() && (v < (int64_t)std::numeric_limits<T>::min() || (int64_t)std::numeric_limits<T>::max() < v))){
+                throw std::runtime_error("Value out of range.");
+            }
+            if(res.ec!=std::errc()){
+                throw std::runtime_error("Couldn't parse scalar while extracting xmlV4Value.");
+            }
+            val=(T)v;
+            p=res.ptr;
+        }else{
+            if(*p=='-'){
+                throw std::runtime_error("Value out of range.");
+            }
+            uint64_t v;
+            auto res=std::from_chars(p, end, v);
+            if(res.ec==std::errc::result_out_of_range || (res.ec==std::errc() && (uint64_t)std::numeric_limits<T>::max() < v)){
+                throw std::runtime_error("Value out of range.");
+            }
+            if(res.ec!=std::errc()){
+                throw std::runtime_error("Couldn't parse scalar while extracting xmlV4Value.");
+            }
+            val=(T)v;
+            p=res.ptr;
+        }
+        store(dst, val);
+
+        // consume a C type suffix
+        if(*p=='u') p++;
+        if(*p=='l') p++;
+        if(*p=='l') p++;
+        return p;
+    }
+
+    static const char *parse_xml_v4_scalar(ScalarType type, const char *p, char *dst)
+    {
+        char *end;
+        switch(type){
+        case TypedDataSpecElement::ScalarType_uint8_t: return parse_int<uint8_t>(p, dst);
+        case TypedDataSpecElement::ScalarType_uint16_t: return parse_int<uint16_t>(p, dst);
+        case TypedDataSpecElement::ScalarType_uint32_t: return parse_int<uint32_t>(p, dst);
+        case TypedDataSpecElement::ScalarType_uint64_t: return parse_int<uint64_t>(p, dst);
+
+        case TypedDataSpecElement::ScalarType_int8_t: return parse_int<int8_t>(p, dst);
+        case TypedDataSpecElement::ScalarType_int16_t: return parse_int<int16_t>(p, dst);
+        case TypedDataSpecElement::ScalarType_int32_t: return parse_int<int32_t>(p, dst);
+        case TypedDataSpecElement::ScalarType_int64_t: return parse_int<int64_t>(p, dst);
+
+        case TypedDataSpecElement::ScalarType_float:{
+            float v=strtof(p, &end);
+            if(end==p){
+                throw std::runtime_error("Couldn't parse scalar while extracting xmlV4Value.");
+            }
+            store(dst, v);
+            return end;
+        }
+        case TypedDataSpecElement::ScalarType_double:{
+            double v=strtod(p, &end);
+            if(end==p){
+                throw std::runtime_error("Couldn't parse scalar while extracting xmlV4Value.");
+            }
+            store(dst, v);
+            return end;
+        }
+
+        case TypedDataSpecElement::ScalarType_char:
+            p=skip_ws(p);
+            if(*p==0){
+                throw std::runtime_error("Couldn't parse scalar while extracting xmlV4Value.");
+            }
+            *dst=*p;
+            return p+1;
+
+        case TypedDataSpecElement::ScalarType_half: throw std::runtime_error("JSONtoBinary - half not implemented yet.");
+        default: throw std::runtime_error("JSONToBinary - Unknown scalar type.");
+        }
+    }
+
+    /* The element tree reads every JSON number as a double and then casts it,
+       so do the same. Integers that can't be represented as a double are read
+       exactly though. */
+    template<class T>
+    static void store_json_number(char *dst, double d, bool isInt, int64_t i, uint64_t u, bool isNeg)
+    {
+        if(isInt && std::is_integral<T>::value){
+            store<T>(dst, isNeg ? (T)i : (T)u);
+        }else{
+            store<T>(dst, (T)d);
+        }
+    }
+
+    static const char *parse_json_scalar(ScalarType type, const char *p, char *dst)
+    {
+        p=skip_ws(p);
+        char *end;
+        double d=strtod(p, &end);
+        if(end==p || !(*p=='-' || ('0'<=*p && *p<='9'))){
+            throw std::runtime_error("JSONToBinary - expected a number.");
+        }
+        bool isNeg = *p=='-';
+        bool isInt = std::all_of(p+isNeg, (const char*)end, [](char c){ return '0'<=c && c<='9'; });
+        int64_t i=0;
+        uint64_t u=0;
+        if(isInt){
+            if(isNeg){
+                isInt = std::from_chars(p, (const char*)end, i).ec==std::errc();
+            }else{
+                isInt = std::from_chars(p, (const char*)end, u).ec==std::errc();
+            }
+        }
+
+        switch(type){
+        case TypedDataSpecElement::ScalarType_uint8_t: store_json_number<uint8_t>(dst, d, isInt, i, u, isNeg); break;
+        case TypedDataSpecElement::ScalarType_uint16_t: store_json_number<uint16_t>(dst, d, isInt, i, u, isNeg); break;
+        case TypedDataSpecElement::ScalarType_uint32_t: store_json_number<uint32_t>(dst, d, isInt, i, u, isNeg); break;
+        case TypedDataSpecElement::ScalarType_uint64_t: store_json_number<uint64_t>(dst, d, isInt, i, u, isNeg); break;
+
+        case TypedDataSpecElement::ScalarType_int8_t: store_json_number<int8_t>(dst, d, isInt, i, u, isNeg); break;
+        case TypedDataSpecElement::ScalarType_int16_t: store_json_number<int16_t>(dst, d, isInt, i, u, isNeg); break;
+        case TypedDataSpecElement::ScalarType_int32_t: store_json_number<int32_t>(dst, d, isInt, i, u, isNeg); break;
+        case TypedDataSpecElement::ScalarType_int64_t: store_json_number<int64_t>(dst, d, isInt, i, u, isNeg); break;
+
+        case TypedDataSpecElement::ScalarType_float: store<float>(dst, (float)d); break;
+        case TypedDataSpecElement::ScalarType_double: store<double>(dst, d); break;
+
+        case TypedDataSpecElement::ScalarType_char: store_json_number<char>(dst, d, isInt, i, u, isNeg); break;
+
+        case TypedDataSpecElement::ScalarType_half: throw std::runtime_error("JSONtoBinary - half not implemented yet.");
+        default: throw std::runtime_error("JSONToBinary - Unknown/unsupported scalar type.");
+        }
+        return end;
+    }
+
+    static const char *expect(const char *p, char c, const char *context)
+    {
+        p=skip_ws(p);
+        if(*p!=c){
+            std::string got = *p ? std::string(1,*p) : std::string("end of input");
+            throw std::runtime_error(std::string(context)+" - Got unexpected '"+got+"', but expected '"+c+"'");
+        }
+        return p+1;
+    }
+
+    /* The element tree only puts a comma before an element if its offset within the
+       parent is non-zero, so zero-sized elements don't get one. This has to be kept
+       to read and write the same text. */
+    static bool needs_xml_v4_comma(const frame_t *frames, int depth, const op_t &op)
+    {
+        if(depth<0){
+            return false;
+        }
+        const frame_t &f=frames[depth];
+        if(f.count){
+            return f.index*f.stride!=0;
+        }
+        return op.offset!=0;
+    }
+
+    // Index of the op after the element starting at pc
+    unsigned skip_element(unsigned pc) const
+    {
+        const op_t &op=m_ops[pc];
+        if(op.kind==Op_BeginTuple || op.kind==Op_BeginArray){
+            return op.match+1;
+        }
+        return pc+1;
+    }
+
+    const char *parse_json_element(unsigned pc, const char *p, char *base) const
+    {
+        const op_t &op=m_ops[pc];
+        char *dst=base+op.offset;
+        switch(op.kind){
+        case Op_Scalar:
+            return parse_json_scalar(op.type, p, dst);
+        case Op_ScalarArray:
+        case Op_BeginArray:{
+            p=expect(p, '[', "JSONToBinary");
+            p=skip_ws(p);
+            unsigned i=0;
+            while(*p!=']'){
+                if(i>0){
+                    p=expect(p, ',', "JSONToBinary");
+                }
+                if(i>=op.count){
+                    throw std::runtime_error("JSONToBinary - expected array with at most "+std::to_string(op.count)+" entries.");
+                }
+                if(op.kind==Op_ScalarArray){
+                    p=parse_json_scalar(op.type, p, dst+i*op.stride);
+                }else{
+                    p=parse_json_element(pc+1, p, dst+i*op.stride);
+                }
+                p=skip_ws(p);
+                i++;
+            }
+            return p+1;
+        }
+        case Op_BeginTuple:
+            p=expect(p, '{', "JSONToBinary");
+            p=parse_json_members(pc, p, dst);
+            return expect(p, '}', "JSONToBinary");
+        default:
+            assert(0);
+            throw std::runtime_error("TypedDataCodec - corrupt program.");
+        }
+    }
+
+    // Parse "key":value pairs for the tuple starting at pc, stopping before a closing '}' or the end
+    const char *parse_json_members(unsigned pc, const char *p, char *base) const
+    {
+        const op_t &tuple=m_ops[pc];
+        std::string key;
+        bool first=true;
+        while(1){
+            p=skip_ws(p);
+            if(*p=='}' || *p==0){
+                return p;
+            }
+            if(!first){
+                p=expect(p, ',', "JSONToBinary");
+                p=skip_ws(p);
+            }
+            first=false;
+
+            p=expect(p, '"', "JSONToBinary");
+            const char *begin=p;
+            while(*p && *p!='"' && *p!='\\'){
+                p++;
+            }
+            const char *keyBegin=begin;
+            size_t keyLen=p-begin;
+            if(*p=='\\'){
+                // Slow path for escaped keys
+                key.assign(begin, p);
+                while(*p && *p!='"'){
+                    if(*p=='\\'){
+                        p++;
+                        if(*p==0) break;
+                    }
+                    key.push_back(*p++);
+                }
+                keyBegin=key.c_str();
+                keyLen=key.size();
+            }
+            p=expect(p, '"', "JSONToBinary");
+            p=expect(p, ':', "JSONToBinary");
+
+            unsigned child=pc+1;
+            while(child<tuple.match){
+                const op_t &c=m_ops[child];
+                if(c.name.size()==keyLen && !memcmp(c.name.data(), keyBegin, keyLen)){
+                    break;
+                }
+                child=skip_element(child);
+            }
+            if(child>=tuple.match){
+                throw std::runtime_error("Unknown element '"+std::string(keyBegin, keyLen)+"' in JSON initialiser.");
+            }
+            p=parse_json_element(child, p, base);
+        }
+    }
+
+public:
+    TypedDataCodec(const TypedDataSpecElementTuplePtr &tuple)
+        : m_payloadSize(tuple->getPayloadSize())
+        , m_maxDepth(0)
+    {
+        compile(tuple.get(), 0, std::string(), 1);
+    }
+
+    const std::vector<op_t> &ops() const
+    { return m_ops; }
+
+    size_t payloadSize() const
+    { return m_payloadSize; }
+
+    //! Same text as the element tree's binaryToJSON through rapidjson::PrettyWriter
+    void binaryToJSON(const char *pBinary, size_t cbBinary, std::string &dst) const
+    {
+        check_size("binaryToJSON", cbBinary, m_payloadSize);
+
+        frame_stack stack(m_maxDepth);
+        frame_t *frames=stack.frames;
+        int depth=-1; // Index of the innermost frame; also the JSON indent level minus one
+
+        auto prefix=[&](const op_t &op)
+        {
+            if(depth<0){
+                return;
+            }
+            frame_t &f=frames[depth];
+            if(!f.first){
+                dst.push_back(',');
+            }
+            f.first=false;
+            dst.push_back('\n');
+            dst.append(4*(depth+1), ' ');
+            dst+=op.jsonKey;
+        };
+
+        auto is_default_member=[&](const op_t &op) -> bool
+        {
+            // Only members of tuples are skipped; array elements are trimmed from the end
+            return depth>=0 && !op.name.empty() && is_equal(frames[depth].base+op.offset, default_of(op), op.size);
+        };
+
+        unsigned pc=0;
+        const unsigned n=m_ops.size();
+        while(pc<n){
+            const op_t &op=m_ops[pc];
+            switch(op.kind){
+            case Op_Scalar:
+                if(!is_default_member(op)){
+                    prefix(op);
+                    append_json_scalar(dst, op.type, frames[depth].base+op.offset);
+                }
+                pc++;
+                break;
+            case Op_ScalarArray:
+                if(!is_default_member(op)){
+                    prefix(op);
+                    const char *p=frames[depth].base+op.offset;
+                    unsigned len=json_array_length(op, p);
+                    dst.push_back('[');
+                    for(unsigned i=0; i<len; i++){
+                        if(i>0){
+                            dst.push_back(',');
+                        }
+                        dst.push_back('\n');
+                        dst.append(4*(depth+2), ' ');
+                        append_json_scalar(dst, op.type, p+i*op.stride);
+                    }
+                    if(len>0){
+                        dst.push_back('\n');
+                        dst.append(4*(depth+1), ' ');
+                    }
+                    dst.push_back(']');
+                }
+                pc++;
+                break;
+            case Op_BeginTuple:
+                if(is_default_member(op)){
+                    pc=op.match+1;
+                }else{
+                    prefix(op);
+                    const char *base= depth<0 ? pBinary : frames[depth].base+op.offset;
+                    ++depth;
+                    frames[depth]=frame_t{base, 0, 0, 0, true};
+                    dst.push_back('{');
+                    pc++;
+                }
+                break;
+            case Op_EndTuple:
+                if(!frames[depth].first){
+                    dst.push_back('\n');
+                    dst.append(4*depth, ' ');
+                }
+                dst.push_back('}');
+                --depth;
+                pc++;
+                break;
+            case Op_BeginArray:{
+                if(is_default_member(op)){
+                    pc=op.match+1;
+                    break;
+                }
+                prefix(op);
+                const char *base=frames[depth].base+op.offset;
+                unsigned len=json_array_length(op, base);
+                dst.push_back('[');
+                if(len==0){
+                    dst.push_back(']');
+                    pc=op.match+1;
+                    break;
+                }
+                // The element has an offset of zero, so the array frame's base is the current element
+                ++depth;
+                frames[depth]=frame_t{base, 0, len, op.stride, true};
+                pc++;
+                break;
+            }
+            case Op_EndArray:{
+                frame_t &f=frames[depth];
+                if(++f.index<f.count){
+                    f.base+=op.stride;
+                    pc=op.match+1;
+                }else{
+                    dst.push_back('\n');
+                    dst.append(4*depth, ' ');
+                    dst.push_back(']');
+                    --depth;
+                    pc++;
+                }
+                break;
+            }
+            }
+        }
+    }
+
+    std::string binaryToJSON(const char *pBinary, size_t cbBinary) const
+    {
+        std::string res;
+        binaryToJSON(pBinary, cbBinary, res);
+        return res;
+    }
+
+    /* Parse JSON into an already defaulted payload. If membersOnly is true then
+       the text is the inside of the top-level object, without the braces, which
+       is how values are stored in v3 XML. */
+    void JSONToBinary(const char *text, char *pBinary, size_t cbBinary, bool membersOnly) const
+    {
+        check_size("JSONToBinary", cbBinary, m_payloadSize);
+        const char *p;
+        if(membersOnly){
+            p=parse_json_members(0, text, pBinary);
+        }else{
+            p=parse_json_element(0, text, pBinary);
+        }
+        p=skip_ws(p);
+        if(*p!=0){
+            throw std::runtime_error("JSONToBinary - unexpected trailing characters in JSON.");
+        }
+    }
+
+    //! Same text as the element tree's binaryToXmlV4Value
+    void binaryToXmlV4Value(const char *pBinary, size_t cbBinary, std::string &dst) const
+    {
+        check_size("binaryToXmlV4Value", cbBinary, m_payloadSize);
+
+        frame_stack stack(m_maxDepth);
+        frame_t *frames=stack.frames;
+        int depth=-1;
+
+        auto separate=[&](const op_t &op)
+        {
+            if(needs_xml_v4_comma(frames, depth, op)){
+                dst.push_back(',');
+            }
+        };
+
+        unsigned pc=0;
+        const unsigned n=m_ops.size();
+        while(pc<n){
+            const op_t &op=m_ops[pc];
+            switch(op.kind){
+            case Op_Scalar:
+                separate(op);
+                append_xml_v4_scalar(dst, op.type, frames[depth].base+op.offset);
+                pc++;
+                break;
+            case Op_ScalarArray:{
+                separate(op);
+                const char *p=frames[depth].base+op.offset;
+                dst.push_back('{');
+                for(unsigned i=0; i<op.count; i++){
+                    if(i>0){
+                        dst.push_back(',');
+                    }
+                    append_xml_v4_scalar(dst, op.type, p+i*op.stride);
+                }
+                dst.push_back('}');
+                pc++;
+                break;
+            }
+            case Op_BeginTuple:{
+                separate(op);
+                const char *base= depth<0 ? pBinary : frames[depth].base+op.offset;
+                ++depth;
+                frames[depth]=frame_t{base, 0, 0, 0, true};
+                dst.push_back('{');
+                pc++;
+                break;
+            }
+            case Op_EndTuple:
+                dst.push_back('}');
+                --depth;
+                pc++;
+                break;
+            case Op_BeginArray:{
+                separate(op);
+                const char *base=frames[depth].base+op.offset;
+                dst.push_back('{');
+                if(op.count==0){
+                    dst.push_back('}');
+                    pc=op.match+1;
+                    break;
+                }
+                ++depth;
+                frames[depth]=frame_t{base, 0, op.count, op.stride, true};
+                pc++;
+                break;
+            }
+            case Op_EndArray:{
+                frame_t &f=frames[depth];
+                if(++f.index<f.count){
+                    f.base+=op.stride;
+                    pc=op.match+1;
+                }else{
+                    dst.push_back('}');
+                    --depth;
+                    pc++;
+                }
+                break;
+            }
+            }
+        }
+    }
+
+    std::string binaryToXmlV4Value(const char *pBinary, size_t cbBinary) const
+    {
+        std::string res;
+        binaryToXmlV4Value(pBinary, cbBinary, res);
+        return res;
+    }
+
+    //! Parse an XML v4 value into a payload, which must already be defaulted
+    void xmlV4ValueToBinary(const char *text, char *pBinary, size_t cbBinary) const
+    {
+        check_size("xmlV4ValueToBinary", cbBinary, m_payloadSize);
+
+        frame_stack stack(m_maxDepth);
+        frame_t *frames=stack.frames;
+        int depth=-1;
+        const char *p=text;
+
+        auto separate=[&](const op_t &op)
+        {
+            if(needs_xml_v4_comma(frames, depth, op)){
+                p=expect(p, ',', "xmlV4ValueToBinary");
+            }
+        };
+
+        unsigned pc=0;
+        const unsigned n=m_ops.size();
+        while(pc<n){
+            const op_t &op=m_ops[pc];
+            switch(op.kind){
+            case Op_Scalar:
+                separate(op);
+                p=parse_xml_v4_scalar(op.type, p, (char*)frames[depth].base+op.offset);
+                pc++;
+                break;
+            case Op_ScalarArray:{
+                separate(op);
+                char *dst=(char*)frames[depth].base+op.offset;
+                p=expect(p, '{', "xmlV4ValueToBinary");
+                for(unsigned i=0; i<op.count; i++){
+                    if(i>0){
+                        p=expect(p, ',', "xmlV4ValueToBinary");
+                    }
+                    p=parse_xml_v4_scalar(op.type, p, dst+i*op.stride);
+                }
+                p=expect(p, '}', "xmlV4ValueToBinary");
+                pc++;
+                break;
+            }
+            case Op_BeginTuple:{
+                separate(op);
+                const char *base= depth<0 ? pBinary : frames[depth].base+op.offset;
+                p=expect(p, '{', "xmlV4ValueToBinary");
+                ++depth;
+                frames[depth]=frame_t{base, 0, 0, 0, true};
+                pc++;
+                break;
+            }
+            case Op_EndTuple:
+                p=expect(p, '}', "xmlV4ValueToBinary");
+                --depth;
+                pc++;
+                break;
+            case Op_BeginArray:{
+                separate(op);
+                const char *base=frames[depth].base+op.offset;
+                p=expect(p, '{', "xmlV4ValueToBinary");
+                if(op.count==0){
+                    p=expect(p, '}', "xmlV4ValueToBinary");
+                    pc=op.match+1;
+                    break;
+                }
+                ++depth;
+                frames[depth]=frame_t{base, 0, op.count, op.stride, true};
+                pc++;
+                break;
+            }
+            case Op_EndArray:{
+                frame_t &f=frames[depth];
+                if(++f.index<f.count){
+                    f.base+=op.stride;
+                    pc=op.match+1;
+                }else{
+                    p=expect(p, '}', "xmlV4ValueToBinary");
+                    --depth;
+                    pc++;
+                }
+                break;
+            }
+            }
+        }
+    }
+};
+typedef std::shared_ptr<TypedDataCodec> TypedDataCodecPtr;
+
+#endif
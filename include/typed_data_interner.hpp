@@ -38,6 +38,7 @@ private:
     };
 
 
+    POETSHashAlgorithm m_algorithm;
     std::unordered_set<entry_t,hash_entry_t,equal_entry_t> m_dataInstances;
     std::vector<const entry_t*> m_indexToInstance;
     
@@ -45,7 +46,7 @@ private:
     
     const entry_t &internImpl(const TypedDataPtr &o)
     {
-        entry_t entry{ o.payloadHash(), o, m_dataInstances.size() };
+        entry_t entry{ o.payloadHash(m_algorithm), o, m_dataInstances.size() };
         auto it=m_dataInstances.find( entry );
         if(it==m_dataInstances.end()){
             entry.data=o.clone();
@@ -58,10 +59,30 @@ private:
         return *it;
     }
 public:
+    // The algorithm determines entry_t::hash. Stick to FNV1a if the hashes
+    // are going to be compared with anything outside this process.
+    TypedDataInterner(POETSHashAlgorithm algorithm=POETSHashAlgorithm::FNV1a)
+        : m_algorithm(algorithm)
+    {}
+
+    POETSHashAlgorithm getAlgorithm() const
+    { return m_algorithm; }
+
     const entry_t *intern(const TypedDataPtr &o)
     {
         return &internImpl(o);
     }
+
+    // Entries are numbered from zero in the order they were first interned
+    const entry_t *indexToEntry(size_t index) const
+    {
+        return m_indexToInstance.at(index);
+    }
+
+    size_t size() const
+    {
+        return m_indexToInstance.size();
+    }
     
 };
 
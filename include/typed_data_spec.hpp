@@ -828,8 +828,6 @@ public:
         if(epos!=std::string::npos){
             next=path.substr(epos+1, std::string::npos);
         }
-        fprintf(stderr, "now=%s, next=%s\n", now.c_str(), next.c_str());
-
         if(now.empty()){
             throw std::runtime_error("No immediate part to index into tuple.");
         }
@@ -0,0 +1,214 @@
+#include "graph.hpp"
+#include "external_connection.hpp"
+
+#include <libxml++/parsers/domparser.h>
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <sys/socket.h>
+
+#include <cstring>
+#include <cstdlib>
+
+/* Measures the throughput of the external connection protocols by sending
+   messages from internal devices to externals through a loopback socket, and
+   reading them straight back in on the other end.
+
+   The graph instance is only used for its types and external edges, so it does
+   not need a compiled provider.
+*/
+
+struct ExternalEdgeCollector
+  : public GraphLoadEvents
+{
+  struct device_t
+  {
+    std::string id;
+    DeviceTypePtr type;
+  };
+
+  struct edge_t
+  {
+    unsigned dstDev;
+    InputPinPtr dstPin;
+    unsigned srcDev;
+    OutputPinPtr srcPin;
+  };
+
+  std::vector<device_t> m_devices;
+  std::vector<edge_t> m_edges; // All edges touching an external
+
+  uint64_t onDeviceInstance(uint64_t, const DeviceTypePtr &dt, const std::string &id, const TypedDataPtr &, const TypedDataPtr &, rapidjson::Document &&) override
+  {
+    m_devices.push_back(device_t{id, dt});
+    return m_devices.size()-1;
+  }
+
+  void onEdgeInstance(uint64_t, uint64_t dstDevIndex, const DeviceTypePtr &dstDevType, const InputPinPtr &dstInput, uint64_t srcDevIndex, const DeviceTypePtr &srcDevType, const OutputPinPtr &srcOutput, int, const TypedDataPtr &, const TypedDataPtr &, rapidjson::Document &&) override
+  {
+    if(!dstDevType->isExternal() && !srcDevType->isExternal()){
+      return;
+    }
+    if(m_devices.at(dstDevIndex).id=="__halt__"){
+      return;
+    }
+    m_edges.push_back(edge_t{(unsigned)dstDevIndex, dstInput, (unsigned)srcDevIndex, srcOutput});
+  }
+
+  void connect(ExternalConnection &conn) const
+  {
+    for(const auto &e : m_edges){
+      conn.onExternalEdgeInstance(
+        m_devices[e.dstDev].id.c_str(), e.dstDev, m_devices[e.dstDev].type, e.dstPin,
+        m_devices[e.srcDev].id.c_str(), e.srcDev, m_devices[e.srcDev].type, e.srcPin
+      );
+    }
+  }
+};
+
+double run_loopback(const std::string &mode, const ExternalEdgeCollector &graph, unsigned nMessages)
+{
+  int fds[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)!=0){
+    throw std::runtime_error("Couldn't create socket pair.");
+  }
+
+  // Writes go into fds[0], and come back out of fds[1]
+  auto conn=createExternalConnection(mode, fds[1], fds[0]);
+  graph.connect(*conn);
+
+  std::vector<external_message_t> messages;
+  for(const auto &e : graph.m_edges){
+    external_message_t m;
+    m.isMulticast=false;
+    m.srcDev=e.srcDev;
+    m.srcPort=e.srcPin->getIndex();
+    m.dstDev=e.dstDev;
+    m.dstPort=e.dstPin->getIndex();
+    m.data=e.srcPin->getMessageType()->getMessageSpec()->create();
+    messages.push_back(m);
+  }
+
+  auto start=std::chrono::steady_clock::now();
+
+  conn->startPump();
+
+  std::thread writer([&](){
+    for(unsigned i=0; i<nMessages; i++){
+      conn->write(messages[i%messages.size()]);
+    }
+    conn->flush();
+    shutdown(fds[0], SHUT_WR);
+  });
+
+  unsigned received=0;
+  external_message_t msg;
+  while(received<nMessages){
+    if(conn->canRead()){
+      conn->read(msg);
+      received++;
+    }else if(!conn->isReadOpen()){
+      break;
+    }else{
+      std::this_thread::yield();
+    }
+  }
+
+  writer.join();
+
+  double t=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+  if(received!=nMessages){
+    throw std::runtime_error("Loopback lost messages: sent "+std::to_string(nMessages)+", received "+std::to_string(received));
+  }
+
+  return t;
+}
+
+void usage()
+{
+  fprintf(stderr, "benchmark_external_connection [options] sourceFile\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  --messages n : Number of messages to send in each mode (default is 1000000).\n");
+  fprintf(stderr, "  --mode json|binary|both : Which protocols to measure (default is both).\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  try{
+    std::string srcFilePath;
+    unsigned nMessages=1000000;
+    std::string mode="both";
+
+    int ia=1;
+    while(ia < argc){
+      if(!strcmp("--help",argv[ia])){
+        usage();
+      }else if(!strcmp("--messages",argv[ia])){
+        if(ia+1 >= argc){
+          fprintf(stderr, "Missing argument to --messages\n");
+          usage();
+        }
+        nMessages=strtoul(argv[ia+1], 0, 0);
+        ia+=2;
+      }else if(!strcmp("--mode",argv[ia])){
+        if(ia+1 >= argc){
+          fprintf(stderr, "Missing argument to --mode\n");
+          usage();
+        }
+        mode=argv[ia+1];
+        if(mode!="json" && mode!="binary" && mode!="both"){
+          fprintf(stderr, "Didn't understand mode '%s'\n", mode.c_str());
+          usage();
+        }
+        ia+=2;
+      }else{
+        srcFilePath=argv[ia];
+        ia++;
+      }
+    }
+
+    if(srcFilePath.empty()){
+      usage();
+    }
+
+    RegistryImpl registry;
+    xmlpp::DomParser parser;
+
+    filepath p(srcFilePath);
+    p=absolute(p);
+    parser.parse_file(p.c_str());
+
+    ExternalEdgeCollector graph;
+    loadGraph(&registry, p.parent_path(), parser.get_document()->get_root_node(), &graph);
+
+    if(graph.m_edges.empty()){
+      throw std::runtime_error("Graph instance does not have any edges to or from externals.");
+    }
+    fprintf(stderr, "Found %u edges touching externals.\n", (unsigned)graph.m_edges.size());
+
+    std::vector<std::string> modes;
+    if(mode=="both"){
+      modes={"binary","json"};
+    }else{
+      modes={mode};
+    }
+
+    for(const auto &m : modes){
+      double t=run_loopback(m, graph, nMessages);
+      fprintf(stdout, "mode=%s, messages=%u, seconds=%g, msgsPerSec=%g\n", m.c_str(), nMessages, t, nMessages/t);
+      fflush(stdout);
+    }
+
+    return 0;
+  }catch(std::exception &e){
+    std::cerr<<"Exception : "<<e.what()<<"\n";
+    exit(1);
+  }catch(...){
+    std::cerr<<"Exception of unknown type\n";
+    exit(1);
+  }
+}
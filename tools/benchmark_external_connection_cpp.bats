@@ -0,0 +1,12 @@
+load bats_helpers
+
+setup() {
+    make_target bin/benchmark_external_connection test_external_ping_pong_provider
+}
+
+@test "benchmark_external_connection round trips messages in binary and json modes" {
+    run bin/benchmark_external_connection --messages 20000 apps/tests/externals/test_external_ping_pong_graph_inst_1.xml
+    [[ $status -eq 0 ]]
+    echo "$output" | grep "mode=binary, messages=20000,"
+    echo "$output" | grep "mode=json, messages=20000,"
+}
@@ -0,0 +1,530 @@
+#include "graph.hpp"
+#include "graph_provider_helpers.hpp"
+#include "typed_data_interner.hpp"
+#include "concurrent_typed_data_interner.hpp"
+#include "base85_codec.hpp"
+
+#include "xml_pull_parser.hpp"
+#include "graph_persist_sax_writer.hpp"
+
+#include <libxml++/document.h>
+
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <cstdlib>
+
+/* Microbenchmarks for the code that every tool shares: base85, typed data
+   conversion, hashing, interning, and reading and writing graphs.
+
+   All inputs are fixed: byte buffers come from a fixed-seed generator, typed
+   data comes from a fixed JSON value, and the graphs are a fixed number of
+   copies of a source instance that is checked into the repository. Results go
+   to stdout as CSV with one row per benchmark, so they can be diffed or
+   loaded straight into a spreadsheet.
+
+   Each benchmark is calibrated so that one batch takes about min-time/batches,
+   and then the median and minimum time per op over the batches is reported.
+*/
+
+volatile uint64_t g_sink; // Stops the compiler from removing work whose result isn't used
+
+struct bench_options_t
+{
+  double minTime=0.5;
+  unsigned batches=5;
+  std::string filter;
+};
+
+void print_header()
+{
+  fprintf(stdout, "benchmark,param,ops_per_batch,batches,median_ns_per_op,min_ns_per_op,bytes_per_op,median_mb_per_sec\n");
+}
+
+/* f(n) should do n operations. bytesPerOp is only used to calculate a throughput,
+   and can be zero if it doesn't mean anything for this benchmark. */
+template<class TF>
+void measure(const bench_options_t &opts, const std::string &name, const std::string &param, uint64_t bytesPerOp, TF f)
+{
+  std::string full=param.empty() ? name : name+"/"+param;
+  if(!opts.filter.empty() && full.find(opts.filter)==std::string::npos){
+    return;
+  }
+
+  auto time_batch=[&](uint64_t n){
+    auto start=std::chrono::steady_clock::now();
+    f(n);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  };
+
+  // Find a batch size that takes long enough to time reliably. This also warms everything up.
+  double target=opts.minTime/opts.batches;
+  uint64_t n=1;
+  double t=time_batch(n);
+  while(t < target && n < (1ull<<40)){
+    uint64_t next = t>0 ? (uint64_t)(n*std::min(10.0, 1.2*target/t)) : n*10;
+    n=std::max(n+1, next);
+    t=time_batch(n);
+  }
+
+  std::vector<double> perOp;
+  for(unsigned i=0; i<opts.batches; i++){
+    perOp.push_back(time_batch(n)/n);
+  }
+  std::sort(perOp.begin(), perOp.end());
+  double med=perOp[perOp.size()/2];
+
+  fprintf(stdout, "%s,%s,%llu,%u,%.3f,%.3f,%llu,%.3f\n",
+    name.c_str(), param.c_str(), (unsigned long long)n, opts.batches,
+    med*1e9, perOp[0]*1e9, (unsigned long long)bytesPerOp,
+    bytesPerOp ? bytesPerOp/med/1e6 : 0.0
+  );
+  fflush(stdout);
+}
+
+//! Fixed-seed xorshift, so inputs are the same on every run and platform
+struct stable_rng_t
+{
+  uint64_t s=0x9E3779B97F4A7C15ull;
+
+  uint64_t operator()()
+  {
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
+  }
+};
+
+std::vector<uint8_t> make_bytes(size_t n, unsigned percentNonZero)
+{
+  stable_rng_t rng;
+  std::vector<uint8_t> res(n);
+  for(auto &b : res){
+    uint64_t r=rng();
+    b = (r%100) < percentNonZero ? (uint8_t)(r>>32) : 0;
+  }
+  return res;
+}
+
+void bench_base85(const bench_options_t &opts)
+{
+  Base85Codec codec;
+  for(auto size : {16u, 256u, 4096u}){
+    for(auto density : {100u, 10u}){
+      auto src=make_bytes(size, density);
+      std::vector<char> encoded(codec.get_max_encoded_size(size));
+      char *end=codec.encode_bytes(size, &src[0], &encoded[0]);
+      encoded.resize(end-&encoded[0]);
+      std::vector<uint8_t> decoded(size);
+
+      std::string param=std::to_string(size)+"B_"+std::to_string(density)+"pc_nonzero";
+      measure(opts, "base85_encode", param, size, [&](uint64_t n){
+        std::vector<char> dst(codec.get_max_encoded_size(size));
+        for(uint64_t i=0; i<n; i++){
+          g_sink += codec.encode_bytes(size, &src[0], &dst[0]) - &dst[0];
+        }
+      });
+      measure(opts, "base85_decode", param, size, [&](uint64_t n){
+        for(uint64_t i=0; i<n; i++){
+          const char *p=&encoded[0];
+          codec.decode_bytes(p, &encoded[0]+encoded.size(), size, &decoded[0]);
+          g_sink += decoded[0];
+        }
+      });
+      if(decoded!=src){
+        throw std::runtime_error("base85 round trip failed.");
+      }
+    }
+  }
+}
+
+/* A mixture of the things that appear in app properties and state: scalars of
+   different widths, arrays, and a nested tuple. */
+std::shared_ptr<TypedDataSpecImpl> make_benchmark_spec()
+{
+  return std::make_shared<TypedDataSpecImpl>(makeTuple("_", {
+    makeScalar("id", "uint32_t"),
+    makeScalar("step", "int16_t"),
+    makeScalar("flags", "uint8_t"),
+    makeScalar("x", "float"),
+    makeScalar("y", "double"),
+    makeArray("weights", 8, makeScalar("_", "float")),
+    makeArray("seen", 16, makeScalar("_", "uint8_t")),
+    makeTuple("nested", {
+      makeScalar("count", "uint64_t"),
+      makeArray("history", 4, makeScalar("_", "int32_t"))
+    })
+  }));
+}
+
+static const char *BENCHMARK_VALUE_JSON=
+  "\"id\":123456, \"step\":-42, \"flags\":7, \"x\":0.25, \"y\":-1234.5678,"
+  "\"weights\":[0.5,1.5,2.5,3.5,-0.5,-1.5,-2.5,-3.5],"
+  "\"seen\":[1,0,1,0,1,1,0,0,0,0,0,0,1,0,0,1],"
+  "\"nested\":{\"count\":9876543210, \"history\":[1,-2,3,-4]}";
+
+TypedDataPtr make_benchmark_value(const TypedDataSpecImpl &spec)
+{
+  rapidjson::Document doc;
+  doc.Parse((std::string("{")+BENCHMARK_VALUE_JSON+"}").c_str());
+  if(doc.HasParseError()){
+    throw std::runtime_error("Couldn't parse benchmark value.");
+  }
+  TypedDataPtr res=spec.create();
+  spec.getTupleElement()->JSONToBinary(doc, (char*)res.payloadPtr(), res.payloadSize());
+  return res;
+}
+
+void bench_typed_data(const bench_options_t &opts)
+{
+  auto spec=make_benchmark_spec();
+  auto value=make_benchmark_value(*spec);
+  uint64_t size=spec->payloadSize();
+  std::string param=std::to_string(size)+"B";
+
+  measure(opts, "typed_data_to_json", param, size, [&](uint64_t n){
+    for(uint64_t i=0; i<n; i++){
+      g_sink += spec->toJSON(value).size();
+    }
+  });
+
+  xmlpp::Document xml;
+  auto elt=xml.create_root_node("P");
+  elt->add_child_text(BENCHMARK_VALUE_JSON);
+  if(!(spec->load(elt)==value)){
+    throw std::runtime_error("load didn't give the benchmark value.");
+  }
+  measure(opts, "typed_data_load", param, size, [&](uint64_t n){
+    for(uint64_t i=0; i<n; i++){
+      g_sink += spec->load(elt).payloadSize();
+    }
+  });
+
+  measure(opts, "typed_data_to_xml_v4", param, size, [&](uint64_t n){
+    for(uint64_t i=0; i<n; i++){
+      g_sink += spec->toXmlV4ValueSpec(value).size();
+    }
+  });
+
+  std::string v4=spec->toXmlV4ValueSpec(value);
+  if(!(spec->loadXmlV4ValueSpec(v4)==value)){
+    throw std::runtime_error("v4 value spec round trip failed.");
+  }
+  measure(opts, "typed_data_load_xml_v4", param, size, [&](uint64_t n){
+    for(uint64_t i=0; i<n; i++){
+      g_sink += spec->loadXmlV4ValueSpec(v4).payloadSize();
+    }
+  });
+}
+
+void bench_hash_and_intern(const bench_options_t &opts)
+{
+  for(auto size : {8u, 64u, 4096u}){
+    auto src=make_bytes(size, 100);
+    measure(opts, "poets_hash", std::to_string(size)+"B", size, [&](uint64_t n){
+      for(uint64_t i=0; i<n; i++){
+        POETSHash h;
+        h.add(&src[0], size);
+        g_sink += h.getHash();
+      }
+    });
+    measure(opts, "poets_fast_hash", std::to_string(size)+"B", size, [&](uint64_t n){
+      for(uint64_t i=0; i<n; i++){
+        g_sink += POETSFastHash::hash(&src[0], size);
+      }
+    });
+  }
+
+  auto spec=make_benchmark_spec();
+  auto base=make_benchmark_value(*spec);
+  uint64_t size=spec->payloadSize();
+
+  // Values that differ only in the first word, like device state that differs in a counter
+  const unsigned DISTINCT=4096;
+  std::vector<TypedDataPtr> values;
+  for(unsigned i=0; i<DISTINCT; i++){
+    auto v=base.clone();
+    memcpy(v.payloadPtr(), &i, sizeof(i));
+    values.push_back(v);
+  }
+
+  {
+    TypedDataInterner interner;
+    for(const auto &v : values){
+      interner.intern(v);
+    }
+    measure(opts, "typed_data_interner_hit", std::to_string(DISTINCT)+"_values", size, [&](uint64_t n){
+      for(uint64_t i=0; i<n; i++){
+        g_sink += interner.intern(values[i%DISTINCT])->index;
+      }
+    });
+  }
+
+  // Each op is a whole fill of a new interner, so this includes the cost of growing it
+  measure(opts, "typed_data_interner_fill", std::to_string(DISTINCT)+"_values", size*DISTINCT, [&](uint64_t n){
+    for(uint64_t i=0; i<n; i++){
+      TypedDataInterner interner;
+      for(const auto &v : values){
+        g_sink += interner.intern(v)->index;
+      }
+    }
+  });
+
+  {
+    ConcurrentTypedDataInterner interner;
+    for(const auto &v : values){
+      interner.intern(v);
+    }
+    measure(opts, "concurrent_typed_data_interner_hit", std::to_string(DISTINCT)+"_values", size, [&](uint64_t n){
+      for(uint64_t i=0; i<n; i++){
+        g_sink += interner.intern(values[i%DISTINCT])->index;
+      }
+    });
+  }
+
+  measure(opts, "concurrent_typed_data_interner_fill", std::to_string(DISTINCT)+"_values", size*DISTINCT, [&](uint64_t n){
+    for(uint64_t i=0; i<n; i++){
+      ConcurrentTypedDataInterner interner;
+      for(const auto &v : values){
+        g_sink += interner.intern(v)->index;
+      }
+    }
+  });
+}
+
+/* Holds a whole graph instance in memory, so that it can be written out
+   repeatedly without including the cost of reading it. */
+class GraphRecorder
+  : public GraphLoadEvents
+{
+public:
+  struct device_t
+  {
+    DeviceTypePtr type;
+    std::string id;
+    TypedDataPtr properties;
+    TypedDataPtr state;
+  };
+
+  struct edge_t
+  {
+    uint64_t dstDev;
+    InputPinPtr dstPin;
+    uint64_t srcDev;
+    OutputPinPtr srcPin;
+    int sendIndex;
+    TypedDataPtr properties;
+    TypedDataPtr state;
+  };
+
+  GraphTypePtr m_graphType;
+  std::string m_id;
+  TypedDataPtr m_properties;
+  std::vector<device_t> m_devices;
+  std::vector<edge_t> m_edges;
+
+  void onGraphType(const GraphTypePtr &graph) override
+  { m_graphType=graph; }
+
+  uint64_t onBeginGraphInstance(const GraphTypePtr &graph, const std::string &id, const TypedDataPtr &properties, rapidjson::Document &&) override
+  {
+    m_graphType=graph;
+    m_id=id;
+    m_properties=properties;
+    return 0;
+  }
+
+  uint64_t onDeviceInstance(uint64_t, const DeviceTypePtr &dt, const std::string &id, const TypedDataPtr &properties, const TypedDataPtr &state, rapidjson::Document &&) override
+  {
+    m_devices.push_back(device_t{dt, id, properties, state});
+    return m_devices.size()-1;
+  }
+
+  void onEdgeInstance(uint64_t, uint64_t dstDevInst, const DeviceTypePtr &, const InputPinPtr &dstPin, uint64_t srcDevInst, const DeviceTypePtr &, const OutputPinPtr &srcPin, int sendIndex, const TypedDataPtr &properties, const TypedDataPtr &state, rapidjson::Document &&) override
+  {
+    m_edges.push_back(edge_t{dstDevInst, dstPin, srcDevInst, srcPin, sendIndex, properties, state});
+  }
+
+  //! Sends the graph to dst as `copies` disjoint copies of itself, with device ids prefixed by the copy number.
+  void replay(GraphLoadEvents *dst, unsigned copies) const
+  {
+    dst->onGraphType(m_graphType);
+    uint64_t g=dst->onBeginGraphInstance(m_graphType, m_id+"_x"+std::to_string(copies), m_properties, rapidjson::Document());
+
+    std::vector<uint64_t> ids(m_devices.size()*copies);
+    dst->onBeginDeviceInstances(g);
+    for(unsigned c=0; c<copies; c++){
+      std::string prefix="c"+std::to_string(c)+"_";
+      for(unsigned i=0; i<m_devices.size(); i++){
+        const auto &d=m_devices[i];
+        ids[c*m_devices.size()+i]=dst->onDeviceInstance(g, d.type, prefix+d.id, d.properties, d.state, rapidjson::Document());
+      }
+    }
+    dst->onEndDeviceInstances(g);
+
+    dst->onBeginEdgeInstances(g);
+    for(unsigned c=0; c<copies; c++){
+      size_t base=c*m_devices.size();
+      for(const auto &e : m_edges){
+        const auto &dd=m_devices[e.dstDev];
+        const auto &sd=m_devices[e.srcDev];
+        dst->onEdgeInstance(g,
+          ids[base+e.dstDev], dd.type, e.dstPin,
+          ids[base+e.srcDev], sd.type, e.srcPin,
+          e.sendIndex, e.properties, e.state, rapidjson::Document()
+        );
+      }
+    }
+    dst->onEndEdgeInstances(g);
+
+    dst->onEndGraphInstance(g);
+  }
+};
+
+//! Does as little as possible with each event, so that loading time is mostly parsing.
+class GraphCounter
+  : public GraphLoadEvents
+{
+public:
+  uint64_t devices=0;
+  uint64_t edges=0;
+
+  uint64_t onDeviceInstance(uint64_t, const DeviceTypePtr &, const std::string &, const TypedDataPtr &, const TypedDataPtr &, rapidjson::Document &&) override
+  { return devices++; }
+
+  void onEdgeInstance(uint64_t, uint64_t, const DeviceTypePtr &, const InputPinPtr &, uint64_t, const DeviceTypePtr &, const OutputPinPtr &, int, const TypedDataPtr &, const TypedDataPtr &, rapidjson::Document &&) override
+  { edges++; }
+};
+
+uint64_t file_size(const std::string &path)
+{
+  struct stat st;
+  if(stat(path.c_str(), &st)!=0){
+    throw std::runtime_error("Couldn't stat '"+path+"'");
+  }
+  return st.st_size;
+}
+
+void bench_graph_persistence(const bench_options_t &opts, const std::string &srcPath, unsigned copies, const std::string &workingDir)
+{
+  GraphRecorder graph;
+  loadGraphPull(nullptr, filepath(srcPath), &graph);
+  if(!graph.m_graphType){
+    throw std::runtime_error("Source file '"+srcPath+"' didn't contain a graph instance.");
+  }
+  uint64_t devices=graph.m_devices.size()*copies;
+  uint64_t edges=graph.m_edges.size()*copies;
+  fprintf(stderr, "Source graph has %u devices and %u edges, benchmarking %u copies.\n",
+    (unsigned)graph.m_devices.size(), (unsigned)graph.m_edges.size(), copies);
+
+  std::string param=std::to_string(devices)+"_devices_"+std::to_string(edges)+"_edges";
+
+  for(std::string format : {"v4", "v3", "base85"}){
+    std::string path=workingDir+"/benchmark_hot_paths_"+format+".xml";
+
+    sax_writer_options wopts;
+    wopts.format=format;
+    {
+      auto writer=createSAXWriterOnFile(path, wopts);
+      graph.replay(writer.get(), copies);
+    }
+    uint64_t bytes=file_size(path);
+
+    // The writer is the same code for every format, but v4 is the default output of every tool
+    if(format=="v4"){
+      measure(opts, "graph_sax_writer_v4", param, bytes, [&](uint64_t n){
+        for(uint64_t i=0; i<n; i++){
+          auto writer=createSAXWriterOnFile(path, wopts);
+          graph.replay(writer.get(), copies);
+        }
+      });
+    }
+
+    measure(opts, "load_graph_pull_"+format, param, bytes, [&](uint64_t n){
+      for(uint64_t i=0; i<n; i++){
+        GraphCounter counter;
+        loadGraphPull(nullptr, filepath(path), &counter);
+        if(counter.devices!=devices || counter.edges!=edges){
+          throw std::runtime_error("Loading "+path+" gave the wrong number of devices or edges.");
+        }
+        g_sink += counter.devices;
+      }
+    });
+
+    unlink(path.c_str());
+  }
+}
+
+void usage()
+{
+  fprintf(stderr, "benchmark_hot_paths [options]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  --filter text : Only run benchmarks whose name/param contains text.\n");
+  fprintf(stderr, "  --min-time secs : Approximate time spent measuring each benchmark (default is 0.5).\n");
+  fprintf(stderr, "  --batches n : Number of timed batches for each benchmark (default is 5).\n");
+  fprintf(stderr, "  --source file : Graph instance used for the graph reading and writing benchmarks\n");
+  fprintf(stderr, "                  (default is apps/ising_spin/ising_spin_8x8.xml).\n");
+  fprintf(stderr, "  --copies n : Number of copies of the source graph in each benchmark graph (default is 64).\n");
+  fprintf(stderr, "  --working-dir dir : Where to put temporary graph files (default is /tmp).\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Results are written to stdout as CSV.\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  try{
+    bench_options_t opts;
+    std::string srcPath="apps/ising_spin/ising_spin_8x8.xml";
+    unsigned copies=64;
+    std::string workingDir="/tmp";
+
+    int ia=1;
+    while(ia < argc){
+      if(!strcmp("--help",argv[ia])){
+        usage();
+      }
+      if(ia+1 >= argc){
+        fprintf(stderr, "Missing argument to %s\n", argv[ia]);
+        usage();
+      }
+      if(!strcmp("--filter",argv[ia])){
+        opts.filter=argv[ia+1];
+      }else if(!strcmp("--min-time",argv[ia])){
+        opts.minTime=strtod(argv[ia+1], 0);
+      }else if(!strcmp("--batches",argv[ia])){
+        opts.batches=std::max(1ul, strtoul(argv[ia+1], 0, 0));
+      }else if(!strcmp("--source",argv[ia])){
+        srcPath=argv[ia+1];
+      }else if(!strcmp("--copies",argv[ia])){
+        copies=std::max(1ul, strtoul(argv[ia+1], 0, 0));
+      }else if(!strcmp("--working-dir",argv[ia])){
+        workingDir=argv[ia+1];
+      }else{
+        fprintf(stderr, "Didn't understand option '%s'\n", argv[ia]);
+        usage();
+      }
+      ia+=2;
+    }
+
+    print_header();
+    bench_base85(opts);
+    bench_typed_data(opts);
+    bench_hash_and_intern(opts);
+    bench_graph_persistence(opts, srcPath, copies, workingDir);
+
+    return 0;
+  }catch(std::exception &e){
+    std::cerr<<"Exception : "<<e.what()<<"\n";
+    exit(1);
+  }catch(...){
+    std::cerr<<"Exception of unknown type\n";
+    exit(1);
+  }
+}
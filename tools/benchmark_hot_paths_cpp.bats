@@ -0,0 +1,15 @@
+load bats_helpers
+
+setup() {
+    make_target bin/benchmark_hot_paths
+}
+
+@test "benchmark_hot_paths produces a CSV row for each benchmark" {
+    WD=$(make_test_wd)
+    bin/benchmark_hot_paths --min-time 0.01 --batches 1 --copies 2 --working-dir $WD > $WD/out.csv
+    head -n 1 $WD/out.csv | grep "^benchmark,param,"
+    for b in base85_encode base85_decode typed_data_to_json typed_data_load typed_data_to_xml_v4 typed_data_load_xml_v4 \
+        poets_hash typed_data_interner_hit graph_sax_writer_v4 load_graph_pull_v3 load_graph_pull_v4 load_graph_pull_base85 ; do
+        grep "^${b}," $WD/out.csv
+    done
+}
@@ -0,0 +1,869 @@
+#define RAPIDJSON_HAS_STDSTRING 1
+#include <rapidjson/document.h>
+#include <rapidjson/prettywriter.h>
+#include <rapidjson/istreamwrapper.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <climits>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+/* Runs the standard app suite at a few scales through each simulator, and
+   records load time, run time, throughput, peak RSS and status as JSON. The
+   result can be compared against a previous result to look for regressions.
+
+   Statuses follow benchmarks/benchmarks_2019/readme.md, so a run is only a
+   success if the app explicitly says so with _HANDLER_EXIT_SUCCESS_9be65737_.
+
+   Instances are generated with the python random module seeded, and are
+   cached in the working directory, so repeated runs against the same working
+   directory see exactly the same graphs. Each instance is hashed, and the hash
+   goes in the output so that comparisons can tell if the inputs changed.
+*/
+
+struct suite_entry_t
+{
+  std::string app;
+  std::string scale;
+  std::string script; // Relative to the repository root
+  std::string args;
+};
+
+// Scales roughly follow benchmarks/small/makefile. The large scales take minutes on epoch_sim.
+static const std::vector<suite_entry_t> g_suite = {
+  {"clock_tree", "small", "apps/clock_tree/create_clock_tree_instance.py", "6 2 100"},
+  {"clock_tree", "medium", "apps/clock_tree/create_clock_tree_instance.py", "10 2 400"},
+  {"clock_tree", "large", "apps/clock_tree/create_clock_tree_instance.py", "14 2 800"},
+
+  {"storm", "small", "apps/storm/create_storm_instance.py", "64 16 64"},
+  {"storm", "medium", "apps/storm/create_storm_instance.py", "1024 16 64"},
+  {"storm", "large", "apps/storm/create_storm_instance.py", "16384 16 64"},
+
+  {"gals_heat", "small", "apps/gals_heat/create_gals_heat_instance.py", "32"},
+  {"gals_heat", "medium", "apps/gals_heat/create_gals_heat_instance.py", "128"},
+  {"gals_heat", "large", "apps/gals_heat/create_gals_heat_instance.py", "512"},
+
+  {"ising_spin", "small", "apps/ising_spin/create_ising_spin_instance.py", "16 1 100"},
+  {"ising_spin", "medium", "apps/ising_spin/create_ising_spin_instance.py", "64 1 100"},
+  {"ising_spin", "large", "apps/ising_spin/create_ising_spin_instance.py", "256 1 100"},
+
+  {"apsp", "small", "apps/apsp/create_apsp_instance.py", "64 8"},
+  {"apsp", "medium", "apps/apsp/create_apsp_instance.py", "256 8"},
+  {"apsp", "large", "apps/apsp/create_apsp_instance.py", "1024 8"},
+
+  {"amg", "small", "apps/amg/make_poisson_graph_instance.py", "16 16"},
+  {"amg", "medium", "apps/amg/make_poisson_graph_instance.py", "64 64"},
+  {"amg", "large", "apps/amg/make_poisson_graph_instance.py", "256 256"}
+};
+
+static const std::vector<std::string> g_scales = {"small", "medium", "large"};
+static const std::vector<std::string> g_simulators = {"graph_sim", "epoch_sim", "queue_sim", "poems"};
+
+// Times below this are dominated by process startup, so are not compared against the baseline
+static const double MIN_COMPARABLE_SECS = 0.1;
+
+std::vector<std::string> split(const std::string &s, char sep)
+{
+  std::vector<std::string> res;
+  std::stringstream src(s);
+  std::string part;
+  while(std::getline(src, part, sep)){
+    if(!part.empty()){
+      res.push_back(part);
+    }
+  }
+  return res;
+}
+
+std::string quote(const std::string &s)
+{
+  if(s.find_first_of(" \t\"'\\$`") == std::string::npos){
+    return s;
+  }
+  std::string res="'";
+  for(char c : s){
+    if(c=='\''){
+      res+="'\\''";
+    }else{
+      res+=c;
+    }
+  }
+  return res+"'";
+}
+
+std::string join_command(const std::vector<std::string> &argv)
+{
+  std::string res;
+  for(const auto &a : argv){
+    if(!res.empty()){
+      res+=" ";
+    }
+    res+=quote(a);
+  }
+  return res;
+}
+
+bool file_exists(const std::string &path)
+{
+  struct stat st;
+  return stat(path.c_str(), &st)==0;
+}
+
+//! FNV-1a over the file contents, so that results can say which inputs they came from
+std::string hash_file(const std::string &path, uint64_t &size)
+{
+  FILE *f=fopen(path.c_str(), "rb");
+  if(!f){
+    throw std::runtime_error("Couldn't open '"+path+"' to hash it.");
+  }
+  uint64_t h=14695981039346656037ull;
+  size=0;
+  char buffer[65536];
+  size_t n;
+  while((n=fread(buffer, 1, sizeof(buffer), f)) > 0){
+    for(size_t i=0; i<n; i++){
+      h=(h ^ (uint8_t)buffer[i]) * 1099511628211ull;
+    }
+    size+=n;
+  }
+  fclose(f);
+  char tmp[32];
+  snprintf(tmp, sizeof(tmp), "%016llx", (unsigned long long)h);
+  return tmp;
+}
+
+struct process_result_t
+{
+  bool timedOut=false;
+  bool exited=false;
+  int exitCode=-1;
+  int signal=0;
+  double wallSecs=0;
+  long peakRssKb=0;
+  std::vector<std::pair<double,std::string>> lines; // Output lines, stamped with seconds since start
+};
+
+/* Runs a command with stdout and stderr captured, and kills it (and anything
+   it started) if it goes over the time limit. If outPath is non-empty then
+   stdout goes there instead. */
+process_result_t run_process(const std::vector<std::string> &argv, const std::vector<std::string> &env, double timeoutSecs, const std::string &outPath=std::string())
+{
+  int fds[2];
+  if(pipe(fds)!=0){
+    throw std::runtime_error("Couldn't create pipe.");
+  }
+
+  auto start=std::chrono::steady_clock::now();
+
+  pid_t pid=fork();
+  if(pid<0){
+    throw std::runtime_error("Couldn't fork.");
+  }
+  if(pid==0){
+    setpgid(0, 0); // New process group, so a timeout can kill the whole tree
+    close(fds[0]);
+    if(!outPath.empty()){
+      int fd=open(outPath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+      if(fd<0){
+        fprintf(stderr, "Couldn't open '%s' for output\n", outPath.c_str());
+        _exit(127);
+      }
+      dup2(fd, 1);
+      close(fd);
+    }else{
+      dup2(fds[1], 1);
+    }
+    dup2(fds[1], 2);
+    close(fds[1]);
+    for(const auto &e : env){
+      putenv(strdup(e.c_str()));
+    }
+    std::vector<char*> args;
+    for(const auto &a : argv){
+      args.push_back((char*)a.c_str());
+    }
+    args.push_back(nullptr);
+    execvp(args[0], &args[0]);
+    fprintf(stderr, "Couldn't execute '%s' : %s\n", args[0], strerror(errno));
+    _exit(127);
+  }
+  setpgid(pid, pid);
+  close(fds[1]);
+
+  process_result_t res;
+  auto elapsed=[&](){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  };
+
+  std::string partial;
+  char buffer[4096];
+  while(true){
+    double left=timeoutSecs-elapsed();
+    if(left<=0){
+      res.timedOut=true;
+      kill(-pid, SIGKILL);
+      break;
+    }
+    struct pollfd pfd{fds[0], POLLIN, 0};
+    int r=poll(&pfd, 1, (int)std::min(1000.0, std::ceil(left*1000)));
+    if(r<0){
+      if(errno==EINTR){
+        continue;
+      }
+      throw std::runtime_error("poll failed.");
+    }
+    if(r==0){
+      continue;
+    }
+    ssize_t n=read(fds[0], buffer, sizeof(buffer));
+    if(n<=0){
+      break;
+    }
+    double t=elapsed();
+    partial.append(buffer, n);
+    size_t pos;
+    while((pos=partial.find('\n')) != std::string::npos){
+      res.lines.emplace_back(t, partial.substr(0, pos));
+      partial.erase(0, pos+1);
+    }
+  }
+  if(!partial.empty()){
+    res.lines.emplace_back(elapsed(), partial);
+  }
+  close(fds[0]);
+
+  int status=0;
+  struct rusage usage;
+  while(wait4(pid, &status, 0, &usage)<0){
+    if(errno!=EINTR){
+      throw std::runtime_error("wait4 failed.");
+    }
+  }
+  if(res.timedOut){
+    kill(-pid, SIGKILL); // Anything left in the group
+  }
+  res.wallSecs=elapsed();
+  res.peakRssKb=usage.ru_maxrss; // Kilobytes on linux
+  if(WIFEXITED(status)){
+    res.exited=true;
+    res.exitCode=WEXITSTATUS(status);
+  }else if(WIFSIGNALED(status)){
+    res.signal=WTERMSIG(status);
+  }
+  return res;
+}
+
+struct options_t
+{
+  std::string root;
+  std::string workingDir;
+  std::set<std::string> apps;
+  std::vector<std::string> scales={"small"};
+  std::vector<std::string> simulators=g_simulators;
+  unsigned repeats=1;
+  double timeout=600;
+  unsigned threads=0;
+  unsigned seed=1;
+  double threshold=10;
+};
+
+struct instance_t
+{
+  std::string path;
+  std::string generator;
+  std::string hash;
+  uint64_t bytes=0;
+  bool ok=false;
+};
+
+struct run_t
+{
+  std::string app, scale, simulator;
+  std::string command;
+  std::string status;
+  int exitCode=-1;
+  double loadSecs=-1;  // Negative if the simulator never said it had loaded
+  double runSecs=-1;
+  double wallSecs=0;
+  double eventsPerSec=-1; // Negative until the simulator's summary line is seen
+  double compileSecs=-1; // Only for POEMS
+  long peakRssKb=0;
+  unsigned repeats=0;
+
+  std::string key() const
+  { return app+"/"+scale+"/"+simulator; }
+};
+
+double median(std::vector<double> x)
+{
+  x.erase(std::remove_if(x.begin(), x.end(), [](double v){ return v<0; }), x.end());
+  if(x.empty()){
+    return -1;
+  }
+  std::sort(x.begin(), x.end());
+  return x.size()%2 ? x[x.size()/2] : 0.5*(x[x.size()/2-1]+x[x.size()/2]);
+}
+
+instance_t generate_instance(const options_t &opts, const suite_entry_t &e)
+{
+  instance_t res;
+  res.path=opts.workingDir+"/"+e.app+"_"+e.scale+".xml";
+
+  // Seed the python random module before the script runs, so that instances are repeatable
+  std::vector<std::string> argv={
+    "python3", "-c",
+    "import random,runpy,sys; random.seed(int(sys.argv[1])); sys.argv=sys.argv[2:]; runpy.run_path(sys.argv[0], run_name='__main__')",
+    std::to_string(opts.seed), opts.root+"/"+e.script
+  };
+  for(const auto &a : split(e.args, ' ')){
+    argv.push_back(a);
+  }
+  res.generator=e.script+" "+e.args;
+
+  if(!file_exists(res.path)){
+    fprintf(stderr, "Generating %s\n", res.path.c_str());
+    std::string tmpPath=res.path+".tmp";
+    auto pr=run_process(argv, {"PYTHONPATH="+opts.root+"/tools"}, opts.timeout, tmpPath);
+    if(pr.timedOut || !pr.exited || pr.exitCode!=0){
+      for(const auto &l : pr.lines){
+        fprintf(stderr, "  %s\n", l.second.c_str());
+      }
+      fprintf(stderr, "Couldn't generate %s\n", res.path.c_str());
+      unlink(tmpPath.c_str());
+      return res;
+    }
+    if(rename(tmpPath.c_str(), res.path.c_str())!=0){
+      throw std::runtime_error("Couldn't rename "+tmpPath);
+    }
+  }
+  res.hash=hash_file(res.path, res.bytes);
+  res.ok=true;
+  return res;
+}
+
+std::vector<std::string> simulator_command(const options_t &opts, const std::string &sim, const std::string &exe, const std::string &instance)
+{
+  std::string bin=opts.root+"/bin/";
+  std::string seed=std::to_string(opts.seed);
+  std::string threads=std::to_string(opts.threads ? opts.threads : std::max(1u, (unsigned)sysconf(_SC_NPROCESSORS_ONLN)));
+  // Log level 2 is the lowest level at which the simulators say when loading has finished,
+  // and print the message count summary at exit
+  if(sim=="graph_sim"){
+    return {bin+"graph_sim", "--log-level", "2", "--set-seed", seed, instance};
+  }else if(sim=="epoch_sim"){
+    return {bin+"epoch_sim", "--log-level", "2", "--stats-delta", std::to_string(INT_MAX), "--rng-seed", seed, instance};
+  }else if(sim=="queue_sim"){
+    return {bin+"queue_sim", "--log-level", "2", "--threads", threads, instance};
+  }else if(sim=="poems"){
+    return {exe, "--threads", threads, instance};
+  }
+  throw std::runtime_error("Unknown simulator '"+sim+"'");
+}
+
+//! Turns the output of one execution into a status and some timings.
+void parse_output(const process_result_t &pr, run_t &run)
+{
+  bool sawSuccess=false, sawFail=false;
+  double messages=-1, simSecs=-1;
+  for(const auto &l : pr.lines){
+    const std::string &s=l.second;
+    if(s.find("_HANDLER_EXIT_SUCCESS_9be65737_")!=std::string::npos){
+      sawSuccess=true;
+    }
+    if(s.find("_HANDLER_EXIT_FAIL_9be65737_")!=std::string::npos){
+      sawFail=true;
+    }
+    if(run.loadSecs<0 && (s=="Loaded" || s.compare(0, 15, "Running, setup=")==0)){
+      run.loadSecs=l.first;
+    }
+    double t, m;
+    if(sscanf(s.c_str(), "Sim time = %lg secs, M messages received = %lg", &t, &m)==2){
+      simSecs=t;
+      messages=m*1e6;
+    }
+  }
+
+  if(pr.timedOut){
+    run.status="timeout";
+  }else if(sawFail){
+    run.status="fail";
+  }else if(sawSuccess && pr.exited && pr.exitCode==0){
+    run.status="success";
+  }else{
+    run.status="error";
+  }
+  run.exitCode=pr.exitCode;
+  run.wallSecs=pr.wallSecs;
+  run.peakRssKb=pr.peakRssKb;
+  if(run.loadSecs>=0){
+    run.runSecs=pr.wallSecs-run.loadSecs;
+  }
+  if(messages>=0 && simSecs>0){
+    run.eventsPerSec=messages/simSecs;
+  }
+  // Every simulator prints the summary at log level 2, so a run without one can't be compared
+  if(run.status=="success" && run.eventsPerSec<0){
+    fprintf(stderr, "No 'Sim time = ...' summary in the output of %s, so events/sec is unknown.\n", run.simulator.c_str());
+    run.status="error";
+  }
+}
+
+run_t run_benchmark(const options_t &opts, const suite_entry_t &e, const instance_t &inst, const std::string &sim)
+{
+  run_t res;
+  res.app=e.app;
+  res.scale=e.scale;
+  res.simulator=sim;
+
+  if(!inst.ok){
+    res.status="error";
+    return res;
+  }
+
+  std::string exe;
+  if(sim=="poems"){
+    exe=opts.workingDir+"/"+e.app+"_"+e.scale+".poems";
+    auto start=std::chrono::steady_clock::now();
+    if(!file_exists(exe)){
+      fprintf(stderr, "Compiling %s\n", exe.c_str());
+      auto pr=run_process(
+        {opts.root+"/tools/poems/compile_poems_sim.sh", "--release", "--working-dir", exe+"_build", inst.path, "-o", exe},
+        {"PYTHONPATH="+opts.root+"/tools"}, opts.timeout
+      );
+      if(pr.timedOut || !pr.exited || pr.exitCode!=0 || !file_exists(exe)){
+        for(const auto &l : pr.lines){
+          fprintf(stderr, "  %s\n", l.second.c_str());
+        }
+        res.status=pr.timedOut ? "timeout" : "error";
+        return res;
+      }
+    }
+    res.compileSecs=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  }
+
+  auto argv=simulator_command(opts, sim, exe, inst.path);
+  res.command=join_command(argv);
+
+  std::vector<double> loads, runs, walls, rates, rss;
+  for(unsigned i=0; i<opts.repeats; i++){
+    fprintf(stderr, "Running %s (%u of %u)\n", res.key().c_str(), i+1, opts.repeats);
+    auto pr=run_process(argv, {"POETS_PROVIDER_PATH="+opts.root+"/providers"}, opts.timeout);
+    run_t r=res;
+    parse_output(pr, r);
+    res.repeats++;
+    if(r.status!="success"){
+      // Keep the first bad run, as it is the one worth looking at
+      auto compileSecs=res.compileSecs;
+      res=r;
+      res.compileSecs=compileSecs;
+      for(unsigned j=pr.lines.size()>20 ? pr.lines.size()-20 : 0; j<pr.lines.size(); j++){
+        fprintf(stderr, "  %s\n", pr.lines[j].second.c_str());
+      }
+      return res;
+    }
+    loads.push_back(r.loadSecs);
+    runs.push_back(r.runSecs);
+    walls.push_back(r.wallSecs);
+    rates.push_back(r.eventsPerSec);
+    rss.push_back(r.peakRssKb);
+    res.status=r.status;
+    res.exitCode=r.exitCode;
+  }
+  res.loadSecs=median(loads);
+  res.runSecs=median(runs);
+  res.wallSecs=median(walls);
+  res.eventsPerSec=median(rates);
+  res.peakRssKb=(long)median(rss);
+  return res;
+}
+
+struct regression_t
+{
+  std::string key;
+  std::string metric;
+  std::string baseline;
+  std::string current;
+  double changePct;
+};
+
+/* Each metric has a direction. Times and memory are worse when they go up,
+   events/sec is worse when it goes down, and any move away from success is
+   always a regression. */
+std::vector<regression_t> compare_with_baseline(const rapidjson::Document &baseline, const std::vector<run_t> &runs, double thresholdPct)
+{
+  std::map<std::string,const rapidjson::Value*> prev;
+  if(baseline.IsObject() && baseline.HasMember("runs") && baseline["runs"].IsArray()){
+    for(const auto &r : baseline["runs"].GetArray()){
+      if(r.IsObject() && r.HasMember("key") && r["key"].IsString()){
+        prev[r["key"].GetString()]=&r;
+      }
+    }
+  }
+
+  std::vector<regression_t> res;
+  for(const auto &r : runs){
+    auto it=prev.find(r.key());
+    if(it==prev.end()){
+      continue;
+    }
+    const rapidjson::Value &b=*it->second;
+
+    std::string prevStatus=b.HasMember("status") && b["status"].IsString() ? b["status"].GetString() : "";
+    if(prevStatus=="success" && r.status!="success"){
+      res.push_back(regression_t{r.key(), "status", prevStatus, r.status, 0.0});
+      continue;
+    }
+    if(r.status!="success"){
+      continue;
+    }
+
+    auto check=[&](const char *metric, double cur, bool higherIsWorse, double minimum){
+      if(!b.HasMember(metric) || !b[metric].IsNumber() || cur<0){
+        return;
+      }
+      double old=b[metric].GetDouble();
+      if(old<=0 || std::max(old,cur) < minimum){
+        return;
+      }
+      double changePct=100.0*(cur-old)/old;
+      if( (higherIsWorse && changePct > thresholdPct) || (!higherIsWorse && changePct < -thresholdPct) ){
+        res.push_back(regression_t{r.key(), metric, std::to_string(old), std::to_string(cur), changePct});
+      }
+    };
+    check("load_secs", r.loadSecs, true, MIN_COMPARABLE_SECS);
+    check("run_secs", r.runSecs, true, MIN_COMPARABLE_SECS);
+    check("events_per_sec", r.eventsPerSec, false, 0);
+    check("peak_rss_kb", r.peakRssKb, true, 0);
+  }
+  return res;
+}
+
+std::string git_commit(const std::string &root)
+{
+  auto pr=run_process({"git", "-C", root, "rev-parse", "HEAD"}, {}, 60);
+  if(pr.exitCode!=0 || pr.lines.empty()){
+    return "unknown";
+  }
+  return pr.lines[0].second;
+}
+
+std::string default_root(const char *argv0)
+{
+  // Assume we are bin/benchmark_simulators within the repository
+  char buffer[PATH_MAX];
+  ssize_t n=readlink("/proc/self/exe", buffer, sizeof(buffer)-1);
+  std::string exe = n>0 ? std::string(buffer, n) : std::string(argv0);
+  auto pos=exe.rfind("/bin/");
+  if(pos==std::string::npos){
+    return ".";
+  }
+  return exe.substr(0, pos);
+}
+
+void usage()
+{
+  fprintf(stderr, "benchmark_simulators [options]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  --apps a,b,... : Which apps to run (default is all of them).\n");
+  fprintf(stderr, "  --scales s,... : Which of small,medium,large to run (default is small).\n");
+  fprintf(stderr, "  --simulators s,... : Which of graph_sim,epoch_sim,queue_sim,poems to use (default is all of them).\n");
+  fprintf(stderr, "  --repeats n : Run each benchmark n times, and report the median (default is 1).\n");
+  fprintf(stderr, "  --timeout secs : Time limit for each generation, compilation and run (default is 600).\n");
+  fprintf(stderr, "  --threads n : Threads for queue_sim and POEMS (default is number of cpus).\n");
+  fprintf(stderr, "  --seed n : Seed for instance generation and the sequential simulators (default is 1).\n");
+  fprintf(stderr, "  --working-dir dir : Where instances and POEMS executables are cached (default is a new temporary directory).\n");
+  fprintf(stderr, "  --root dir : Root of the repository (default is the parent of the directory this executable is in).\n");
+  fprintf(stderr, "  --output file : Where to write the JSON results (default is stdout).\n");
+  fprintf(stderr, "  --baseline file : Previous JSON results to compare against. Exit code is 2 if there are regressions.\n");
+  fprintf(stderr, "  --threshold pct : Percentage change in a metric that counts as a regression (default is 10).\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Apps :");
+  std::string prev;
+  for(const auto &e : g_suite){
+    if(e.app!=prev){
+      fprintf(stderr, " %s", e.app.c_str());
+      prev=e.app;
+    }
+  }
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  try{
+    options_t opts;
+    opts.root=default_root(argv[0]);
+    std::string outputPath, baselinePath;
+
+    int ia=1;
+    auto next_arg=[&](const char *name) -> std::string {
+      if(ia+1 >= argc){
+        fprintf(stderr, "Missing argument to %s\n", name);
+        usage();
+      }
+      std::string res=argv[ia+1];
+      ia+=2;
+      return res;
+    };
+    auto check_names=[&](const char *what, const std::vector<std::string> &names, const std::vector<std::string> &valid){
+      for(const auto &n : names){
+        if(std::find(valid.begin(), valid.end(), n)==valid.end()){
+          fprintf(stderr, "Didn't understand %s '%s'\n", what, n.c_str());
+          usage();
+        }
+      }
+    };
+
+    while(ia < argc){
+      if(!strcmp("--help",argv[ia])){
+        usage();
+      }else if(!strcmp("--apps",argv[ia])){
+        auto apps=split(next_arg("--apps"), ',');
+        std::vector<std::string> valid;
+        for(const auto &e : g_suite){
+          valid.push_back(e.app);
+        }
+        check_names("app", apps, valid);
+        opts.apps.insert(apps.begin(), apps.end());
+      }else if(!strcmp("--scales",argv[ia])){
+        opts.scales=split(next_arg("--scales"), ',');
+        check_names("scale", opts.scales, g_scales);
+      }else if(!strcmp("--simulators",argv[ia])){
+        opts.simulators=split(next_arg("--simulators"), ',');
+        check_names("simulator", opts.simulators, g_simulators);
+      }else if(!strcmp("--repeats",argv[ia])){
+        opts.repeats=std::max(1ul, strtoul(next_arg("--repeats").c_str(), 0, 0));
+      }else if(!strcmp("--timeout",argv[ia])){
+        opts.timeout=strtod(next_arg("--timeout").c_str(), 0);
+      }else if(!strcmp("--threads",argv[ia])){
+        opts.threads=strtoul(next_arg("--threads").c_str(), 0, 0);
+      }else if(!strcmp("--seed",argv[ia])){
+        opts.seed=strtoul(next_arg("--seed").c_str(), 0, 0);
+      }else if(!strcmp("--working-dir",argv[ia])){
+        opts.workingDir=next_arg("--working-dir");
+      }else if(!strcmp("--root",argv[ia])){
+        opts.root=next_arg("--root");
+      }else if(!strcmp("--output",argv[ia])){
+        outputPath=next_arg("--output");
+      }else if(!strcmp("--baseline",argv[ia])){
+        baselinePath=next_arg("--baseline");
+      }else if(!strcmp("--threshold",argv[ia])){
+        opts.threshold=strtod(next_arg("--threshold").c_str(), 0);
+      }else{
+        fprintf(stderr, "Didn't understand option '%s'\n", argv[ia]);
+        usage();
+      }
+    }
+
+    if(opts.workingDir.empty()){
+      char tmp[]="/tmp/benchmark_simulators_XXXXXX";
+      if(!mkdtemp(tmp)){
+        throw std::runtime_error("Couldn't create temporary working directory.");
+      }
+      opts.workingDir=tmp;
+    }else{
+      mkdir(opts.workingDir.c_str(), 0755);
+    }
+    {
+      char buffer[PATH_MAX];
+      if(!realpath(opts.workingDir.c_str(), buffer)){
+        throw std::runtime_error("Working directory '"+opts.workingDir+"' doesn't exist.");
+      }
+      opts.workingDir=buffer;
+      if(!realpath(opts.root.c_str(), buffer)){
+        throw std::runtime_error("Root directory '"+opts.root+"' doesn't exist.");
+      }
+      opts.root=buffer;
+    }
+    fprintf(stderr, "root=%s, working_dir=%s\n", opts.root.c_str(), opts.workingDir.c_str());
+
+    rapidjson::Document baseline;
+    if(!baselinePath.empty()){
+      std::ifstream src(baselinePath);
+      if(!src.is_open()){
+        throw std::runtime_error("Couldn't open baseline '"+baselinePath+"'");
+      }
+      rapidjson::IStreamWrapper isw(src);
+      baseline.ParseStream(isw);
+      if(baseline.HasParseError() || !baseline.IsObject()){
+        throw std::runtime_error("Couldn't parse baseline '"+baselinePath+"'");
+      }
+    }
+
+    rapidjson::Document doc;
+    doc.SetObject();
+    auto &alloc=doc.GetAllocator();
+    auto str=[&](const std::string &s){
+      return rapidjson::Value(s.c_str(), alloc);
+    };
+
+    rapidjson::Value instances(rapidjson::kArrayType);
+    std::vector<run_t> runs;
+    std::set<std::string> timedOut; // app/simulator pairs, so larger scales can be skipped
+
+    // Run scales in increasing order, so that a timeout can skip the larger ones
+    for(const auto &scale : g_scales){
+      if(std::find(opts.scales.begin(), opts.scales.end(), scale)==opts.scales.end()){
+        continue;
+      }
+      for(const auto &e : g_suite){
+        if(e.scale!=scale || (!opts.apps.empty() && !opts.apps.count(e.app))){
+          continue;
+        }
+
+        auto inst=generate_instance(opts, e);
+
+        rapidjson::Value vi(rapidjson::kObjectType);
+        vi.AddMember("app", str(e.app), alloc);
+        vi.AddMember("scale", str(e.scale), alloc);
+        vi.AddMember("generator", str(inst.generator), alloc);
+        vi.AddMember("hash", str(inst.hash), alloc);
+        vi.AddMember("bytes", inst.bytes, alloc);
+        instances.PushBack(vi, alloc);
+
+        for(const auto &sim : opts.simulators){
+          run_t r;
+          if(timedOut.count(e.app+"/"+sim)){
+            r.app=e.app;
+            r.scale=e.scale;
+            r.simulator=sim;
+            r.status="timeout(transitive)";
+          }else{
+            r=run_benchmark(opts, e, inst, sim);
+          }
+          if(r.status=="timeout" || r.status=="timeout(transitive)"){
+            timedOut.insert(e.app+"/"+sim);
+          }
+          fprintf(stderr, "%s : status=%s, load=%.3fs, run=%.3fs, events/sec=%g, peak_rss=%ldKB\n",
+            r.key().c_str(), r.status.c_str(), r.loadSecs, r.runSecs, r.eventsPerSec, r.peakRssKb);
+          runs.push_back(r);
+        }
+      }
+    }
+
+    std::string hostname(256, 0);
+    gethostname(&hostname[0], hostname.size()-1);
+    hostname.resize(strlen(hostname.c_str()));
+
+    doc.AddMember("format", "benchmark_simulators/1", alloc);
+    doc.AddMember("commit", str(git_commit(opts.root)), alloc);
+    doc.AddMember("host", str(hostname), alloc);
+    doc.AddMember("cpus", (unsigned)sysconf(_SC_NPROCESSORS_ONLN), alloc);
+    doc.AddMember("timestamp", (int64_t)time(0), alloc);
+    doc.AddMember("seed", opts.seed, alloc);
+    doc.AddMember("repeats", opts.repeats, alloc);
+    doc.AddMember("instances", instances, alloc);
+
+    auto add_number=[&](rapidjson::Value &v, const char *name, double x){
+      // Missing measurements are null rather than a magic number
+      if(x<0){
+        v.AddMember(rapidjson::StringRef(name), rapidjson::Value(), alloc);
+      }else{
+        v.AddMember(rapidjson::StringRef(name), x, alloc);
+      }
+    };
+
+    rapidjson::Value vruns(rapidjson::kArrayType);
+    for(const auto &r : runs){
+      rapidjson::Value vr(rapidjson::kObjectType);
+      vr.AddMember("key", str(r.key()), alloc);
+      vr.AddMember("app", str(r.app), alloc);
+      vr.AddMember("scale", str(r.scale), alloc);
+      vr.AddMember("simulator", str(r.simulator), alloc);
+      vr.AddMember("command", str(r.command), alloc);
+      vr.AddMember("status", str(r.status), alloc);
+      vr.AddMember("exit_code", r.exitCode, alloc);
+      vr.AddMember("repeats", r.repeats, alloc);
+      add_number(vr, "compile_secs", r.compileSecs);
+      add_number(vr, "load_secs", r.loadSecs);
+      add_number(vr, "run_secs", r.runSecs);
+      add_number(vr, "wall_secs", r.repeats ? r.wallSecs : -1);
+      add_number(vr, "events_per_sec", r.eventsPerSec);
+      add_number(vr, "peak_rss_kb", r.repeats ? (double)r.peakRssKb : -1);
+      vruns.PushBack(vr, alloc);
+    }
+    doc.AddMember("runs", vruns, alloc);
+
+    std::vector<regression_t> regressions;
+    if(!baselinePath.empty()){
+      if(baseline.HasMember("host") && baseline["host"].IsString() && hostname!=baseline["host"].GetString()){
+        fprintf(stderr, "Warning: baseline was measured on host '%s', not '%s'.\n", baseline["host"].GetString(), hostname.c_str());
+      }
+      if(baseline.HasMember("instances") && baseline["instances"].IsArray()){
+        std::map<std::string,std::string> hashes;
+        for(const auto &i : baseline["instances"].GetArray()){
+          hashes[std::string(i["app"].GetString())+"/"+i["scale"].GetString()]=i["hash"].GetString();
+        }
+        for(const auto &i : doc["instances"].GetArray()){
+          auto it=hashes.find(std::string(i["app"].GetString())+"/"+i["scale"].GetString());
+          if(it!=hashes.end() && it->second!=i["hash"].GetString()){
+            fprintf(stderr, "Warning: instance %s/%s is different from the one in the baseline.\n", i["app"].GetString(), i["scale"].GetString());
+          }
+        }
+      }
+
+      regressions=compare_with_baseline(baseline, runs, opts.threshold);
+
+      rapidjson::Value vregs(rapidjson::kArrayType);
+      for(const auto &g : regressions){
+        fprintf(stderr, "Regression : %s %s, baseline=%s, current=%s, change=%.1f%%\n",
+          g.key.c_str(), g.metric.c_str(), g.baseline.c_str(), g.current.c_str(), g.changePct);
+        rapidjson::Value vg(rapidjson::kObjectType);
+        vg.AddMember("key", str(g.key), alloc);
+        vg.AddMember("metric", str(g.metric), alloc);
+        vg.AddMember("baseline", str(g.baseline), alloc);
+        vg.AddMember("current", str(g.current), alloc);
+        vg.AddMember("change_pct", g.changePct, alloc);
+        vregs.PushBack(vg, alloc);
+      }
+      doc.AddMember("baseline", str(baselinePath), alloc);
+      doc.AddMember("threshold_pct", opts.threshold, alloc);
+      doc.AddMember("regressions", vregs, alloc);
+      fprintf(stderr, "Found %u regressions against baseline.\n", (unsigned)regressions.size());
+    }
+
+    rapidjson::StringBuffer buffer;
+    rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
+    doc.Accept(writer);
+
+    if(outputPath.empty()){
+      std::cout<<buffer.GetString()<<"\n";
+      std::cout.flush();
+    }else{
+      std::ofstream dst(outputPath);
+      dst<<buffer.GetString()<<"\n";
+      if(!dst.good()){
+        throw std::runtime_error("Couldn't write to '"+outputPath+"'");
+      }
+    }
+
+    return regressions.empty() ? 0 : 2;
+  }catch(std::exception &e){
+    std::cerr<<"Exception : "<<e.what()<<"\n";
+    exit(1);
+  }catch(...){
+    std::cerr<<"Exception of unknown type\n";
+    exit(1);
+  }
+}
@@ -0,0 +1,22 @@
+load bats_helpers
+
+setup() {
+    make_target bin/benchmark_simulators bin/epoch_sim bin/graph_sim bin/queue_sim clock_tree_provider
+}
+
+@test "benchmark_simulators runs clock_tree on epoch_sim and compares against itself" {
+    WD=$(make_test_wd)
+    bin/benchmark_simulators --apps clock_tree --simulators epoch_sim --working-dir $WD --output $WD/base.json
+    grep '"status": "success"' $WD/base.json
+    # Same instances against its own result shouldn't show a status regression
+    run bin/benchmark_simulators --apps clock_tree --simulators epoch_sim --working-dir $WD --baseline $WD/base.json --threshold 1000 --output $WD/cur.json
+    [[ $status -eq 0 ]]
+    grep '"regressions": \[\]' $WD/cur.json
+}
+
+@test "benchmark_simulators gets events/sec from each sequential simulator" {
+    WD=$(make_test_wd)
+    bin/benchmark_simulators --apps clock_tree --simulators graph_sim,epoch_sim,queue_sim --working-dir $WD --output $WD/base.json
+    [[ $(grep -c '"status": "success"' $WD/base.json) -eq 3 ]]
+    ! grep '"events_per_sec": null' $WD/base.json
+}
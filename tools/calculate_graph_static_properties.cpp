@@ -2,6 +2,7 @@
 #include "graph.hpp"
 
 #include "xml_pull_parser.hpp"
+#include "graph_static_analysis.hpp"
 
 #include <iostream>
 #include <fstream>
@@ -35,6 +36,33 @@ public:
   std::vector<std::vector<unsigned> > incoming_edge_count;
   std::vector<std::vector<unsigned> > outgoing_edge_count;
 
+  // Compact topology for GraphStaticAnalysis, with pins numbered globally
+  struct device_type_info_t
+  {
+    unsigned outputBase;
+    unsigned inputBase;
+  };
+  std::unordered_map<const DeviceType*,device_type_info_t> device_type_info;
+  std::vector<std::string> output_pin_names;
+  std::vector<uint32_t> input_pin_message_bytes;
+  std::vector<uint32_t> input_pin_edge_bytes;
+  std::vector<uint32_t> input_pin_device_bytes;
+  std::vector<GraphStaticAnalysis::edge_t> edges;
+
+  // Partitions recorded in the meta-data by partition_graph_with_metis.py or partition_graph_streaming
+  struct metadata_partition_t
+  {
+    std::string tag;
+    std::string key;
+    unsigned partitions;
+    std::vector<uint32_t> assignment;
+    uint64_t missing=0; // Devices without a valid partition under key
+  };
+  std::vector<metadata_partition_t> metadata_partitions;
+
+  static uint32_t spec_size(const TypedDataSpecPtr &spec)
+  { return spec ? spec->payloadSize() : 0; }
+
 
   virtual bool parseMetaData() const override
   { return true; }
@@ -47,6 +75,21 @@ public:
     for(auto mt : graph->getMessageTypes()){
       message_type_to_edge_count[mt->getId()]=0;
     }
+
+    for(auto dt : graph->getDeviceTypes()){
+      device_type_info_t info{ (unsigned)output_pin_names.size(), (unsigned)input_pin_message_bytes.size() };
+      device_type_info[dt.get()]=info;
+      for(unsigned i=0; i<dt->getOutputCount(); i++){
+        output_pin_names.push_back("<"+dt->getId()+">:"+dt->getOutput(i)->getName());
+      }
+      uint32_t deviceBytes=spec_size(dt->getPropertiesSpec())+spec_size(dt->getStateSpec());
+      for(unsigned i=0; i<dt->getInputCount(); i++){
+        auto ip=dt->getInput(i);
+        input_pin_message_bytes.push_back(spec_size(ip->getMessageType()->getMessageSpec()));
+        input_pin_edge_bytes.push_back(spec_size(ip->getPropertiesSpec())+spec_size(ip->getStateSpec()));
+        input_pin_device_bytes.push_back(deviceBytes);
+      }
+    }
   }
 
   virtual uint64_t onBeginGraphInstance(const GraphTypePtr &graphType,
@@ -59,6 +102,26 @@ public:
     this->id=id;
     this->properties=properties;
     this->metadata=std::move(metadata);
+
+    const char *prefix="dt10.partitions.";
+    if(this->metadata.IsObject() && this->metadata.HasMember("device.keys") && this->metadata["device.keys"].IsObject()){
+      for(const auto &kv : this->metadata["device.keys"].GetObject()){
+        if(!kv.value.IsString()){
+          continue;
+        }
+        std::string tag=kv.value.GetString();
+        if(tag.compare(0, strlen(prefix), prefix)!=0){
+          continue;
+        }
+        metadata_partition_t mp;
+        mp.tag=tag;
+        mp.key=kv.name.GetString();
+        mp.partitions=strtoul(tag.c_str()+strlen(prefix), nullptr, 10);
+        if(mp.partitions>0){
+          metadata_partitions.push_back(std::move(mp));
+        }
+      }
+    }
     return 0;
   }
 
@@ -74,6 +137,17 @@ public:
      incoming_edge_count.push_back(std::vector<unsigned>( dt->getInputCount(), 0 ));
      outgoing_edge_count.push_back(std::vector<unsigned>( dt->getOutputCount(), 0 ));
      device_type_to_instance_count[dt->getId()]++;
+     for(auto &mp : metadata_partitions){
+       uint32_t p=UINT32_MAX;
+       if(metadata.IsObject()){
+         auto it=metadata.FindMember(mp.key.c_str());
+         if(it!=metadata.MemberEnd() && it->value.IsUint() && it->value.GetUint()<mp.partitions){
+           p=it->value.GetUint();
+         }
+       }
+       mp.missing += p==UINT32_MAX;
+       mp.assignment.push_back(p);
+     }
       return total_device_count++;
   }
 
@@ -97,6 +171,12 @@ public:
     outgoing_edge_count.at(srcDevInst).at(srcPin->getIndex())++;
     message_type_to_edge_count[dstPin->getMessageType()->getId()]++;
 
+    edges.push_back({
+      (uint32_t)srcDevInst, (uint32_t)dstDevInst,
+      device_type_info.at(srcDevType.get()).outputBase+srcPin->getIndex(),
+      device_type_info.at(dstDevType.get()).inputBase+dstPin->getIndex()
+    });
+
     // This could be made much cheaper
     std::stringstream tmp;
     tmp<<"<"<<dstDevType->getId()<<">:"<<dstPin->getName()<<"-<"<<srcDevType->getId()<<">:"<<srcPin->getName();
@@ -104,6 +184,36 @@ public:
   }
 };
 
+rapidjson::Value histogram_to_json(const GraphStaticAnalysis::histogram_t &h, rapidjson::Document::AllocatorType &alloc)
+{
+  rapidjson::Value res(rapidjson::kObjectType);
+  for(const auto &kv : h){
+    res.AddMember(rapidjson::Value(GraphStaticAnalysis::histogram_label(kv.first), alloc), rapidjson::Value(uint64_t(kv.second)), alloc);
+  }
+  return res;
+}
+
+rapidjson::Value partition_to_json(const GraphStaticAnalysis::partition_stats_t &ps, uint64_t totalEdges, rapidjson::Document::AllocatorType &alloc)
+{
+  rapidjson::Value res(rapidjson::kObjectType);
+  res.AddMember("partitions", ps.partitions, alloc);
+  res.AddMember("min_partition_size", uint64_t(ps.minSize), alloc);
+  res.AddMember("max_partition_size", uint64_t(ps.maxSize), alloc);
+  res.AddMember("cut_edges", uint64_t(ps.cutEdges), alloc);
+  res.AddMember("cut_fraction", totalEdges ? ps.cutEdges/(double)totalEdges : 0.0, alloc);
+  res.AddMember("communication_volume", uint64_t(ps.communicationVolume), alloc);
+  res.AddMember("max_partition_communication_volume", uint64_t(ps.maxPartitionVolume), alloc);
+  return res;
+}
+
+void usage()
+{
+  fprintf(stderr, "calculate_graph_static_properties [options] path-to-xml [metadata.json]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  --threads n : Threads to use for the analysis (default is all cores).\n");
+  fprintf(stderr, "  --cluster-size n : Report the edge cut of blocks of n consecutive devices. Can be repeated (default 32 and 1024).\n");
+  exit(1);
+}
 
 int main(int argc, char *argv[])
 {
@@ -117,17 +227,51 @@ int main(int argc, char *argv[])
 
     filepath metaPath;
 
-    if(argc>1){
-      srcFileName=std::string(argv[1]);
+    unsigned threads=0;
+    std::vector<uint32_t> clusterSizes;
+
+    std::vector<std::string> positional;
+    int ai=1;
+    while(ai<argc){
+      if(!strcmp(argv[ai], "--help")){
+        usage();
+      }else if(!strcmp(argv[ai], "--threads")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Missing argument to --threads\n");
+          usage();
+        }
+        threads=strtoul(argv[ai+1], 0, 0);
+        ai+=2;
+      }else if(!strcmp(argv[ai], "--cluster-size")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Missing argument to --cluster-size\n");
+          usage();
+        }
+        clusterSizes.push_back(std::max(1ul, strtoul(argv[ai+1], 0, 0)));
+        ai+=2;
+      }else{
+        positional.push_back(argv[ai]);
+        ai++;
+      }
+    }
+    if(positional.size()>2){
+      usage();
+    }
+    if(clusterSizes.empty()){
+      clusterSizes={32, 1024};
+    }
+
+    if(positional.size()>0){
+      srcFileName=positional[0];
       if(srcFileName.native()!="-"){
         srcFileName=absolute(srcFileName);
-        fprintf(stderr,"Reading from '%s' ( = '%s' absolute)\n", argv[1], srcFileName.c_str());
+        fprintf(stderr,"Reading from '%s' ( = '%s' absolute)\n", positional[0].c_str(), srcFileName.c_str());
         srcPath=srcFileName.parent_path();
       }
     }
 
-    if(argc>2){
-      metaPath=filepath(argv[2]);
+    if(positional.size()>1){
+      metaPath=filepath(positional[1]);
     }
 
     GraphInfo graph;
@@ -217,6 +361,72 @@ int main(int argc, char *argv[])
     //out_stats.AddMember("kurtosis", kurtosis(out_acc), info.GetAllocator());
     info.AddMember("outgoing_degree", out_stats, info.GetAllocator());
 
+    fprintf(stderr, "Building CSR\n");
+    if(graph.total_device_count>=UINT32_MAX){
+      throw std::runtime_error("Too many devices for static analysis.");
+    }
+    auto &alloc=info.GetAllocator();
+    GraphStaticAnalysis analysis(threads);
+    auto csr=GraphStaticAnalysis::build(graph.total_device_count, std::move(graph.edges));
+
+    fprintf(stderr, "Analysing degrees\n");
+    auto degrees=analysis.degrees(csr, graph.output_pin_names.size());
+    info.AddMember("in_degree_histogram", histogram_to_json(degrees.inDegree, alloc), alloc);
+    info.AddMember("out_degree_histogram", histogram_to_json(degrees.outDegree, alloc), alloc);
+    rapidjson::Value fanouts(rapidjson::kObjectType);
+    for(unsigned i=0; i<graph.output_pin_names.size(); i++){
+      if(!degrees.fanoutByOutputPin[i].empty()){
+        fanouts.AddMember(rapidjson::Value(graph.output_pin_names[i], alloc), histogram_to_json(degrees.fanoutByOutputPin[i], alloc), alloc);
+      }
+    }
+    info.AddMember("fanout_histogram_by_output_pin", fanouts, alloc);
+
+    fprintf(stderr, "Analysing partitions\n");
+    rapidjson::Value clusterStats(rapidjson::kArrayType);
+    for(auto size : clusterSizes){
+      unsigned k;
+      auto part=GraphStaticAnalysis::clusters(csr.deviceCount, size, k);
+      auto v=partition_to_json(analysis.partition(csr, part, k), graph.total_edge_count, alloc);
+      v.AddMember("cluster_size", size, alloc);
+      clusterStats.PushBack(v, alloc);
+    }
+    info.AddMember("cluster_partitions", clusterStats, alloc);
+
+    rapidjson::Value metadataStats(rapidjson::kObjectType);
+    rapidjson::Value metadataSkipped(rapidjson::kObjectType);
+    for(const auto &mp : graph.metadata_partitions){
+      if(mp.missing){
+        fprintf(stderr, "Skipping partition %s, as %llu devices don't have a valid key %s\n", mp.tag.c_str(), (unsigned long long)mp.missing, mp.key.c_str());
+        rapidjson::Value v(rapidjson::kObjectType);
+        v.AddMember("key", rapidjson::Value(mp.key, alloc), alloc);
+        v.AddMember("partitions", mp.partitions, alloc);
+        v.AddMember("devices_missing", mp.missing, alloc);
+        metadataSkipped.AddMember(rapidjson::Value(mp.tag, alloc), v, alloc);
+        continue;
+      }
+      auto v=partition_to_json(analysis.partition(csr, mp.assignment, mp.partitions), graph.total_edge_count, alloc);
+      metadataStats.AddMember(rapidjson::Value(mp.tag, alloc), v, alloc);
+    }
+    info.AddMember("metadata_partitions", metadataStats, alloc);
+    info.AddMember("metadata_partitions_skipped", metadataSkipped, alloc);
+
+    fprintf(stderr, "Analysing reuse distance\n");
+    auto reuse=analysis.reuse_distance(csr);
+    rapidjson::Value reuseStats(rapidjson::kObjectType);
+    reuseStats.AddMember("accesses", uint64_t(reuse.accesses), alloc);
+    reuseStats.AddMember("cold", uint64_t(reuse.cold), alloc);
+    reuseStats.AddMember("mean", reuse.meanDistance, alloc);
+    reuseStats.AddMember("histogram", histogram_to_json(reuse.histogram, alloc), alloc);
+    info.AddMember("delivery_reuse_distance", reuseStats, alloc);
+
+    auto bytes=analysis.bytes_per_delivery(csr, graph.input_pin_message_bytes, graph.input_pin_edge_bytes, graph.input_pin_device_bytes);
+    rapidjson::Value bytesStats(rapidjson::kObjectType);
+    bytesStats.AddMember("total", bytes.total(), alloc);
+    bytesStats.AddMember("message", bytes.message, alloc);
+    bytesStats.AddMember("edge", bytes.edge, alloc);
+    bytesStats.AddMember("device", bytes.device, alloc);
+    info.AddMember("bytes_per_delivery", bytesStats, alloc);
+
 
     rapidjson::StringBuffer buffer;
     rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
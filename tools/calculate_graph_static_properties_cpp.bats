@@ -0,0 +1,36 @@
+load bats_helpers
+
+setup() {
+    make_target bin/calculate_graph_static_properties bin/partition_graph_streaming
+}
+
+@test "calculate_graph_static_properties reports locality metrics for a partitioned graph" {
+    WD=$(make_test_wd)
+    bin/partition_graph_streaming --partitions 4 --generate clock_tree:4,2,10 $WD/a.xml
+    bin/calculate_graph_static_properties --threads 2 --cluster-size 8 $WD/a.xml > $WD/a.json
+    python3 -c "
+import json, sys
+info=json.load(open('$WD/a.json'))
+assert info['cluster_partitions'][0]['cluster_size']==8
+assert info['metadata_partitions_skipped']=={}
+p=info['metadata_partitions']['dt10.partitions.4']
+assert p['partitions']==4 and p['cut_edges']<=info['total_edges']
+assert info['delivery_reuse_distance']['accesses']==info['total_edges']
+assert info['bytes_per_delivery']['total']>=0
+"
+}
+
+@test "calculate_graph_static_properties reports partitions which some devices are missing" {
+    WD=$(make_test_wd)
+    bin/partition_graph_streaming --partitions 4 --generate clock_tree:4,2,10 $WD/a.xml
+    # Drop the partition of the first device
+    sed '0,/<M>[^<]*<\/M>/s///' $WD/a.xml > $WD/b.xml
+    bin/calculate_graph_static_properties $WD/b.xml > $WD/b.json
+    python3 -c "
+import json
+info=json.load(open('$WD/b.json'))
+assert 'dt10.partitions.4' not in info['metadata_partitions']
+s=info['metadata_partitions_skipped']['dt10.partitions.4']
+assert s['partitions']==4 and s['devices_missing']==1
+"
+}
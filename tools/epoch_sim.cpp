@@ -19,8 +19,10 @@
 #include <chrono>
 
 #include "fenv_control.hpp"
+#include "graph_generators.hpp"
 
 #include "poets_protocol/InProcessBinaryUpstreamConnection.hpp"
+#include "inproc_ring_connection.hpp"
 
 #include <cstring>
 #include <cstdlib>
@@ -31,7 +33,7 @@ static unsigned messageInit;
 
 
 struct InProcMessageBuffer
-  : public InProcessBinaryUpstreamConnection
+  : public InProcExternalServer
 {
   const unsigned MAX_EXT2INT_IN_FLIGHT = 65536;
   const unsigned MAX_INT2EXT_IN_FLIGHT = 65536;
@@ -43,16 +45,6 @@ struct InProcMessageBuffer
     unsigned sendIndex;
   };
 
-  std::function<void(const std::string &graph_type,const std::string &graph_instance,const std::vector<std::pair<std::string,std::string>> &owned)> m_connect;
-  std::function<size_t (size_t cbBuffer, void *pBuffer)> m_getGraphProperties;
-  std::function<size_t(poets_device_address_t address, size_t cbBuffer, void *pBuffer)> m_getDeviceProperties;
- 
-  std::function<poets_device_address_t(const std::string &s)> m_idToAddress;
-  std::function<std::string(poets_device_address_t)> m_addressToId;
-  std::function<void(poets_endpoint_address_t,std::vector<poets_endpoint_address_t>&)> m_endpointToFanout;
-
-  std::mutex m_mutex;
-  std::condition_variable m_cond;
   std::queue<message> m_ext2int;
   std::queue<message> m_int2ext;
 
@@ -60,16 +52,40 @@ struct InProcMessageBuffer
 
   std::shared_ptr<halt_message_type> m_halt;
 
-  void post_message(poets_endpoint_address_t address, std::vector<uint8_t> &payload, unsigned sendIndex)
+  InProcMessageBuffer()
+  {
+    m_logLevel=logLevel;
+  }
+
+  void post_message(poets_endpoint_address_t address, const uint8_t *payload, unsigned size, unsigned sendIndex) override
   {
     std::unique_lock<std::mutex> lk(m_mutex);
-    m_int2ext.push(message{address,payload,sendIndex});
+    m_int2ext.push(message{address,std::vector<uint8_t>(payload, payload+size),sendIndex});
     if(m_waiting>0){
       m_cond.notify_all();
     }
   }
 
-  void wait_for_client_to_send()
+  unsigned drain_incoming(const std::function<void(poets_endpoint_address_t,const uint8_t*,unsigned,unsigned)> &f) override
+  {
+    std::queue<message> pending;
+    {
+      std::unique_lock<std::mutex> lk(m_mutex);
+      std::swap(pending, m_ext2int);
+      if(!pending.empty()){
+        m_cond.notify_one();
+      }
+    }
+    unsigned n=pending.size();
+    while(!pending.empty()){
+      const auto &m=pending.front();
+      f(m.address, m.payload.empty() ? nullptr : &m.payload[0], m.payload.size(), m.sendIndex);
+      pending.pop();
+    }
+    return n;
+  }
+
+  void wait_for_client_to_send() override
   {
     std::unique_lock<std::mutex> lk(m_mutex);
     m_waiting++;
@@ -79,7 +95,7 @@ struct InProcMessageBuffer
     m_waiting--;
   }
 
-  void wait_for_client_to_drain()
+  void wait_for_client_to_drain() override
   {
     std::unique_lock<std::mutex> lk(m_mutex);
     if(m_int2ext.size() < MAX_INT2EXT_IN_FLIGHT){
@@ -94,53 +110,19 @@ struct InProcMessageBuffer
     m_waiting--;
   }
 
-  void set_halt_message(TypedDataPtr message)
+  void set_halt_message(const halt_message_type &halt) override
   {
-    if(message.payloadSize()!=sizeof(halt_message_type)){
-      throw std::runtime_error("Received a halt message of the wrong size (internal error?)");
-    }
-
-    fprintf(stderr, "set_halt_message - code=%u\n", ((halt_message_type*)message.payloadPtr())->code);
+    fprintf(stderr, "set_halt_message - code=%u\n", halt.code);
 
     std::unique_lock<std::mutex> lk(m_mutex);
     assert(!m_halt);
-    m_halt.reset(new halt_message_type());
-    memcpy(m_halt.get(), message.payloadPtr(), sizeof(halt_message_type));
+    m_halt.reset(new halt_message_type(halt));
     m_cond.notify_all();
   }
 
   ////////////////////////////////////
   // Client interface
 
-    virtual void connect(
-        const std::string &graph_type,      //! Regex for matching graph type, or empty
-        const std::string &graph_instance,  //! Regex for matching graph instance, or empty
-        const std::vector<std::pair<std::string,std::string>> &owned    //! Vector of (device_id,device_type) pairs
-    ) {
-      std::unique_lock<std::mutex> lk;
-      if(!m_connect){
-        throw std::runtime_error("connect was called twice.");
-      }
-      m_connect(graph_type, graph_instance, owned);
-      m_connect=nullptr;
-    }
-
-    size_t get_graph_properties(size_t cbBuffer, void *pBuffer) override
-    { return m_getGraphProperties(cbBuffer, pBuffer); }
-
-    size_t get_device_properties(poets_device_address_t address, size_t cbBuffer, void *pBuffer) override
-    { return m_getDeviceProperties(address, cbBuffer, pBuffer); }
-
-    poets_device_address_t get_device_address(const std::string &id) override
-    { return m_idToAddress(id); }
-
-    std::string get_device_id(poets_device_address_t address) override
-    { return m_addressToId(address); }
-
-    void get_endpoint_destinations(poets_endpoint_address_t source, std::vector<poets_endpoint_address_t> &destinations) override
-    { m_endpointToFanout(source, destinations); }
-
-
     bool can_send() override
     {
       std::unique_lock<std::mutex> lk(m_mutex);
@@ -245,20 +227,6 @@ struct InProcMessageBuffer
       m_waiting--;
       return Events(res);
     }
-
-    virtual void external_log(
-        int level,
-        const char *msg,
-        ...
-    ){
-      if(level < (int)logLevel){
-        va_list va;
-        va_start(va, msg);
-        vfprintf(stderr, msg, va);
-        va_end(va);
-        fputs("\n", stderr);
-      }
-    }
 };
 
 
@@ -359,7 +327,7 @@ struct EpochSim
   bool m_deviceExitCode=0;
   std::function<void (const char*,int)> m_onDeviceExit;
 
-  std::shared_ptr<InProcMessageBuffer> m_pExternalBuffer;
+  std::shared_ptr<InProcExternalServer> m_pExternalBuffer;
 
   SupervisorTypePtr m_supervisorType;
   std::shared_ptr<SupervisorInstance> m_supervisor;
@@ -626,6 +594,7 @@ struct EpochSim
   double m_statsShearSum=0;
   double m_statsShearSumSqr=0;
   double m_statsShearMax=0;
+  uint64_t m_statsRecvTotal=0; // Never reset, for the summary at exit
   unsigned m_epoch=0;
 
 //Generate either a zero initialised message, or a random message based on
@@ -724,6 +693,7 @@ struct EpochSim
       auto &slot=in[out.dstPinSlot];
 
       slot.firings++;
+      m_statsRecvTotal++;
 
       if(srcEpoch!=m_epoch){
         double shear=m_epoch-srcEpoch;
@@ -787,18 +757,9 @@ struct EpochSim
 
     /// Drain any incoming external messages first;
     if(m_pExternalBuffer){
-        std::queue<InProcMessageBuffer::message> pending;
-        {
-          std::unique_lock<std::mutex> lk(m_pExternalBuffer->m_mutex);
-          std::swap(pending, m_pExternalBuffer->m_ext2int);
-          if(!pending.empty()){
-            m_pExternalBuffer->m_cond.notify_one();
-          }
-        }
-        while(!pending.empty()){
-          const auto &m=pending.front();
-          unsigned devIndex=getEndpointDevice(m.address).value;
-          unsigned portIndex=getEndpointPin(m.address).value;
+        m_pExternalBuffer->drain_incoming([&](poets_endpoint_address_t address, const uint8_t *payload, unsigned size, unsigned rawSendIndex){
+          unsigned devIndex=getEndpointDevice(address).value;
+          unsigned portIndex=getEndpointPin(address).value;
           if(devIndex>=m_devices.size()){
             throw std::runtime_error("External connection sent message from non-existent external address.");
           }
@@ -810,20 +771,18 @@ struct EpochSim
             throw std::runtime_error("External connection sent message from an invalid output port address.");
           }
           auto port=dev.type->getOutput(portIndex);
-          int sendIndex=m.sendIndex==UINT_MAX ? -1 : m.sendIndex;
+          int sendIndex=rawSendIndex==UINT_MAX ? -1 : rawSendIndex;
           if( (sendIndex!=-1) != port->isIndexedSend() ){
             throw std::runtime_error("External connection sent message where sendIndex did not match indexed type of port.");
           }
           auto spec=port->getMessageType()->getMessageSpec();
-          if(spec->payloadSize() != m.payload.size()){
+          if(spec->payloadSize() != size){
             throw std::runtime_error("External connection sent message where payload size did not match type's payload size.");
           }
           TypedDataPtr p=spec->create();
-          memcpy(p.payloadPtr(), &m.payload.at(0), p.payloadSize());
+          memcpy(p.payloadPtr(), payload, p.payloadSize());
           dev.post_message(portIndex, p, sendIndex);
-          
-          pending.pop();
-        }
+        });
 
         // Also make sure that we don't have huge numbers of messages building
         // up that the client hasn't drained
@@ -1098,7 +1057,7 @@ struct EpochSim
             throw std::runtime_error("Receive halt message with the wrong size.");
           } 
           if(!m_haltMessage){
-            m_pExternalBuffer->set_halt_message(message);
+            m_pExternalBuffer->set_halt_message(*(const halt_message_type*)message.payloadPtr());
             m_haltMessage=message;
           }
           continue;
@@ -1129,10 +1088,12 @@ struct EpochSim
       if(sendToExternalConnection){
         assert(m_pExternalBuffer);
         // At least one external device needs to receive this message
-        auto payload=std::vector<uint8_t>( message.payloadPtr(), message.payloadPtr()+message.payloadSize() );
-        m_pExternalBuffer->post_message(makeEndpoint(poets_device_address_t{index}, poets_pin_index_t{(unsigned)sel}), payload, sendIndex ? *sendIndex : UINT_MAX);
+        m_pExternalBuffer->post_message(makeEndpoint(poets_device_address_t{index}, poets_pin_index_t{(unsigned)sel}), message.payloadPtr(), message.payloadSize(), sendIndex ? *sendIndex : UINT_MAX);
       }
     }
+    if(m_pExternalBuffer){
+      m_pExternalBuffer->flush_posted();
+    }
     ++m_epoch;
     return sent || anyReady || !m_delayed.empty();
   }
@@ -1156,11 +1117,14 @@ void usage()
   fprintf(stderr, "  --rng-seed seed\n");
   fprintf(stderr, "  --accurate-assertions : Capture device state before send/recv in case of assertions.\n");
   fprintf(stderr, "  --message-init n: 0 (default) - Zero initialise all messages, 1 - All messages are randomly inisitalised, 2 - Randomly zero or random inisitalise\n");
+  fprintf(stderr, "  --generate spec : Generate the graph in-process rather than loading a file, e.g. clock_tree:6,2,100\n");
+  fprintf(stderr, "  --external-transport queue|ring : How in-proc externals are connected. Default is queue.\n");
   fprintf(stderr, "  --external spec [args]* : External spec, plus any args. Must be the last option\n");
   fprintf(stderr, "\n");
   fprintf(stderr, "External spec could be:\n");
   fprintf(stderr, "  PROVIDER - Take the default in-proc external from the provider.\n");
   fprintf(stderr, "  INPROC:<PATH> - Load the shared object and instantiate InProcessBinaryUpstreamConnection.\n");
+  fprintf(stderr, "  SHM:<NAME> - Create shared memory rings called NAME, and wait for another process to attach with ShmRingClient.\n");
   fprintf(stderr, "\n");
   fprintf(stderr,"   For directly instantiated providers the startup arguments can be");
   fprintf(stderr,"   provided by arguments following the external spec.\n");
@@ -1201,6 +1165,7 @@ int main(int argc, char *argv[])
     DisableDenormals();
 
     std::string srcFilePath="";
+    std::string generateSpec;
 
     std::string snapshotSinkName;
     unsigned snapshotDelta=0;
@@ -1223,6 +1188,7 @@ int main(int argc, char *argv[])
 
     std::string externalSpec;
     std::vector<std::string> externalArgs;
+    std::string externalTransport="queue";
 
     int ia=1;
     while(ia < argc){
@@ -1317,6 +1283,24 @@ int main(int argc, char *argv[])
       }else if(!strcmp("--expect-idle-exit",argv[ia])){
         expectIdleExit=true;
         ia+=1;
+      }else if(!strcmp("--generate",argv[ia])){
+        if(ia+1 >= argc){
+          fprintf(stderr, "Missing argument to --generate\n");
+          usage();
+        }
+        generateSpec=argv[ia+1];
+        ia+=2;
+      }else if(!strcmp("--external-transport",argv[ia])){
+        if(ia+1 >= argc){
+          fprintf(stderr, "Missing argument to --external-transport\n");
+          usage();
+        }
+        externalTransport=argv[ia+1];
+        if(externalTransport!="queue" && externalTransport!="ring"){
+          fprintf(stderr, "Didn't understand external transport '%s'.\n", externalTransport.c_str());
+          usage();
+        }
+        ia+=2;
       }else if(!strcmp("--external",argv[ia])){
         if(ia+1 >= argc){
           fprintf(stderr, "Missing specification to --external\n");
@@ -1352,7 +1336,11 @@ int main(int argc, char *argv[])
     if(srcFilePath.empty()){
       srcFilePath="-";
     }
-    if(srcFilePath!="-"){
+    if(!generateSpec.empty()){
+      if(logLevel>1){
+        fprintf(stderr,"Generating graph from '%s'\n", generateSpec.c_str());
+      }
+    }else if(srcFilePath!="-"){
       filepath p(srcFilePath);
       p=absolute(p);
       if(logLevel>1){
@@ -1366,7 +1354,7 @@ int main(int argc, char *argv[])
       }
       parser.parse_stream(std::cin);
     }
-    if(logLevel>1){
+    if(logLevel>1 && generateSpec.empty()){
       fprintf(stderr, "Parsed XML\n");
     }
 
@@ -1376,8 +1364,16 @@ int main(int argc, char *argv[])
 
     EpochSim graph;
 
+    bool externalIsShm = externalSpec.substr(0,4)=="SHM:";
+    std::shared_ptr<InProcRingConnection> externalRing;
     if(!externalSpec.empty()){
-      graph.m_pExternalBuffer=std::make_shared<InProcMessageBuffer>();
+      if(externalIsShm || externalTransport=="ring"){
+        externalRing=std::make_shared<InProcRingConnection>();
+        externalRing->m_logLevel=logLevel;
+        graph.m_pExternalBuffer=externalRing;
+      }else{
+        graph.m_pExternalBuffer=std::make_shared<InProcMessageBuffer>();
+      }
     }
 
     if(!logSinkName.empty()){
@@ -1385,11 +1381,26 @@ int main(int argc, char *argv[])
       g_pLog=graph.m_log;
     }
 
-    loadGraph(&registry, srcPath, parser.get_document()->get_root_node(), &graph);
+    if(!generateSpec.empty()){
+      generateGraph(&registry, generateSpec, &graph);
+    }else{
+      loadGraph(&registry, srcPath, parser.get_document()->get_root_node(), &graph);
+    }
     if(logLevel>1){
       fprintf(stderr, "Loaded\n");
     }
 
+    // Same format as POEMS, so that benchmark_simulators can parse either
+    auto runStart=std::chrono::steady_clock::now();
+    auto print_throughput=[&]()
+    {
+      if(logLevel>1){
+        double secs=std::chrono::duration<double>(std::chrono::steady_clock::now()-runStart).count();
+        double messages=graph.m_statsRecvTotal;
+        fprintf(stderr, "Sim time = %g secs, M messages received = %f, MReceive/sec = %f\n", secs, messages/1e6, messages/secs/1e6);
+      }
+    };
+
     if(snapshotDelta!=0){
       snapshotWriter.reset(new SnapshotWriterToFile(snapshotSinkName.c_str()));
     }
@@ -1445,41 +1456,10 @@ int main(int argc, char *argv[])
         }
       };
 
-    }
-
-    std::thread inProcExternalThread;
-
-    if(!externalSpec.empty()){
-      in_proc_external_main_t pProc=nullptr;
-
-      if(externalSpec.substr(0, 7)=="INPROC:"){
-        std::string so_path=externalSpec.substr(7);
-        fprintf(stderr, "Loading inproc external from %s\n", so_path.c_str());
-        void *hExternalObj=dlopen(so_path.c_str(), RTLD_NOW);
-        if(!hExternalObj){
-          throw std::runtime_error("Couldn't open shared object file "+so_path);
-        }
-
-        pProc=(in_proc_external_main_t)dlsym(hExternalObj, "poets_in_proc_external_main");
-        if(!pProc){
-          throw std::runtime_error("Couldn't find symbol 'poets_in_proc_external_main' in shared object.");
-        }
-        fprintf(stderr, "Found non-null inproc external in %s at %p\n", so_path.c_str(), pProc);
-      }else if(externalSpec=="PROVIDER"){
-        fprintf(stderr, "Loading default inproc external from provider\n");
-        pProc=graph.m_graphType->getDefaultInProcExternalProcedure();
-        if(pProc==nullptr){
-          throw std::runtime_error("Provider did not contain an in-proc external (is it dynamic? You might need to compiler the provider.)");
-        }
-      }else{
-        throw std::runtime_error("Didn't understand external spec: "+externalSpec);
-      }
-
-      bool connected=false;
-
+      // Applies to both in-process and shared memory externals
       graph.m_pExternalBuffer->m_connect = [&](const std::string &graphType, const std::string &graphInst, const std::vector<std::pair<std::string,std::string> > &owned)
       {
-        fprintf(stderr, "Recevied call to connect from inproc external.\n");
+        fprintf(stderr, "Recevied call to connect from external.\n");
         if(!std::regex_match(graph.m_graphType->getId(), std::regex(graphType))){
           throw std::runtime_error("Graph type of "+graph.m_graphType->getId()+" does not match externals type of "+graphType);
         }
@@ -1487,7 +1467,7 @@ int main(int argc, char *argv[])
           throw std::runtime_error("Graph instance of "+graph.m_graphType->getId()+" does not match externals type of "+graphType);
         }
 
-        fprintf(stderr, "Checking owned externals and types from inproc external connection against graph instance.\n");
+        fprintf(stderr, "Checking owned externals and types from external connection against graph instance.\n");
         std::unordered_set<unsigned> foundIndices;
         for(auto i_v : owned){
           if(i_v.first=="__halt__"){
@@ -1511,13 +1491,76 @@ int main(int argc, char *argv[])
         }
         if(foundIndices != graph.m_externalIndices){
           // TODO: is this really an error?
-          throw std::runtime_error("Inproc external did not bind to the complete set of externals.");
+          throw std::runtime_error("External did not bind to the complete set of externals.");
         }
-
-        connected=true;
-        graph.m_pExternalBuffer->m_cond.notify_one(); // We are still under lock here
       };
-      
+
+    }
+
+    if(externalRing){
+      unsigned maxPayload=0;
+      for(const auto &mt : graph.m_graphType->getMessageTypes()){
+        maxPayload=std::max(maxPayload, (unsigned)mt->getMessageSpec()->payloadSize());
+      }
+      maxPayload=std::max(maxPayload, (unsigned)sizeof(halt_message_type));
+
+      if(!externalIsShm){
+        externalRing->create_heap(InProcRingConnection::DEFAULT_CAPACITY, maxPayload);
+      }else{
+        std::string shmName=externalSpec.substr(4);
+
+        std::vector<InProcRingConnection::directory_entry> entries;
+        std::vector<std::pair<std::string,size_t>> sizes;
+        for(unsigned index : graph.m_externalIndices){
+          const auto &dev=graph.m_devices[index];
+          InProcRingConnection::directory_entry e;
+          e.address=poets_device_address_t{dev.index};
+          e.id=dev.id;
+          if(dev.properties){
+            e.properties.assign(dev.properties.payloadPtr(), dev.properties.payloadPtr()+dev.properties.payloadSize());
+          }
+          sizes.push_back({e.id, e.properties.size()});
+          entries.push_back(std::move(e));
+        }
+        std::vector<uint8_t> graphProperties;
+        if(graph.m_graphProperties){
+          graphProperties.assign(graph.m_graphProperties.payloadPtr(), graph.m_graphProperties.payloadPtr()+graph.m_graphProperties.payloadSize());
+        }
+
+        externalRing->create_shm(shmName, InProcRingConnection::directory_bytes(sizes, graphProperties.size()), InProcRingConnection::connect_bytes(sizes), InProcRingConnection::DEFAULT_CAPACITY, maxPayload);
+        externalRing->publish_directory(entries, graphProperties);
+        fprintf(stderr, "Created shared memory rings '%s', waiting for external process to attach.\n", shmName.c_str());
+      }
+    }
+
+    std::thread inProcExternalThread;
+
+    if(!externalSpec.empty() && !externalIsShm){
+      in_proc_external_main_t pProc=nullptr;
+
+      if(externalSpec.substr(0, 7)=="INPROC:"){
+        std::string so_path=externalSpec.substr(7);
+        fprintf(stderr, "Loading inproc external from %s\n", so_path.c_str());
+        void *hExternalObj=dlopen(so_path.c_str(), RTLD_NOW);
+        if(!hExternalObj){
+          throw std::runtime_error("Couldn't open shared object file "+so_path);
+        }
+
+        pProc=(in_proc_external_main_t)dlsym(hExternalObj, "poets_in_proc_external_main");
+        if(!pProc){
+          throw std::runtime_error("Couldn't find symbol 'poets_in_proc_external_main' in shared object.");
+        }
+        fprintf(stderr, "Found non-null inproc external in %s at %p\n", so_path.c_str(), pProc);
+      }else if(externalSpec=="PROVIDER"){
+        fprintf(stderr, "Loading default inproc external from provider\n");
+        pProc=graph.m_graphType->getDefaultInProcExternalProcedure();
+        if(pProc==nullptr){
+          throw std::runtime_error("Provider did not contain an in-proc external (is it dynamic? You might need to compiler the provider.)");
+        }
+      }else{
+        throw std::runtime_error("Didn't understand external spec: "+externalSpec);
+      }
+
       graph.m_pExternalBuffer->m_getGraphProperties=[&](size_t cbBuffer, void *pBuffer) -> size_t
       {
         if(cbBuffer < graph.m_graphProperties.payloadSize()){
@@ -1544,14 +1587,16 @@ int main(int argc, char *argv[])
           fargv.push_back( x.c_str() );
         }
         pProc(*graph.m_pExternalBuffer, fargv.size(), &fargv[0]);
+        // Externals often finish by sending a halt, which a batching transport may still be holding
+        graph.m_pExternalBuffer->flush();
       });
 
-      fprintf(stderr, "Waiting for inproc external to call 'connect'\n");
-      {
-        std::unique_lock<std::mutex> lk(graph.m_pExternalBuffer->m_mutex);
-        graph.m_pExternalBuffer->m_cond.wait(lk, [&]{ return connected; });
-      }
-      fprintf(stderr, "Inproc external is connected.\n");
+    }
+
+    if(graph.m_pExternalBuffer){
+      fprintf(stderr, "Waiting for external to call 'connect'\n");
+      graph.m_pExternalBuffer->wait_for_connect();
+      fprintf(stderr, "External is connected.\n");
     }
 
     graph.init();
@@ -1598,6 +1643,7 @@ int main(int argc, char *argv[])
       }
 
       if(graph.m_deviceExitCalled){
+        print_throughput();
         exit(graph.m_deviceExitCode);
       }
 
@@ -1627,6 +1673,7 @@ int main(int argc, char *argv[])
     if(logLevel>1){
       fprintf(stderr, "Done\n");
     }
+    print_throughput();
 
     if(inProcExternalThread.joinable()){
       fprintf(stderr, "Joining with in-proc external thread.\n");
@@ -61,3 +61,29 @@ setup() {
         echo $output | grep "application_exit(0)"
     done
 }
+
+@test "epoch_sim runs test_external_ping_pong over the ring transport" {
+    make_target test_external_ping_pong_provider
+    run bin/epoch_sim --external-transport ring apps/tests/externals/test_external_ping_pong_graph_inst_1.xml --external INPROC:providers/test_external_ping_pong.external.so
+    [[ $status -eq 0 ]]
+}
+
+@test "epoch_sim runs test_external_ping_pong with a shared memory external" {
+    make_target test_external_ping_pong_provider bin/test_shm_ring_client
+    NAME=/epoch_sim_bats_$$
+    bin/epoch_sim apps/tests/externals/test_external_ping_pong_graph_inst_1.xml --external SHM:$NAME &
+    SIM=$!
+    bin/test_shm_ring_client $NAME
+    wait $SIM
+}
+
+@test "epoch_sim rejects a shared memory external that binds the wrong device type" {
+    make_target test_external_ping_pong_provider bin/test_shm_ring_client
+    NAME=/epoch_sim_bats_bad_$$
+    bin/epoch_sim apps/tests/externals/test_external_ping_pong_graph_inst_1.xml --external SHM:$NAME &
+    SIM=$!
+    run bin/test_shm_ring_client $NAME not_a_type
+    [[ $status -ne 0 ]]
+    run wait $SIM
+    [[ $status -ne 0 ]]
+}
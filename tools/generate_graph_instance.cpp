@@ -0,0 +1,112 @@
+#include "graph.hpp"
+
+#include "graph_persist_sax_writer.hpp"
+#include "graph_generators.hpp"
+
+#include <iostream>
+#include <thread>
+
+void usage()
+{
+  fprintf(stderr, "generate_graph_instance spec [--v4 path] [--v3 path] [--base85 path] [--compress]\n");
+  fprintf(stderr, "generate_graph_instance --list\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  spec : generator and parameters, e.g. clock_tree:6,2,100\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Each output is written by a separate thread, which runs the generator\n");
+  fprintf(stderr, "independently. With no outputs, v4 is written to stdout.\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  try{
+    std::string spec;
+    std::vector<std::pair<std::string,std::string>> outputs; // (format,path)
+    bool compress=false;
+
+    int ia=1;
+    while(ia < argc){
+      std::string arg(argv[ia]);
+      if(arg=="--help"){
+        usage();
+      }else if(arg=="--list"){
+        for(auto g : GraphGeneratorRegistry::instance().generators()){
+          fprintf(stdout, "%s : %s (graph type %s)\n", g->name().c_str(), g->parameters().c_str(), g->graphTypeId().c_str());
+        }
+        return 0;
+      }else if(arg=="--v4" || arg=="--v3" || arg=="--base85"){
+        if(ia+1>=argc){
+          fprintf(stderr, "Missing argument to %s\n", arg.c_str());
+          usage();
+        }
+        outputs.push_back({arg.substr(2), argv[ia+1]});
+        ia+=2;
+      }else if(arg=="--compress"){
+        compress=true;
+        ia++;
+      }else if(!arg.empty() && arg[0]=='-'){
+        fprintf(stderr, "Unknown option '%s'\n", arg.c_str());
+        usage();
+      }else{
+        if(!spec.empty()){
+          fprintf(stderr, "Received more than one generator spec.\n");
+          usage();
+        }
+        spec=arg;
+        ia++;
+      }
+    }
+
+    if(spec.empty()){
+      usage();
+    }
+    if(outputs.empty()){
+      outputs.push_back({"v4", "/dev/stdout"});
+    }
+
+    // Make sure the spec and graph type are good before starting any threads
+    auto parsed=parseGraphGeneratorSpec(spec);
+    auto generator=GraphGeneratorRegistry::instance().lookup(parsed.first);
+    auto graphType=findGraphGeneratorGraphType(nullptr, *generator);
+
+    std::vector<std::thread> threads;
+    std::vector<std::string> errors(outputs.size());
+    for(unsigned i=0; i<outputs.size(); i++){
+      threads.emplace_back([&,i](){
+        try{
+          sax_writer_options options;
+          options.format=outputs[i].first;
+          options.compress=compress;
+          auto writer=createSAXWriterOnFile(outputs[i].second, options);
+          generator->generate(graphType, parsed.second, writer.get());
+        }catch(std::exception &e){
+          errors[i]=e.what();
+        }
+      });
+    }
+    for(auto &t : threads){
+      t.join();
+    }
+
+    bool failed=false;
+    for(unsigned i=0; i<outputs.size(); i++){
+      if(!errors[i].empty()){
+        fprintf(stderr, "Error while writing %s : %s\n", outputs[i].second.c_str(), errors[i].c_str());
+        failed=true;
+      }
+    }
+    if(failed){
+      exit(1);
+    }
+
+    fprintf(stderr, "Done\n");
+
+  }catch(std::exception &e){
+    std::cerr<<"Exception : "<<e.what()<<"\n";
+    exit(1);
+  }catch(...){
+    std::cerr<<"Exception of unknown type\n";
+    exit(1);
+  }
+}
@@ -0,0 +1,36 @@
+load bats_helpers
+
+setup() {
+    make_target bin/generate_graph_instance bin/topologically_compare_graph_instances bin/epoch_sim storm_provider gals_heat_provider
+}
+
+@test "generate_graph_instance matches the python clock_tree generator in every format" {
+    WD=$(make_test_wd)
+    python3 apps/clock_tree/create_clock_tree_instance.py 3 2 10 > $WD/ref.xml
+    bin/generate_graph_instance clock_tree:3,2,10 --v4 $WD/gen.v4.xml --v3 $WD/gen.v3.xml --base85 $WD/gen.b85
+    for i in $WD/gen.v4.xml $WD/gen.v3.xml $WD/gen.b85 ; do
+        bin/topologically_compare_graph_instances $WD/ref.xml $i
+    done
+    run bin/epoch_sim --log-level 0 --generate clock_tree:3,2,10
+    echo $output | grep _HANDLER_EXIT_SUCCESS_9be65737_
+}
+
+@test "generate_graph_instance builds storm with n devices and n*(d+1) edges" {
+    WD=$(make_test_wd)
+    bin/generate_graph_instance storm:64,16,64 --v4 $WD/storm.xml
+    [[ $(grep -o '<DevI ' $WD/storm.xml | wc -l) -eq 64 ]]
+    [[ $(grep -o '<EdgeI ' $WD/storm.xml | wc -l) -eq 1088 ]]
+    run bin/epoch_sim --log-level 0 --generate storm:64,16,64
+    [[ $status -eq 0 ]]
+}
+
+@test "generate_graph_instance builds gals_heat as a grid without corners plus an exit node" {
+    WD=$(make_test_wd)
+    bin/generate_graph_instance gals_heat:8 --v4 $WD/heat.xml
+    # 8*8-4 cells and dirichlet variables, plus the exit node
+    [[ $(grep -o '<DevI ' $WD/heat.xml | wc -l) -eq 61 ]]
+    # 36 interior cells with 4 inputs, 24 boundary variables with 1, and 60 edges to the exit node
+    [[ $(grep -o '<EdgeI ' $WD/heat.xml | wc -l) -eq 228 ]]
+    run bin/epoch_sim --log-level 0 --generate gals_heat:8
+    [[ $status -eq 0 ]]
+}
@@ -2,9 +2,12 @@
 
 #include "simulator_context.hpp"
 #include "graph_persist_dom_reader.hpp"
+#include "graph_generators.hpp"
 
 #include <libxml++/parsers/domparser.h>
 
+#include <chrono>
+
 void usage()
 {
     fprintf(stderr, "graph_sim [options] sourceFile?\n");
@@ -16,6 +19,7 @@ void usage()
     fprintf(stderr, "  --accurate-assertions : Capture device state before send/recv in case of assertions.\n");
     fprintf(stderr, "  --message-init n: 0 (default) - Zero initialise all messages, 1 - All messages are randomly inisitalised, 2 - Randomly zero or random inisitalise\n");
     fprintf(stderr, "  --strategy strategy-name : FIFO|Random|LIFO\n");
+    fprintf(stderr, "  --generate spec : Generate the graph in-process rather than loading a file, e.g. clock_tree:6,2,100\n");
     exit(1);
 }
 
@@ -34,6 +38,20 @@ void atexit_close_resources()
     close_resources();
 }
 
+// Handlers can call exit from within the engine, so the summary is printed at exit
+std::shared_ptr<SimulationEngineFast> g_pStatsEngine;
+std::chrono::steady_clock::time_point g_statsStart;
+
+void atexit_print_throughput()
+{
+    if(g_pStatsEngine){
+        // Same format as POEMS, so that benchmark_simulators can parse either
+        double secs=std::chrono::duration<double>(std::chrono::steady_clock::now()-g_statsStart).count();
+        double messages=g_pStatsEngine->getReceiveCount();
+        fprintf(stderr, "Sim time = %g secs, M messages received = %f, MReceive/sec = %f\n", secs, messages/1e6, messages/secs/1e6);
+    }
+}
+
 void onsignal_close_resources (int)
 {
     close_resources();
@@ -45,6 +63,7 @@ int main(int argc, char *argv[])
     DisableDenormals();
 
     std::string srcFilePath="-";
+    std::string generateSpec;
 
     std::string logSinkName;
 
@@ -122,6 +141,13 @@ int main(int argc, char *argv[])
             }
             strategyName=argv[ia+1];
             ia+=2;
+        }else if(!strcmp("--generate",argv[ia])){
+            if(ia+1 >= argc){
+                fprintf(stderr, "Missing argument to --generate\n");
+                usage();
+            }
+            generateSpec=argv[ia+1];
+            ia+=2;
         }else{
             srcFilePath=argv[ia];
             ia++;
@@ -139,7 +165,11 @@ int main(int argc, char *argv[])
 
     filepath srcPath(current_path());
 
-    if(srcFilePath!="-"){
+    if(!generateSpec.empty()){
+        if(logLevel>1){
+            fprintf(stderr,"Generating graph from '%s'\n", generateSpec.c_str());
+        }
+    }else if(srcFilePath!="-"){
         filepath p(srcFilePath);
         p=absolute(p);
         if(logLevel>1){
@@ -153,7 +183,7 @@ int main(int argc, char *argv[])
         }
         parser.parse_stream(std::cin);
     }
-    if(logLevel>1){
+    if(logLevel>1 && generateSpec.empty()){
         fprintf(stderr, "Parsed XML\n");
     }
 
@@ -168,12 +198,20 @@ int main(int argc, char *argv[])
     std::shared_ptr<SimulationEngine> engine;
 
 
-    engine = std::make_shared<SimulationEngineFast>(g_pLog);
+    auto fastEngine = std::make_shared<SimulationEngineFast>(g_pLog);
+    engine = fastEngine;
     engine->setLogLevel(logLevel);
 
-    loadGraph(&registry, srcPath, parser.get_document()->get_root_node(), engine.get());
+    if(!generateSpec.empty()){
+        generateGraph(&registry, generateSpec, engine.get());
+    }else{
+        loadGraph(&registry, srcPath, parser.get_document()->get_root_node(), engine.get());
+    }
     if(logLevel>1){
         fprintf(stderr, "Loaded\n");
+        g_pStatsEngine=fastEngine;
+        g_statsStart=std::chrono::steady_clock::now();
+        atexit(atexit_print_throughput);
     }
 
     std::shared_ptr<BasicStrategy> strategy;
@@ -201,5 +239,10 @@ int main(int argc, char *argv[])
     }
     fprintf(stderr, "Application has gone idle.\n");
 
+#ifdef POETS_HANDLER_PROFILER
+    fprintf(stderr, "Handler profile, 1 in %u calls timed, most expensive first:\n", 1u<<POETS_HANDLER_PROFILER_SAMPLE_SHIFT);
+    HandlerProfiler::write_csv(stderr, fastEngine->getHandlerProfile());
+#endif
+
     return 0;
 }
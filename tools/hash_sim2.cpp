@@ -15,7 +15,7 @@
 
 #include <type_traits>
 
-#include "typed_data_interner.hpp"
+#include "concurrent_typed_data_interner.hpp"
 
 using uint128_t = unsigned __int128;
 
@@ -37,10 +37,15 @@ struct HashSim
   : public GraphLoadEvents
 {
   mutable std::unordered_set<std::string> m_internedStrings;
-  mutable TypedDataInterner m_internedData;
+  mutable ConcurrentTypedDataInterner m_internedData;
+
+  // State hashes never leave the process, so default to the word-wise hash
+  HashSim(POETSHashAlgorithm hashAlgorithm=POETSHashAlgorithm::Fast)
+    : m_internedData(hashAlgorithm)
+  {}
 
   
-  using interned_typed_data_t = const TypedDataInterner::entry_t *;
+  using interned_typed_data_t = const ConcurrentTypedDataInterner::entry_t *;
 
   // Return a stable C pointer to the name. Allows us to store
   // pointers in the data structures, and avoid calling .c_str() everywhere
@@ -472,7 +477,7 @@ public:
       auto pin=di.type->getOutput(m_source_pin);
 
       auto oldState=ds.state;
-      TypedDataPtr newStateR=oldState->data.clone();
+      TypedDataPtr newStateR=oldState->clone();
 
       TypedDataPtr messageR=pin->getMessageType()->getMessageSpec()->create();
 
@@ -543,12 +548,12 @@ public:
       auto pin=di.type->getInput(m_message.dest_pin);
 
       auto oldState=ds.state;
-      TypedDataPtr newStateR=oldState->data.clone();
+      TypedDataPtr newStateR=oldState->clone();
 
       EmptyOrchestratorServices orch;
-      pin->onReceive(&orch, graph_properties(), di.properties.get(), newStateR.get(), m_message.properties->data.get(), nullptr, m_message.message->data.get());
+      pin->onReceive(&orch, graph_properties(), di.properties.get(), newStateR.get(), m_message.properties->get(), nullptr, m_message.message->get());
       ds.state=get_parent()->intern(newStateR);
-      ds.rts=di.type->calcReadyToSend(&orch, graph_properties(), di.properties.get(), ds.state->data.get());
+      ds.rts=di.type->calcReadyToSend(&orch, graph_properties(), di.properties.get(), ds.state->get());
       state.hash=get_parent()->world_hash_update_device(state.hash, di.device_address, oldState, ds.state);
       state.hash=get_parent()->world_hash_remove_message(state.hash, m_message);
 
@@ -581,12 +586,12 @@ public:
         const auto &di=get_parent()->m_device_info[i];
         auto &ds=state.devices[i];
         auto oldState=ds.state;
-        TypedDataPtr newStateR=oldState->data.clone();
+        TypedDataPtr newStateR=oldState->clone();
 
         EmptyOrchestratorServices orch;
         di.type->onHardwareIdle(&orch, graph_properties(), di.properties.get(), newStateR.get());
         ds.state=get_parent()->intern(newStateR);
-        ds.rts=di.type->calcReadyToSend(&orch, graph_properties(), di.properties.get(), ds.state->data.get());
+        ds.rts=di.type->calcReadyToSend(&orch, graph_properties(), di.properties.get(), ds.state->get());
         state.hash=get_parent()->world_hash_update_device(state.hash, di.device_address, oldState, ds.state);
 
         check_exit(state, orch);
@@ -845,14 +850,47 @@ int breadth_first_visit(HashSim &sim, visit_params &params)
   return 0;
 };
 
+void usage()
+{
+  fprintf(stderr, "hash_sim2 [--hash-algorithm fnv1a|fast] [--memory-report] sourceFile\n");
+  exit(1);
+}
+
 int main(int argc, char *argv[])
 {
   try{
+    POETSHashAlgorithm hashAlgorithm=POETSHashAlgorithm::Fast;
+    std::string srcFileName;
+    bool memoryReport=false;
+
+    int ia=1;
+    while(ia < argc){
+      if(!strcmp("--help",argv[ia])){
+        usage();
+      }else if(!strcmp("--hash-algorithm",argv[ia])){
+        if(ia+1 >= argc){
+          fprintf(stderr, "Missing argument to --hash-algorithm\n");
+          usage();
+        }
+        hashAlgorithm=parsePOETSHashAlgorithm(argv[ia+1]);
+        ia+=2;
+      }else if(!strcmp("--memory-report",argv[ia])){
+        memoryReport=true;
+        ia++;
+      }else{
+        srcFileName=argv[ia];
+        ia++;
+      }
+    }
+    if(srcFileName.empty()){
+      usage();
+    }
+
     RegistryImpl registry;
 
     xmlpp::DomParser parser;
 
-    filepath srcFilePath(argv[1]);
+    filepath srcFilePath(srcFileName);
 
     filepath p(srcFilePath);
     p=absolute(p);
@@ -862,13 +900,16 @@ int main(int argc, char *argv[])
     auto srcPath=p.parent_path();
     parser.parse_file(p.c_str());
 
-    HashSim sim;
+    HashSim sim(hashAlgorithm);
 
     loadGraph(&registry, srcPath, parser.get_document()->get_root_node(), &sim);
 
     visit_params params;
 
     int res=breadth_first_visit(sim, params);
+    if(memoryReport){
+      sim.m_internedData.printMemoryReport(stderr);
+    }
     return res;
 
   }catch(std::exception &e){
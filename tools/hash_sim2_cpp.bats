@@ -34,3 +34,21 @@ setup() {
     [[ $status -ne 0 ]]
 }
 
+@test "exhaustive sim explores the same states with either hash algorithm" {
+    WD=$(make_test_wd)
+    apps/gals_heat_protocol_only/create_gals_heat_protocol_only_instance.py 2 10 > $WD/gals_heat_po_ok.xml
+    run bin/hash_sim2 --hash-algorithm fnv1a $WD/gals_heat_po_ok.xml
+    echo "$output" | grep 'Beginning depth 120, state size=1, explored=19487'
+    [[ $status -eq 0 ]]
+}
+
+@test "exhaustive sim only prints the interner memory report when asked" {
+    WD=$(make_test_wd)
+    apps/gals_heat_protocol_only/create_gals_heat_protocol_only_instance.py 3 1 > $WD/gals_heat_po_ok.xml
+    run bin/hash_sim2 $WD/gals_heat_po_ok.xml
+    [[ $status -eq 0 ]]
+    ! echo "$output" | grep 'Interner:'
+    run bin/hash_sim2 --memory-report $WD/gals_heat_po_ok.xml
+    [[ $status -eq 0 ]]
+    echo "$output" | grep 'Interner: entries='
+}
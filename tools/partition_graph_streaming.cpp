@@ -0,0 +1,174 @@
+#include "graph.hpp"
+
+#include "xml_pull_parser.hpp"
+#include "graph_generators.hpp"
+#include "graph_persist_sax_writer.hpp"
+#include "streaming_partitioner.hpp"
+
+#include <iostream>
+#include <fstream>
+
+void usage()
+{
+  fprintf(stderr, "partition_graph_streaming [options] (input.xml|--generate spec) [output.xml]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Partitions the graph in one pass as it is loaded, without building it in memory.\n");
+  fprintf(stderr, "If an output is given the source is streamed a second time to add the partition\n");
+  fprintf(stderr, "to the device meta-data, in the same form as partition_graph_with_metis.py.\n");
+  fprintf(stderr, "The output is v3, as the other formats have no per-device meta-data.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  --partitions n : Number of partitions (default 2).\n");
+  fprintf(stderr, "  --method ldg|fennel : Placement heuristic (default fennel).\n");
+  fprintf(stderr, "  --imbalance x : Allowed fraction above the average partition size (default 0.05).\n");
+  fprintf(stderr, "  --assignments path : Write 'deviceId partition' lines to path.\n");
+  fprintf(stderr, "  --output-format fmt : Format of output.xml (default v3). Formats which would drop the partitions are rejected.\n");
+  fprintf(stderr, "  --generate spec : Generate the graph in-process rather than loading a file, e.g. clock_tree:6,2,100\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  try{
+    RegistryImpl registry;
+
+    std::string srcFileName;
+    std::string dstFileName;
+    std::string generateSpec;
+    std::string assignmentsFileName;
+    sax_writer_options writerOptions;
+    writerOptions.format="v3";
+
+    unsigned partitions=2;
+    std::string method="fennel";
+    double imbalance=0.05;
+
+    int ai=1;
+    while(ai < argc){
+      if(!strcmp(argv[ai], "--help")){
+        usage();
+      }else if(!strcmp(argv[ai], "--partitions")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Missing argument to --partitions\n");
+          usage();
+        }
+        partitions = strtoul(argv[ai+1], 0, 0);
+        ai+=2;
+      }else if(!strcmp(argv[ai], "--method")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Missing argument to --method\n");
+          usage();
+        }
+        method = argv[ai+1];
+        ai+=2;
+      }else if(!strcmp(argv[ai], "--imbalance")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Missing argument to --imbalance\n");
+          usage();
+        }
+        imbalance = strtod(argv[ai+1], nullptr);
+        ai+=2;
+      }else if(!strcmp(argv[ai], "--assignments")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Missing argument to --assignments\n");
+          usage();
+        }
+        assignmentsFileName = argv[ai+1];
+        ai+=2;
+      }else if(!strcmp(argv[ai], "--output-format")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Missing argument to --output-format\n");
+          usage();
+        }
+        writerOptions.format = argv[ai+1];
+        ai+=2;
+      }else if(!strcmp(argv[ai], "--generate")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Missing argument to --generate\n");
+          usage();
+        }
+        generateSpec = argv[ai+1];
+        ai+=2;
+      }else if(srcFileName.empty() && generateSpec.empty()){
+        srcFileName=argv[ai];
+        ai++;
+      }else if(dstFileName.empty()){
+        dstFileName=argv[ai];
+        ai++;
+      }else{
+        fprintf(stderr, "Unexpected argument '%s'\n", argv[ai]);
+        usage();
+      }
+    }
+
+    if(srcFileName.empty() && generateSpec.empty()){
+      usage();
+    }
+    if(!dstFileName.empty() && !sax_writer_keeps_instance_metadata(writerOptions)){
+      fprintf(stderr, "Output format '%s' has no per-device meta-data, so the partitions would be lost. Use v3.\n", writerOptions.format.c_str());
+      exit(1);
+    }
+    if(srcFileName=="-"){
+      // Both passes need to read it, so it can't be a pipe
+      fprintf(stderr, "Input must be a file or a --generate spec, not stdin.\n");
+      exit(1);
+    }
+
+    auto load=[&](GraphLoadEvents *events){
+      if(!generateSpec.empty()){
+        generateGraph(&registry, generateSpec, events);
+      }else{
+        loadGraphPull(&registry, filepath(srcFileName), events);
+      }
+    };
+
+    StreamingPartitioner partitioner(partitions, StreamingPartitioner::parseMethod(method), imbalance);
+
+    fprintf(stderr, "Partitioning into %u using %s\n", partitions, method.c_str());
+    load(&partitioner);
+
+    const auto &sizes=partitioner.getPartitionSizes();
+    fprintf(stderr, "Devices = %llu, sizes = [", (unsigned long long)partitioner.getDeviceCount());
+    for(unsigned i=0; i<sizes.size(); i++){
+      fprintf(stderr, "%s%llu", i?",":"", (unsigned long long)sizes[i]);
+    }
+    fprintf(stderr, "]\n");
+
+    if(dstFileName.empty() && assignmentsFileName.empty()){
+      return 0;
+    }
+
+    FILE *assignments=nullptr;
+    if(!assignmentsFileName.empty()){
+      assignments=fopen(assignmentsFileName.c_str(), "wt");
+      if(!assignments){
+        throw std::runtime_error("Couldn't open '"+assignmentsFileName+"' for writing.");
+      }
+    }
+
+    std::shared_ptr<GraphLoadEvents> writer;
+    if(!dstFileName.empty()){
+      writer=createSAXWriterOnFile(dstFileName, writerOptions);
+    }
+
+    PartitionMetadataWriter annotator(
+      writer.get(), partitions,
+      [&](uint64_t device){ return partitioner.getPartition(device); },
+      sizes, assignments
+    );
+    load(&annotator);
+    writer.reset();
+
+    if(assignments){
+      fclose(assignments);
+    }
+
+    fprintf(stderr, "Edges = %llu, cut = %llu\n", (unsigned long long)annotator.getEdgeCount(), (unsigned long long)annotator.getCutEdgeCount());
+
+  }catch(std::exception &e){
+    std::cerr<<"Exception : "<<e.what()<<"\n";
+    exit(1);
+  }catch(...){
+    std::cerr<<"Exception of unknown type\n";
+    exit(1);
+  }
+}
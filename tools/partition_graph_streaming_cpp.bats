@@ -0,0 +1,50 @@
+load bats_helpers
+
+setup() {
+    make_target bin/partition_graph_streaming bin/topologically_compare_graph_instances bin/queue_sim clock_tree_provider
+}
+
+# Checks every device in a v3 file has a partition in [0,k) under the key recorded for dt10.partitions.k
+check_device_partitions() {
+    python3 - "$1" "$2" <<'PYEOF'
+import json, sys
+import xml.etree.ElementTree as ET
+path, k = sys.argv[1], int(sys.argv[2])
+local=lambda e: e.tag.split('}')[-1]
+gi=next(e for e in ET.parse(path).getroot().iter() if local(e)=='GraphInstance')
+meta=json.loads('{'+next(c for c in gi if local(c)=='MetaData').text+'}')
+key=meta['dt10.partitions.%d' % k]['key']
+devices=[e for e in gi.iter() if local(e)=='DevI']
+assert len(devices)>0
+for d in devices:
+    m=[c for c in d if local(c)=='M']
+    assert m, "device %s has no metadata" % d.get('id')
+    p=json.loads('{'+m[0].text+'}')[key]
+    assert 0<=p<k, "device %s has partition %d" % (d.get('id'), p)
+PYEOF
+}
+
+@test "partition_graph_streaming annotates a generated graph with balanced partitions" {
+    WD=$(make_test_wd)
+    bin/partition_graph_streaming --partitions 4 --method ldg --generate clock_tree:4,2,10 $WD/a.xml --assignments $WD/a.txt
+    check_device_partitions $WD/a.xml 4
+    bin/partition_graph_streaming --partitions 4 --generate clock_tree:4,2,10 $WD/b.xml
+    check_device_partitions $WD/b.xml 4
+    bin/topologically_compare_graph_instances $WD/a.xml $WD/b.xml
+    [[ $(cut -d ' ' -f 2 $WD/a.txt | sort -u | wc -l) -eq 4 ]]
+}
+
+@test "partition_graph_streaming rejects an output format which would drop the partitions" {
+    WD=$(make_test_wd)
+    run bin/partition_graph_streaming --partitions 4 --output-format v4 --generate clock_tree:4,2,10 $WD/a.xml
+    [[ $status -ne 0 ]]
+    [[ ! -e $WD/a.xml ]]
+}
+
+@test "queue_sim runs the partitions written by partition_graph_streaming" {
+    WD=$(make_test_wd)
+    bin/partition_graph_streaming --partitions 4 --generate clock_tree:4,2,10 $WD/a.xml
+    run bin/queue_sim --threads 4 $WD/a.xml
+    [[ $status -eq 0 ]]
+    echo "$output" | grep "Loading partition information from graph."
+}
@@ -28,7 +28,11 @@ int main(int argc, char *argv[])
     int imbalanceWeight=1;
     int imbalanceExponent=2;
     int crossingWeight=4;
-    std::string method="anneal";
+    std::string method="multilevel";
+    unsigned threads=0;
+    unsigned chains=1;
+    double imbalance=0.03;
+    uint64_t seed=1;
     
     bool showGraph=false;
 
@@ -86,6 +90,34 @@ int main(int argc, char *argv[])
         }
         method = (argv[ai+1]);
         ai+=2;
+      }else if(!strcmp(argv[ai], "--threads")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Not enough arguments for --threads.");
+          exit(1);
+        }
+        threads = strtoul(argv[ai+1], nullptr, 0);
+        ai+=2;
+      }else if(!strcmp(argv[ai], "--chains")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Not enough arguments for --chains.");
+          exit(1);
+        }
+        chains = strtoul(argv[ai+1], nullptr, 0);
+        ai+=2;
+      }else if(!strcmp(argv[ai], "--imbalance")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Not enough arguments for --imbalance.");
+          exit(1);
+        }
+        imbalance = strtod(argv[ai+1], nullptr);
+        ai+=2;
+      }else if(!strcmp(argv[ai], "--seed")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Not enough arguments for --seed.");
+          exit(1);
+        }
+        seed = strtoull(argv[ai+1], nullptr, 0);
+        ai+=2;
       }else{
         if(!srcFileName.empty()){
           if(!dstFileName.empty()){
@@ -125,14 +157,25 @@ int main(int argc, char *argv[])
     graph.setCrossingWeight(crossingWeight);
 
     std::cerr<<"building partitioner\n";
-    loadGraph(&registry, parser.get_document()->get_root_node(), &graph);
+    filepath srcPath(current_path());
+    if(!srcFileName.empty()){
+      srcPath=absolute(filepath(srcFileName)).parent_path();
+    }
+    loadGraph(&registry, srcPath, parser.get_document()->get_root_node(), &graph);
 
-    if(method=="greedy"){
+    if(method=="multilevel"){
+      std::cerr<<"Multilevel:\n";
+      graph.multilevel(threads, imbalance, seed);
+    }else if(method=="greedy"){
       std::cerr<<"Greedy:\n";
       graph.greedy(steps, propSteps);
     }else if(method=="anneal"){
       std::cerr<<"Anneal:\n";
-      graph.anneal(steps, propSteps);
+      if(chains==1){
+        graph.anneal(steps, propSteps);
+      }else{
+        graph.annealParallel(steps, propSteps, chains, threads, seed);
+      }
     }else{
       throw std::runtime_error("Unknonwn method.");
     }
@@ -156,7 +199,10 @@ int main(int argc, char *argv[])
     }else{
       
       
-      std::shared_ptr<GraphLoadEvents> dst=createSAXWriterOnFile(dstFileName);
+      // v4 has nowhere to put per-device metadata, so the partitions would be lost
+      sax_writer_options options;
+      options.format="v3";
+      std::shared_ptr<GraphLoadEvents> dst=createSAXWriterOnFile(dstFileName, options);
       graph.write(dst.get());
     }
 
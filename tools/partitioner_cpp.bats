@@ -0,0 +1,33 @@
+load bats_helpers
+
+setup() {
+    make_target bin/partitioner bin/generate_graph_instance gals_heat_provider
+}
+
+@test "partitioner multilevel assigns every device within the imbalance limit, whatever the thread count" {
+    WD=$(make_test_wd)
+    bin/generate_graph_instance gals_heat:50 --v4 $WD/heat.xml
+    bin/partitioner --partitions 64 --method multilevel --threads 1 $WD/heat.xml $WD/p1.xml
+    bin/partitioner --partitions 64 --method multilevel --threads 4 $WD/heat.xml $WD/p4.xml
+    diff $WD/p1.xml $WD/p4.xml
+
+    # 50*50-4 cells plus the exit node
+    N=$(grep -o '<DevI ' $WD/p1.xml | wc -l)
+    [[ $N -eq 2497 ]]
+    grep -o '<M>"p1":[0-9]*</M>' $WD/p1.xml | sed 's/.*"p1":\([0-9]*\).*/\1/' | sort -n | uniq -c > $WD/counts.txt
+    [[ $(awk '{s+=$1} END {print s}' $WD/counts.txt) -eq $N ]]
+    [[ $(wc -l < $WD/counts.txt) -eq 64 ]]
+    # max(floor(2497*1.03/64), ceil(2497/64))
+    [[ $(sort -n $WD/counts.txt | tail -n 1 | awk '{print $1}') -le 40 ]]
+}
+
+@test "partitioner anneal with several chains gives the same result for the same seed, whatever the thread count" {
+    WD=$(make_test_wd)
+    bin/generate_graph_instance gals_heat:16 --v4 $WD/heat.xml
+    bin/partitioner --partitions 8 --method anneal --steps 200000 --chains 4 --threads 4 --seed 7 $WD/heat.xml $WD/a.xml
+    bin/partitioner --partitions 8 --method anneal --steps 200000 --chains 4 --threads 4 --seed 7 $WD/heat.xml $WD/b.xml
+    bin/partitioner --partitions 8 --method anneal --steps 200000 --chains 4 --threads 1 --seed 7 $WD/heat.xml $WD/c.xml
+    diff $WD/a.xml $WD/b.xml
+    diff $WD/a.xml $WD/c.xml
+    [[ $(grep -o '<M>"p1":[0-9]*</M>' $WD/a.xml | wc -l) -eq $(grep -o '<DevI ' $WD/a.xml | wc -l) ]]
+}
@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# Builds a generic and a specialised POEMS simulator for one graph instance,
+# runs each a number of times, and reports the best MReceive/sec of each plus
+# the speedup from specialisation.
+
+poems_dir="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+function usage ()
+{
+>&2 echo "compare_specialised_sim.sh : [--repeats n] [--specialise-devices] [--working-dir dir] input-file [-- sim-args...]
+    --repeats n : How many times to run each simulator, keeping the best (default is 3).
+    --specialise-devices : Also bake uniform device properties into the specialised simulator.
+    --working-dir dir : Where to place the simulators. Default comes from mktemp.
+    input-file : The XML graph instance to compile and run.
+    sim-args : Extra arguments passed to both simulators (e.g. --threads 4).
+"
+}
+
+repeats=3
+specialise_flag=--specialise
+working_dir=$(mktemp -d)
+input_file=""
+sim_args=""
+while true; do
+    case "$1" in
+    --help ) usage ; exit 1 ;;
+    --repeats ) repeats=$2 ; shift 2 ;;
+    --specialise-devices ) specialise_flag=--specialise-devices ; shift ;;
+    --working-dir ) working_dir=$2 ; shift 2 ;;
+    -- ) shift ; sim_args="$*" ; break ;;
+    -* ) >&2 echo "Unknown option $1" ; exit 1 ;;
+    "" ) break ;;
+    * ) if [[ "$input_file" != "" ]] ; then
+            >&2 echo "Received multiple input files (prev=\"$input_file\")" ; exit 1 ;
+        else
+            input_file="$1" ;
+            shift ;
+        fi
+        ;;
+  esac
+done
+
+if [[ "$input_file" == "" ]] ; then
+    >&2 echo "No input file specified."
+    exit 1
+fi
+
+${poems_dir}/compile_poems_sim.sh --release "${input_file}" -o ${working_dir}/generic.sim || exit 1
+${poems_dir}/compile_poems_sim.sh --release ${specialise_flag} "${input_file}" -o ${working_dir}/specialised.sim || exit 1
+
+# Prints the best MReceive/sec over all repeats of one simulator.
+function best_rate ()
+{
+    local best=0
+    for ((i=0; i<repeats; i++)) ; do
+        local rate=$($1 ${sim_args} "${input_file}" 2>&1 | sed -n -e 's/^Sim time = .*MReceive\/sec = \([0-9.]*\).*$/\1/p')
+        if [[ "$rate" == "" ]] ; then
+            >&2 echo "Simulator $1 failed or did not report a rate."
+            exit 1
+        fi
+        best=$(echo "$rate $best" | awk '{ print ($1>$2) ? $1 : $2 }')
+    done
+    echo $best
+}
+
+generic=$(best_rate ${working_dir}/generic.sim) || exit 1
+specialised=$(best_rate ${working_dir}/specialised.sim) || exit 1
+
+echo "$generic $specialised" | awk '{ printf("generic MReceive/sec = %f, specialised MReceive/sec = %f, speedup = %.3f\n", $1, $2, ($1>0) ? $2/$1 : 0) }'
@@ -14,6 +14,12 @@ function usage ()
     --debug : Debuggable executable with all run-time checks.
     --sanitizers : Add thread and undefined sanitisers
     --run : If the simulation compiles, then run it immediately
+    --batch all|type,type,... : Generate batch rts handlers for the given device types (see --batch-execution).
+    --native : Compile for the host CPU (-march=native), which lets batch handlers use AVX2/AVX-512.
+    --specialise : Bake the graph properties of input-file (which must be an instance) into the simulator.
+    --specialise-devices : As --specialise, and also bake device properties that are uniform across a type.
+    --profile-handlers : Count and sample handler timings per device type and pin, and report them at exit.
+    --no-metis : Cluster with the built-in multilevel partitioner, so metis is not needed to build or link.
     input-file the XML graph type or graph instance to compile.
 "
 }
@@ -29,6 +35,8 @@ asserts=0
 sanitizers=0
 max_log_level=
 run=0
+no_metis=0
+render_flags=""
 while true; do
     case "$1" in
     --help ) usage ; exit 1 ;;
@@ -41,6 +49,11 @@ while true; do
     --debug ) optimise=0 ; asserts=1 ; shift ;;
     --sanitizers ) sanitizers=1 ; shift ;;
     --run ) run=1 ; shift ;;
+    --batch ) render_flags="$render_flags --batch $2" ; shift 2 ;;
+    --native ) CPPFLAGS="$CPPFLAGS -march=native" ; shift ;;
+    --specialise | --specialise-devices ) render_flags="$render_flags $1" ; shift ;;
+    --profile-handlers ) CPPFLAGS="$CPPFLAGS -DPOETS_HANDLER_PROFILER=1" ; shift ;;
+    --no-metis ) no_metis=1 ; shift ;;
     --max-log-level ) max_log_level=$2 ; shift 2 ;;
     -* ) >&2 echo "Unknown option $1" ; exit 1 ;;
     "" ) break ;;
@@ -68,7 +81,7 @@ if [[ "$input_file" == "" ]] ; then
 fi
 
 >&2 echo "Rendering provider as sprovider"
-${sprovider_dir}/render_graph_as_sprovider.py "${input_file}" > ${working_dir}/sprovider_impl.hpp || exit 1
+${sprovider_dir}/render_graph_as_sprovider.py ${render_flags} "${input_file}" > ${working_dir}/sprovider_impl.hpp || exit 1
 
 >&2 echo "Compiling poems sim"
 
@@ -135,7 +148,12 @@ else
 	CPPFLAGS+=" -I ${POETS_EXTERNAL_INTERFACE_SPEC}/include"
 fi
 
-LDLIBS+=" ${LIBXML_PKG_CONFIG_LDLIBS} -ltbb -lmetis -ldl"
+LDLIBS+=" ${LIBXML_PKG_CONFIG_LDLIBS} -ltbb -ldl"
+if [[ "$no_metis" == "1" ]] ; then
+	CPPFLAGS+=" -DPOEMS_NO_METIS=1"
+else
+	LDLIBS+=" -lmetis"
+fi
 LDFLAGS+=" ${LIBXML_PKG_CONFIG_LDFLAGS} -pthread"
 
 >&2 echo "CPPFLAGS=${CPPFLAGS}"
@@ -179,11 +179,8 @@ SPROVIDER_ALWAYS_INLINE bool do_send_cell(unsigned _pin_index, const void *gp, v
 }
 
 
-SPROVIDER_ALWAYS_INLINE active_flag_t try_send_cell(const void *gp, void *dp_ds, int *_action_taken, int *_output_port, unsigned *_message_size, int *_send_index, void *m)
+SPROVIDER_ALWAYS_INLINE active_flag_t send_or_compute_with_rts_cell(const void *gp, void *dp_ds, uint32_t rts, bool requestCompute, int *_action_taken, int *_output_port, unsigned *_message_size, int *_send_index, void *m)
 {
-    uint32_t rts=0;
-    bool requestCompute=false;
-    calc_rts_cell(gp, dp_ds, &rts, &requestCompute );
     if(!rts){
         if(!requestCompute){
             return false;
@@ -206,6 +203,25 @@ SPROVIDER_ALWAYS_INLINE active_flag_t try_send_cell(const void *gp, void *dp_ds,
     return true; // We did something, regardless of if we sent
 }
 
+SPROVIDER_ALWAYS_INLINE active_flag_t try_send_cell(const void *gp, void *dp_ds, int *_action_taken, int *_output_port, unsigned *_message_size, int *_send_index, void *m)
+{
+    uint32_t rts=0;
+    bool requestCompute=false;
+    calc_rts_cell(gp, dp_ds, &rts, &requestCompute );
+    return send_or_compute_with_rts_cell(gp, dp_ds, rts, requestCompute, _action_taken, _output_port, _message_size, _send_index, m);
+}
+
+SPROVIDER_ALWAYS_INLINE void calc_rts_batch_cell(const void *gp, unsigned n, const void *dp_ds_base, unsigned stride, uint32_t *SPROVIDER_RESTRICT rts, bool *SPROVIDER_RESTRICT requestCompute)
+{
+    SPROVIDER_BATCH_LOOP
+    for(unsigned i=0; i<n; i++){
+        const int offset=(int)(i*stride);
+        auto deviceState=get_S<cell_properties_t,cell_state_t>((char*)dp_ds_base+offset);
+        rts[i]=deviceState->rts;
+        requestCompute[i]=false;
+    }
+}
+
 active_flag_t sprovider_do_send(void *_ctxt, unsigned _device_type_index, unsigned _pin_index, const void *gp, void *dp_ds, bool *doSend, int *sendIndex, void *m)
 {
     switch(_device_type_index){
@@ -223,6 +239,22 @@ SPROVIDER_ALWAYS_INLINE active_flag_t sprovider_try_send_or_compute(void *_ctxt,
     }
 }
 
+SPROVIDER_ALWAYS_INLINE active_flag_t sprovider_send_or_compute_with_rts(void *_ctxt, unsigned _device_index, const void *gp, void *dp_ds, uint32_t rts, bool requestCompute, int *_action_taken, int *_output_port, unsigned *_message_size, int *_send_index, void *m)
+{
+    switch(_device_index){
+    default: SPROVIDER_UNREACHABLE;
+    case 0: return send_or_compute_with_rts_cell(gp, dp_ds, rts, requestCompute, _action_taken, _output_port, _message_size, _send_index, m);
+    }
+}
+
+static bool sprovider_calc_rts_batch(void *_ctxt, unsigned _device_type_index, const void *gp, unsigned n, const void *dp_ds_base, unsigned stride, uint32_t *rts, bool *requestCompute)
+{
+    switch(_device_type_index){
+    default: SPROVIDER_UNREACHABLE;
+    case 0: calc_rts_batch_cell(gp, n, dp_ds_base, stride, rts, requestCompute); return true;
+    }
+}
+
 
 active_flag_t sprovider_do_recv(void *_ctxt, unsigned _device_type_index, unsigned _pin_index, const void *gp, void *dp_ds, void *ep_es, const void *m)
 {
@@ -249,6 +281,12 @@ active_flag_t sprovider_do_device_idle(void *_ctxt, unsigned _device_index, cons
     return false;
 }
 
+// No supervisor in this graph type
+static void sprovider_supervisor_init(const void *gp) {}
+static void sprovider_supervisor_recv(const void *gp, const void *m, void *reply, void *bcast, bool *rtsReply, bool *rtsBcast) {}
+static void sprovider_supervisor_idle(const void *gp) {}
+static void sprovider_supervisor_stop(const void *gp) {}
+
 
 /* Total number of device types */
 SPROVIDER_GLOBAL_CONST int SPROVIDER_DEVICE_TYPE_COUNT = 1;
@@ -260,6 +298,7 @@ SPROVIDER_GLOBAL_CONST sprovider_graph_info_t SPROVIDER_GRAPH_TYPE_INFO = {
     false,
     sizeof(gals_heat_properties_t),
     (sizeof(gals_heat_properties_t)+3)&0xFFFFFFFCul,
+    false // no supervisor
 };
 
 SPROVIDER_GLOBAL_CONST sprovider_device_info_t SPROVIDER_DEVICE_TYPE_INFO[SPROVIDER_DEVICE_TYPE_COUNT] = {
@@ -287,7 +326,8 @@ SPROVIDER_GLOBAL_CONST sprovider_device_info_t SPROVIDER_DEVICE_TYPE_INFO[SPROVI
                 sizeof(update_message_t),  (sizeof(update_message_t)+3)&0xFFFFFFFCul,
                 false
             }
-        }
+        },
+        true // has_batch
     }
 };
 
@@ -4,6 +4,8 @@
 
 #include "xml_pull_parser_impl.hpp"
 
+#include "graph_generators.hpp"
+
 #include <libxml++/parsers/domparser.h>
 
 
@@ -35,9 +37,17 @@ int main(int argc, char *argv[])
     int nThreads=std::thread::hardware_concurrency();
     int cluster_size=1024;
     int use_metis=1;
+    int batch_execution=0;
+    std::string rebalance_interval="0";
+    int perf_counters=0;
     int log_level=1;
     int use_pull_parser=1;
     int max_contiguous_idle_steps=10;
+    int n_ranks=1;
+    int rank=0;
+    std::string transport_spec;
+    std::string idle_detection="tree";
+    std::string generate_spec;
 
     int ai=1;
 
@@ -76,11 +86,19 @@ int main(int argc, char *argv[])
 usage : %s [--threads n] [--cluster-size n] [--use-metis 0|1] [--log-level n] <source.xml>
 --threads : How many threads to use for simulation (default is std::thread::hardware_concurrency)
 --cluster-size : Target number of devices per cluster (default is 1024)
---use-metis : Whether to cluster using metis (default is 1)
+--use-metis : Whether to cluster using metis, or the built-in multilevel partitioner when built with POEMS_NO_METIS=1 (default is 1)
 --use-pull-parser 0|1 : Use the pull (streaming) parser rather than AST (default is 1).
 --log-level n : Set the maximum printed application log level
 --max-contiguous-idle-steps : How many no-message idle steps before aborting (default is 10)
 --stats-file file : A file to log execution information to.
+--ranks n : Number of processes the simulation is split across (default is 1). Every process still loads the whole graph.
+--rank r : Which of the processes this is, from 0 to ranks-1 (default is 0)
+--transport unix:<dir>|tcp:<host>:<base-port> : How the processes connect to each other.
+--idle-detection tree|mutex|check : Idle detection method. check runs tree and cross-checks it every round (default is tree).
+--batch-execution 0|1 : Group same-type devices and evaluate rts in lockstep for types with batch handlers (default is 0).
+--rebalance-interval secs : Pause every secs seconds to move devices out of the busiest clusters (default is 0, never).
+--perf-counters 0|1 : Measure time and hardware counters in each phase of each thread (default is 0).
+--generate spec : Generate the graph in-process rather than loading <source.xml>, e.g. clock_tree:6,2,100
 )", argv[0]);
     };
 
@@ -95,6 +113,14 @@ usage : %s [--threads n] [--cluster-size n] [--use-metis 0|1] [--log-level n] <s
         else if(parse_int_opt("--log-level", log_level)) {}
         else if(parse_int_opt("--use-pull-parser", use_pull_parser)) {}
         else if(parse_int_opt("--max-contiguous-idle-steps", max_contiguous_idle_steps)) {}
+        else if(parse_int_opt("--ranks", n_ranks)) {}
+        else if(parse_int_opt("--rank", rank)) {}
+        else if(parse_str_opt("--transport", transport_spec)) {}
+        else if(parse_str_opt("--idle-detection", idle_detection)) {}
+        else if(parse_int_opt("--batch-execution", batch_execution)) {}
+        else if(parse_str_opt("--rebalance-interval", rebalance_interval)) {}
+        else if(parse_int_opt("--perf-counters", perf_counters)) {}
+        else if(parse_str_opt("--generate", generate_spec)) {}
         else{
             if(source_path.native()!=""){
                 fprintf(stderr, "Received more than one source path (mis-spelled option?)\n");
@@ -124,6 +150,15 @@ usage : %s [--threads n] [--cluster-size n] [--use-metis 0|1] [--log-level n] <s
         fprintf(stderr, "Warning: requested log level of %u is higher than compiler-in log level limit of %u\n", log_level, SPROVIDER_MAX_LOG_LEVEL);
     }
 
+    if(n_ranks<=0 || rank<0 || rank>=n_ranks){
+        fprintf(stderr, "Invalid rank %d of %d ranks.\n", rank, n_ranks);
+        exit(1);
+    }
+    if(n_ranks>1 && transport_spec.empty()){
+        fprintf(stderr, "Running with more than one rank needs a --transport.\n");
+        exit(1);
+    }
+
     sprovider_handler_log_level=log_level;
 
     if(stats_file_path.native()!=""){
@@ -137,11 +172,49 @@ usage : %s [--threads n] [--cluster-size n] [--use-metis 0|1] [--log-level n] <s
     stats_log("threads_used", "", std::to_string(nThreads));
     stats_log("cluster_size", "", std::to_string(cluster_size));
     stats_log("use_metis", "", std::to_string(use_metis));
+    stats_log("ranks", "", std::to_string(n_ranks));
 
+    std::unique_ptr<POEMSTransport> transport;
+    if(n_ranks>1){
+        // Connect before loading, so that mistakes in the spec turn up early
+        transport=create_poems_transport(transport_spec, rank, n_ranks);
+        instance.m_transport=transport.get();
+    }
 
     instance.use_metis=use_metis;
     instance.m_cluster_size=cluster_size;
     instance.m_maxNonMessageRoundCount=max_contiguous_idle_steps;
+    if(idle_detection=="tree"){
+        instance.m_idleDetectionMode=POEMS::IDLE_DETECTION_TREE;
+    }else if(idle_detection=="mutex"){
+        instance.m_idleDetectionMode=POEMS::IDLE_DETECTION_MUTEX;
+    }else if(idle_detection=="check"){
+        instance.m_idleDetectionMode=POEMS::IDLE_DETECTION_CHECK;
+    }else{
+        fprintf(stderr, "Unknown idle detection method '%s'.\n", idle_detection.c_str());
+        exit(1);
+    }
+    stats_log("idle_detection", "", idle_detection);
+    instance.m_batchExecution=batch_execution!=0;
+    stats_log("batch_execution", "", std::to_string(batch_execution));
+    instance.m_rebalanceInterval=std::atof(rebalance_interval.c_str());
+    if(instance.m_rebalanceInterval<0){
+        fprintf(stderr, "Invalid rebalance interval.\n");
+        exit(1);
+    }
+    stats_log("rebalance_interval", "", rebalance_interval);
+
+    PerfPhaseCounters *phase_counters=nullptr; // Never freed, as the exit hook reports from it
+    if(perf_counters){
+        phase_counters=new PerfPhaseCounters(POEMS::phase_names());
+        phase_counters->attach(POEMS::PHASE_LOAD);
+        if(!phase_counters->hardware_available()){
+            fprintf(stderr, "Warning: hardware performance counters are not available, so only measuring time in each phase.\n");
+        }
+        instance.m_phaseCounters=phase_counters;
+    }
+    stats_log("perf_counters", "", std::to_string(perf_counters));
+    stats_log("perf_counters", "hardware", std::to_string(phase_counters && phase_counters->hardware_available()));
 
     POEMSBuilder builder(instance);
     builder.stats_log=stats_log;
@@ -156,7 +229,9 @@ usage : %s [--threads n] [--cluster-size n] [--use-metis 0|1] [--log-level n] <s
     }
 
 
-    if(!use_pull_parser){
+    if(!generate_spec.empty()){
+        generateGraph(nullptr, generate_spec, &builder);
+    }else if(!use_pull_parser){
         xmlpp::DomParser parser;
         parser.parse_file(source_path.c_str());
 
@@ -169,11 +244,50 @@ usage : %s [--threads n] [--cluster-size n] [--use-metis 0|1] [--log-level n] <s
 
     auto beginTime=std::chrono::high_resolution_clock::now();
 
-    _at_exit_hook=[&](){
+    _at_exit_hook=[&, phase_counters](){
         auto endTime=std::chrono::high_resolution_clock::now();
         double runTime=std::chrono::duration<double>(endTime-beginTime).count();
         uint64_t messages=instance.total_received_messages_approx();
         fprintf(stderr, "Sim time = %g secs, M messages received = %f, MReceive/sec = %f\n",  runTime, messages/(1000.0*1000.0), messages/runTime/(1000.0*1000.0));
+        auto bundles=instance.bundle_stats_approx();
+        fprintf(stderr, "Bundles = %llu, messages/bundle = %f, bundle fill = %.1f%%\n", (unsigned long long)bundles.bundles, bundles.messages_per_bundle(), bundles.fill()*100);
+        stats_log("bundles", "count", std::to_string(bundles.bundles));
+        stats_log("bundles", "messages_per_bundle", std::to_string(bundles.messages_per_bundle()));
+        stats_log("bundles", "fill", std::to_string(bundles.fill()));
+        if(instance.m_batchExecution){
+            auto batch=instance.batch_stats_approx();
+            fprintf(stderr, "Batch groups = %llu, ready devices/group = %f, fallbacks = %llu\n", (unsigned long long)batch.groups, batch.devices_per_group(), (unsigned long long)batch.fallbacks);
+            stats_log("batch", "groups", std::to_string(batch.groups));
+            stats_log("batch", "devices_per_group", std::to_string(batch.devices_per_group()));
+            stats_log("batch", "fallbacks", std::to_string(batch.fallbacks));
+        }
+        if(instance.m_rebalanceInterval>0){
+            const auto &rebalance=instance.m_rebalanceStats;
+            double t=now();
+            double finalRate=rebalance.current_rate(t, messages);
+            double gain=rebalance.gain(t, messages);
+            fprintf(stderr, "Rebalance pauses = %u (%u skipped), devices moved = %llu, pause time = %g secs, MReceive/sec first interval = %f, last interval = %f, gain = %f\n",
+                rebalance.pauses, rebalance.skipped, (unsigned long long)rebalance.devicesMoved, rebalance.pauseTime,
+                rebalance.initialRate/1000000.0, finalRate/1000000.0, gain
+            );
+            stats_log("rebalance", "pauses", std::to_string(rebalance.pauses));
+            stats_log("rebalance", "devices_moved", std::to_string(rebalance.devicesMoved));
+            stats_log("rebalance", "pause_secs", std::to_string(rebalance.pauseTime));
+            stats_log("rebalance", "initial_rate", std::to_string(rebalance.initialRate));
+            stats_log("rebalance", "final_rate", std::to_string(finalRate));
+            stats_log("rebalance", "gain", std::to_string(gain));
+        }
+        if(phase_counters){
+            phase_counters->enter(PerfPhaseCounters::NONE); // Charge whatever this thread was doing
+            fprintf(stderr, "Phases : %s\n", phase_counters->summary().c_str());
+            phase_counters->stats_log(stats_log);
+        }
+#ifdef POETS_HANDLER_PROFILER
+        auto profile=instance.m_profiler.report();
+        fprintf(stderr, "Handler profile, 1 in %u calls timed, most expensive first:\n", 1u<<POETS_HANDLER_PROFILER_SAMPLE_SHIFT);
+        HandlerProfiler::write_csv(stderr, profile);
+        HandlerProfiler::stats_log(stats_log, profile);
+#endif
     };
     atexit(at_exit_raw);
 
@@ -56,6 +56,67 @@ load ../bats_helpers
     $WD/wibble.sim $WD/wibble.xml
 }
 
+@test "Cross-check idle detection with gals heat for POEMS" {
+    WD=$(make_test_wd)
+    apps/gals_heat/create_gals_heat_instance.py 64 64  > $WD/wibble.xml
+    tools/poems/compile_poems_sim.sh --release-with-asserts $WD/wibble.xml -o $WD/wibble.sim
+    [[ -x $WD/wibble.sim ]]
+    $WD/wibble.sim --idle-detection check --threads 4 --cluster-size 64 $WD/wibble.xml
+}
+
+@test "Compile and test gals heat with batch execution for POEMS" {
+    WD=$(make_test_wd)
+    apps/gals_heat/create_gals_heat_instance.py 64 64  > $WD/wibble.xml
+    tools/poems/compile_poems_sim.sh --release-with-asserts --batch all $WD/wibble.xml -o $WD/wibble.sim
+    [[ -x $WD/wibble.sim ]]
+    $WD/wibble.sim --batch-execution 1 --cluster-size 256 $WD/wibble.xml
+}
+
+@test "Compile and test gals heat with rebalancing for POEMS" {
+    WD=$(make_test_wd)
+    apps/gals_heat/create_gals_heat_instance.py 64 64  > $WD/wibble.xml
+    tools/poems/compile_poems_sim.sh --release-with-asserts $WD/wibble.xml -o $WD/wibble.sim
+    [[ -x $WD/wibble.sim ]]
+    $WD/wibble.sim --rebalance-interval 0.01 --threads 4 --cluster-size 64 $WD/wibble.xml
+}
+
+@test "Compile and test specialised gals heat for POEMS" {
+    WD=$(make_test_wd)
+    apps/gals_heat/create_gals_heat_instance.py 64 64  > $WD/wibble.xml
+    tools/poems/compile_poems_sim.sh --release-with-asserts --specialise-devices $WD/wibble.xml -o $WD/wibble.sim
+    [[ -x $WD/wibble.sim ]]
+    $WD/wibble.sim $WD/wibble.xml
+}
+
+@test "Compile and test gals heat with handler profiling for POEMS" {
+    WD=$(make_test_wd)
+    apps/gals_heat/create_gals_heat_instance.py 64 64  > $WD/wibble.xml
+    tools/poems/compile_poems_sim.sh --profile-handlers $WD/wibble.xml -o $WD/wibble.sim
+    [[ -x $WD/wibble.sim ]]
+    $WD/wibble.sim --stats-file $WD/stats.csv $WD/wibble.xml
+    grep -q "handler_profile_calls,cell/recv" $WD/stats.csv
+}
+
+@test "Compile and test gals heat with phase counters for POEMS" {
+    WD=$(make_test_wd)
+    apps/gals_heat/create_gals_heat_instance.py 64 64  > $WD/wibble.xml
+    tools/poems/compile_poems_sim.sh $WD/wibble.xml -o $WD/wibble.sim
+    [[ -x $WD/wibble.sim ]]
+    $WD/wibble.sim --perf-counters 1 --threads 2 --stats-file $WD/stats.csv $WD/wibble.xml
+    grep -q "perf_step,secs" $WD/stats.csv
+}
+
+@test "Compile and test gals heat across two ranks for POEMS" {
+    WD=$(make_test_wd)
+    apps/gals_heat/create_gals_heat_instance.py 64 64  > $WD/wibble.xml
+    tools/poems/compile_poems_sim.sh $WD/wibble.xml -o $WD/wibble.sim
+    [[ -x $WD/wibble.sim ]]
+    $WD/wibble.sim --ranks 2 --rank 1 --transport unix:$WD --cluster-size 256 $WD/wibble.xml &
+    RANK1=$!
+    $WD/wibble.sim --ranks 2 --rank 0 --transport unix:$WD --cluster-size 256 $WD/wibble.xml
+    wait $RANK1
+}
+
 #TODO: Waiting till bug is fixed in AMG. poems is quite good at triggering it.
 #@test "Compile and test standard amg for POEMS" {
 #    WD=$(make_test_wd)
@@ -73,6 +134,22 @@ load ../bats_helpers
     $WD/wibble.sim $WD/wibble.xml
 }
 
+@test "Compile and test supervisor relay reply for POEMS" {
+    WD=$(make_test_wd)
+    python3 apps/tests/supervisors/test_supervisor_Ndev_to_sup_relay_reply_generator.py 10 10 > $WD/wibble.xml
+    tools/poems/compile_poems_sim.sh apps/tests/supervisors/test_supervisor_Ndev_to_sup_relay_reply_graph_type.xml -o $WD/wibble.sim
+    [[ -x $WD/wibble.sim ]]
+    $WD/wibble.sim $WD/wibble.xml
+}
+
+@test "Compile and test supervisor relay broadcast for POEMS" {
+    WD=$(make_test_wd)
+    python3 apps/tests/supervisors/test_supervisor_Ndev_to_sup_relay_bcast_generator.py 10 10 > $WD/wibble.xml
+    tools/poems/compile_poems_sim.sh apps/tests/supervisors/test_supervisor_Ndev_to_sup_relay_bcast_graph_type.xml -o $WD/wibble.sim
+    [[ -x $WD/wibble.sim ]]
+    $WD/wibble.sim $WD/wibble.xml
+}
+
 #TODO: Unclear if poems makes this really slow (quite possible), or if there is a bug in poems
 #@test "Compile and test standard storm for POEMS" {
 #    WD=$(make_test_wd)
@@ -17,8 +17,15 @@
 #include <cstdarg>
 #include <functional>
 #include <array>
+#include <tuple>
+#include <numeric>
+#include <cmath>
 
+#ifdef POEMS_NO_METIS
+#include "../../include/multilevel_partitioner.hpp"
+#else
 #include <metis.h>
+#endif
 #include "tbb/concurrent_queue.h"
 
 #include "shared_pool.hpp"
@@ -29,6 +36,20 @@
 
 #include "../sprovider/sprovider_helpers.hpp"
 
+#include "poems_transport.hpp"
+
+#include "../../include/perf_phase_counters.hpp"
+
+#ifdef POETS_HANDLER_PROFILER
+#include "../../include/handler_profiler.hpp"
+// Arguments are only evaluated when the profiler is compiled in
+#define POEMS_PROFILE_BEGIN(var) uint64_t var=m_profiler.begin()
+#define POEMS_PROFILE_END(var, slot) m_profiler.end(var, m_profiler.slot)
+#else
+#define POEMS_PROFILE_BEGIN(var)
+#define POEMS_PROFILE_END(var, slot)
+#endif
+
 //////////////////////////////////////////////////
 // Simulation logic
 
@@ -36,6 +57,18 @@ static unsigned sprovider_handler_log_level = SPROVIDER_MAX_LOG_LEVEL;
 
 static std::mutex g_handler_log_mutex;
 
+// Called with the exit code when the application decides to finish, before exit runs.
+static std::function<void(int)> g_application_exit_hook;
+static std::atomic<bool> g_application_exiting{false};
+
+[[noreturn]] void poems_application_exit(int code)
+{
+    if(!g_application_exiting.exchange(true) && g_application_exit_hook){
+        g_application_exit_hook(code);
+    }
+    exit(code);
+}
+
 void sprovider_handler_log(int level, const char *msg, ...)
 {
     if(level<=(int)sprovider_handler_log_level){
@@ -52,14 +85,26 @@ void sprovider_handler_log(int level, const char *msg, ...)
 
     if(level==0){
         if(!strcmp(msg,"_HANDLER_EXIT_SUCCESS_9be65737_")){
-            exit(0);
+            poems_application_exit(0);
         }
         if(!strcmp(msg,"_HANDLER_EXIT_FAIL_9be65737_")){
-            exit(1);
+            poems_application_exit(1);
         }
     }
 }
 
+// Set once the supervisor has been initialised, so that the stop handler can run on exit
+static const void *g_supervisor_gp = nullptr;
+
+void sprovider_supervisor_stop_application()
+{
+    if(g_supervisor_gp){
+        sprovider_supervisor_stop(g_supervisor_gp);
+    }
+    fflush(stdout);
+    poems_application_exit(0);
+}
+
 static std::chrono::high_resolution_clock::time_point g_now_start;
 
 void set_now_start()
@@ -157,13 +202,73 @@ struct POEMS
     };
 
     static_assert(sizeof(message) <= 1024 );
-    static const unsigned MAX_MESSAGES_PER_BUNDLE = (4096 - 2*sizeof(void*) - 4) / sizeof(message);
+
+    /* Bundles are packed by bytes rather than by message count. Each entry is
+       the edge and the padded size of the message, followed by just that many bytes
+       of payload, so bundles of small messages don't carry the padding needed for
+       the largest message type. */
+    struct bundle_entry
+    {
+        const edge *p_edge;
+        uint32_t size; // message_size_padded of the pin
+        uint32_t _pad_;
+        uint8_t payload[];
+
+        static unsigned entry_bytes(unsigned size)
+        { return sizeof(bundle_entry)+((size+7)&~7u); }
+    };
+
+    static const unsigned BUNDLE_DATA_BYTES = 4096 - 2*sizeof(void*) - 8;
+    static_assert(sizeof(bundle_entry)+SPROVIDER_MAX_PAYLOAD_SIZE+8 <= BUNDLE_DATA_BYTES);
+
     struct message_bundle
     {
         message_bundle *next;
         message_bundle *prev;
-        uint32_t n;
-        std::array<message,MAX_MESSAGES_PER_BUNDLE> msgs;
+        uint32_t n;     // Number of messages
+        uint32_t bytes; // Bytes used in data
+        alignas(8) uint8_t data[BUNDLE_DATA_BYTES];
+
+        void clear()
+        {
+            next=0;
+            prev=0;
+            n=0;
+            bytes=0;
+        }
+
+        bool can_append(unsigned size) const
+        { return bytes+bundle_entry::entry_bytes(size) <= BUNDLE_DATA_BYTES; }
+
+        void append(const edge &e, const void *payload, unsigned size)
+        {
+            assert(can_append(size));
+            auto *entry=(bundle_entry*)(data+bytes);
+            entry->p_edge=&e;
+            entry->size=size;
+            memcpy(entry->payload, payload, size);
+            bytes+=bundle_entry::entry_bytes(size);
+            n++;
+        }
+
+        const edge *first_edge() const
+        {
+            assert(n>0);
+            return ((const bundle_entry*)data)->p_edge;
+        }
+
+        // Calls cb(const bundle_entry &) for each message in order
+        template<class CB>
+        void for_each(CB &&cb) const
+        {
+            unsigned offset=0;
+            for(unsigned i=0; i<n; i++){
+                const auto *entry=(const bundle_entry*)(data+offset);
+                cb(*entry);
+                offset+=bundle_entry::entry_bytes(entry->size);
+            }
+            assert(offset==bytes);
+        }
     };
 
     struct device
@@ -177,6 +282,9 @@ struct POEMS
         device_cluster *cluster;
         unsigned offset_in_cluster;
 
+        // Non-null if the device has a supervisor implicit input or output
+        const edge *supervisor_edge=nullptr;
+
         // Each port has just a vector of ougoing destinations.
         std::vector<edge_vector> output_ports;
 
@@ -214,6 +322,28 @@ struct POEMS
 
     static_assert( !(USE_POSTBOXES&&USE_BUNDLES) );
 
+    /* Number of same-type devices whose rts is evaluated in lockstep during
+       batched execution. Matches the number of 32-bit lanes in a vector. */
+#if defined(__AVX512F__)
+    static const unsigned BATCH_WIDTH = 16;
+#else
+    static const unsigned BATCH_WIDTH = 8;
+#endif
+
+    static const unsigned NO_BATCH_WINDOW = 0xFFFFFFFFu;
+
+    /* A contiguous range of devices in a cluster that all have the same type.
+       If stride is non-zero then the devices are laid out stride bytes apart
+       starting at devices[begin], so properties_then_state can be walked directly. */
+    struct device_run
+    {
+        unsigned begin;
+        unsigned end;
+        unsigned device_type_index;
+        unsigned stride;
+        bool batch; // Provider has batch handlers for the type, and devices are laid out at stride
+    };
+
     // One entry per destination cluster
     struct PostBox
     {
@@ -262,6 +392,13 @@ struct POEMS
         std::vector<device*> devices;
         std::vector<uint64_t> devices_active_mask;
 
+        // Only used for batched execution, otherwise empty
+        std::vector<device_run> device_runs;
+        // Devices in [batch_window_begin,batch_window_begin+BATCH_WIDTH) that have received
+        // a local message since their rts was evaluated.
+        unsigned batch_window_begin=NO_BATCH_WINDOW;
+        uint32_t batch_window_dirty=0;
+
         bool active=false; // Is any device in the cluster currently active?
         bool provider_do_hardware_idle=false; // Is there a pending hardware idle?  implies active is true.
         
@@ -273,6 +410,14 @@ struct POEMS
         uint64_t numNoSendClusterSteps=0;
         uint64_t numNoActivityClusterSteps=0;
         uint64_t numNonLocalFlushes=0;
+        uint64_t numNonLocalFlushedMessages=0; // Only counts bundles
+        uint64_t numNonLocalFlushedBytes=0;
+        uint64_t numBatchGroups=0;
+        uint64_t numBatchDevices=0; // Active devices dispatched using batched rts
+        uint64_t numBatchFallbacks=0; // Active devices in a group that had to recalculate rts
+
+        // Messages sent and received as of the last rebalancing pause
+        uint64_t rebalanceWorkMark=0;
 
         std::atomic<uint64_t> localMessagesSentAndReceivedSync;
 
@@ -286,6 +431,9 @@ struct POEMS
         message_bundle *postBundlesHead=0;
         message_bundle *postBundlesTail=0;
 
+        // Messages from devices in this cluster to the supervisor
+        message_bundle *supervisorBundle=0;
+
         device_cluster(unsigned id)
             : incoming_queue(0)
             , incoming_bundle_queue(0)
@@ -353,6 +501,18 @@ struct POEMS
             return 0 != (devices_active_mask[offset/64] & 1ull<<(offset%64));
         }
 
+        // Active flags for the n<=32 devices starting at offset, with bit i for offset+i
+        uint32_t get_devices_active(unsigned offset, unsigned n) const
+        {
+            assert(n<=32 && offset+n <= devices.size());
+            unsigned word=offset/64, shift=offset%64;
+            uint64_t bits=devices_active_mask[word] >> shift;
+            if(shift+n > 64){
+                bits |= devices_active_mask[word+1] << (64-shift);
+            }
+            return uint32_t(bits) & uint32_t((1ull<<n)-1);
+        }
+
         void set_device_active(unsigned offset, bool isActive)
         {
             assert(offset < devices.size());
@@ -424,11 +584,13 @@ struct POEMS
             assert(USE_BUNDLES);
 
             auto &slot=postBundles[e.dest_cluster_index];
+            if(slot && !slot->can_append(size)){
+                flush_bundle(*this, slot);
+            }
             if(!slot){
                 slot=pool.alloc();
+                slot->clear();
                 slot->prev=postBundlesTail;
-                slot->next=0;
-                slot->n=0;
                 if(postBundlesTail){
                     postBundlesTail->next=slot;
                 }else{
@@ -437,12 +599,10 @@ struct POEMS
                 postBundlesTail=slot;
             }
 
-            auto &m=slot->msgs[slot->n];
-            m.p_edge=&e;
-            memcpy(&m.payload[0], msg, size);
-            slot->n++;
+            slot->append(e, msg, size);
 
-            if(slot->n==MAX_MESSAGES_PER_BUNDLE){
+            // Assume the next message to this cluster is probably the same size
+            if(!slot->can_append(size)){
                 flush_bundle(*this, slot);
             }
         }
@@ -496,8 +656,8 @@ struct POEMS
             assert(bundle);
             assert(bundle->next==0);
             assert(bundle->prev==0);
-            assert(0 < bundle->n && bundle->n <= MAX_MESSAGES_PER_BUNDLE );
-            assert(bundle->msgs[0].p_edge->dest_cluster == this);
+            assert(0 < bundle->n && bundle->bytes <= BUNDLE_DATA_BYTES );
+            assert(bundle->first_edge()->dest_cluster == this);
 
             bundle->next=incoming_bundle_queue.load(std::memory_order_relaxed);
             do{
@@ -520,10 +680,10 @@ struct POEMS
             if(USE_BUNDLES){
                 message_bundle *head=pop_bundle();
                 while(head){
-                    assert(0 < head->n && head->n <= MAX_MESSAGES_PER_BUNDLE);
-                    for(unsigned i=0; i<head->n; i++){
-                        cb(head->msgs[i]);
-                    }
+                    assert(0 < head->n && head->bytes <= BUNDLE_DATA_BYTES);
+                    head->for_each([&](const bundle_entry &e){
+                        cb(e.p_edge, e.payload);
+                    });
                     auto curr=head;
                     head=head->next;
                     bundle_pool.free(curr);
@@ -531,7 +691,7 @@ struct POEMS
             }else{
                 message_list *head=pop_list();
                 while(head){
-                    cb(head->msg);
+                    cb(head->msg.p_edge, &head->msg.payload[0]);
                     auto curr=head;
                     head=head->next;
                     pool.free(curr);
@@ -540,6 +700,50 @@ struct POEMS
         }
     };
 
+    enum phase_t{
+        PHASE_LOAD,
+        PHASE_CLUSTER, // Cluster assignment, including metis
+        PHASE_INIT,    // Setting up run-time structures before the workers start
+        PHASE_STEP,
+        PHASE_IDLE,    // Idle detection, including waiting for other threads
+        PHASE_FLUSH,
+        PHASE_COUNT
+    };
+
+    static std::vector<std::string> phase_names()
+    {
+        return {"load", "cluster", "init", "step", "idle", "flush"};
+    }
+
+    // Optional per-thread hardware counters, split by phase. Null if not wanted.
+    PerfPhaseCounters *m_phaseCounters=nullptr;
+
+    void enter_phase(unsigned phase)
+    {
+        if(m_phaseCounters){
+            m_phaseCounters->enter(phase);
+        }
+    }
+
+#ifdef POETS_HANDLER_PROFILER
+    HandlerProfiler m_profiler;
+
+    void profiler_init()
+    {
+        for(unsigned i=0; i<SPROVIDER_DEVICE_TYPE_COUNT; i++){
+            const auto &dti=SPROVIDER_DEVICE_TYPE_INFO[i];
+            std::vector<std::string> inputs, outputs;
+            for(unsigned j=0; j<dti.input_count; j++){
+                inputs.push_back(dti.inputs[j].name);
+            }
+            for(unsigned j=0; j<dti.output_count; j++){
+                outputs.push_back(dti.outputs[j].name);
+            }
+            m_profiler.add_device_type(dti.id, inputs, outputs);
+        }
+    }
+#endif
+
     bool try_send(shared_pool<message_list>::local_pool &pool, shared_pool<message_bundle>::local_pool &bundle_pool, device_cluster *cluster, const void *gp, device *dev, int &nonLocalMessagesSent, int &localMessagesSent)
     {
 #ifndef NDEBUG
@@ -552,7 +756,30 @@ struct POEMS
         int sendIndex=-1;
         int action_taken=-2;
         unsigned size;
+        POEMS_PROFILE_BEGIN(prof);
         bool active=sprovider_try_send_or_compute(nullptr, dev->device_type_index, gp, dev->properties_then_state, &action_taken, &output_port_index, &size, &sendIndex, payload_buffer);
+        POEMS_PROFILE_END(prof, action_slot(dev->device_type_index, action_taken));
+        return complete_send(pool, bundle_pool, cluster, gp, dev, active, action_taken, output_port_index, size, sendIndex, payload_buffer, nonLocalMessagesSent, localMessagesSent);
+    }
+
+    // As try_send, but with rts and requestCompute already calculated for the current device state
+    bool try_send_with_rts(shared_pool<message_list>::local_pool &pool, shared_pool<message_bundle>::local_pool &bundle_pool, device_cluster *cluster, const void *gp, device *dev, uint32_t rts, bool requestCompute, int &nonLocalMessagesSent, int &localMessagesSent)
+    {
+        char payload_buffer[SPROVIDER_MAX_PAYLOAD_SIZE];
+
+        int output_port_index=-1;
+        int sendIndex=-1;
+        int action_taken=-2;
+        unsigned size;
+        POEMS_PROFILE_BEGIN(prof);
+        bool active=sprovider_send_or_compute_with_rts(nullptr, dev->device_type_index, gp, dev->properties_then_state, rts, requestCompute, &action_taken, &output_port_index, &size, &sendIndex, payload_buffer);
+        POEMS_PROFILE_END(prof, action_slot(dev->device_type_index, action_taken));
+        return complete_send(pool, bundle_pool, cluster, gp, dev, active, action_taken, output_port_index, size, sendIndex, payload_buffer, nonLocalMessagesSent, localMessagesSent);
+    }
+
+    // Deals with the outcome of a send or compute handler, including delivering any message
+    bool complete_send(shared_pool<message_list>::local_pool &pool, shared_pool<message_bundle>::local_pool &bundle_pool, device_cluster *cluster, const void *gp, device *dev, bool active, int action_taken, int output_port_index, unsigned size, int sendIndex, const char *payload_buffer, int &nonLocalMessagesSent, int &localMessagesSent)
+    {
         assert(
             (action_taken==-2 && output_port_index < 0 && !active)
             ||
@@ -575,6 +802,16 @@ struct POEMS
 
         // If we got here then doSend was true
 
+        const auto &output_info=SPROVIDER_DEVICE_TYPE_INFO[dev->device_type_index].outputs[output_port_index];
+        unsigned size_padded=output_info.message_size_padded;
+        assert(size<=size_padded);
+
+        if(SPROVIDER_GRAPH_TYPE_INFO.has_supervisor && output_info.is_supervisor){
+            post_message_to_supervisor(bundle_pool, *cluster, *dev->supervisor_edge, payload_buffer, size_padded);
+            nonLocalMessagesSent++;
+            return true;
+        }
+
         const auto &output=dev->output_ports[output_port_index];
 
         const edge *pEdges;
@@ -591,9 +828,15 @@ struct POEMS
             const auto &edge=pEdges[i];
             if(edge.is_local){
                 auto dest_dev=edge.dest_device;
+                POEMS_PROFILE_BEGIN(prof);
                 bool active=sprovider_do_recv(nullptr, dest_dev->device_type_index, edge.pin_index, gp, dest_dev->properties_then_state, edge.properties_then_state, payload_buffer);
+                POEMS_PROFILE_END(prof, recv_slot(dest_dev->device_type_index, edge.pin_index));
                 unsigned dest_cluster_offset=edge.dest_device_offset_in_cluster;
                 edge.dest_cluster->set_device_active(dest_cluster_offset, active);
+                // Any rts calculated for the destination in the current batch is now stale
+                if(dest_cluster_offset >= cluster->batch_window_begin && dest_cluster_offset-cluster->batch_window_begin < BATCH_WIDTH){
+                    cluster->batch_window_dirty |= 1u<<(dest_cluster_offset-cluster->batch_window_begin);
+                }
 #ifndef NDEBUG
                 //fprintf(stderr, "     Delivering from %s:%u to %s:%u\n", dev->id, output_port_index, dest_dev->id, dest_dev->device_type_index);
                 //dump_state(stderr, dest_dev->cluster, dest_dev);
@@ -601,7 +844,7 @@ struct POEMS
                 localMessagesSent++;
             }else{
                 if(USE_BUNDLES){
-                    cluster->post_message_to_bundle(bundle_pool, edge, payload_buffer, size);
+                    cluster->post_message_to_bundle(bundle_pool, edge, payload_buffer, size_padded);
                 }else{
                     message_list *m=pool.alloc();
                     assert(m);
@@ -620,15 +863,16 @@ struct POEMS
     {
         bool anyActive=false;
 
-        cluster->pop_and_process_messages(pool, bundle_pool, [&](message &m) {
-            const auto *pedge=m.p_edge;
+        cluster->pop_and_process_messages(pool, bundle_pool, [&](const edge *pedge, const void *payload) {
             assert(pedge);
             auto *dev=pedge->dest_device;
             assert(pedge->dest_cluster==dev->cluster);
             assert(pedge->dest_cluster==cluster);
             assert(dev->cluster==cluster);
             assert(cluster->devices[dev->offset_in_cluster]==dev);
-            bool active=sprovider_do_recv(nullptr, dev->device_type_index, pedge->pin_index, gp, dev->properties_then_state, pedge->properties_then_state, &m.payload[0]);
+            POEMS_PROFILE_BEGIN(prof);
+            bool active=sprovider_do_recv(nullptr, dev->device_type_index, pedge->pin_index, gp, dev->properties_then_state, pedge->properties_then_state, payload);
+            POEMS_PROFILE_END(prof, recv_slot(dev->device_type_index, pedge->pin_index));
             cluster->set_device_active(dev->offset_in_cluster, active); // Any messages mean we need to check rts at some point
             anyActive = anyActive || active;
             nonLocalMessagesReceived++;
@@ -690,16 +934,19 @@ struct POEMS
         }
 
         cluster.numNonLocalFlushes += 1;
+        cluster.numNonLocalFlushedMessages += slot->n;
+        cluster.numNonLocalFlushedBytes += slot->bytes;
 
         assert(slot->n>0);
         slot->next=0;
         slot->prev=0;
 
-        unsigned dest_cluster_index=slot->msgs[0].p_edge->dest_cluster_index;
+        const edge *first=slot->first_edge();
+        unsigned dest_cluster_index=first->dest_cluster_index;
         assert(slot==cluster.postBundles[dest_cluster_index]);
         cluster.postBundles[dest_cluster_index] = 0;
 
-        device_cluster *dest_cluster=slot->msgs[0].p_edge->dest_cluster;
+        device_cluster *dest_cluster=first->dest_cluster;
         dest_cluster->push_bundle(slot);
     }
 
@@ -718,6 +965,81 @@ struct POEMS
         }
     }
 
+    /*
+        Batched version of the send loop in step_cluster. Devices in each run of the same type
+        are taken BATCH_WIDTH at a time, and if any are active then the rts handler is evaluated
+        for the whole group in lockstep using sprovider_calc_rts_batch. Only the devices that
+        are ready then go through the (scalar) send or compute handlers, and active devices that
+        turned out not to be ready are switched off without calling into the provider again.
+
+        A local delivery can change the state of a later device in the same group, in which case
+        its batched rts is stale and it falls back to try_send. Runs for types without batch
+        handlers use try_send throughout.
+    */
+    bool send_batched(
+        shared_pool<message_list>::local_pool &pool,
+        shared_pool<message_bundle>::local_pool &bundle_pool,
+        const void *gp,
+        device_cluster &cluster,
+        int &nonLocalMessagesSent,
+        int &localMessagesSent
+    ){
+        bool anyActive=false;
+        uint32_t rts[BATCH_WIDTH];
+        bool rtc[BATCH_WIDTH];
+
+        for(const device_run &run : cluster.device_runs){
+            for(unsigned base=run.begin; base<run.end; base+=BATCH_WIDTH){
+                unsigned n=(run.end-base < BATCH_WIDTH) ? run.end-base : BATCH_WIDTH;
+                uint32_t active=cluster.get_devices_active(base, n);
+                if(!active){
+                    continue;
+                }
+
+                if(!run.batch){
+                    for(unsigned j=0; j<n; j++){
+                        if(active & (1u<<j)){
+                            bool a=try_send(pool, bundle_pool, &cluster, gp, cluster.devices[base+j], nonLocalMessagesSent, localMessagesSent);
+                            anyActive=anyActive || a;
+                        }
+                    }
+                    continue;
+                }
+
+                const uint8_t *dp_ds_base=cluster.devices[base]->properties_then_state;
+                bool ok=sprovider_calc_rts_batch(nullptr, run.device_type_index, gp, n, dp_ds_base, run.stride, rts, rtc);
+                assert(ok);
+                cluster.numBatchGroups++;
+
+                cluster.batch_window_begin=base;
+                cluster.batch_window_dirty=0;
+                for(unsigned j=0; j<n; j++){
+                    device *dev=cluster.devices[base+j];
+                    assert(dev->properties_then_state==dp_ds_base+j*run.stride);
+                    if(!(active & (1u<<j))){
+                        // Inactive devices are precisely idle, unless something was delivered to them since
+                        assert( (cluster.batch_window_dirty & (1u<<j)) || (rts[j]==0 && !rtc[j]) );
+                        continue;
+                    }
+                    bool a;
+                    if(cluster.batch_window_dirty & (1u<<j)){
+                        cluster.numBatchFallbacks++;
+                        a=try_send(pool, bundle_pool, &cluster, gp, dev, nonLocalMessagesSent, localMessagesSent);
+                    }else if(rts[j]==0 && !rtc[j]){
+                        cluster.set_device_active(base+j, false);
+                        a=false;
+                    }else{
+                        cluster.numBatchDevices++;
+                        a=try_send_with_rts(pool, bundle_pool, &cluster, gp, dev, rts[j], rtc[j], nonLocalMessagesSent, localMessagesSent);
+                    }
+                    anyActive=anyActive || a;
+                }
+                cluster.batch_window_begin=NO_BATCH_WINDOW;
+            }
+        }
+        return anyActive;
+    }
+
     /*
         A key principle is when processing clusters we always check if there are
         messages to receive. This lets us get round race conditions todo with the
@@ -757,7 +1079,9 @@ struct POEMS
                 sprovider_calc_rts(nullptr, dev->device_type_index, gp, dev->properties_then_state, &rts, &rtc);
                 assert(rts==0 && rtc==0);
                 #endif
+                POEMS_PROFILE_BEGIN(prof);
                 bool active=sprovider_do_hardware_idle(nullptr, dev->device_type_index, gp, dev->properties_then_state);
+                POEMS_PROFILE_END(prof, hardware_idle_slot(dev->device_type_index));
                 cluster.set_device_active(dev->offset_in_cluster, active);
             }
             cluster.provider_do_hardware_idle=false;
@@ -774,7 +1098,11 @@ struct POEMS
         bool anyActiveFromReceive=try_recv(pool, bundle_pool, &cluster, gp, nonLocalMessagesReceivedDelta);
 
         bool anyActive=false;
-        if(!throttleSend && (cluster.active || anyActiveFromReceive))
+        if(!throttleSend && (cluster.active || anyActiveFromReceive) && !cluster.device_runs.empty())
+        {
+            anyActive=send_batched(pool, bundle_pool, gp, cluster, nonLocalMessagesSentDelta, localMessagesSentAndReceivedDelta);
+        }
+        else if(!throttleSend && (cluster.active || anyActiveFromReceive))
         {
             for(unsigned i_base=0; i_base<cluster.devices_active_mask.size(); i_base++){
                 uint64_t m=cluster.devices_active_mask[i_base];
@@ -807,10 +1135,19 @@ struct POEMS
         cluster.sanity(gp);
 #endif
 
-        if(!anyActive){
-            anyActive=flush_head(cluster);
+        {
+            PerfPhaseCounters::scope phase(m_phaseCounters, PHASE_FLUSH);
+
+            if(!anyActive){
+                anyActive=flush_head(cluster);
+            }
+            //while(flush_head(cluster));
+
+            // Supervisor messages are batched per step rather than waiting for the bundle to fill
+            if(cluster.supervisorBundle){
+                flush_supervisor_bundle(cluster);
+            }
         }
-        //while(flush_head(cluster));
 
         cluster.active=anyActive || throttleSend;
 
@@ -843,15 +1180,76 @@ struct POEMS
     // This really shouldn't live here
     bool use_metis=true;
 
+    // Lay out same-type devices contiguously within clusters and use the provider's
+    // batch rts handlers where available. Must be set before the graph is loaded.
+    bool m_batchExecution=false;
+
     const void *m_gp;
     std::vector<device*> m_devices;
     std::vector<device_cluster*> m_clusters;
     concurrent_queue_impl<device_cluster*> m_cluster_queue;
     //moodycamel::ConcurrentQueue<device_cluster*> m_cluster_queue;
 
+    // Clusters stepped by this process. Equal to m_clusters unless running distributed.
+    std::vector<device_cluster*> m_local_clusters;
+
+    // Approximate number of messages sent from this process but not yet received.
+    int64_t in_flight_approx() const
+    {
+        return (int64_t)(nonlocal_sent_total(std::memory_order_relaxed)+m_remoteIn.load(std::memory_order_relaxed))
+            - (int64_t)(nonlocal_received_total(std::memory_order_relaxed)+m_remoteOut.load(std::memory_order_relaxed));
+    }
+
+    struct bundle_stats_t
+    {
+        uint64_t bundles=0;
+        uint64_t messages=0;
+        uint64_t bytes=0;
+
+        double messages_per_bundle() const
+        { return bundles ? messages/(double)bundles : 0.0; }
+
+        double fill() const
+        { return bundles ? bytes/(double(bundles)*BUNDLE_DATA_BYTES) : 0.0; }
+    };
+
+    // Not synchronised with the workers, so only approximate while running
+    bundle_stats_t bundle_stats_approx() const
+    {
+        bundle_stats_t res;
+        for(const auto *c : m_clusters){
+            res.bundles += c->numNonLocalFlushes;
+            res.messages += c->numNonLocalFlushedMessages;
+            res.bytes += c->numNonLocalFlushedBytes;
+        }
+        return res;
+    }
+
+    struct batch_stats_t
+    {
+        uint64_t groups=0;
+        uint64_t devices=0;
+        uint64_t fallbacks=0;
+
+        double devices_per_group() const
+        { return groups ? devices/(double)groups : 0.0; }
+    };
+
+    // Not synchronised with the workers, so only approximate while running
+    batch_stats_t batch_stats_approx() const
+    {
+        batch_stats_t res;
+        for(const auto *c : m_clusters){
+            res.groups += c->numBatchGroups;
+            res.devices += c->numBatchDevices;
+            res.fallbacks += c->numBatchFallbacks;
+        }
+        return res;
+    }
+
     uint64_t total_received_messages_approx()
     {
-        uint64_t received=m_globalNonLocalReceives.load();
+        uint64_t received=nonlocal_received_total();
         for(auto *c : m_clusters){
             // Warning: this is _not_ synchronised
             //received += c->localMessagesSentAndReceived;
@@ -877,176 +1275,1556 @@ struct POEMS
 #endif
     }
 
-    /* Idle detection.
-    
-        If a cluster is idle (no receives or sends in a pass), then there is a chance that the whole thing has gone idle.
-        We take a heuristic approach to this, by first trying to guess when things are idle, then switching to
-        a correct approach when it seems very likely we are idle.
-
-        There is a global atomic counter which tracks the number of consecutive idle clusters processed across all threads.
-        Any time a thread processes an idle cluster it increments the counter, and every time it processes a
-        non-idle cluster it resets it to zero. We also track the number of non-local messages that have been
-        sent and received. So it is _likely_ that we are idle if the following conditions hold:
-        - consecutiveIdle > numClusters+SAFETY = INACTIVE_THRESHOLD
-        - nonLocalSent == nonLocalReceived
+    /* Distributed execution.
+
+        Every process loads the whole graph and builds the same cluster assignment, then
+        contiguous blocks of clusters are owned by each rank. Only local clusters are stepped.
+        Remote clusters still exist, and workers push bundles into their incoming queues
+        exactly as for local clusters. A per-process network thread drains those queues,
+        turns each message into (edge id, size, payload) and forwards it over the transport. Edge ids
+        are assigned by enumerating edges in load order, so both sides agree on them without
+        exchanging tables. After setup, non-local devices drop their outgoing edges, and edges
+        into this process are kept in m_remote_in_edges.
+
+        This does not reduce memory per process. The cluster assignment needs the whole graph,
+        so every rank parses all of it and keeps every device with its properties and state.
+
+        Idle detection counts messages leaving this process (m_remoteOut) as received, and
+        messages arriving (m_remoteIn) as sent, so a process can detect when it is locally idle.
+        It then waits in check_for_idle_verify for the rest of the system. Rank 0 runs waves of
+        status probes, and declares global idle using the four-counter method: every rank is
+        idle, the total sent between processes equals the total received, and the counts are
+        identical in two consecutive waves. Each rank then runs hardware idle.
+     */
 
-        INACTIVE_THRESHOLD should be quite conservative, 
-        
-        These three counters are a potential bottleneck, so we need to make sure clusters are large enough to amortise this cust.
-        They should probably all be in the same cache line as well, as typically they are all accessed together.
+    enum distributed_frame_kind : uint32_t
+    {
+        FRAME_PARTITION = 1,
+        FRAME_BUNDLE,
+        FRAME_PROBE,
+        FRAME_STATUS,
+        FRAME_GLOBAL_IDLE,
+        FRAME_EXIT
+    };
 
-        When a thread finds the inactive counter exceeds INACTIVE_THRESHOLD and sent==received, it will block. As each following
-        thread hits the same counter it will block on the same lock. When the final thread enters the lock, it will verify
-        that:
-        - non-local sent == non-local received
-        - each cluster is inactive.
-        Once it has checked each cluster, it sets the provider_do_hardware_idle flag, and then wakes up all the threads.
+#pragma pack(push,1)
+    struct distributed_status_t
+    {
+        uint32_t wave;
+        uint32_t idle;
+        uint64_t remote_out;
+        uint64_t remote_in;
+        uint64_t messages;
+    };
+#pragma pack(pop)
 
-        If it turns out that the wake-up was incorrect, it resets the idle wait count, and wakes up the other threads.
+    POEMSTransport *m_transport=nullptr;
 
-        We can be sure that all pending hardware idles must be dealt with before another idle is possible,
-        as any cluster that still has pending hardware idle is also marked as active.
-     */
+    std::vector<device_cluster*> m_remote_clusters;
+    std::vector<unsigned> m_cluster_rank;
+    std::unordered_map<const edge*,uint32_t> m_remote_out_edge_ids;
+    std::vector<std::vector<edge>> m_remote_in_edges; // Indexed by [source rank][edge id]
+    std::vector<std::vector<char>> m_remote_in_edge_data;
+    uint64_t m_partition_hash=0;
 
-    
-    uint8_t _pad1_[128];
-    std::atomic<uint64_t> m_globalNonLocalSends;
-    std::atomic<uint64_t> m_globalNonLocalReceives;
-    std::atomic<uint64_t> m_globalInactiveClusters;
-    std::atomic<unsigned> m_idleDetectionWaiters; // Number of threads currently blocked on idle detection
-    uint8_t _pad2_[128];
+    std::atomic<uint64_t> m_remoteOut{0};
+    std::atomic<uint64_t> m_remoteIn{0};
 
-    uint64_t m_lastCheckpointTotalMessageCount=-1;
-    unsigned m_nonMessageRoundCount=0;
-    unsigned m_maxNonMessageRoundCount=10;
+    // Protected by m_distributedMutex
+    std::mutex m_distributedMutex;
+    std::condition_variable m_distributedCond;
+    bool m_localIdle=false;
+    uint64_t m_localIdleOut=0;
+    uint64_t m_localIdleIn=0;
+    uint64_t m_localIdleMessages=0;
+    bool m_globalIdlePending=false;
+    uint64_t m_globalIdleMessages=0;
 
-    unsigned m_idleDetectionInactiveThreshold; // Number of clusters plus some safety factor
-    std::mutex m_idleDetectionMutex;
-    std::condition_variable m_idleDetectionCond;
+    std::vector<std::tuple<unsigned,uint32_t,std::vector<char>>> m_deferred_frames;
 
-    void check_for_idle_verify(unsigned nThreads)
+    void setup_partition()
     {
-        /////////////////////////////////////////////////////////////////
-        // Begin lock
-        std::unique_lock<std::mutex> lk(m_idleDetectionMutex);
-        unsigned waiters=1+m_idleDetectionWaiters.fetch_add(1);
-        if(waiters<nThreads){
-            // Either we went to sleep erroneously, or there was an idle. Either way we don't care
-            // and just leave when the inactive clusters drops below the threshold
-            m_idleDetectionCond.wait(lk);
-        }else{
-            // We are the final thread.
+        if(!m_transport){
+            m_local_clusters=m_clusters;
+            return;
+        }
 
-            // Have to capture once more, to get the definitive final version
-            uint64_t totalNonLocalSent=m_globalNonLocalSends.load();
-            uint64_t totalNonLocalReceived=m_globalNonLocalReceives.load();
+        unsigned nRanks=m_transport->size();
+        unsigned rank=m_transport->rank();
+        if(m_clusters.size() < nRanks){
+            fprintf(stderr, "Graph only has %u clusters, which is not enough for %u ranks. Try a smaller cluster size.\n", unsigned(m_clusters.size()), nRanks);
+            exit(1);
+        }
+        if(SPROVIDER_GRAPH_TYPE_INFO.has_supervisor){
+            fprintf(stderr, "Supervisors are not supported when running distributed.\n");
+            exit(1);
+        }
 
-            if(totalNonLocalSent!=totalNonLocalReceived){
-                assert(totalNonLocalSent > totalNonLocalReceived); // Should be a consistent view at this point
-                // We have not yet reached idle as there are messages in flight. So there is some message
-                // still to be delivered within some cluster.
+        // Contiguous blocks of clusters. Metis recursive bisection numbers partitions hierarchically,
+        // so this keeps neighbouring partitions within the same process.
+        m_cluster_rank.resize(m_clusters.size());
+        m_local_clusters.clear();
+        m_remote_clusters.clear();
+        for(unsigned i=0; i<m_clusters.size(); i++){
+            m_cluster_rank[i]=(uint64_t(i)*nRanks)/m_clusters.size();
+            if(m_cluster_rank[i]==rank){
+                m_local_clusters.push_back(m_clusters[i]);
             }else{
-                // Verify that all clusters are inactive
-                uint64_t totalLocalMessages=0;
-                bool active=false;
-                for(auto *cluster : m_clusters){
-                    if(cluster->active){
-                        active=true;
-                        break;
-                    }
-                    totalLocalMessages += cluster->localMessagesSentAndReceived;
+                m_remote_clusters.push_back(m_clusters[i]);
+            }
+        }
 
-                    #ifndef NDEBUG
-                    for(auto *dev : cluster->devices){
-                        uint32_t rts=0;
-                        bool rtc=0;
-                        bool aa=sprovider_calc_rts(nullptr, dev->device_type_index, m_gp, dev->properties_then_state, &rts, &rtc);
-                        assert(!aa);
-                        assert( aa ? 1 : rts==0 && rtc==0);
-                        assert(rts==0 && rtc==0);        
-                    }
-                    #endif
-                }
-                if(!active){
-                    // Yes! We have reach idle: all messages sent have been received, and no cluster is active
-                    uint64_t totalMessages=totalNonLocalSent+totalLocalMessages;
-                    //fprintf(stderr, "Idle: nonLocal=%llu, local=%llu, total=%llu\n", (unsigned long long)totalNonLocalSent, (unsigned long long)totalLocalMessages, (unsigned long long)totalMessages);
+        std::vector<uint32_t> nextOutId(nRanks, 0);
+        m_remote_in_edges.assign(nRanks, {});
+        m_remote_in_edge_data.assign(nRanks, {});
+        std::vector<std::vector<unsigned>> inDataOffsets(nRanks);
 
-                    if(m_lastCheckpointTotalMessageCount!=totalMessages){
-                        m_nonMessageRoundCount=0;
-                        m_lastCheckpointTotalMessageCount=totalMessages;
-                    }else{
-                        m_nonMessageRoundCount++;
-                        if(m_nonMessageRoundCount>m_maxNonMessageRoundCount){
-                            fprintf(stderr, "Error: system has completed %u idle steps without sending a message. Terminating.\n", m_nonMessageRoundCount);
-                            exit(1);
-                        }
-                    }
+        uint64_t hash=0xcbf29ce484222325ull;
+        auto mix=[&](uint64_t x){
+            hash = (hash ^ x) * 0x100000001b3ull;
+        };
 
-                    for(auto *cluster : m_clusters){
-                        cluster->active=true; // Wake up the cluster
-                        cluster->provider_do_hardware_idle=true; // And indicate idle needs to be run
+        for(device *d : m_devices){
+            unsigned srcRank=m_cluster_rank[d->cluster->cluster_index];
+            mix(d->cluster->cluster_index);
+            mix(d->offset_in_cluster);
+            for(auto &op : d->output_ports){
+                mix(op.edges.size());
+                for(edge &e : op.edges){
+                    mix(e.dest_cluster_index);
+                    mix(e.dest_device_offset_in_cluster);
+                    unsigned dstRank=m_cluster_rank[e.dest_cluster_index];
+                    if(srcRank==dstRank){
+                        continue;
+                    }
+                    if(srcRank==rank){
+                        m_remote_out_edge_ids[&e]=nextOutId[dstRank]++;
+                    }else if(dstRank==rank){
+                        const auto &input_info=SPROVIDER_DEVICE_TYPE_INFO[e.dest_device->device_type_index].inputs[e.pin_index];
+                        auto &data=m_remote_in_edge_data[srcRank];
+                        unsigned offset=data.size();
+                        data.insert(data.end(), (const char*)e.properties_then_state, (const char*)e.properties_then_state+input_info.properties_state_size_padded);
+                        inDataOffsets[srcRank].push_back(offset);
+                        m_remote_in_edges[srcRank].push_back(e);
                     }
-                    // And that's it!
                 }
             }
+        }
+        m_partition_hash=hash;
 
-            // Regardless of the outcome we need to start idle detection again
-            m_globalInactiveClusters.store(0); // Start the process again
-            m_idleDetectionCond.notify_all(); // Wake up all the threads
+        for(unsigned r=0; r<nRanks; r++){
+            for(unsigned i=0; i<m_remote_in_edges[r].size(); i++){
+                m_remote_in_edges[r][i].properties_then_state=m_remote_in_edge_data[r].data()+inDataOffsets[r][i];
+            }
         }
-        m_idleDetectionWaiters.fetch_sub(1);
-        // End lock
-        //////////////////////////////////////////////////
 
-    }
+        // Devices in other processes never send from here
+        for(device *d : m_devices){
+            if(m_cluster_rank[d->cluster->cluster_index]!=rank){
+                std::vector<edge_vector>().swap(d->output_ports);
+            }
+        }
 
-    void check_for_idle(unsigned nThreads, bool clusterActive, unsigned nonLocalSent, unsigned nonLocalReceived)
+        unsigned inEdges=0;
+        for(const auto &v : m_remote_in_edges){
+            inEdges+=v.size();
+        }
+        fprintf(stderr, "Rank %u of %u owns %u of %u clusters, with %u outgoing and %u incoming remote edges.\n",
+            rank, nRanks, unsigned(m_local_clusters.size()), unsigned(m_clusters.size()), unsigned(m_remote_out_edge_ids.size()), inEdges);
+    }
+
+    // Make sure everyone has built the same partition before any messages move
+    void distributed_barrier()
+    {
+        unsigned nRanks=m_transport->size();
+        for(unsigned r=0; r<nRanks; r++){
+            if(r!=m_transport->rank()){
+                m_transport->send(r, FRAME_PARTITION, &m_partition_hash, sizeof(m_partition_hash));
+            }
+        }
+        unsigned seen=0;
+        while(seen+1 < nRanks){
+            m_transport->pump(10, [&](unsigned src, uint32_t kind, const char *payload, size_t bytes){
+                if(kind==FRAME_PARTITION){
+                    uint64_t other;
+                    memcpy(&other, payload, sizeof(other));
+                    if(other!=m_partition_hash){
+                        fprintf(stderr, "Rank %u built a different partition to rank %u. Are they running the same graph and options?\n", src, m_transport->rank());
+                        exit(1);
+                    }
+                    seen++;
+                }else{
+                    // Faster ranks may already be running
+                    m_deferred_frames.emplace_back(src, kind, std::vector<char>(payload, payload+bytes));
+                }
+            });
+        }
+    }
+
+    // Called by the final thread in check_for_idle_verify once this process is idle. Returns true
+    // if the whole system is idle, or false if work arrived from another process.
+    bool wait_for_global_idle(uint64_t localMessages, uint64_t &globalMessages)
+    {
+        std::unique_lock<std::mutex> lk(m_distributedMutex);
+        m_localIdleOut=m_remoteOut.load();
+        m_localIdleIn=m_remoteIn.load();
+        m_localIdleMessages=localMessages;
+        m_localIdle=true;
+        while(!m_globalIdlePending && m_remoteIn.load()==m_localIdleIn){
+            m_distributedCond.wait_for(lk, std::chrono::milliseconds(1));
+        }
+        m_localIdle=false;
+        if(m_globalIdlePending){
+            m_globalIdlePending=false;
+            globalMessages=m_globalIdleMessages;
+            return true;
+        }
+        return false;
+    }
+
+    distributed_status_t get_local_status(uint32_t wave)
+    {
+        std::unique_lock<std::mutex> lk(m_distributedMutex);
+        distributed_status_t res;
+        res.wave=wave;
+        res.remote_out=m_remoteOut.load();
+        res.remote_in=m_remoteIn.load();
+        res.messages=m_localIdleMessages;
+        res.idle= m_localIdle && !m_globalIdlePending && res.remote_out==m_localIdleOut && res.remote_in==m_localIdleIn;
+        return res;
+    }
+
+    void on_global_idle(uint64_t messages)
+    {
+        std::unique_lock<std::mutex> lk(m_distributedMutex);
+        assert(!m_globalIdlePending);
+        m_globalIdlePending=true;
+        m_globalIdleMessages=messages;
+        m_distributedCond.notify_all();
+    }
+
+    void distributed_loop(std::atomic<bool> &quit, shared_pool<message_bundle> &gbundlepool)
+    {
+        auto lbundlepool=gbundlepool.create_local_pool();
+
+        const unsigned nRanks=m_transport->size();
+        const unsigned rank=m_transport->rank();
+
+        std::vector<std::vector<char>> outgoing(nRanks);
+        std::vector<message_bundle*> incoming(m_clusters.size(), nullptr);
+        std::vector<unsigned> touched;
+
+        // Coordinator state, only used on rank 0
+        uint32_t wave=0;
+        bool waveActive=false;
+        unsigned statusCount=0;
+        std::vector<distributed_status_t> statuses(nRanks), prevStatuses(nRanks);
+        bool prevValid=false;
+
+        // Number of global idles seen. Messages are tagged with the sender's epoch, and any from
+        // a later epoch are held back until we have also seen the global idle, as otherwise they
+        // could be delivered to a device before its hardware idle handler runs.
+        uint32_t epoch=0;
+        std::vector<std::tuple<uint32_t,unsigned,std::vector<char>>> early;
+
+        auto deliver=[&](unsigned src, const char *entries, size_t bytes){
+            const auto &edges=m_remote_in_edges[src];
+            size_t offset=0;
+            while(offset<bytes){
+                uint32_t id, size;
+                if(offset+2*sizeof(uint32_t) > bytes){
+                    fprintf(stderr, "Truncated message from rank %u.\n", src);
+                    exit(1);
+                }
+                memcpy(&id, entries+offset, sizeof(id));
+                memcpy(&size, entries+offset+sizeof(id), sizeof(size));
+                offset+=2*sizeof(uint32_t);
+                if(id>=edges.size() || size>SPROVIDER_MAX_PAYLOAD_SIZE || offset+size>bytes){
+                    fprintf(stderr, "Received invalid message for edge %u from rank %u.\n", id, src);
+                    exit(1);
+                }
+                const edge &e=edges[id];
+                auto &slot=incoming[e.dest_cluster_index];
+                if(slot && !slot->can_append(size)){
+                    m_remoteIn.fetch_add(slot->n); // Must be counted before it can be received
+                    e.dest_cluster->push_bundle(slot);
+                    slot=0;
+                }
+                if(!slot){
+                    touched.push_back(e.dest_cluster_index);
+                    slot=lbundlepool.alloc();
+                    slot->clear();
+                }
+                slot->append(e, entries+offset, size);
+                offset+=size;
+            }
+            for(unsigned index : touched){
+                auto &slot=incoming[index];
+                if(slot){
+                    m_remoteIn.fetch_add(slot->n);
+                    slot->first_edge()->dest_cluster->push_bundle(slot);
+                    slot=0;
+                }
+            }
+            touched.clear();
+            m_distributedCond.notify_all();
+        };
+
+        auto advance_epoch=[&](uint64_t messages){
+            // Workers are all blocked in check_for_idle_verify, so hardware idle will be
+            // flagged on every cluster before any of the held back messages are received.
+            on_global_idle(messages);
+            epoch++;
+            auto it=std::stable_partition(early.begin(), early.end(), [&](const auto &f){ return std::get<0>(f)!=epoch; });
+            for(auto itDeliver=it; itDeliver!=early.end(); ++itDeliver){
+                deliver(std::get<1>(*itDeliver), std::get<2>(*itDeliver).data(), std::get<2>(*itDeliver).size());
+            }
+            early.erase(it, early.end());
+        };
+
+        auto declare_global_idle=[&](uint64_t messages){
+            for(unsigned r=0; r<nRanks; r++){
+                if(r!=rank){
+                    m_transport->send(r, FRAME_GLOBAL_IDLE, &messages, sizeof(messages));
+                }
+            }
+            advance_epoch(messages);
+        };
+
+        auto on_status=[&](unsigned src, const distributed_status_t &status){
+            if(!waveActive || status.wave!=wave){
+                return;
+            }
+            statuses[src]=status;
+            if(++statusCount < nRanks){
+                return;
+            }
+            waveActive=false;
+
+            bool allIdle=true, same=prevValid;
+            uint64_t sumOut=0, sumIn=0, sumMessages=0;
+            for(unsigned r=0; r<nRanks; r++){
+                const auto &s=statuses[r];
+                allIdle = allIdle && s.idle;
+                sumOut+=s.remote_out;
+                sumIn+=s.remote_in;
+                sumMessages+=s.messages;
+                same = same && s.remote_out==prevStatuses[r].remote_out && s.remote_in==prevStatuses[r].remote_in;
+            }
+            if(allIdle && sumOut==sumIn){
+                if(same){
+                    prevValid=false;
+                    declare_global_idle(sumMessages);
+                }else{
+                    prevStatuses=statuses;
+                    prevValid=true;
+                }
+            }else{
+                prevValid=false;
+            }
+        };
+
+        auto on_frame=[&](unsigned src, uint32_t kind, const char *payload, size_t bytes){
+            switch(kind){
+            case FRAME_BUNDLE:
+            {
+                uint32_t frameEpoch;
+                memcpy(&frameEpoch, payload, sizeof(frameEpoch));
+                if(frameEpoch!=epoch){
+                    // The sender has already seen a global idle which hasn't reached us yet
+                    assert(frameEpoch>epoch);
+                    early.emplace_back(frameEpoch, src, std::vector<char>(payload+sizeof(frameEpoch), payload+bytes));
+                }else{
+                    deliver(src, payload+sizeof(frameEpoch), bytes-sizeof(frameEpoch));
+                }
+                break;
+            }
+            case FRAME_PROBE:
+            {
+                uint32_t w;
+                memcpy(&w, payload, sizeof(w));
+                auto status=get_local_status(w);
+                m_transport->send(src, FRAME_STATUS, &status, sizeof(status));
+                break;
+            }
+            case FRAME_STATUS:
+            {
+                distributed_status_t status;
+                memcpy(&status, payload, sizeof(status));
+                on_status(src, status);
+                break;
+            }
+            case FRAME_GLOBAL_IDLE:
+            {
+                uint64_t messages;
+                memcpy(&messages, payload, sizeof(messages));
+                advance_epoch(messages);
+                break;
+            }
+            case FRAME_EXIT:
+            {
+                int32_t code;
+                memcpy(&code, payload, sizeof(code));
+                g_application_exiting.store(true); // Don't tell everyone else again
+                fflush(stdout);
+                exit(code);
+            }
+            default:
+                fprintf(stderr, "Unexpected frame kind %u from rank %u\n", kind, src);
+                exit(1);
+            }
+        };
+
+        try{
+            for(auto &f : m_deferred_frames){
+                on_frame(std::get<0>(f), std::get<1>(f), std::get<2>(f).data(), std::get<2>(f).size());
+            }
+            m_deferred_frames.clear();
+
+            while(!quit.load(std::memory_order_relaxed)){
+                // Forward anything that workers have pushed to remote clusters
+                uint64_t forwarded=0;
+                for(device_cluster *c : m_remote_clusters){
+                    message_bundle *head=c->pop_bundle();
+                    if(!head){
+                        continue;
+                    }
+                    auto &buffer=outgoing[m_cluster_rank[c->cluster_index]];
+                    if(buffer.empty()){
+                        buffer.resize(sizeof(epoch));
+                        memcpy(&buffer[0], &epoch, sizeof(epoch));
+                    }
+                    while(head){
+                        head->for_each([&](const bundle_entry &m){
+                            uint32_t id=m_remote_out_edge_ids.at(m.p_edge);
+                            size_t offset=buffer.size();
+                            buffer.resize(offset+2*sizeof(uint32_t)+m.size);
+                            memcpy(&buffer[offset], &id, sizeof(id));
+                            memcpy(&buffer[offset+sizeof(id)], &m.size, sizeof(m.size));
+                            memcpy(&buffer[offset+2*sizeof(uint32_t)], m.payload, m.size);
+                        });
+                        forwarded+=head->n;
+                        message_bundle *curr=head;
+                        head=head->next;
+                        lbundlepool.free(curr);
+                    }
+                }
+                if(forwarded){
+                    m_remoteOut.fetch_add(forwarded);
+                    for(unsigned r=0; r<nRanks; r++){
+                        if(!outgoing[r].empty()){
+                            m_transport->send(r, FRAME_BUNDLE, outgoing[r].data(), outgoing[r].size());
+                            outgoing[r].clear();
+                        }
+                    }
+                }
+
+                if(rank==0 && !waveActive){
+                    auto status=get_local_status(wave+1);
+                    if(status.idle){
+                        wave++;
+                        waveActive=true;
+                        statusCount=0;
+                        for(unsigned r=1; r<nRanks; r++){
+                            m_transport->send(r, FRAME_PROBE, &wave, sizeof(wave));
+                        }
+                        on_status(0, status);
+                    }
+                }
+
+                m_transport->pump(forwarded ? 0 : 1, on_frame);
+            }
+        }catch(std::exception &e){
+            if(!g_application_exiting.exchange(true)){
+                fprintf(stderr, "Error in distributed transport : %s\n", e.what());
+                exit(1);
+            }
+        }
+    }
+
+    /* Supervisor.
+
+        Devices send to the supervisor by appending to a per-cluster bundle, which is pushed
+        onto m_supervisor_incoming at the end of each cluster step. A dedicated supervisor thread
+        pops the bundles and runs the supervisor receive handler for each message. Replies and
+        broadcasts are gathered into one bundle per destination cluster, and delivered using the
+        same incoming bundle queues as device to device messages.
+
+        Messages to and from the supervisor are counted as non-local sends and receives, so
+        idle detection still holds: the supervisor counts its sends before pushing a bundle,
+        and only counts its receives once the replies they caused have been sent. Supervisor
+        idle runs in check_for_idle_verify, once the system is idle and before hardware idle.
+     */
+
+    static const uint16_t NO_SUPERVISOR_INPUT = 0xFFFF;
+
+    // One edge per device with a supervisor pin. dest_device is the device itself, so the
+    // edge both identifies the sender of a message and routes replies and broadcasts back.
+    std::vector<edge> m_supervisor_edges;
+    std::atomic<message_bundle*> m_supervisor_incoming;
+
+    /* Sorts the devices within each cluster by type, and moves each run of same-type devices
+       that the provider has batch handlers for into a single allocation with a fixed stride.
+       Must happen after cluster assignment, but before edges are bound to cluster offsets. */
+    void layout_clusters_by_type()
+    {
+        std::unordered_map<device*,device*> moved;
+        unsigned nRuns=0;
+
+        for(auto *c : m_clusters){
+            auto &devices=c->devices;
+            std::stable_sort(devices.begin(), devices.end(), [](const device *a, const device *b){
+                return a->device_type_index < b->device_type_index;
+            });
+
+            c->device_runs.clear();
+            unsigned begin=0;
+            while(begin<devices.size()){
+                unsigned device_type_index=devices[begin]->device_type_index;
+                unsigned end=begin+1;
+                while(end<devices.size() && devices[end]->device_type_index==device_type_index){
+                    end++;
+                }
+
+                const auto &info=SPROVIDER_DEVICE_TYPE_INFO[device_type_index];
+                device_run run{begin, end, device_type_index, 0, false};
+                if(info.has_batch){
+                    unsigned P_S_size=info.properties_state_size_padded;
+                    unsigned stride=(sizeof(device)+P_S_size+alignof(device)-1) & ~unsigned(alignof(device)-1);
+                    // Never freed, in the same way as individually allocated devices
+                    uint8_t *slab=(uint8_t*)::operator new(size_t(stride)*(end-begin));
+                    for(unsigned i=begin; i<end; i++){
+                        device *old=devices[i];
+                        // The flexible array member means there is no implicit copy or move
+                        device *dev=::new (slab+size_t(stride)*(i-begin)) device();
+                        #ifndef NDEBUG
+                        dev->id=old->id;
+                        dev->device_type=std::move(old->device_type);
+                        #endif
+                        dev->device_type_index=old->device_type_index;
+                        dev->cluster=old->cluster;
+                        dev->supervisor_edge=old->supervisor_edge;
+                        dev->output_ports=std::move(old->output_ports);
+                        memcpy(dev->properties_then_state, old->properties_then_state, P_S_size);
+                        moved[old]=dev;
+                        devices[i]=dev;
+                    }
+                    run.stride=stride;
+                    run.batch=true;
+                }
+                c->device_runs.push_back(run);
+                nRuns++;
+                begin=end;
+            }
+
+            for(unsigned i=0; i<devices.size(); i++){
+                devices[i]->offset_in_cluster=i;
+            }
+        }
+
+        if(!moved.empty()){
+            for(device *&d : m_devices){
+                auto it=moved.find(d);
+                if(it!=moved.end()){
+                    d=it->second;
+                }
+            }
+            for(device *d : m_devices){
+                for(auto &o : d->output_ports){
+                    for(edge &e : o.edges){
+                        auto it=moved.find(e.dest_device);
+                        if(it!=moved.end()){
+                            e.dest_device=it->second;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Only free once nothing refers to the old devices, so that addresses can't be reused while remapping
+        for(auto &om : moved){
+            om.first->~device();
+            ::operator delete(om.first);
+        }
+
+        fprintf(stderr, "Laid out clusters as %u same-type runs, %u of %u devices in batch runs.\n", nRuns, unsigned(moved.size()), unsigned(m_devices.size()));
+    }
+
+    void build_supervisor_edges()
+    {
+        m_supervisor_edges.clear();
+        // Devices point into this vector, so it must never reallocate
+        m_supervisor_edges.reserve(m_devices.size());
+
+        for(device *d : m_devices){
+            const auto &dinfo=SPROVIDER_DEVICE_TYPE_INFO[d->device_type_index];
+            int input_index=-1;
+            bool has_output=false;
+            for(unsigned i=0; i<dinfo.input_count; i++){
+                if(dinfo.inputs[i].is_supervisor){
+                    input_index=i;
+                }
+            }
+            for(unsigned i=0; i<dinfo.output_count; i++){
+                has_output = has_output || dinfo.outputs[i].is_supervisor;
+            }
+            if(input_index==-1 && !has_output){
+                continue;
+            }
+
+            edge e;
+            e.dest_cluster=d->cluster;
+            e.dest_device=d;
+            e.properties_then_state=nullptr; // Supervisor pins have no properties or state
+            e.dest_device_offset_in_cluster=d->offset_in_cluster;
+            e.dest_cluster_index=d->cluster->cluster_index;
+            e.is_local=false;
+            e.pin_index= input_index==-1 ? NO_SUPERVISOR_INPUT : input_index;
+            m_supervisor_edges.push_back(e);
+            d->supervisor_edge=&m_supervisor_edges.back();
+        }
+    }
+
+    void post_message_to_supervisor(shared_pool<message_bundle>::local_pool &pool, device_cluster &cluster, const edge &e, const void *msg, unsigned size)
+    {
+        auto &slot=cluster.supervisorBundle;
+        if(slot && !slot->can_append(size)){
+            flush_supervisor_bundle(cluster);
+        }
+        if(!slot){
+            slot=pool.alloc();
+            slot->clear();
+        }
+
+        slot->append(e, msg, size);
+    }
+
+    void flush_supervisor_bundle(device_cluster &cluster)
+    {
+        message_bundle *bundle=cluster.supervisorBundle;
+        assert(bundle && bundle->n>0);
+        cluster.supervisorBundle=0;
+
+        bundle->next=m_supervisor_incoming.load(std::memory_order_relaxed);
+        do{
+        }while(!m_supervisor_incoming.compare_exchange_weak(bundle->next, bundle, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    void post_message_from_supervisor(shared_pool<message_bundle>::local_pool &pool, std::vector<message_bundle*> &outgoing, const edge &e, const void *msg)
+    {
+        assert(e.pin_index!=NO_SUPERVISOR_INPUT);
+
+        unsigned size=SPROVIDER_DEVICE_TYPE_INFO[e.dest_device->device_type_index].inputs[e.pin_index].message_size_padded;
+
+        auto &slot=outgoing[e.dest_cluster_index];
+        if(slot && !slot->can_append(size)){
+            push_bundle_from_supervisor(slot);
+            slot=0;
+        }
+        if(!slot){
+            slot=pool.alloc();
+            slot->clear();
+        }
+
+        slot->append(e, msg, size);
+    }
+
+    void push_bundle_from_supervisor(message_bundle *bundle)
+    {
+        // Sends must be visible before the messages can be received
+        m_globalNonLocalSends.fetch_add(bundle->n);
+        bundle->first_edge()->dest_cluster->push_bundle(bundle);
+    }
+
+    void supervisor_loop(std::atomic<bool> &quit, shared_pool<message_bundle> &gbundlepool)
+    {
+        auto lbundlepool=gbundlepool.create_local_pool();
+
+        std::vector<message_bundle*> outgoing(m_clusters.size(), nullptr);
+        std::array<uint8_t,SPROVIDER_MAX_PAYLOAD_SIZE> reply, bcast;
+
+        unsigned idleSpins=0;
+        while(!quit.load(std::memory_order_relaxed)){
+            message_bundle *head=m_supervisor_incoming.exchange(nullptr, std::memory_order_acquire);
+            if(!head){
+                if(++idleSpins < 1000){
+                    std::this_thread::yield();
+                }else{
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+                continue;
+            }
+            idleSpins=0;
+
+            // Bundles are pushed as a stack, so reverse to get them in arrival order
+            message_bundle *ordered=nullptr;
+            while(head){
+                message_bundle *next=head->next;
+                head->next=ordered;
+                ordered=head;
+                head=next;
+            }
+
+            uint64_t received=0;
+            while(ordered){
+                assert(0 < ordered->n && ordered->bytes <= BUNDLE_DATA_BYTES);
+                ordered->for_each([&](const bundle_entry &m){
+                    bool rtsReply=false, rtsBcast=false;
+                    reply.fill(0);
+                    bcast.fill(0);
+                    sprovider_supervisor_recv(m_gp, m.payload, &reply[0], &bcast[0], &rtsReply, &rtsBcast);
+                    if(rtsReply){
+                        if(m.p_edge->pin_index==NO_SUPERVISOR_INPUT){
+                            fprintf(stderr, "Supervisor replied to a device with no supervisor input pin.\n");
+                            exit(1);
+                        }
+                        post_message_from_supervisor(lbundlepool, outgoing, *m.p_edge, &reply[0]);
+                    }
+                    if(rtsBcast){
+                        for(const edge &e : m_supervisor_edges){
+                            if(e.pin_index!=NO_SUPERVISOR_INPUT){
+                                post_message_from_supervisor(lbundlepool, outgoing, e, &bcast[0]);
+                            }
+                        }
+                    }
+                    received++;
+                });
+                message_bundle *curr=ordered;
+                ordered=ordered->next;
+                lbundlepool.free(curr);
+            }
+
+            for(auto &slot : outgoing){
+                if(slot){
+                    push_bundle_from_supervisor(slot);
+                    slot=nullptr;
+                }
+            }
+
+            // Only count receives once everything they caused has been counted as sent
+            m_globalNonLocalReceives.fetch_add(received);
+        }
+    }
+
+    /* Idle detection.
+    
+        If a cluster is idle (no receives or sends in a pass), then there is a chance that the whole thing has gone idle.
+        We take a heuristic approach to this, by first trying to guess when things are idle, then switching to
+        a correct approach when it seems very likely we are idle.
+
+        There is a global atomic counter which tracks the number of consecutive idle clusters processed across all threads.
+        Any time a thread processes an idle cluster it increments the counter, and every time it processes a
+        non-idle cluster it resets it to zero. We also track the number of non-local messages that have been
+        sent and received. So it is _likely_ that we are idle if the following conditions hold:
+        - consecutiveIdle > numClusters+SAFETY = INACTIVE_THRESHOLD
+        - nonLocalSent == nonLocalReceived
+
+        INACTIVE_THRESHOLD should be quite conservative, 
+        
+        These three counters are a potential bottleneck, so we need to make sure clusters are large enough to amortise this cust.
+        They should probably all be in the same cache line as well, as typically they are all accessed together.
+
+        When a thread finds the inactive counter exceeds INACTIVE_THRESHOLD and sent==received, it will block. As each following
+        thread hits the same counter it will block on the same lock. When the final thread enters the lock, it will verify
+        that:
+        - non-local sent == non-local received
+        - each cluster is inactive.
+        Once it has checked each cluster, it sets the provider_do_hardware_idle flag, and then wakes up all the threads.
+
+        If it turns out that the wake-up was incorrect, it resets the idle wait count, and wakes up the other threads.
+
+        We can be sure that all pending hardware idles must be dealt with before another idle is possible,
+        as any cluster that still has pending hardware idle is also marked as active.
+     */
+
+    
+    uint8_t _pad1_[128];
+    std::atomic<uint64_t> m_globalNonLocalSends;
+    std::atomic<uint64_t> m_globalNonLocalReceives;
+    std::atomic<uint64_t> m_globalInactiveClusters;
+    std::atomic<unsigned> m_idleDetectionWaiters; // Number of threads currently blocked on idle detection
+    uint8_t _pad2_[128];
+
+    uint64_t m_lastCheckpointTotalMessageCount=-1;
+    unsigned m_nonMessageRoundCount=0;
+    unsigned m_maxNonMessageRoundCount=10;
+
+    unsigned m_idleDetectionInactiveThreshold; // Number of clusters plus some safety factor
+    std::mutex m_idleDetectionMutex;
+    std::condition_variable m_idleDetectionCond;
+
+    /* Called by whichever thread has exclusive access once this process is known to be quiescent.
+        Returns true if hardware idle should run, or false if work arrived from another process. */
+    bool confirm_idle(uint64_t totalMessages)
+    {
+        if(m_transport){
+            // This process is idle, but the others might not be
+            if(!wait_for_global_idle(totalMessages, totalMessages)){
+                return false;
+            }
+        }
+
+        // All supervisor messages have been received, so the supervisor thread is not in a handler
+        if(SPROVIDER_GRAPH_TYPE_INFO.has_supervisor){
+            sprovider_supervisor_idle(m_gp);
+        }
+        //fprintf(stderr, "Idle: total=%llu\n", (unsigned long long)totalMessages);
+
+        if(m_lastCheckpointTotalMessageCount!=totalMessages){
+            m_nonMessageRoundCount=0;
+            m_lastCheckpointTotalMessageCount=totalMessages;
+        }else{
+            m_nonMessageRoundCount++;
+            if(m_nonMessageRoundCount>m_maxNonMessageRoundCount){
+                fprintf(stderr, "Error: system has completed %u idle steps without sending a message. Terminating.\n", m_nonMessageRoundCount);
+                poems_application_exit(1);
+            }
+        }
+        return true;
+    }
+
+    void check_for_idle_verify(unsigned nThreads)
+    {
+        /////////////////////////////////////////////////////////////////
+        // Begin lock
+        std::unique_lock<std::mutex> lk(m_idleDetectionMutex);
+        unsigned waiters=1+m_idleDetectionWaiters.fetch_add(1);
+        if(waiters<nThreads){
+            // Either we went to sleep erroneously, or there was an idle. Either way we don't care
+            // and just leave when the inactive clusters drops below the threshold
+            if(!m_rebalanceRequested.load(std::memory_order_relaxed)){
+                m_idleDetectionCond.wait(lk);
+            }
+        }else{
+            // We are the final thread.
+
+            // Have to capture once more, to get the definitive final version
+            uint64_t totalNonLocalSent=nonlocal_sent_total()+m_remoteIn.load();
+            uint64_t totalNonLocalReceived=nonlocal_received_total()+m_remoteOut.load();
+
+            if(totalNonLocalSent!=totalNonLocalReceived){
+                assert(totalNonLocalSent > totalNonLocalReceived); // Should be a consistent view at this point
+                // We have not yet reached idle as there are messages in flight. So there is some message
+                // still to be delivered within some cluster.
+            }else{
+                // Verify that all clusters are inactive
+                uint64_t totalLocalMessages=0;
+                bool active=false;
+                for(auto *cluster : m_local_clusters){
+                    if(cluster->active){
+                        active=true;
+                        break;
+                    }
+                    totalLocalMessages += cluster->localMessagesSentAndReceived;
+
+                    #ifndef NDEBUG
+                    for(auto *dev : cluster->devices){
+                        uint32_t rts=0;
+                        bool rtc=0;
+                        bool aa=sprovider_calc_rts(nullptr, dev->device_type_index, m_gp, dev->properties_then_state, &rts, &rtc);
+                        assert(!aa);
+                        assert( aa ? 1 : rts==0 && rtc==0);
+                        assert(rts==0 && rtc==0);        
+                    }
+                    #endif
+                }
+                uint64_t totalMessages=totalNonLocalSent+totalLocalMessages;
+
+                if(!active && confirm_idle(totalMessages)){
+                    // Yes! We have reach idle: all messages sent have been received, and no cluster is active
+                    for(auto *cluster : m_local_clusters){
+                        cluster->active=true; // Wake up the cluster
+                        cluster->provider_do_hardware_idle=true; // And indicate idle needs to be run
+                    }
+                    // And that's it!
+                }
+            }
+
+            // Regardless of the outcome we need to start idle detection again
+            m_globalInactiveClusters.store(0); // Start the process again
+            m_idleDetectionCond.notify_all(); // Wake up all the threads
+        }
+        m_idleDetectionWaiters.fetch_sub(1);
+        // End lock
+        //////////////////////////////////////////////////
+
+    }
+
+    void check_for_idle_mutex(unsigned nThreads, bool clusterActive, unsigned nonLocalSent, unsigned nonLocalReceived)
+    {
+        // We can't save the values for these until we get into the mutex. We also
+        // want to avoid updating if nothing is happening, as that is when lots of
+        // threads will be racing through here with no sends or receives, just before
+        // idle
+        if(nonLocalSent){
+            m_globalNonLocalSends.fetch_add(nonLocalSent, std::memory_order_relaxed);
+        }
+        if(nonLocalReceived){
+            m_globalNonLocalReceives.fetch_add(nonLocalReceived, std::memory_order_relaxed);
+        }
+
+        if(clusterActive){
+            // Cancel anyone attempting to idle detect for now. 
+            m_globalInactiveClusters.store(0, std::memory_order_relaxed);
+            // Stop anyone else who is trying. This condition should be unlikely unless we are approaching idle
+            if(m_idleDetectionWaiters.load(std::memory_order_relaxed) > 0){
+                m_idleDetectionCond.notify_all(); // Wake up everyone that went to sleep by mistake
+            }
+        }else{
+            // Start the route towards idle detection
+            uint64_t totalInactiveClusters=m_globalInactiveClusters.fetch_add(1);
+            if(totalInactiveClusters < m_idleDetectionInactiveThreshold){
+                // We haven't reached the point where idleness is likely. Just carry on
+            }else{
+                // Capture a possibly inconsistent view of these variables. Note that they may not
+                // be exact, unless we are the final thread.
+                // Messages arriving from other processes count as sent, and messages leaving as received.
+                uint64_t totalNonLocalSent=nonlocal_sent_total()+m_remoteIn.load();
+                uint64_t totalNonLocalReceived=nonlocal_received_total()+m_remoteOut.load();
+
+                if(totalNonLocalSent!=totalNonLocalReceived){
+                    // Send/receive count is not yet stable
+                }else{
+                    // Heuristic has been passed. It is quite likely we are now idle, so need to
+                    // start verifying.
+                    check_for_idle_verify(nThreads);
+                }
+            }
+        }
+
+    }
+
+
+    /* Hierarchical idle detection.
+
+        The mutex based detector above funnels every cluster step through the same few atomics,
+        and then serialises all threads on one lock while the final thread scans every cluster.
+        The tree detector keeps the same two levels (heuristic then exact), but spreads the work:
+
+        - Each thread counts its own run of inactive cluster steps, rather than sharing one counter.
+          Non-local send and receive counts go into a counter group shared by a leaf of the tree,
+          so at most IDLE_TREE_FANIN threads touch the same cache line. Totals are the sum of the groups.
+
+        - A thread that thinks the system is idle parks by arriving at its leaf of a combining
+          tree. Each node holds (stamp,count) in one word, where the stamp is the current value of
+          m_idleGeneration, so stale arrivals from an abandoned round are simply overwritten.
+          The thread that completes the root knows every thread has parked.
+
+        - Any thread that steps an active cluster while others are parked bumps m_idleGeneration,
+          which releases the parked threads. The thread that completed the root must claim the round
+          by moving the generation into the VERIFY phase, which only succeeds if nobody aborted.
+
+        - In VERIFY every thread checks its own slice of the clusters and arrives again. The final
+          arrival sums the results and decides. If the system is idle, the APPLY phase has every thread
+          flag hardware idle on its slice, and the final arrival of that releases everyone. Nobody
+          steps a cluster until all flags are set, so a message cannot overtake hardware idle.
+
+        With IDLE_DETECTION_CHECK the tree detector runs, but the final thread of each VERIFY also
+        recomputes the decision the same way as the mutex detector, checks every device's RTS, and
+        compares the combined counters against exact per-thread counts. Any disagreement aborts.
+     */
+
+    enum idle_detection_mode
+    {
+        IDLE_DETECTION_MUTEX,
+        IDLE_DETECTION_TREE,
+        IDLE_DETECTION_CHECK
+    };
+
+    idle_detection_mode m_idleDetectionMode=IDLE_DETECTION_TREE;
+
+    static const unsigned IDLE_TREE_FANIN = 4;
+
+    // Low bits of m_idleGeneration
+    static const uint64_t IDLE_PHASE_RUN = 0;
+    static const uint64_t IDLE_PHASE_VERIFY = 1;
+    static const uint64_t IDLE_PHASE_APPLY = 2;
+    static const uint64_t IDLE_PHASE_MASK = 3;
+
+    struct alignas(64) idle_tree_node
+    {
+        std::atomic<uint64_t> word{0}; // (stamp<<16) | arrivals
+        unsigned expected=0;
+        int parent=-1;
+    };
+
+    struct alignas(64) idle_counter_group
+    {
+        std::atomic<uint64_t> sent{0};
+        std::atomic<uint64_t> received{0};
+    };
+
+    struct alignas(64) idle_thread_state
     {
-        // We can't save the values for these until we get into the mutex. We also
-        // want to avoid updating if nothing is happening, as that is when lots of
-        // threads will be racing through here with no sends or receives, just before
-        // idle
-        if(nonLocalSent){
-            m_globalNonLocalSends.fetch_add(nonLocalSent, std::memory_order_relaxed);
+        unsigned leaf;
+        uint64_t inactiveRun=0;
+        // Exact per-thread totals, only used to cross-check the groups
+        uint64_t sent=0;
+        uint64_t received=0;
+        // Written during VERIFY for this thread's slice of clusters
+        bool anyActive=false;
+        uint64_t localMessages=0;
+    };
+
+    std::vector<idle_tree_node> m_idleTree; // Leaves first, root last
+    std::vector<idle_counter_group> m_idleGroups; // One per leaf
+    std::vector<idle_thread_state> m_idleThreads;
+    unsigned m_idleThreadThreshold;
+    uint8_t _pad3_[128];
+    std::atomic<uint64_t> m_idleGeneration;
+    std::atomic<unsigned> m_idleParked;
+    uint8_t _pad4_[128];
+
+    uint64_t nonlocal_sent_total(std::memory_order order=std::memory_order_seq_cst) const
+    {
+        uint64_t res=m_globalNonLocalSends.load(order);
+        for(const auto &g : m_idleGroups){
+            res+=g.sent.load(order);
         }
-        if(nonLocalReceived){
-            m_globalNonLocalReceives.fetch_add(nonLocalReceived, std::memory_order_relaxed);
+        return res;
+    }
+
+    uint64_t nonlocal_received_total(std::memory_order order=std::memory_order_seq_cst) const
+    {
+        uint64_t res=m_globalNonLocalReceives.load(order);
+        for(const auto &g : m_idleGroups){
+            res+=g.received.load(order);
         }
+        return res;
+    }
 
-        if(clusterActive){
-            // Cancel anyone attempting to idle detect for now. 
-            m_globalInactiveClusters.store(0, std::memory_order_relaxed);
-            // Stop anyone else who is trying. This condition should be unlikely unless we are approaching idle
-            if(m_idleDetectionWaiters.load(std::memory_order_relaxed) > 0){
-                m_idleDetectionCond.notify_all(); // Wake up everyone that went to sleep by mistake
+    void build_idle_tree(unsigned nThreads)
+    {
+        // Count the nodes at each level, as atomics can't move once the vector is built
+        std::vector<unsigned> levelSizes{(nThreads+IDLE_TREE_FANIN-1)/IDLE_TREE_FANIN};
+        while(levelSizes.back()>1){
+            levelSizes.push_back((levelSizes.back()+IDLE_TREE_FANIN-1)/IDLE_TREE_FANIN);
+        }
+        unsigned total=0;
+        for(unsigned n : levelSizes){
+            total+=n;
+        }
+
+        std::vector<idle_tree_node>(total).swap(m_idleTree);
+        std::vector<idle_counter_group>(levelSizes[0]).swap(m_idleGroups);
+
+        m_idleThreads.assign(nThreads, idle_thread_state());
+        for(unsigned i=0; i<nThreads; i++){
+            m_idleThreads[i].leaf=i/IDLE_TREE_FANIN;
+            m_idleTree[i/IDLE_TREE_FANIN].expected++;
+        }
+
+        unsigned levelBase=0;
+        for(unsigned l=0; l+1<levelSizes.size(); l++){
+            unsigned nextBase=levelBase+levelSizes[l];
+            for(unsigned i=0; i<levelSizes[l]; i++){
+                auto &node=m_idleTree[levelBase+i];
+                node.parent=nextBase+i/IDLE_TREE_FANIN;
+                m_idleTree[node.parent].expected++;
             }
-        }else{
-            // Start the route towards idle detection
-            uint64_t totalInactiveClusters=m_globalInactiveClusters.fetch_add(1);
-            if(totalInactiveClusters < m_idleDetectionInactiveThreshold){
-                // We haven't reached the point where idleness is likely. Just carry on
+            levelBase=nextBase;
+        }
+        assert(m_idleTree.back().parent==-1);
+
+        m_idleGeneration=0;
+        m_idleParked=0;
+    }
+
+    // Returns true if this arrival completed the root for this stamp. Arrivals with a stamp older
+    // than a node has seen belong to an abandoned round, and stop without touching it.
+    bool idle_tree_arrive(unsigned thread, uint64_t stamp)
+    {
+        stamp &= 0xFFFFFFFFFFFFull;
+        int index=m_idleThreads[thread].leaf;
+        while(1){
+            auto &node=m_idleTree[index];
+            uint64_t curr=node.word.load(std::memory_order_relaxed);
+            uint64_t count;
+            do{
+                if((curr>>16) > stamp){
+                    return false;
+                }
+                count= (curr>>16)==stamp ? (curr&0xFFFF) : 0;
+            }while(!node.word.compare_exchange_weak(curr, (stamp<<16)|(count+1), std::memory_order_acq_rel, std::memory_order_relaxed));
+            if(count+1 < node.expected){
+                return false;
+            }
+            if(node.parent==-1){
+                return true;
+            }
+            index=node.parent;
+        }
+    }
+
+    // If abortForRebalance is set then a pending rebalance aborts the round, in the same way as
+    // stepping an active cluster. That fails if the round was claimed, so everyone still verifies.
+    uint64_t idle_tree_wait(uint64_t stamp, bool abortForRebalance=false)
+    {
+        unsigned spins=0;
+        while(1){
+            uint64_t curr=m_idleGeneration.load(std::memory_order_acquire);
+            if(curr!=stamp){
+                return curr;
+            }
+            if(abortForRebalance && m_rebalanceRequested.load(std::memory_order_relaxed)){
+                assert((curr&IDLE_PHASE_MASK)==IDLE_PHASE_RUN);
+                m_idleGeneration.compare_exchange_strong(curr, curr+IDLE_PHASE_MASK+1, std::memory_order_acq_rel);
+                continue;
+            }
+            if(++spins < 1000){
+                std::this_thread::yield();
             }else{
-                // Capture a possibly inconsistent view of these variables. Note that they may not
-                // be exact, unless we are the final thread.
-                uint64_t totalNonLocalSent=m_globalNonLocalSends.load();
-                uint64_t totalNonLocalReceived=m_globalNonLocalReceives.load();
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+    }
 
-                if(totalNonLocalSent!=totalNonLocalReceived){
-                    // Send/receive count is not yet stable
-                }else{
-                    // Heuristic has been passed. It is quite likely we are now idle, so need to
-                    // start verifying.
-                    check_for_idle_verify(nThreads);
+    void idle_tree_release(uint64_t generation)
+    {
+        m_idleGeneration.store((generation&~IDLE_PHASE_MASK)+IDLE_PHASE_MASK+1, std::memory_order_release);
+    }
+
+    void cross_check_idle(bool idle, uint64_t totalNonLocalSent, uint64_t totalNonLocalReceived, bool anyActive, uint64_t totalLocalMessages)
+    {
+        uint64_t exactSent=m_globalNonLocalSends.load(), exactReceived=m_globalNonLocalReceives.load();
+        for(const auto &t : m_idleThreads){
+            exactSent+=t.sent;
+            exactReceived+=t.received;
+        }
+        exactSent+=m_remoteIn.load();
+        exactReceived+=m_remoteOut.load();
+
+        bool legacyActive=false;
+        uint64_t legacyLocalMessages=0;
+        bool anyRts=false;
+        for(auto *cluster : m_local_clusters){
+            legacyActive = legacyActive || cluster->active;
+            legacyLocalMessages += cluster->localMessagesSentAndReceived;
+            if(!cluster->active){
+                for(auto *dev : cluster->devices){
+                    uint32_t rts=0;
+                    bool rtc=0;
+                    sprovider_calc_rts(nullptr, dev->device_type_index, m_gp, dev->properties_then_state, &rts, &rtc);
+                    anyRts = anyRts || rts || rtc;
+                }
+            }
+        }
+        bool legacyIdle = !legacyActive && exactSent==exactReceived;
+
+        if(exactSent!=totalNonLocalSent || exactReceived!=totalNonLocalReceived || legacyActive!=anyActive
+            || (!anyActive && legacyLocalMessages!=totalLocalMessages) || legacyIdle!=idle || anyRts
+        ){
+            fprintf(stderr, "Idle detection cross-check failed: tree idle=%d, mutex idle=%d, sent=%llu/%llu, received=%llu/%llu, active=%d/%d, local=%llu/%llu, inactive devices with rts=%d\n",
+                idle, legacyIdle,
+                (unsigned long long)totalNonLocalSent, (unsigned long long)exactSent,
+                (unsigned long long)totalNonLocalReceived, (unsigned long long)exactReceived,
+                anyActive, legacyActive,
+                (unsigned long long)totalLocalMessages, (unsigned long long)legacyLocalMessages,
+                anyRts
+            );
+            abort();
+        }
+    }
+
+    // Runs the VERIFY and APPLY phases for a generation which has been claimed
+    void idle_tree_verify(unsigned thread, unsigned nThreads, uint64_t generation)
+    {
+        while(1){
+            uint64_t phase=generation&IDLE_PHASE_MASK;
+            assert(phase!=IDLE_PHASE_RUN);
+
+            auto &state=m_idleThreads[thread];
+            if(phase==IDLE_PHASE_VERIFY){
+                state.anyActive=false;
+                state.localMessages=0;
+                for(unsigned i=thread; i<m_local_clusters.size(); i+=nThreads){
+                    const auto *cluster=m_local_clusters[i];
+                    state.anyActive = state.anyActive || cluster->active;
+                    state.localMessages += cluster->localMessagesSentAndReceived;
+                }
+            }else{
+                for(unsigned i=thread; i<m_local_clusters.size(); i+=nThreads){
+                    auto *cluster=m_local_clusters[i];
+                    cluster->active=true; // Wake up the cluster
+                    cluster->provider_do_hardware_idle=true; // And indicate idle needs to be run
+                }
+            }
+
+            if(!idle_tree_arrive(thread, generation)){
+                generation=idle_tree_wait(generation);
+                if((generation&IDLE_PHASE_MASK)==IDLE_PHASE_RUN){
+                    return;
+                }
+                continue;
+            }
+
+            // Final arrival for this phase, and every other thread is parked
+            if(phase==IDLE_PHASE_APPLY){
+                idle_tree_release(generation);
+                return;
+            }
+
+            uint64_t totalNonLocalSent=nonlocal_sent_total()+m_remoteIn.load();
+            uint64_t totalNonLocalReceived=nonlocal_received_total()+m_remoteOut.load();
+            assert(totalNonLocalSent >= totalNonLocalReceived);
+            bool anyActive=false;
+            uint64_t totalLocalMessages=0;
+            for(const auto &t : m_idleThreads){
+                anyActive = anyActive || t.anyActive;
+                totalLocalMessages += t.localMessages;
+            }
+            bool idle = !anyActive && totalNonLocalSent==totalNonLocalReceived;
+
+            if(m_idleDetectionMode==IDLE_DETECTION_CHECK){
+                cross_check_idle(idle, totalNonLocalSent, totalNonLocalReceived, anyActive, totalLocalMessages);
+            }
+
+            if(idle && confirm_idle(totalNonLocalSent+totalLocalMessages)){
+                generation=(generation&~IDLE_PHASE_MASK)|IDLE_PHASE_APPLY;
+                m_idleGeneration.store(generation, std::memory_order_release);
+            }else{
+                idle_tree_release(generation);
+                return;
+            }
+        }
+    }
+
+    void check_for_idle_tree(unsigned thread, unsigned nThreads, bool clusterActive, unsigned nonLocalSent, unsigned nonLocalReceived)
+    {
+        auto &state=m_idleThreads[thread];
+        if(nonLocalSent | nonLocalReceived){
+            auto &group=m_idleGroups[state.leaf];
+            if(nonLocalSent){
+                group.sent.fetch_add(nonLocalSent, std::memory_order_relaxed);
+            }
+            if(nonLocalReceived){
+                group.received.fetch_add(nonLocalReceived, std::memory_order_relaxed);
+            }
+            state.sent+=nonLocalSent;
+            state.received+=nonLocalReceived;
+        }
+
+        if(clusterActive){
+            state.inactiveRun=0;
+            if(m_idleParked.load(std::memory_order_relaxed) > 0){
+                // Release anyone who parked by mistake. Fails harmlessly if someone else
+                // already did, or if the round has been claimed (which means we were parked too).
+                uint64_t curr=m_idleGeneration.load(std::memory_order_relaxed);
+                if((curr&IDLE_PHASE_MASK)==IDLE_PHASE_RUN){
+                    m_idleGeneration.compare_exchange_strong(curr, curr+IDLE_PHASE_MASK+1, std::memory_order_acq_rel);
                 }
             }
+            return;
+        }
+
+        if(++state.inactiveRun < m_idleThreadThreshold){
+            return;
+        }
+        state.inactiveRun=0;
+
+        uint64_t generation=m_idleGeneration.load(std::memory_order_acquire);
+        assert((generation&IDLE_PHASE_MASK)==IDLE_PHASE_RUN);
+
+        m_idleParked.fetch_add(1, std::memory_order_relaxed);
+        if(idle_tree_arrive(thread, generation)){
+            // Everyone has parked. Claim the round, unless it was aborted in the meantime.
+            uint64_t claimed=generation|IDLE_PHASE_VERIFY;
+            if(m_idleGeneration.compare_exchange_strong(generation, claimed, std::memory_order_acq_rel)){
+                idle_tree_verify(thread, nThreads, claimed);
+            }
+        }else{
+            generation=idle_tree_wait(generation, true);
+            if((generation&IDLE_PHASE_MASK)!=IDLE_PHASE_RUN){
+                idle_tree_verify(thread, nThreads, generation);
+            }
+        }
+        m_idleParked.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void check_for_idle(unsigned thread, unsigned nThreads, bool clusterActive, unsigned nonLocalSent, unsigned nonLocalReceived)
+    {
+        if(m_idleDetectionMode==IDLE_DETECTION_MUTEX){
+            check_for_idle_mutex(nThreads, clusterActive, nonLocalSent, nonLocalReceived);
+        }else{
+            check_for_idle_tree(thread, nThreads, clusterActive, nonLocalSent, nonLocalReceived);
+        }
+    }
+
+    /* Dynamic load rebalancing.
+
+        Clusters are fixed when the graph is loaded, but in many applications the work moves
+        around as they run (e.g. wavefronts), leaving a few hot clusters that all the other threads
+        end up waiting on. With m_rebalanceInterval set, a timer thread periodically asks the workers
+        to pause. Each worker parks in rebalance_pause before taking its next cluster, and threads
+        parked in idle detection give up the round so that they can get there. The final thread to
+        arrive has exclusive access to every cluster, and:
+
+        - flushes all outgoing bundles and delivers every incoming message, so nothing in flight
+          refers to the old cluster offsets;
+        - compares the work (messages sent and received) done by each cluster since the last pause,
+          and moves devices from clusters well above the mean into the coldest clusters. Active
+          devices go first, then those with the most edges into the destination cluster;
+        - rebinds every edge to the new cluster and offset, and re-evaluates which edges are local.
+
+        The throughput between pauses is reported, so the gain from moving devices can be seen.
+        Rebalancing is not supported with batched execution (runs are fixed at load), a supervisor
+        (which delivers into clusters concurrently), or multiple ranks.
+     */
+
+    // Seconds between rebalancing pauses, or 0 to never rebalance
+    double m_rebalanceInterval=0;
+    // Clusters with more than (1+tolerance) times the mean work give devices away
+    double m_rebalanceTolerance=0.25;
+    // Maximum fraction of a cluster's devices that can leave in one pause
+    double m_rebalanceMaxFraction=0.25;
+
+    struct rebalance_stats_t
+    {
+        unsigned pauses=0;
+        unsigned skipped=0; // Pauses where hardware idle was pending, so nothing could move
+        uint64_t devicesMoved=0;
+        double pauseTime=0;
+        double initialRate=0; // Messages per second before the first pause
+
+        double lastPauseTime=0;
+        uint64_t lastPauseMessages=0;
+
+        // Messages per second since the last pause
+        double current_rate(double t, uint64_t messages) const
+        { return t>lastPauseTime ? (messages-lastPauseMessages)/(t-lastPauseTime) : 0.0; }
+
+        double gain(double t, uint64_t messages) const
+        { return initialRate>0 ? current_rate(t, messages)/initialRate : 0.0; }
+    };
+
+    rebalance_stats_t m_rebalanceStats;
+
+    std::atomic<bool> m_rebalanceRequested{false};
+    std::mutex m_rebalanceMutex;
+    std::condition_variable m_rebalanceCond;
+    unsigned m_rebalanceArrived=0;
+    unsigned m_rebalanceEpoch=0;
+
+    bool rebalance_supported() const
+    {
+        return !m_batchExecution && !m_transport && !SPROVIDER_GRAPH_TYPE_INFO.has_supervisor;
+    }
+
+    void request_rebalance()
+    {
+        {
+            std::unique_lock<std::mutex> lk(m_rebalanceMutex);
+            if(m_rebalanceRequested.load()){
+                return; // The last one hasn't finished yet
+            }
+            m_rebalanceRequested.store(true);
+        }
+        // Wake anyone parked in mutex idle detection. Tree waiters poll the flag.
+        std::unique_lock<std::mutex> lk(m_idleDetectionMutex);
+        m_idleDetectionCond.notify_all();
+    }
+
+    // Called by every worker when m_rebalanceRequested is set, while it is not holding a cluster.
+    // Returns the number of non-local messages this thread received on behalf of the clusters.
+    unsigned rebalance_pause(
+        unsigned nThreads,
+        shared_pool<message_list>::local_pool &pool,
+        shared_pool<message_bundle>::local_pool &bundle_pool
+    ){
+        std::unique_lock<std::mutex> lk(m_rebalanceMutex);
+        assert(m_rebalanceRequested.load());
+        unsigned epoch=m_rebalanceEpoch;
+        if(++m_rebalanceArrived < nThreads){
+            m_rebalanceCond.wait(lk, [&]{ return m_rebalanceEpoch!=epoch; });
+            return 0;
         }
 
+        // Every other worker is parked
+        unsigned received=rebalance_clusters(pool, bundle_pool);
+
+        m_rebalanceArrived=0;
+        m_rebalanceEpoch++;
+        m_rebalanceRequested.store(false);
+        m_rebalanceCond.notify_all();
+        return received;
+    }
+
+    // Picks n devices of cluster src to move to dst, active devices first and then by how many more
+    // of their edges go to dst than stay in src.
+    void rebalance_pick_devices(device_cluster *src, device_cluster *dst, unsigned n, std::vector<device_cluster*> &moveTo)
+    {
+        std::vector<std::pair<int,unsigned>> candidates;
+        for(unsigned i=0; i<src->devices.size(); i++){
+            if(moveTo[i]){
+                continue;
+            }
+            int affinity=0;
+            for(const auto &o : src->devices[i]->output_ports){
+                for(const edge &e : o.edges){
+                    affinity += (e.dest_cluster==dst) - (e.dest_cluster==src);
+                }
+            }
+            int score = src->is_device_active(i) ? (1<<20)+affinity : affinity;
+            candidates.push_back({score, i});
+        }
+        n=std::min<unsigned>(n, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin()+n, candidates.end(), [](const auto &a, const auto &b){
+            return a.first > b.first || (a.first==b.first && a.second < b.second);
+        });
+        for(unsigned i=0; i<n; i++){
+            moveTo[candidates[i].second]=dst;
+        }
     }
 
+    unsigned rebalance_clusters(
+        shared_pool<message_list>::local_pool &pool,
+        shared_pool<message_bundle>::local_pool &bundle_pool
+    ){
+        double t0=now();
+
+        auto &stats=m_rebalanceStats;
+        uint64_t totalMessages=total_received_messages_approx();
+        double rate=stats.current_rate(t0, totalMessages);
+        if(stats.pauses==0){
+            stats.initialRate=rate;
+        }
+        stats.pauses++;
+        stats.lastPauseMessages=totalMessages;
+
+        // Hardware idle has to run before anything is delivered, so leave this pause alone
+        for(auto *c : m_local_clusters){
+            if(c->provider_do_hardware_idle){
+                stats.skipped++;
+                stats.lastPauseTime=now();
+                return 0;
+            }
+        }
+
+        // Get rid of everything in flight, so that edges can be rebound
+        unsigned received=0;
+        for(auto *c : m_local_clusters){
+            while(flush_head(*c));
+        }
+        for(auto *c : m_local_clusters){
+            int r=0;
+            try_recv(pool, bundle_pool, c, m_gp, r);
+            c->nonLocalMessagesReceived += r;
+            received += r;
+        }
+
+        unsigned nClusters=m_local_clusters.size();
+        std::vector<double> work(nClusters), projected(nClusters);
+        double totalWork=0, maxWork=0;
+        for(unsigned i=0; i<nClusters; i++){
+            auto *c=m_local_clusters[i];
+            uint64_t mark=c->localMessagesSentAndReceived+c->nonLocalMessagesSent+c->nonLocalMessagesReceived;
+            work[i]=mark-c->rebalanceWorkMark;
+            c->rebalanceWorkMark=mark;
+            totalWork += work[i];
+            maxWork=std::max(maxWork, work[i]);
+        }
+        double mean=totalWork/nClusters;
+        projected=work;
+
+        // Destination for each device, indexed by cluster then offset. Null means stay.
+        std::vector<std::vector<device_cluster*>> moveTo(nClusters);
+        for(unsigned i=0; i<nClusters; i++){
+            moveTo[i].assign(m_local_clusters[i]->devices.size(), nullptr);
+        }
+
+        std::vector<unsigned> order(nClusters);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b){ return work[a] > work[b]; });
+
+        unsigned moved=0;
+        for(unsigned h : order){
+            auto *hot=m_local_clusters[h];
+            if(mean==0 || work[h] <= mean*(1+m_rebalanceTolerance) || hot->devices.size()<2){
+                break;
+            }
+            // Assume the work is spread evenly over the devices
+            double perDevice=work[h]/hot->devices.size();
+            unsigned budget=std::max<unsigned>(1, hot->devices.size()*m_rebalanceMaxFraction);
+            budget=std::min<unsigned>(budget, hot->devices.size()-1);
+            while(budget>0 && projected[h] > mean*(1+m_rebalanceTolerance)){
+                unsigned c=std::min_element(projected.begin(), projected.end())-projected.begin();
+                if(projected[c] >= mean){
+                    break;
+                }
+                double amount=std::min(projected[h]-mean, mean-projected[c]);
+                unsigned n=std::min<unsigned>(budget, std::max(1.0, std::ceil(amount/perDevice)));
+                rebalance_pick_devices(hot, m_local_clusters[c], n, moveTo[h]);
+                projected[h] -= n*perDevice;
+                projected[c] += n*perDevice;
+                budget -= n;
+                moved += n;
+            }
+        }
+
+        if(moved>0){
+            // Rebuild every cluster, keeping the active flags with the devices
+            std::vector<std::vector<std::pair<device*,bool>>> members(nClusters);
+            for(unsigned i=0; i<nClusters; i++){
+                auto *c=m_local_clusters[i];
+                assert(c->cluster_index==i);
+                for(unsigned j=0; j<c->devices.size(); j++){
+                    auto *dst=moveTo[i][j] ? moveTo[i][j] : c;
+                    members[dst->cluster_index].push_back({c->devices[j], c->is_device_active(j)});
+                }
+            }
+            for(unsigned i=0; i<nClusters; i++){
+                auto *c=m_local_clusters[i];
+                c->devices.clear();
+                c->devices_active_mask.assign((members[i].size()+63)/64, 0);
+                for(const auto &m : members[i]){
+                    m.first->cluster=c;
+                    m.first->offset_in_cluster=c->devices.size();
+                    c->devices.push_back(m.first);
+                    c->set_device_active(m.first->offset_in_cluster, m.second);
+                }
+            }
+            stats.devicesMoved += moved;
+        }
+
+        unsigned locals=0, total=0;
+        for(auto *d : m_devices){
+            for(auto &o : d->output_ports){
+                for(edge &e : o.edges){
+                    auto *dc=e.dest_device->cluster;
+                    e.is_local = dc==d->cluster;
+                    e.dest_cluster=dc;
+                    e.dest_cluster_index=dc->cluster_index;
+                    e.dest_device_offset_in_cluster=e.dest_device->offset_in_cluster;
+                    locals += e.is_local;
+                    total++;
+                }
+            }
+        }
+
+        for(auto *c : m_local_clusters){
+            c->active=true; // Make sure every cluster looks at its devices again
+        }
+
+        sanity();
+
+        double t1=now();
+        stats.pauseTime += t1-t0;
+        stats.lastPauseTime=t1; // The next interval shouldn't be charged for the pause
+
+        fprintf(stderr, "Rebalance %u: %g MReceive/sec since last pause (%+.1f%% on first interval), max/mean cluster work=%.2f, moved %u devices, %.1f%% edges local, pause=%.3f ms\n",
+            stats.pauses, rate/1000000.0, stats.initialRate>0 ? (rate/stats.initialRate-1)*100 : 0.0,
+            mean>0 ? maxWork/mean : 0.0, moved, total ? locals*100.0/total : 0.0, (t1-t0)*1000
+        );
+
+        return received;
+    }
 
     void run(unsigned nThreads)
     {
+        enter_phase(PHASE_INIT);
+#ifdef POETS_HANDLER_PROFILER
+        profiler_init();
+#endif
         shared_pool<message_list> gpool(sizeof(message_list));
         shared_pool<message_bundle> gbundlepool(sizeof(message_bundle));
 
@@ -1061,15 +2839,71 @@ struct POEMS
         m_globalNonLocalSends=0;
         m_globalInactiveClusters=0;
         m_idleDetectionWaiters=0;
-        m_idleDetectionInactiveThreshold=2*m_clusters.size();
+        m_idleDetectionInactiveThreshold=2*m_local_clusters.size();
 
-        for(auto *cluster : m_clusters){
+        for(auto *cluster : m_local_clusters){
             m_cluster_queue.push(cluster);
         }
 
-        nThreads=std::min(nThreads, (unsigned)m_clusters.size());
+        nThreads=std::min(nThreads, (unsigned)m_local_clusters.size());
+
+        if(m_idleDetectionMode!=IDLE_DETECTION_MUTEX){
+            build_idle_tree(nThreads);
+            m_idleThreadThreshold=std::max(2u, m_idleDetectionInactiveThreshold/nThreads);
+        }
         std::vector<std::thread> threads;
 
+        m_rebalanceStats=rebalance_stats_t();
+        m_rebalanceStats.lastPauseTime=now();
+        if(m_rebalanceInterval>0 && !rebalance_supported()){
+            fprintf(stderr, "Warning: rebalancing is not supported with batched execution, a supervisor, or multiple ranks. Disabling.\n");
+            m_rebalanceInterval=0;
+        }
+        if(m_rebalanceInterval>0){
+            threads.push_back(std::thread([&]{
+                std::unique_lock<std::mutex> lk(quitMutex);
+                while(!quit.load()){
+                    quitCond.wait_for(lk, std::chrono::duration<double>(m_rebalanceInterval));
+                    if(quit.load(std::memory_order_relaxed)){
+                        break;
+                    }
+                    request_rebalance();
+                }
+            }));
+        }
+
+        m_supervisor_incoming=nullptr;
+        if(SPROVIDER_GRAPH_TYPE_INFO.has_supervisor){
+            sprovider_supervisor_init(m_gp);
+            g_supervisor_gp=m_gp;
+
+            threads.push_back(std::thread([&]{
+                supervisor_loop(quit, gbundlepool);
+            }));
+        }
+
+        if(m_transport){
+            distributed_barrier();
+
+            g_application_exit_hook=[this](int code){
+                int32_t c=code;
+                for(unsigned r=0; r<m_transport->size(); r++){
+                    if(r!=m_transport->rank()){
+                        m_transport->send(r, FRAME_EXIT, &c, sizeof(c));
+                    }
+                }
+                try{
+                    m_transport->flush();
+                }catch(...){
+                    // Peers may already have gone
+                }
+            };
+
+            threads.push_back(std::thread([&]{
+                distributed_loop(quit, gbundlepool);
+            }));
+        }
+
         threads.push_back(std::thread([&]{
             unsigned delay=1000;
 
@@ -1094,19 +2928,24 @@ struct POEMS
                     numEmpty += ( nullptr != q.load(std::memory_order_relaxed) );
                     numFlushes += c->numNonLocalFlushes;
                 }
+                auto bundleStats=bundle_stats_approx();
 
                 unsigned long long totalRecvs=(unsigned long long)total_received_messages_approx();
 
-                bool throttleSend = IN_FLIGHT_THROTTLE < ((int64_t)m_globalNonLocalSends.load(std::memory_order_relaxed)-m_globalNonLocalReceives.load(std::memory_order_relaxed));
-                fprintf(stderr, "nlInFl=%lld, nlRcvs=%llu, allRecvs=%llu, %g MRecv/Sec, inactive=%d/%d, allocBytes = %f MBytes, throttle=%d, msg/Flush=%f\n",
-                     (long long)((int64_t)m_globalNonLocalSends.load(std::memory_order_relaxed)-m_globalNonLocalReceives.load(std::memory_order_relaxed)),
+                bool throttleSend = IN_FLIGHT_THROTTLE < in_flight_approx();
+                fprintf(stderr, "nlInFl=%lld, nlRcvs=%llu, allRecvs=%llu, %g MRecv/Sec, inactive=%d/%d, allocBytes = %f MBytes, throttle=%d, msg/Flush=%f, msg/Bundle=%f, bundleFill=%.1f%%\n",
+                     (long long)in_flight_approx(),
                      (unsigned long long)m_globalNonLocalReceives.load(std::memory_order_relaxed),
                      totalRecvs, (totalRecvs/(t1-t0))/1000000.0,
                     (int)m_globalInactiveClusters.load(std::memory_order_relaxed), (int)m_clusters.size(),
                     gpool.get_alloced_bytes()/(1024.0*1024.0),
                     throttleSend,
-                    m_globalNonLocalSends.load(std::memory_order_relaxed) / (double)numFlushes
+                    m_globalNonLocalSends.load(std::memory_order_relaxed) / (double)numFlushes,
+                    bundleStats.messages_per_bundle(), bundleStats.fill()*100
                 );
+                if(m_phaseCounters){
+                    fprintf(stderr, "  phases : %s\n", m_phaseCounters->summary().c_str());
+                }
 
                 delay=std::min<unsigned>(delay*1.5, 60000);
             }
@@ -1116,18 +2955,25 @@ struct POEMS
             auto lpool=gpool.create_local_pool();
             auto lbundlepool=gbundlepool.create_local_pool();
             while(!quit.load(std::memory_order_relaxed)){
+                if(m_rebalanceRequested.load(std::memory_order_relaxed)){
+                    unsigned received=rebalance_pause(nThreads, lpool, lbundlepool);
+                    check_for_idle(0, nThreads, true, 0, received);
+                }
+                enter_phase(PHASE_STEP);
                 device_cluster *cluster=0;
                 if(!m_cluster_queue.try_pop(cluster)){
                     // Is this possible due to slight delays?
                     throw std::runtime_error("Attempt to pop failed.");
                 }
                 unsigned sent=0, received=0;
-                bool throttleSend = IN_FLIGHT_THROTTLE < ((int64_t)m_globalNonLocalSends.load(std::memory_order_relaxed)-m_globalNonLocalReceives.load(std::memory_order_relaxed));
+                bool throttleSend = IN_FLIGHT_THROTTLE < in_flight_approx();
                 step_cluster(lpool, lbundlepool, m_gp, *cluster, throttleSend, sent, received);
                 bool active=cluster->active;
                 m_cluster_queue.push(cluster);
-                check_for_idle(nThreads, active, sent, received);
+                enter_phase(PHASE_IDLE);
+                check_for_idle(0, nThreads, active, sent, received);
             }
+            enter_phase(PerfPhaseCounters::NONE);
         /*
         // The logic for this seems wrong. It fails, and I can't work out how
         // it was originally supposed to deal with races.
@@ -1138,7 +2984,7 @@ struct POEMS
 
                     while(!quit.load(std::memory_order_relaxed)){
                         unsigned sent=0, received=0;
-                        bool throttleSend = IN_FLIGHT_THROTTLE < ((int64_t)m_globalNonLocalSends.load(std::memory_order_relaxed)-m_globalNonLocalReceives.load(std::memory_order_relaxed));
+                        bool throttleSend = IN_FLIGHT_THROTTLE < in_flight_approx();
                         step_cluster(lpool, m_gp, *m_clusters[i], throttleSend, sent, received);
                         check_for_idle(nThreads, m_clusters[i]->active, sent, received);
                     }
@@ -1146,27 +2992,38 @@ struct POEMS
             }*/
         }else{
             for(unsigned i=0; i<nThreads; i++){
-                threads.emplace_back( std::thread([&](){
+                threads.emplace_back( std::thread([&, i](){
                     auto lpool=gpool.create_local_pool();
                     auto lbundlepool=gbundlepool.create_local_pool();
+                    if(m_phaseCounters){
+                        m_phaseCounters->attach();
+                    }
 
                     while(!quit.load(std::memory_order_relaxed)){
+                        if(m_rebalanceRequested.load(std::memory_order_relaxed)){
+                            unsigned received=rebalance_pause(nThreads, lpool, lbundlepool);
+                            check_for_idle(i, nThreads, true, 0, received);
+                        }
                         device_cluster *cluster=0;
                         if(!m_cluster_queue.try_pop(cluster)){
                             // Is this possible due to slight delays?
                             throw std::runtime_error("Attempt to pop failed.");
                         }
                         std::atomic_thread_fence(std::memory_order_seq_cst);
+                        enter_phase(PHASE_STEP);
                         unsigned sent=0, received=0;
-                        bool throttleSend = IN_FLIGHT_THROTTLE < ((int64_t)m_globalNonLocalSends.load(std::memory_order_relaxed)-m_globalNonLocalReceives.load(std::memory_order_relaxed));
+                        bool throttleSend = IN_FLIGHT_THROTTLE < in_flight_approx();
                         step_cluster(lpool, lbundlepool, m_gp, *cluster, throttleSend, sent, received);
                         std::atomic_thread_fence(std::memory_order_seq_cst);
                         bool active=cluster->active;
                         m_cluster_queue.push(cluster);
-                        check_for_idle(nThreads, active, sent, received);
+                        enter_phase(PHASE_IDLE);
+                        check_for_idle(i, nThreads, active, sent, received);
                     }
+                    enter_phase(PerfPhaseCounters::NONE);
                 }));
             }
+            enter_phase(PerfPhaseCounters::NONE);
         }
 
         for(auto &thread : threads){
@@ -1296,6 +3153,14 @@ public:
 
         check_size("graph properties", id.c_str(), SPROVIDER_GRAPH_TYPE_INFO.properties_size, properties);
         m_target.m_gp=alloc_copy_P(properties);
+
+        // A specialised provider only works for the instance it was specialised against.
+        if(SPROVIDER_GRAPH_TYPE_INFO.specialised_properties){
+            if(memcmp(SPROVIDER_GRAPH_TYPE_INFO.specialised_properties, m_target.m_gp, SPROVIDER_GRAPH_TYPE_INFO.properties_size)){
+                fprintf(stderr, "Simulator was specialised for different graph properties than instance '%s' has.\n", id.c_str());
+                exit(1);
+            }
+        }
         return 0;
     }
 
@@ -1326,6 +3191,12 @@ public:
     check_size("device properties", id.c_str(), expected_properties_size, properties);
     check_size("device state", id.c_str(), expected_state_size, state);
 
+    const auto &dti=SPROVIDER_DEVICE_TYPE_INFO[device_type_index];
+    if(dti.specialised_unused){
+        fprintf(stderr, "Device %s has type %s, which was removed when the simulator was specialised.\n", id.c_str(), dti.id);
+        exit(1);
+    }
+
     unsigned dev_P_S_size=sizeof(device)+calc_P_S_size(properties,state);
     device *dev=new (dev_P_S_size) device();
     dev->cluster=0;
@@ -1333,6 +3204,13 @@ public:
     dev->device_type_index=device_type_index;
     copy_P_S( dev->properties_then_state, properties, state );
 
+    if(dti.specialised_properties){
+        if(memcmp(dti.specialised_properties, dev->properties_then_state, expected_properties_size)){
+            fprintf(stderr, "Device %s has different properties to those baked in when the simulator was specialised.\n", id.c_str());
+            exit(1);
+        }
+    }
+
     dev->output_ports.resize(dt->getOutputCount());
 
     #ifndef NDEBUG
@@ -1373,6 +3251,10 @@ void onEdgeInstance
     unsigned output_p_s_size=calc_P_S_size(properties,state);
 
     const auto &input_info=SPROVIDER_DEVICE_TYPE_INFO[e.dest_device->device_type_index].inputs[e.pin_index];
+    if(input_info.specialised_unused){
+        fprintf(stderr, "Edge into %s:%s, but that pin was removed when the simulator was specialised.\n", dstDevType->getId().c_str(), dstPin->getName().c_str());
+        exit(1);
+    }
     check_size("edge properties", "?", input_info.properties_size, properties);
     check_size("edge state", "?", input_info.state_size, state);
 
@@ -1409,6 +3291,42 @@ void onEdgeInstance
     }
   }
 
+#ifdef POEMS_NO_METIS
+/* Stands in for metis when POEMS is built without it. Partitions are grown
+   directly rather than by recursive bisection, so cluster numbers are not
+   hierarchical and contiguous blocks of clusters are less well connected. */
+void assign_clusters_multilevel(std::vector<device*> &devices, std::vector<device_cluster*> &clusters)
+{
+    for(unsigned i=0; i<devices.size(); i++){
+        devices[i]->offset_in_cluster=i;
+    }
+
+    fprintf(stderr, "Building CSR graph\n");
+    std::vector<MultilevelPartitioner::edge_t> edges;
+    for(device *d : devices){
+        for(auto &ev : d->output_ports){
+            for(edge &e : ev.edges){
+                edges.push_back(MultilevelPartitioner::edge_t{d->offset_in_cluster, e.dest_device->offset_in_cluster, 1});
+            }
+        }
+    }
+    auto graph=MultilevelPartitioner::buildUndirected(devices.size(), std::move(edges));
+
+    MultilevelPartitioner::options_t options;
+    options.partitions=clusters.size();
+    auto res=MultilevelPartitioner::partition(graph, options);
+
+    fprintf(stderr, "Applying multilevel partition, cut=%lld\n", (long long)res.cut);
+    for(unsigned i=0; i<devices.size(); i++){
+        auto d=devices[i];
+        auto c=clusters[res.part[d->offset_in_cluster]];
+        unsigned offset=c->devices.size();
+        c->devices.push_back(d);
+        d->cluster=c;
+        d->offset_in_cluster=offset;
+    }
+  }
+#else
 void assign_clusters_metis(std::vector<device*> &devices, std::vector<device_cluster*> &clusters)
 {
     fprintf(stderr, "Assigning giant cluster indices\n");
@@ -1476,6 +3394,7 @@ void assign_clusters_metis(std::vector<device*> &devices, std::vector<device_clu
         d->offset_in_cluster=offset;
     }
   }
+#endif
 
   void onEndGraphInstance(uint64_t /*graphToken*/) override
   {
@@ -1516,6 +3435,8 @@ void assign_clusters_metis(std::vector<device*> &devices, std::vector<device_clu
         ///////////////////////////////////////////////////////////////////////
         // Task two: cluster assignment
 
+      m_target.enter_phase(POEMS::PHASE_CLUSTER);
+
       std::vector<device*> devices(m_target.m_devices);
 
       std::shuffle(devices.begin(), devices.end(), urng);
@@ -1537,11 +3458,19 @@ void assign_clusters_metis(std::vector<device*> &devices, std::vector<device_clu
       }
 
       if(m_target.use_metis && nClusters>1){
+#ifdef POEMS_NO_METIS
+          assign_clusters_multilevel(devices, m_target.m_clusters);
+#else
           assign_clusters_metis(devices, m_target.m_clusters);
+#endif
       }else{
           assign_clusters_random(devices, m_target.m_clusters);
       }
 
+      if(m_target.m_batchExecution){
+          m_target.layout_clusters_by_type();
+      }
+
       int locals=0;
       int nonLocals=0;
 
@@ -1580,6 +3509,12 @@ void assign_clusters_metis(std::vector<device*> &devices, std::vector<device_clu
             }
         }
 
+        if(SPROVIDER_GRAPH_TYPE_INFO.has_supervisor){
+            m_target.build_supervisor_edges();
+        }
+
+        m_target.setup_partition();
+
         m_target.sanity();
 
       fprintf(stderr, "Made %u of %u edges local (%f%%).\n", locals, nonLocals+locals, locals*100.0/(locals+nonLocals));
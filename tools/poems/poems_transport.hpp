@@ -0,0 +1,442 @@
+#ifndef poems_transport_hpp
+#define poems_transport_hpp
+
+#include <cstdint>
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Moves frames of bytes between the processes of a distributed POEMS run.
+
+    Each process has a rank in [0,size). A frame is a kind plus an opaque payload,
+    and frames between any pair of ranks are delivered in order. The transport does
+    not interpret the frames at all.
+*/
+class POEMSTransport
+{
+public:
+    virtual ~POEMSTransport()
+    {}
+
+    virtual unsigned rank() const =0;
+    virtual unsigned size() const =0;
+
+    //! Queue a frame for another rank. Thread-safe, and never waits for the network.
+    virtual void send(unsigned dest, uint32_t kind, const void *payload, size_t bytes) =0;
+
+    using frame_callback_t = std::function<void(unsigned src, uint32_t kind, const char *payload, size_t bytes)>;
+
+    /*! Write queued frames and read incoming frames, calling on_frame for each complete
+        frame. If nothing can be done it waits up to timeoutMs. Only one thread may pump.
+        Throws if a peer disconnects. */
+    virtual void pump(int timeoutMs, const frame_callback_t &on_frame) =0;
+
+    //! Blocks until all queued frames have been written. Safe to call from any thread.
+    virtual void flush() =0;
+};
+
+#pragma pack(push,1)
+struct poems_transport_frame_header_t
+{
+    uint32_t bytes; // Size of payload following the header
+    uint32_t kind;
+};
+#pragma pack(pop)
+
+
+/* Full mesh of stream sockets, either unix domain or TCP.
+
+    Each rank listens, then connects to every lower rank and accepts a connection from
+    every higher rank. The first thing sent on a connection is the rank of the connector.
+*/
+class SocketPOEMSTransport
+    : public POEMSTransport
+{
+private:
+    struct peer_t
+    {
+        int fd=-1;
+
+        std::mutex out_mutex;
+        std::vector<char> out;
+        size_t out_offset=0;
+
+        std::vector<char> in;
+    };
+
+    unsigned m_rank;
+    unsigned m_size;
+    std::vector<std::unique_ptr<peer_t>> m_peers; // Entry for m_rank is unused
+
+    static void set_non_blocking(int fd)
+    {
+        int flags=fcntl(fd, F_GETFL, 0);
+        if(flags==-1 || fcntl(fd, F_SETFL, flags|O_NONBLOCK)==-1){
+            throw std::runtime_error("Couldn't make socket non-blocking.");
+        }
+    }
+
+    static void write_all_blocking(int fd, const void *data, size_t bytes)
+    {
+        const char *p=(const char*)data;
+        while(bytes>0){
+            ssize_t done=::send(fd, p, bytes, MSG_NOSIGNAL);
+            if(done<0){
+                if(errno==EINTR){
+                    continue;
+                }
+                throw std::runtime_error("Couldn't write to peer socket.");
+            }
+            p+=done;
+            bytes-=done;
+        }
+    }
+
+    static void read_all_blocking(int fd, void *data, size_t bytes)
+    {
+        char *p=(char*)data;
+        while(bytes>0){
+            ssize_t done=::recv(fd, p, bytes, 0);
+            if(done<0 && errno==EINTR){
+                continue;
+            }
+            if(done<=0){
+                throw std::runtime_error("Couldn't read from peer socket.");
+            }
+            p+=done;
+            bytes-=done;
+        }
+    }
+
+    // Returns false if the write would block
+    bool write_some(peer_t &p)
+    {
+        std::unique_lock<std::mutex> lk(p.out_mutex);
+        while(p.out_offset < p.out.size()){
+            ssize_t done=::send(p.fd, p.out.data()+p.out_offset, p.out.size()-p.out_offset, MSG_NOSIGNAL);
+            if(done<0){
+                if(errno==EINTR){
+                    continue;
+                }
+                if(errno==EAGAIN || errno==EWOULDBLOCK){
+                    return false;
+                }
+                throw std::runtime_error("Couldn't write to peer socket.");
+            }
+            p.out_offset+=done;
+        }
+        p.out.clear();
+        p.out_offset=0;
+        return true;
+    }
+
+    void read_some(unsigned src, peer_t &p, const frame_callback_t &on_frame)
+    {
+        while(1){
+            size_t prev=p.in.size();
+            p.in.resize(prev+65536);
+            ssize_t done=::recv(p.fd, p.in.data()+prev, 65536, 0);
+            if(done<0){
+                p.in.resize(prev);
+                if(errno==EINTR){
+                    continue;
+                }
+                if(errno==EAGAIN || errno==EWOULDBLOCK){
+                    break;
+                }
+                throw std::runtime_error("Couldn't read from peer socket.");
+            }
+            p.in.resize(prev+done);
+            if(done==0){
+                throw std::runtime_error("Rank "+std::to_string(src)+" closed its connection.");
+            }
+        }
+
+        size_t offset=0;
+        while(offset+sizeof(poems_transport_frame_header_t) <= p.in.size()){
+            poems_transport_frame_header_t header;
+            memcpy(&header, p.in.data()+offset, sizeof(header));
+            if(offset+sizeof(header)+header.bytes > p.in.size()){
+                break;
+            }
+            on_frame(src, header.kind, p.in.data()+offset+sizeof(header), header.bytes);
+            offset+=sizeof(header)+header.bytes;
+        }
+        p.in.erase(p.in.begin(), p.in.begin()+offset);
+    }
+
+    struct address_t
+    {
+        sockaddr_storage addr;
+        socklen_t len;
+        int family;
+    };
+
+    static std::vector<address_t> parse_addresses(const std::string &spec, unsigned size)
+    {
+        std::vector<address_t> res;
+
+        if(spec.substr(0,5)=="unix:"){
+            std::string dir=spec.substr(5);
+            for(unsigned i=0; i<size; i++){
+                std::string path=dir+"/poems_rank_"+std::to_string(i)+".sock";
+                address_t a;
+                memset(&a, 0, sizeof(a));
+                sockaddr_un *un=(sockaddr_un*)&a.addr;
+                if(path.size() >= sizeof(un->sun_path)){
+                    throw std::runtime_error("Unix socket path '"+path+"' is too long.");
+                }
+                un->sun_family=AF_UNIX;
+                strcpy(un->sun_path, path.c_str());
+                a.len=sizeof(sockaddr_un);
+                a.family=AF_UNIX;
+                res.push_back(a);
+            }
+        }else if(spec.substr(0,4)=="tcp:"){
+            // Either tcp:host:basePort, where rank i uses basePort+i, or tcp:host0:port0,host1:port1,...
+            std::vector<std::pair<std::string,unsigned>> endpoints;
+            std::string rest=spec.substr(4);
+            size_t pos=0;
+            while(pos<=rest.size()){
+                size_t comma=rest.find(',', pos);
+                std::string part=rest.substr(pos, comma==std::string::npos ? std::string::npos : comma-pos);
+                size_t colon=part.rfind(':');
+                if(colon==std::string::npos){
+                    throw std::runtime_error("Couldn't parse tcp endpoint '"+part+"', expected host:port.");
+                }
+                endpoints.push_back({part.substr(0,colon), (unsigned)std::stoul(part.substr(colon+1))});
+                if(comma==std::string::npos){
+                    break;
+                }
+                pos=comma+1;
+            }
+            if(endpoints.size()==1){
+                for(unsigned i=1; i<size; i++){
+                    endpoints.push_back({endpoints[0].first, endpoints[0].second+i});
+                }
+            }
+            if(endpoints.size()!=size){
+                throw std::runtime_error("Number of tcp endpoints does not match number of ranks.");
+            }
+
+            for(const auto &ep : endpoints){
+                addrinfo hints;
+                memset(&hints, 0, sizeof(hints));
+                hints.ai_family=AF_UNSPEC;
+                hints.ai_socktype=SOCK_STREAM;
+                addrinfo *info=0;
+                int code=getaddrinfo(ep.first.c_str(), std::to_string(ep.second).c_str(), &hints, &info);
+                if(code!=0 || !info){
+                    throw std::runtime_error("Couldn't resolve host '"+ep.first+"' : "+gai_strerror(code));
+                }
+                address_t a;
+                memset(&a, 0, sizeof(a));
+                memcpy(&a.addr, info->ai_addr, info->ai_addrlen);
+                a.len=info->ai_addrlen;
+                a.family=info->ai_family;
+                freeaddrinfo(info);
+                res.push_back(a);
+            }
+        }else{
+            throw std::runtime_error("Didn't understand transport '"+spec+"', expected unix:<dir> or tcp:<host>:<port>.");
+        }
+        return res;
+    }
+
+    static void tune(int fd, int family)
+    {
+        if(family!=AF_UNIX){
+            int one=1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    }
+
+public:
+    SocketPOEMSTransport(const std::string &spec, unsigned rank, unsigned size, double connectTimeoutSecs=60)
+        : m_rank(rank)
+        , m_size(size)
+    {
+        if(rank>=size){
+            throw std::runtime_error("Rank must be less than the number of ranks.");
+        }
+        auto addresses=parse_addresses(spec, size);
+
+        for(unsigned i=0; i<size; i++){
+            m_peers.push_back(std::make_unique<peer_t>());
+        }
+
+        const address_t &self=addresses[rank];
+        int listener=socket(self.family, SOCK_STREAM, 0);
+        if(listener<0){
+            throw std::runtime_error("Couldn't create listening socket.");
+        }
+        if(self.family==AF_UNIX){
+            unlink(((sockaddr_un*)&self.addr)->sun_path);
+        }else{
+            int one=1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        if(bind(listener, (const sockaddr*)&self.addr, self.len)!=0){
+            throw std::runtime_error("Couldn't bind listening socket for rank "+std::to_string(rank)+" : "+strerror(errno));
+        }
+        if(listen(listener, size)!=0){
+            throw std::runtime_error("Couldn't listen on socket.");
+        }
+
+        auto deadline=std::chrono::steady_clock::now()+std::chrono::duration<double>(connectTimeoutSecs);
+
+        for(unsigned i=0; i<rank; i++){
+            const address_t &a=addresses[i];
+            while(1){
+                int fd=socket(a.family, SOCK_STREAM, 0);
+                if(fd<0){
+                    throw std::runtime_error("Couldn't create socket.");
+                }
+                if(connect(fd, (const sockaddr*)&a.addr, a.len)==0){
+                    tune(fd, a.family);
+                    uint32_t me=rank;
+                    write_all_blocking(fd, &me, sizeof(me));
+                    m_peers[i]->fd=fd;
+                    break;
+                }
+                close(fd);
+                if(std::chrono::steady_clock::now() > deadline){
+                    throw std::runtime_error("Timed out connecting to rank "+std::to_string(i));
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+
+        for(unsigned i=rank+1; i<size; i++){
+            int fd=accept(listener, 0, 0);
+            if(fd<0){
+                throw std::runtime_error("Couldn't accept connection.");
+            }
+            tune(fd, self.family);
+            uint32_t other;
+            read_all_blocking(fd, &other, sizeof(other));
+            if(other<=rank || other>=size || m_peers[other]->fd!=-1){
+                throw std::runtime_error("Unexpected connection from rank "+std::to_string(other));
+            }
+            m_peers[other]->fd=fd;
+        }
+
+        close(listener);
+        if(self.family==AF_UNIX){
+            unlink(((sockaddr_un*)&self.addr)->sun_path);
+        }
+
+        for(unsigned i=0; i<size; i++){
+            if(i!=rank){
+                set_non_blocking(m_peers[i]->fd);
+            }
+        }
+    }
+
+    ~SocketPOEMSTransport()
+    {
+        for(auto &p : m_peers){
+            if(p->fd!=-1){
+                close(p->fd);
+            }
+        }
+    }
+
+    unsigned rank() const override
+    { return m_rank; }
+
+    unsigned size() const override
+    { return m_size; }
+
+    void send(unsigned dest, uint32_t kind, const void *payload, size_t bytes) override
+    {
+        assert(dest<m_size && dest!=m_rank);
+        peer_t &p=*m_peers[dest];
+        poems_transport_frame_header_t header{(uint32_t)bytes, kind};
+
+        std::unique_lock<std::mutex> lk(p.out_mutex);
+        p.out.insert(p.out.end(), (const char*)&header, (const char*)&header+sizeof(header));
+        p.out.insert(p.out.end(), (const char*)payload, (const char*)payload+bytes);
+    }
+
+    void pump(int timeoutMs, const frame_callback_t &on_frame) override
+    {
+        std::vector<pollfd> fds;
+        std::vector<unsigned> ranks;
+        for(unsigned i=0; i<m_size; i++){
+            if(i==m_rank){
+                continue;
+            }
+            peer_t &p=*m_peers[i];
+            pollfd pfd;
+            pfd.fd=p.fd;
+            pfd.events=POLLIN;
+            pfd.revents=0;
+            {
+                std::unique_lock<std::mutex> lk(p.out_mutex);
+                if(p.out_offset < p.out.size()){
+                    pfd.events|=POLLOUT;
+                    timeoutMs=0;
+                }
+            }
+            fds.push_back(pfd);
+            ranks.push_back(i);
+        }
+
+        int n=poll(fds.data(), fds.size(), timeoutMs);
+        if(n<0){
+            if(errno==EINTR){
+                return;
+            }
+            throw std::runtime_error("poll failed.");
+        }
+
+        for(unsigned i=0; i<fds.size(); i++){
+            peer_t &p=*m_peers[ranks[i]];
+            if(fds[i].revents & POLLOUT){
+                write_some(p);
+            }
+            if(fds[i].revents & (POLLIN|POLLHUP|POLLERR)){
+                read_some(ranks[i], p, on_frame);
+            }
+        }
+    }
+
+    void flush() override
+    {
+        for(unsigned i=0; i<m_size; i++){
+            if(i==m_rank){
+                continue;
+            }
+            peer_t &p=*m_peers[i];
+            while(!write_some(p)){
+                pollfd pfd{p.fd, POLLOUT, 0};
+                poll(&pfd, 1, 100);
+            }
+        }
+    }
+};
+
+inline std::unique_ptr<POEMSTransport> create_poems_transport(const std::string &spec, unsigned rank, unsigned size)
+{
+    return std::make_unique<SocketPOEMSTransport>(spec, rank, size);
+}
+
+#endif
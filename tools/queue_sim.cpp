@@ -15,9 +15,16 @@
 #include <mutex>
 #include <chrono>
 #include <queue>
+#include <regex>
+#include <atomic>
 
 #include <boost/lockfree/queue.hpp>
 
+#include "poets_protocol/InProcessBinaryUpstreamConnection.hpp"
+#include "inproc_ring_connection.hpp"
+#include "perf_phase_counters.hpp"
+#include "graph_generators.hpp"
+
 #include <cstring>
 #include <cstdlib>
 
@@ -111,9 +118,23 @@ struct QueueSim
     TypedDataSpecPtr spec; // Used to allocate messages
     std::vector<edge_bundle_id_t> batches; // Bundle to deliver to each queue.
     std::vector<edge_t> local; // edges to deliver to this queue
+    std::vector<poets_endpoint_address_t> externals; // external destinations (not including __halt__)
+    bool toHalt=false; // Is connected to __halt__
     unsigned fanout=0;
   };
 
+  /*! A message that needs to go out to the external connection. These are
+      batched up within each queue, then the batch is handed over to the
+      external thread. */
+  struct external_send_t
+  {
+    poets_endpoint_address_t source;
+    bool isHalt;
+    TypedDataPtr message;
+  };
+
+  typedef std::vector<external_send_t> external_batch_t;
+
 
 
 
@@ -135,6 +156,8 @@ struct QueueSim
 
     device_t()
       : id(0)
+      , index(-1)
+      , isExternal(false)
       , owner(-1)
       , isOnReady(false)
       , readyIndex(-1)
@@ -144,11 +167,13 @@ struct QueueSim
     {}
     
     const char *id;
+    unsigned index; // Address of the device, as seen by externals
+    bool isExternal;
     DeviceTypePtr type;
     TypedDataPtr properties;
     TypedDataPtr state;
 
-    int owner; // Which queue currently has responsibility
+    int owner; // Which queue currently has responsibility. Externals are not owned (-1)
 
     uint32_t rtsFlags;
 
@@ -190,6 +215,7 @@ struct QueueSim
     std::unique_ptr<boost::lockfree::queue<broadcast_t> > m_broadcasts;
 
     uint64_t m_eventIdCounter;
+    uint64_t m_recvCount=0; // Only touched by the thread running this queue
     
     uint64_t nextEventId()
     {
@@ -199,6 +225,9 @@ struct QueueSim
     std::shared_ptr<LogWriter> m_log;
     std::vector<std::unique_ptr<LogWriter::event_t> > m_events;
 
+    // Messages going to externals which haven't been handed to the external thread yet
+    std::unique_ptr<external_batch_t> m_externalOut;
+
     uint64_t sentinelB=0x23456781;
     
 
@@ -218,6 +247,7 @@ struct QueueSim
       , m_broadcasts(new boost::lockfree::queue<broadcast_t>(0))
       , m_eventIdCounter( uint64_t(_index)<<48)
       , m_log(pLog)
+      , m_externalOut(new external_batch_t())
     {
       if(_index >= 0x8000 ){
         throw std::runtime_error("Can't have more than 2^16 queues, due to event id distribution method.");
@@ -359,6 +389,20 @@ struct QueueSim
       }
     }
 
+    //! Hand any pending external messages over to the external thread
+    void flushExternal()
+    {
+      if(m_externalOut->empty()){
+        return;
+      }
+      if(!parent->m_externalOutbound->push(m_externalOut.get())){
+        fprintf(stderr, "Push failed.\n");
+        exit(1);
+      }
+      m_externalOut.release();
+      m_externalOut.reset(new external_batch_t());
+    }
+
     bool pop(unsigned &bid, uint64_t &mid, TypedDataPtr &message)
     {
       
@@ -403,6 +447,7 @@ struct QueueSim
         idSendStr=std::to_string(mid);
       }
 
+      m_recvCount+=edges.size();
       for(edge_t &e : edges){
         device_t *device=e.device;
 
@@ -520,6 +565,19 @@ struct QueueSim
         return;
       }
 
+      if(!output.externals.empty() || output.toHalt){
+        auto source=makeEndpoint(poets_device_address_t{device->index}, poets_pin_index_t{output.pin->getIndex()});
+        if(!output.externals.empty()){
+          m_externalOut->push_back(external_send_t{source, false, message});
+        }
+        if(output.toHalt){
+          m_externalOut->push_back(external_send_t{source, true, message});
+        }
+        if(m_externalOut->size()>=64){
+          flushExternal();
+        }
+      }
+
       parent->m_queuedMessages+=output.batches.size();
 
       // Send remote batches
@@ -568,18 +626,50 @@ struct QueueSim
   mutex_t m_idleMutex;
   std::condition_variable m_idleCondition;
 
-  bool m_quit;
+  std::atomic<bool> m_quit;
   int m_exitCode=0;
   bool m_exitCodeSet=false;
 
+  // Connection to externals, or null if the graph doesn't have any
+  std::shared_ptr<InProcRingConnection> m_pExternal;
+  // Batches of messages from the queues which are waiting to go to the external connection
+  std::unique_ptr<boost::lockfree::queue<external_batch_t*> > m_externalOutbound;
+  std::unordered_set<unsigned> m_externalIndices;
+  int m_haltDeviceIndex=-1;
+  TypedDataPtr m_haltMessage;
+
+  enum phase_t{
+    PHASE_LOAD,
+    PHASE_INIT,
+    PHASE_STEP,
+    PHASE_IDLE,
+    PHASE_FLUSH
+  };
+
+  static std::vector<std::string> phase_names()
+  {
+    return {"load", "init", "step", "idle", "flush"};
+  }
+
+  // Optional per-thread hardware counters, split by phase. Null if not wanted.
+  PerfPhaseCounters *m_phaseCounters=nullptr;
+
+  void enter_phase(unsigned phase)
+  {
+    if(m_phaseCounters){
+      m_phaseCounters->enter(phase);
+    }
+  }
+
   std::function<void(const char*, int)> onHandlerExit=[=](const char *device, int code){
     fprintf(stderr, "Device exit from %s, code =%d\n", device, code);
     onExit(device, code);
   };
 
   QueueSim(unsigned nQueues, std::shared_ptr<LogWriter> pLog)
+    : m_externalOutbound(new boost::lockfree::queue<external_batch_t*>(0))
   {
-    
+
     m_queuedMessages=0;
     for(unsigned i=0;i<nQueues;i++){
       m_queues.emplace_back(this, i, pLog);
@@ -587,6 +677,14 @@ struct QueueSim
     m_quit=false;
   }
 
+  ~QueueSim()
+  {
+    external_batch_t *batch;
+    while(m_externalOutbound->pop(batch)){
+      delete batch;
+    }
+  }
+
   void dump()
   {
 
@@ -615,13 +713,128 @@ struct QueueSim
       m_idleCondition.notify_all();
     }
   }
-  
+
+  void onHalt(const TypedDataPtr &message)
+  {
+    fprintf(stderr, "Received halt message from somewhere.\n");
+    if(message.payloadSize()!=sizeof(halt_message_type)){
+      throw std::runtime_error("Receive halt message with the wrong size.");
+    }
+    const auto *halt=(const halt_message_type*)message.payloadPtr();
+    m_pExternal->set_halt_message(*halt);
+
+    std::unique_lock<std::mutex> lk(m_idleMutex);
+    m_haltMessage=message;
+    if(!m_exitCodeSet){
+      m_exitCodeSet=true;
+      m_exitCode=halt->code;
+    }
+    m_quit=true;
+    m_idleCondition.notify_all();
+  }
+
+  /*! Runs on its own thread when there is an external connection. This is the
+      only thread that touches the simulator side of the connection. Outbound
+      batches from the queues are posted to the connection, and messages
+      coming from externals are posted straight into the broadcast queues of
+      the queues that own the destinations, exactly as a remote send would be.
+  */
+  void externalLoop()
+  {
+    assert(m_pExternal);
+
+    // Queues use the top 16 bits for their index, which is always less than 0x8000
+    uint64_t midCounter=uint64_t(0x8000)<<48;
+
+    auto inject=[&](poets_endpoint_address_t address, const uint8_t *payload, unsigned size, unsigned sendIndex)
+    {
+      unsigned devIndex=getEndpointDevice(address).value;
+      unsigned portIndex=getEndpointPin(address).value;
+      if(devIndex>=m_devices.size()){
+        throw std::runtime_error("External connection sent message from non-existent external address.");
+      }
+      device_t *dev=m_devices[devIndex];
+      if(!dev->isExternal){
+        throw std::runtime_error("External connection sent message from an address that is not an external.");
+      }
+      if(portIndex >= dev->outputCount){
+        throw std::runtime_error("External connection sent message from an invalid output port address.");
+      }
+      if(sendIndex!=UINT_MAX){
+        throw std::runtime_error("External connection sent message with sendIndex, but indexed sends are not supported by queue_sim.");
+      }
+      output_pin_t &output=dev->outputs[portIndex];
+      if(output.spec->payloadSize() != size){
+        throw std::runtime_error("External connection sent message where payload size did not match type's payload size.");
+      }
+      TypedDataPtr message=output.spec->create();
+      memcpy(message.payloadPtr(), payload, size);
+
+      if(output.toHalt){
+        onHalt(message);
+      }
+
+      uint64_t mid=midCounter++;
+      m_queuedMessages+=output.batches.size();
+      for(auto &x : output.batches){
+        m_queues[x.queue].post(x.bid, mid, message);
+      }
+    };
+
+    unsigned idleSteps=0;
+    unsigned sleepUs=1;
+
+    while(!m_quit){
+      unsigned done=0;
+
+      external_batch_t *batch;
+      while(!m_quit && m_externalOutbound->pop(batch)){
+        std::unique_ptr<external_batch_t> owned(batch);
+        for(const auto &s : *batch){
+          if(s.isHalt){
+            onHalt(s.message);
+            break;
+          }
+          m_pExternal->post_message(s.source, s.message.payloadPtr(), s.message.payloadSize(), UINT_MAX);
+        }
+        done+=batch->size();
+      }
+      if(m_quit){
+        break;
+      }
+      m_pExternal->flush_posted();
+
+      unsigned got=m_pExternal->drain_incoming(inject);
+      if(got){
+        m_idleCondition.notify_all();
+      }
+      done+=got;
+
+      // Back off in the same way as the ring does, as the queues and
+      // the client only give us something to do occasionally.
+      if(done){
+        idleSteps=0;
+        sleepUs=1;
+      }else if(idleSteps<1024){
+        idleSteps++;
+        std::this_thread::yield();
+      }else{
+        std::this_thread::sleep_for(std::chrono::microseconds(sleepUs));
+        sleepUs=std::min(1000u, sleepUs*2);
+      }
+    }
+  }
+
   void loop(int self)
   {
     queue_t &queue=m_queues.at(self);
 
     const typed_data_t *graphPropertiesPtr=m_graphProperties.get();
 
+    if(m_phaseCounters){
+      m_phaseCounters->attach(PHASE_INIT);
+    }
+
     // Deliver init to all devices we own. We have not started
     // despatching received messages yet, so this must be the
     // first thing they get
@@ -683,6 +896,9 @@ struct QueueSim
         fprintf(stderr, "q = %u, steps = %u\n", queue.index, steps);
       }
       steps++;
+
+      // Only costs anything when the phase actually changes
+      enter_phase(PHASE_STEP);
       
       unsigned bid;
       uint64_t mid;
@@ -703,12 +919,24 @@ struct QueueSim
           queue.send(device);
         }
 
+        {
+          PerfPhaseCounters::scope phase(m_phaseCounters, PHASE_FLUSH);
+          queue.flushExternal();
+        }
+
         // inefficient
         m_idleCondition.notify_all();
       }else if(queue.pop(bid, mid, message)){
         queue.deliver(bid, mid, message);
         m_queuedMessages--;
       }else{
+        enter_phase(PHASE_IDLE);
+
+        {
+          PerfPhaseCounters::scope phase(m_phaseCounters, PHASE_FLUSH);
+          queue.flushExternal();
+        }
+
         if(idleSteps < idleCheckDelta){
           idleSteps++;
           std::this_thread::yield();
@@ -720,8 +948,10 @@ struct QueueSim
           }
           
           m_busyCount--;
-          
-          if(m_busyCount==0 && m_queuedMessages==0){
+
+          // If there is an external then more messages could always turn up, so
+          // we only finish on halt or a device exit.
+          if(m_busyCount==0 && m_queuedMessages==0 && !m_pExternal){
             m_idleCondition.notify_all();
             if(logLevel>2){
               fprintf(stderr,"  queue exit : %d\n", queue.index);
@@ -738,6 +968,8 @@ struct QueueSim
       }
     }
 
+    enter_phase(PerfPhaseCounters::NONE);
+
     if(queue.m_events.size()>0){
       queue.m_log->onEvents(queue.m_events);
       queue.m_events.clear();
@@ -802,10 +1034,17 @@ struct QueueSim
     rapidjson::Document metadata=std::move(_metadata);
     {
       const char *pid=intern(id);
+
+      bool isExternal=dt->isExternal();
+      if(isExternal && !m_pExternal){
+        throw std::runtime_error("Graph contains an external instance, but no external connection has been specified.");
+      }
       
-      unsigned owner;
+      int owner;
       
-      if(m_graphPartitionThreads>0){
+      if(isExternal){
+        owner=-1; // Externals are never run by a queue
+      }else if(m_graphPartitionThreads>0){
 
         if(!metadata.HasMember(m_graphPartitionKey.c_str())){
           rapidjson::StringBuffer buffer;
@@ -822,6 +1061,8 @@ struct QueueSim
       
       device_t d;
       d.id=pid;
+      d.index=m_devicesStg.size();
+      d.isExternal=isExternal;
       d.type=dt;
       d.properties=deviceProperties;
       d.state=deviceState;
@@ -852,10 +1093,18 @@ struct QueueSim
       
       m_idToDevice[d.id] = device;
 
-      if(logLevel>2){
-        fprintf(stderr, " q[%d].add(%p=%s), type=%p\n", d.owner, device, device->id, device->type.get());
+      if(isExternal){
+        if(id=="__halt__"){
+          m_haltDeviceIndex=index;
+        }else{
+          m_externalIndices.insert(index);
+        }
+      }else{
+        if(logLevel>2){
+          fprintf(stderr, " q[%d].add(%p=%s), type=%p\n", d.owner, device, device->id, device->type.get());
+        }
+        m_queues.at(d.owner).devices.push_back(device);
       }
-      m_queues.at(d.owner).devices.push_back(device);
    
     }
 
@@ -868,6 +1117,21 @@ struct QueueSim
     device_t *dstDevice=m_devices.at(dstDevIndex);
     device_t *srcDevice=m_devices.at(srcDevIndex);
 
+    if(dstDevice->isExternal){
+      // Messages to externals are handed to the external thread rather than delivered
+      output_pin_t &out=srcDevice->outputs[srcOutput->getIndex()];
+      if(dstDevIndex==(uint64_t)m_haltDeviceIndex){
+        out.toHalt=true;
+      }else{
+        if(srcDevice->isExternal){
+          throw std::runtime_error("Edges between externals are not supported by queue_sim.");
+        }
+        out.externals.push_back(makeEndpoint(poets_device_address_t{dstDevice->index}, poets_pin_index_t{dstInput->getIndex()}));
+      }
+      out.fanout++;
+      return;
+    }
+
     const char *dstEp=intern(dstDevice->id+std::string(":")+dstInput->getName());
     const char *srcEp=intern(srcDevice->id+std::string(":")+srcOutput->getName());
     
@@ -879,6 +1143,8 @@ struct QueueSim
     edge.state=state;
     edge.properties=properties;
 
+    // Externals have owner -1, so edges from externals always end up in a
+    // remote bundle, which the external thread posts to.
     unsigned dstQueue=dstDevice->owner;
     unsigned srcQueue=srcDevice->owner;
 
@@ -908,11 +1174,19 @@ struct QueueSim
 
 void usage()
 {
-  fprintf(stderr, "queue_sim [options] sourceFile?\n");
+  fprintf(stderr, "queue_sim [options] sourceFile? [--external spec [args]*]\n");
   fprintf(stderr, "\n");
   fprintf(stderr, "  --log-level n\n");
   fprintf(stderr, "  --log-events destFile\n");
   fprintf(stderr, "  --threads count (default is number of cpus).\n");
+  fprintf(stderr, "  --perf-counters : Report time and hardware counters in each phase of each thread at the end.\n");
+  fprintf(stderr, "  --generate spec : Generate the graph in-process rather than loading a file, e.g. clock_tree:6,2,100\n");
+  fprintf(stderr, "  --external spec [args]* : External spec, plus any args. Must be the last option\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "External spec could be:\n");
+  fprintf(stderr, "  PROVIDER - Take the default in-proc external from the provider.\n");
+  fprintf(stderr, "  INPROC:<path> - Load the in-proc external from a shared object.\n");
+  fprintf(stderr, "  SHM:<name> - Create shared memory rings for an external in another process.\n");
   exit(1);
 }
 
@@ -941,6 +1215,7 @@ int main(int argc, char *argv[])
     g_timeNowBase=getNow();
 
     std::string srcFilePath="-";
+    std::string generateSpec;
 
     unsigned statsDelta=1;
 
@@ -948,10 +1223,15 @@ int main(int argc, char *argv[])
 
     double probSend=0.9;
 
+    std::string externalSpec;
+    std::vector<std::string> externalArgs;
+
     unsigned nQueues=std::thread::hardware_concurrency();
     if(nQueues==0)
       nQueues=1;
 
+    bool perfCounters=false;
+
     int ia=1;
     while(ia < argc){
       if(!strcmp("--help",argv[ia])){
@@ -977,6 +1257,27 @@ int main(int argc, char *argv[])
         }
         nQueues=strtoul(argv[ia+1], 0, 0);
         ia+=2;
+      }else if(!strcmp("--perf-counters",argv[ia])){
+        perfCounters=true;
+        ia++;
+      }else if(!strcmp("--generate",argv[ia])){
+        if(ia+1 >= argc){
+          fprintf(stderr, "Missing argument to --generate\n");
+          usage();
+        }
+        generateSpec=argv[ia+1];
+        ia+=2;
+      }else if(!strcmp("--external",argv[ia])){
+        if(ia+1 >= argc){
+          fprintf(stderr, "Missing specification to --external\n");
+          usage();
+        }
+        externalSpec=argv[ia+1];
+        ia+=2;
+        while(ia<argc){
+          externalArgs.push_back(argv[ia]);
+          ia++;
+        }
       }else{
         srcFilePath=argv[ia];
         ia++;
@@ -992,13 +1293,26 @@ int main(int argc, char *argv[])
     }
 
 
+    std::unique_ptr<PerfPhaseCounters> phaseCounters;
+    if(perfCounters){
+      phaseCounters.reset(new PerfPhaseCounters(QueueSim::phase_names()));
+      phaseCounters->attach(QueueSim::PHASE_LOAD);
+      if(!phaseCounters->hardware_available()){
+        fprintf(stderr, "Warning: hardware performance counters are not available, so only measuring time in each phase.\n");
+      }
+    }
+
     RegistryImpl registry;
     
     xmlpp::DomParser parser;
 
     filepath srcPath(current_path());
 
-    if(srcFilePath!="-"){
+    if(!generateSpec.empty()){
+      if(logLevel>1){
+        fprintf(stderr,"Generating graph from '%s'\n", generateSpec.c_str());
+      }
+    }else if(srcFilePath!="-"){
       filepath p(srcFilePath);
       p=absolute(p);
       if(logLevel>1){
@@ -1012,17 +1326,201 @@ int main(int argc, char *argv[])
       }
       parser.parse_stream(std::cin);
     }
-    if(logLevel>1){
+    if(logLevel>1 && generateSpec.empty()){
       fprintf(stderr, "Parsed XML\n");
     }
 
 
     QueueSim graph(nQueues, g_pLog);
+    graph.m_phaseCounters=phaseCounters.get();
+
+    // queue_sim always uses the lock-free rings, as a mutex protected queue
+    // would serialise all the threads that talk to externals.
+    bool externalIsShm = externalSpec.substr(0,4)=="SHM:";
+    if(!externalSpec.empty()){
+      graph.m_pExternal=std::make_shared<InProcRingConnection>();
+      graph.m_pExternal->m_logLevel=logLevel;
+    }
 
-    loadGraph(&registry, srcPath, parser.get_document()->get_root_node(), &graph);
+    if(!generateSpec.empty()){
+      generateGraph(&registry, generateSpec, &graph);
+    }else{
+      loadGraph(&registry, srcPath, parser.get_document()->get_root_node(), &graph);
+    }
     if(logLevel>1){
       fprintf(stderr, "Loaded\n");
     }
+    auto runStart=std::chrono::steady_clock::now();
+
+    std::thread inProcExternalThread;
+    std::thread externalThread;
+
+    if(graph.m_pExternal){
+      auto &ext=*graph.m_pExternal;
+
+      ext.m_idToAddress=[&](const std::string &id) -> poets_device_address_t
+      {
+        auto it=graph.m_idToDevice.find(graph.intern(id));
+        if(it==graph.m_idToDevice.end()){
+          throw std::runtime_error("Unknown device/external instance id "+id);
+        }
+        return poets_device_address_t{it->second->index};
+      };
+      ext.m_addressToId=[&](poets_device_address_t address) -> std::string
+      {
+        if(address.value>=graph.m_devices.size()){
+          throw std::runtime_error("Device address is invalid.");
+        }
+        return graph.m_devices[address.value]->id;
+      };
+      ext.m_endpointToFanout=[&](poets_endpoint_address_t address, std::vector<poets_endpoint_address_t> &fanout) -> void
+      {
+        if(getEndpointDevice(address).value>=graph.m_devices.size()){
+          throw std::runtime_error("Device address is invalid.");
+        }
+        auto *dev=graph.m_devices[getEndpointDevice(address).value];
+        if(getEndpointPin(address).value >= dev->outputCount){
+          throw std::runtime_error("Device pin index is invalid.");
+        }
+        fanout=dev->outputs[getEndpointPin(address).value].externals;
+      };
+
+      // Applies to both in-process and shared memory externals
+      ext.m_connect = [&](const std::string &graphType, const std::string &graphInst, const std::vector<std::pair<std::string,std::string> > &owned)
+      {
+        if(!std::regex_match(graph.m_graphType->getId(), std::regex(graphType))){
+          throw std::runtime_error("Graph type of "+graph.m_graphType->getId()+" does not match externals type of "+graphType);
+        }
+        if(!std::regex_match(graph.m_id, std::regex(graphInst))){
+          throw std::runtime_error("Graph instance of "+graph.m_id+" does not match externals instance of "+graphInst);
+        }
+
+        std::unordered_set<unsigned> foundIndices;
+        for(auto i_v : owned){
+          if(i_v.first=="__halt__"){
+            throw std::runtime_error("Client connection tried to take ownership of the __halt__ device.");
+          }
+          auto it=graph.m_idToDevice.find(graph.intern(i_v.first));
+          if(it==graph.m_idToDevice.end()){
+            throw std::runtime_error("Attempt to bind to unknown external instance "+i_v.first);
+          }
+          auto *d=it->second;
+          if(!d->isExternal){
+            throw std::runtime_error("Attempt to bind to non-external device "+i_v.first);
+          }
+          if(!i_v.second.empty()){
+            if(!std::regex_match( d->type->getId(), std::regex(i_v.second))){
+              throw std::runtime_error("Attempt to bind instance "+i_v.first+" to device matching '"+i_v.second+"' but real type is '"+ d->type->getId() +"'.");
+            }
+          }
+          foundIndices.insert(d->index);
+        }
+        if(foundIndices != graph.m_externalIndices){
+          throw std::runtime_error("External did not bind to the complete set of externals.");
+        }
+      };
+
+      unsigned maxPayload=sizeof(halt_message_type);
+      for(const auto &mt : graph.m_graphType->getMessageTypes()){
+        maxPayload=std::max(maxPayload, (unsigned)mt->getMessageSpec()->payloadSize());
+      }
+
+      if(!externalIsShm){
+        ext.create_heap(InProcRingConnection::DEFAULT_CAPACITY, maxPayload);
+      }else{
+        std::string shmName=externalSpec.substr(4);
+
+        std::vector<InProcRingConnection::directory_entry> entries;
+        std::vector<std::pair<std::string,size_t>> sizes;
+        for(unsigned index : graph.m_externalIndices){
+          const auto *dev=graph.m_devices[index];
+          InProcRingConnection::directory_entry e;
+          e.address=poets_device_address_t{dev->index};
+          e.id=dev->id;
+          if(dev->properties){
+            e.properties.assign(dev->properties.payloadPtr(), dev->properties.payloadPtr()+dev->properties.payloadSize());
+          }
+          sizes.push_back({e.id, e.properties.size()});
+          entries.push_back(std::move(e));
+        }
+        std::vector<uint8_t> graphProperties;
+        if(graph.m_graphProperties){
+          graphProperties.assign(graph.m_graphProperties.payloadPtr(), graph.m_graphProperties.payloadPtr()+graph.m_graphProperties.payloadSize());
+        }
+
+        ext.create_shm(shmName, InProcRingConnection::directory_bytes(sizes, graphProperties.size()), InProcRingConnection::connect_bytes(sizes), InProcRingConnection::DEFAULT_CAPACITY, maxPayload);
+        ext.publish_directory(entries, graphProperties);
+        fprintf(stderr, "Created shared memory rings '%s', waiting for external process to attach.\n", shmName.c_str());
+      }
+
+      if(!externalIsShm){
+        in_proc_external_main_t pProc=nullptr;
+
+        if(externalSpec.substr(0, 7)=="INPROC:"){
+          std::string so_path=externalSpec.substr(7);
+          fprintf(stderr, "Loading inproc external from %s\n", so_path.c_str());
+          void *hExternalObj=dlopen(so_path.c_str(), RTLD_NOW);
+          if(!hExternalObj){
+            throw std::runtime_error("Couldn't open shared object file "+so_path);
+          }
+          pProc=(in_proc_external_main_t)dlsym(hExternalObj, "poets_in_proc_external_main");
+          if(!pProc){
+            throw std::runtime_error("Couldn't find symbol 'poets_in_proc_external_main' in shared object.");
+          }
+        }else if(externalSpec=="PROVIDER"){
+          fprintf(stderr, "Loading default inproc external from provider\n");
+          pProc=graph.m_graphType->getDefaultInProcExternalProcedure();
+          if(pProc==nullptr){
+            throw std::runtime_error("Provider did not contain an in-proc external (is it dynamic? You might need to compiler the provider.)");
+          }
+        }else{
+          throw std::runtime_error("Didn't understand external spec: "+externalSpec);
+        }
+
+        ext.m_getGraphProperties=[&](size_t cbBuffer, void *pBuffer) -> size_t
+        {
+          if(cbBuffer < graph.m_graphProperties.payloadSize()){
+            throw std::runtime_error("Buffer is too small");
+          }
+          memcpy(pBuffer, graph.m_graphProperties.payloadPtr(), graph.m_graphProperties.payloadSize());
+          return graph.m_graphProperties.payloadSize();
+        };
+
+        ext.m_getDeviceProperties=[&](poets_device_address_t address, size_t cbBuffer, void *pBuffer) -> size_t
+        {
+          auto *dev=graph.m_devices.at(address.value);
+          if(cbBuffer < dev->properties.payloadSize()){
+            throw std::runtime_error("Buffer is too small");
+          }
+          memcpy(pBuffer, dev->properties.payloadPtr(), dev->properties.payloadSize());
+          return dev->properties.payloadSize();
+        };
+
+        inProcExternalThread=std::thread([&,pProc](){
+          std::vector<const char *> fargv;
+          fargv.push_back( argv[0] );
+          for(auto &x : externalArgs){
+            fargv.push_back( x.c_str() );
+          }
+          pProc(ext, fargv.size(), &fargv[0]);
+          // Externals often finish by sending a halt, which the ring may still be holding
+          ext.flush();
+        });
+      }
+
+      fprintf(stderr, "Waiting for external to call 'connect'\n");
+      ext.wait_for_connect();
+      fprintf(stderr, "External is connected.\n");
+
+      externalThread=std::thread([&](){
+        try{
+          graph.externalLoop();
+        }catch(std::exception &e){
+          std::cerr<<"Exception in external thread : "<<e.what()<<"\n";
+          exit(1);
+        }
+      });
+    }
 
     if(nQueues==1){
       graph.m_busyCount++;
@@ -1043,8 +1541,33 @@ int main(int argc, char *argv[])
     
     //graph.dump();
 
+    if(externalThread.joinable()){
+      externalThread.join();
+    }
+    if(inProcExternalThread.joinable()){
+      if(graph.m_haltMessage){
+        fprintf(stderr, "Joining with in-proc external thread.\n");
+        inProcExternalThread.join();
+      }else{
+        // A device exited, so the external has no way of knowing it should stop
+        inProcExternalThread.detach();
+      }
+    }
+
     if(logLevel>1){
       fprintf(stderr, "Done\n");
+      // Same format as POEMS, so that benchmark_simulators can parse either
+      double secs=std::chrono::duration<double>(std::chrono::steady_clock::now()-runStart).count();
+      double messages=0;
+      for(const auto &q : graph.m_queues){
+        messages+=q.m_recvCount;
+      }
+      fprintf(stderr, "Sim time = %g secs, M messages received = %f, MReceive/sec = %f\n", secs, messages/1e6, messages/secs/1e6);
+    }
+
+    if(phaseCounters){
+      phaseCounters->enter(PerfPhaseCounters::NONE);
+      fprintf(stderr, "Phases : %s\n", phaseCounters->summary().c_str());
     }
 
     if(graph.m_exitCodeSet){
@@ -35,4 +35,10 @@ LAST_DEV="n_4_3"
     cat $WD/event.log | grep -E "\<RecvEvent sendEventId=\"[^\"]+\" pin=\"in\" dev=\"${LAST_DEV}\""
     (cd $WD && ${GS}/tools/render_event_log_as_dot.py event.log)
     # Don't render the event log to image as it is massive
+}
+
+@test "simulate test_external_ping_pong using queue_sim with in-proc external" {
+    make_target test_external_ping_pong_provider
+    run bin/queue_sim --threads 2 apps/tests/externals/test_external_ping_pong_graph_inst_1.xml --external INPROC:providers/test_external_ping_pong.external.so
+    [[ $status -eq 0 ]]
 }
\ No newline at end of file
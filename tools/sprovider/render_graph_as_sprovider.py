@@ -4,11 +4,13 @@ import io
 import sys
 import os
 import re
+import copy
+import math
 from typing import *
 
 from graph.core import GraphType, DeviceType, OutputPin, InputPin, MessageType, GraphInstance, DeviceInstance, EdgeInstance
 from graph.core import TypedDataSpec, TupleTypedDataSpec, ScalarTypedDataSpec, ArrayTypedDataSpec
-from graph.load_xml import load_graph_type
+from graph.load_xml import load_graph_type, load_graph
 
 
 size = lambda x: x.size_in_bytes() if x is not None else 0
@@ -121,11 +123,108 @@ def render_typed_data_spec_as_struct(dt:TupleTypedDataSpec, id:str, dst:io.TextI
     dst.write("#pragma pack(pop)\n")
     dst.write(f"SPROVIDER_STATIC_ASSERT( sizeof({id}) == {1 if dt is None or dt.size_in_bytes()==0 else dt.size_in_bytes()} );\n")
 
+def typed_data_to_c_init(dt:TypedDataSpec, value) -> str:
+    """Renders an expanded value as a C initialiser for the struct made by typed_data_spec_to_c_decl."""
+    if isinstance(dt,TupleTypedDataSpec):
+        return "{"+",".join(typed_data_to_c_init(e, value[e.name]) for e in dt.elements_by_index)+"}"
+    elif isinstance(dt,ArrayTypedDataSpec):
+        return "{"+",".join(typed_data_to_c_init(dt.type, v) for v in value)+"}"
+    elif isinstance(dt,ScalarTypedDataSpec):
+        if dt.type in ("float","double"):
+            v=float(value)
+            if math.isnan(v):
+                res="__builtin_nan(\"\")"
+            elif math.isinf(v):
+                res="__builtin_inf()" if v>0 else "-__builtin_inf()"
+            else:
+                res=v.hex() # Exact, unlike decimal
+            # Loaders parse floats as doubles and then narrow them, so do the same
+            return f"({dt.type}){res}"
+        v=int(value)
+        if dt.type=="int64_t":
+            return f"INT64_C({v})" if v!=-2**63 else "INT64_MIN"
+        elif dt.type=="uint64_t":
+            return f"UINT64_C({v})"
+        elif dt.type=="uint32_t":
+            return f"{v}u"
+        else:
+            return str(v)
+    else:
+        raise RuntimeError("Unknown/unsupported data type: {}.".format(dt))
+
+class Specialisation:
+    """What a graph instance lets us bake into the handlers.
+
+    - graph_properties : expanded graph properties, or None if there aren't any
+    - device_properties : map of device type id to the expanded properties shared by every instance of that type
+    - used_device_types : ids of device types with at least one instance
+    - used_inputs : (device type id, pin name) of every input pin with at least one edge
+    """
+    def __init__(self, gi:GraphInstance, device_properties:bool):
+        gt=gi.graph_type
+        self.instance_id=gi.id
+        self.graph_properties=None
+        if size(gt.properties)>0:
+            self.graph_properties=gt.properties.expand(copy.deepcopy(gi.properties))
+
+        self.used_device_types=set() # type:Set[str]
+        shared={} # type:Dict[str,Any]
+        varies=set() # type:Set[str]
+        for di in gi.device_instances.values():
+            dt=di.device_type
+            self.used_device_types.add(dt.id)
+            if not device_properties or size(dt.properties)==0 or dt.id in varies:
+                continue
+            # Most instances are identical as written, so only expand when they aren't
+            raw=di.properties
+            if dt.id not in shared:
+                shared[dt.id]=(raw, dt.properties.expand(copy.deepcopy(raw)))
+            elif shared[dt.id][0]!=raw and shared[dt.id][1]!=dt.properties.expand(copy.deepcopy(raw)):
+                varies.add(dt.id)
+        self.device_properties={ id:v[1] for (id,v) in shared.items() if id not in varies }
+
+        self.used_inputs=set() # type:Set[Tuple[str,str]]
+        for ei in gi.edge_instances.values():
+            self.used_inputs.add( (ei.dst_device.device_type.id, ei.dst_pin.name) )
+
 class RenderOptions:
     def __init__(self):
         self.dst =sys.stdout # type:io.TextIOBase
         self.precise_activity_flags=True
         self.adapt_handler=lambda x: x
+        # Device type ids which get batch (struct-of-devices) rts handlers.
+        # "*" means all non-external device types.
+        self.batch_device_types=set() # type:Set[str]
+        # If set then the handlers are only valid for this instance
+        self.specialisation=None # type:Optional[Specialisation]
+
+def is_batch_device_type(dt:DeviceType, options:RenderOptions) -> bool:
+    if dt.is_external:
+        return False
+    return ("*" in options.batch_device_types) or (dt.id in options.batch_device_types)
+
+def is_used_device_type(dt:DeviceType, options:RenderOptions) -> bool:
+    return options.specialisation is None or dt.id in options.specialisation.used_device_types
+
+def is_used_input(dt:DeviceType, ip:InputPin, options:RenderOptions) -> bool:
+    # Supervisor messages don't have edge instances
+    if options.specialisation is None or ip.is_supervisor_implicit_pin:
+        return True
+    return (dt.id, ip.name) in options.specialisation.used_inputs
+
+def render_specialised_values_as_sprovider(gt:GraphType, options:RenderOptions):
+    dst=options.dst
+    spec=options.specialisation
+    if spec is None:
+        return
+
+    dst.write(f"\n// Specialised for graph instance {spec.instance_id}\n")
+    if spec.graph_properties is not None:
+        dst.write(f"SPROVIDER_SPECIALISED_CONST {gt.id}_properties_t sprovider_specialised_graph_properties = {typed_data_to_c_init(gt.properties, spec.graph_properties)};\n")
+    for dt in gt.device_types.values():
+        if dt.id in spec.device_properties:
+            dst.write(f"SPROVIDER_SPECIALISED_CONST {gt.id}_{dt.id}_properties_t sprovider_specialised_{dt.id}_properties = {typed_data_to_c_init(dt.properties, spec.device_properties[dt.id])};\n")
+    dst.write("\n")
 
 def render_graph_type_structs_as_sprovider(gt:GraphType, options:RenderOptions):
     dst=options.dst
@@ -214,12 +313,18 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
     for sc in gt.shared_code:
         dst.write(adapt_handler(sc)+"\n")
 
+    render_specialised_values_as_sprovider(gt, options)
+
     for dt in gt.device_types.values(): # type:DeviceType
         ##################################################################
         ## Begin device type
 
         dst.write(f"///////////////////////////////\n// Device {dt.id}\n\n")
 
+        if not is_used_device_type(dt, options):
+            dst.write(f"// Not used by the specialised instance\n\n")
+            continue
+
         dst.write(f"////////////////////////////\n// Device {dt.id} shared code\n\n")
         dst.write(f"#define DEVICE_PROPERTIES_T {dt.id}_properties_t;\n")
         dst.write(f"#define DEVICE_STATE_T {dt.id}_state_t;\n\n")
@@ -228,7 +333,20 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
         dst.write(f"\n#undef DEVICE_PROPERTIES_T\n")
         dst.write(f"#undef DEVICE_STATE_T\n\n")
 
-        shared_prefix=f"""
+        # dpds is the expression for the start of the device properties and state. Batch
+        # handlers pass base+offset rather than a derived pointer, as that is the form the
+        # vectoriser recognises as a gather.
+        spec=options.specialisation
+        if spec is not None and spec.graph_properties is not None:
+            graph_properties_init="&sprovider_specialised_graph_properties"
+        else:
+            graph_properties_init="(const GRAPH_PROPERTIES_T*)_gpV"
+        if spec is not None and dt.id in spec.device_properties:
+            device_properties_init=lambda dpds: f"&sprovider_specialised_{dt.id}_properties"
+        else:
+            device_properties_init=lambda dpds: f"(const DEVICE_PROPERTIES_T*)({dpds})"
+
+        make_shared_prefix=lambda dpds: f"""
         const int _graph_properties_size={size(gt.properties)};
         const int _graph_properties_size_padded={size_pad(gt.properties)};
         const int _device_properties_size={size(dt.properties)};
@@ -238,9 +356,9 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
         
         typedef {dt.id}_properties_t DEVICE_PROPERTIES_T;
         typedef {dt.id}_state_t DEVICE_STATE_T;
-        const GRAPH_PROPERTIES_T *graphProperties=(const GRAPH_PROPERTIES_T*)_gpV;
-        const DEVICE_PROPERTIES_T *deviceProperties=(const DEVICE_PROPERTIES_T*)_dpdsV;
-        DEVICE_STATE_T *deviceState=(DEVICE_STATE_T*)( ((char*)_dpdsV) + _device_properties_size_padded);
+        const GRAPH_PROPERTIES_T *graphProperties={graph_properties_init};
+        const DEVICE_PROPERTIES_T *deviceProperties={device_properties_init(dpds)};
+        DEVICE_STATE_T *deviceState=(DEVICE_STATE_T*)( ((char*)({dpds})) + _device_properties_size_padded);
         
         #ifdef POEMS_ENABLE_VALGRIND_MEMCHECK
         assert(_graph_properties_size ? 0==VALGRIND_CHECK_MEM_IS_DEFINED(graphProperties, _graph_properties_size) : 1);
@@ -249,9 +367,13 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
         #endif
         
         """
+        rts_flags=""
         for (i,op) in enumerate(dt.outputs_by_index):
-            shared_prefix+=f"const uint32_t RTS_FLAG_{op.name} = 1<<{i};\n"
-            shared_prefix+=f"const uint32_t RTS_INDEX_{op.name} = {i};\n"
+            rts_flags+=f"const uint32_t RTS_FLAG_{op.name} = 1<<{i};\n"
+            rts_flags+=f"const uint32_t RTS_INDEX_{op.name} = {i};\n"
+            if op.is_supervisor_implicit_pin:
+                rts_flags+=f"const uint32_t RTS_SUPER_IMPLICIT_SEND_FLAG = 1<<{i};\n"
+        shared_prefix=make_shared_prefix("_dpdsV")+rts_flags
 
         if options.precise_activity_flags:
             active_flag_postfix=f"""
@@ -325,6 +447,8 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
         """)
 
         for ip in dt.inputs_by_index:
+            if not is_used_input(dt, ip, options):
+                continue
             dst.write(f"""
             static active_flag_t {iprefix}_do_recv_{dt.id}_{ip.name}(void *_ctxt, const void *_gpV, void *_dpdsV, void *_epesV, const void *_msgV)
             {{
@@ -352,6 +476,8 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
                 default:  SPROVIDER_UNREACHABLE;
         """)
         for (i,ip) in enumerate(dt.inputs_by_index):
+            if not is_used_input(dt, ip, options):
+                continue
             dst.write(f"""  case {i}:
             {{
                 const int _edge_properties_size={size(ip.properties)};
@@ -417,21 +543,12 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
         """)
 
         dst.write(f"""
-        static active_flag_t {iprefix}_try_send_or_compute_{dt.id}(void *_ctxt, const void *_gpV, const void *_dpdsV, int *_action_taken, int *_output_port, unsigned *_message_size, int *_send_index, void *_msgV) {{
+        static SPROVIDER_ALWAYS_INLINE active_flag_t {iprefix}_send_or_compute_with_rts_{dt.id}(void *_ctxt, const void *_gpV, const void *_dpdsV, uint32_t _readyToSend, bool _readyToCompute, int *_action_taken, int *_output_port, unsigned *_message_size, int *_send_index, void *_msgV) {{
             {shared_prefix}
             assert(*_action_taken == -2);
             assert(*_output_port < 0);
-            uint32_t _readyToSend=0;
-            bool _readyToCompute=false;
             bool _doSend=true;
             bool *doSend=&_doSend;
-            {{
-                uint32_t *readyToSend=&_readyToSend;
-                bool *requestCompute=&_readyToCompute;
-                ////////////////////////////////////////
-                {adapt_handler(dt.ready_to_send_handler)}
-                ////////////////////////////////////////
-            }}
             if(!_readyToSend){{
                 if(!_readyToCompute){{
                     return false;
@@ -468,19 +585,64 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
             ///////////////////////
             {active_flag_postfix}
         }}
+
+        static active_flag_t {iprefix}_try_send_or_compute_{dt.id}(void *_ctxt, const void *_gpV, const void *_dpdsV, int *_action_taken, int *_output_port, unsigned *_message_size, int *_send_index, void *_msgV) {{
+            {shared_prefix}
+            uint32_t _readyToSend=0;
+            bool _readyToCompute=false;
+            {{
+                uint32_t *readyToSend=&_readyToSend;
+                bool *requestCompute=&_readyToCompute;
+                ////////////////////////////////////////
+                {adapt_handler(dt.ready_to_send_handler)}
+                ////////////////////////////////////////
+            }}
+            return {iprefix}_send_or_compute_with_rts_{dt.id}(_ctxt, _gpV, _dpdsV, _readyToSend, _readyToCompute, _action_taken, _output_port, _message_size, _send_index, _msgV);
+        }}
         """)
 
+        if is_batch_device_type(dt, options):
+            # The rts handler is evaluated for a run of devices laid out at a fixed
+            # stride. There is nothing carried between iterations, so for arithmetic
+            # handlers the compiler can turn this into SIMD over devices (with gathers
+            # for the strided loads).
+            dst.write(f"""
+            static void {iprefix}_calc_rts_batch_{dt.id}(void *_ctxt, const void *_gpV, unsigned _n, const void *_dpdsBase, unsigned _stride, uint32_t *SPROVIDER_RESTRICT _rtsOut, bool *SPROVIDER_RESTRICT _rtcOut)
+            {{
+                SPROVIDER_BATCH_LOOP
+                for(unsigned _i=0; _i<_n; _i++){{
+                    // Signed 32-bit offset so that the loads map onto gather instructions
+                    const int _dpdsOffset=(int)(_i*_stride);
+                    {make_shared_prefix("((const char*)_dpdsBase)+_dpdsOffset")+rts_flags}
+                    uint32_t _readyToSend=0;
+                    bool _readyToCompute=false;
+                    {{
+                        uint32_t *readyToSend=&_readyToSend;
+                        bool *requestCompute=&_readyToCompute;
+                        ////////////////////////////////////////
+                        {adapt_handler(dt.ready_to_send_handler)}
+                        ////////////////////////////////////////
+                    }}
+                    _rtsOut[_i]=_readyToSend;
+                    _rtcOut[_i]=_readyToCompute;
+                }}
+            }}
+            """)
+
         ## Finished device type
         #####################################################
 
     #####################################################
     ## Now do the standard muxing entry points
+    ## Device types removed by specialisation fall through to the default
 
     dst.write(f"""static active_flag_t sprovider_do_init(void *_ctxt, unsigned _device_type_index, const void *_gpV,  void *_dpdsV){{
        switch(_device_type_index){{
        default:  SPROVIDER_UNREACHABLE;
     """)
     for (i,dt) in enumerate(gt.device_types.values()):
+        if not is_used_device_type(dt, options):
+            continue
         dst.write(f"   case {i}: return {iprefix}_do_init_{dt.id}(_ctxt, _gpV, _dpdsV);\n")
     dst.write("}\n}\n\n")
 
@@ -489,6 +651,8 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
        default:  SPROVIDER_UNREACHABLE;
     """)
     for (i,dt) in enumerate(gt.device_types.values()):
+        if not is_used_device_type(dt, options):
+            continue
         dst.write(f"   case {i}: return {iprefix}_do_hardware_idle_{dt.id}(_ctxt, _gpV, _dpdsV);\n")
     dst.write("}\n}\n\n")
 
@@ -497,6 +661,8 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
        default:  SPROVIDER_UNREACHABLE;
     """)
     for (i,dt) in enumerate(gt.device_types.values()):
+        if not is_used_device_type(dt, options):
+            continue
         dst.write(f"   case {i}: return {iprefix}_do_device_idle_{dt.id}(_ctxt, _gpV, _dpdsV);\n")
     dst.write("}\n}\n\n")
 
@@ -505,6 +671,8 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
        default:  SPROVIDER_UNREACHABLE;
     """)
     for (i,dt) in enumerate(gt.device_types.values()):
+        if not is_used_device_type(dt, options):
+            continue
         dst.write(f"   case {i}: return {iprefix}_calc_rts_{dt.id}(_ctxt, _gpV, _dpdsV, readyToSend, requestCompute);\n")
     dst.write("}\n}\n\n")        
 
@@ -513,6 +681,8 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
         default: SPROVIDER_UNREACHABLE;
     """)
     for (i,dt) in enumerate(gt.device_types.values()):
+        if not is_used_device_type(dt, options):
+            continue
         dst.write(f"""    case {i}: return {iprefix}_do_send_{dt.id}(_ctxt, _pin_index, _gpV, _dpdsV, _do_send, _send_index, _msgV);\n""")
     dst.write("}\n}\n\n")
 
@@ -521,23 +691,191 @@ def render_graph_type_handlers_as_sprovider(gt:GraphType, options:RenderOptions)
         default: SPROVIDER_UNREACHABLE;
     """)
     for (i,dt) in enumerate(gt.device_types.values()):
+        if not is_used_device_type(dt, options):
+            continue
         dst.write(f"""    case {i}: return {iprefix}_try_send_or_compute_{dt.id}(_ctxt, _gpV, _dpdsV, _action_taken, _output_port, _message_size, _send_index, _msgV);\n""")
     dst.write("}\n}\n\n")
 
+    dst.write(f"""static active_flag_t sprovider_send_or_compute_with_rts(void *_ctxt, unsigned _device_type_index, const void *_gpV, void *_dpdsV, uint32_t _rts, bool _requestCompute, int *_action_taken, int *_output_port, unsigned *_message_size, int *_send_index, void *_msgV){{
+        switch(_device_type_index){{
+        default: SPROVIDER_UNREACHABLE;
+    """)
+    for (i,dt) in enumerate(gt.device_types.values()):
+        if not is_used_device_type(dt, options):
+            continue
+        dst.write(f"""    case {i}: return {iprefix}_send_or_compute_with_rts_{dt.id}(_ctxt, _gpV, _dpdsV, _rts, _requestCompute, _action_taken, _output_port, _message_size, _send_index, _msgV);\n""")
+    dst.write("}\n}\n\n")
+
+    dst.write(f"""static bool sprovider_calc_rts_batch(void *_ctxt, unsigned _device_type_index, const void *_gpV, unsigned _n, const void *_dpdsBase, unsigned _stride, uint32_t *_rts, bool *_requestCompute){{
+        switch(_device_type_index){{
+        default: SPROVIDER_UNREACHABLE;
+    """)
+    for (i,dt) in enumerate(gt.device_types.values()):
+        if not is_used_device_type(dt, options):
+            continue
+        if is_batch_device_type(dt, options):
+            dst.write(f"    case {i}: {iprefix}_calc_rts_batch_{dt.id}(_ctxt, _gpV, _n, _dpdsBase, _stride, _rts, _requestCompute); return true;\n")
+        else:
+            dst.write(f"    case {i}: return false;\n")
+    dst.write("}\n}\n\n")
+
     dst.write(f"""static active_flag_t sprovider_do_recv(void *_ctxt, unsigned _device_type_index, unsigned _pin_index, const void *_gpV, void *_dpdsV, void *_epesV, const void *_msgV){{
         switch(_device_type_index){{
         default: SPROVIDER_UNREACHABLE;
         """)
     for (i,dt) in enumerate(gt.device_types.values()):
+        if not is_used_device_type(dt, options):
+            continue
         dst.write(f"    case {i}: return {iprefix}_do_recv_{dt.id}(_ctxt, _pin_index, _gpV, _dpdsV, _epesV, _msgV);\n")
     dst.write("}}\n\n")
 
 
-def render_graph_type_as_sprovider(gt:GraphType, options:RenderOptions):
-    if(len(gt.supervisor_types)>0):
-        raise RuntimeError("POEMS cannot currently handle graphs with supervisors")
-        
+def render_graph_type_supervisor_as_sprovider(gt:GraphType, options:RenderOptions):
+    dst=options.dst
+    S=lambda x: x if x is not None else ""
+
+    if len(gt.supervisor_types)==0:
+        dst.write("""
+        ////////////////////////////
+        // No supervisor
+
+        static void sprovider_supervisor_init(const void *_gpV) {}
+        static void sprovider_supervisor_recv(const void *_gpV, const void *_msgV, void *_replyV, void *_bcastV, bool *_rtsReply, bool *_rtsBcast) {}
+        static void sprovider_supervisor_idle(const void *_gpV) {}
+        static void sprovider_supervisor_stop(const void *_gpV) {}
+        """)
+        return
+
+    if len(gt.supervisor_types)>1:
+        raise RuntimeError("sprovider can only handle graphs with at most one supervisor type")
+    st=list(gt.supervisor_types.values())[0]
+    if len(st.inputs_by_index)!=1:
+        raise RuntimeError("sprovider can only handle supervisor types with exactly one input pin")
+    (_,_,mt,receive_handler)=st.inputs_by_index[0]
+
+    ## The supervisor runs on the host, so unlike device handlers it is allowed
+    ## to be C++. Properties and state are single globals, as there is only one
+    ## supervisor instance.
+
+    dst.write(f"""
+    ////////////////////////////
+    // Supervisor {st.id}
+
+    #include <string>
+    #include <cstdlib>
+
+    {S(st.shared_code)}
+
+    namespace sprovider_supervisor_{st.id} {{
+
+    struct Super
+    {{
+        static void post(const std::string &msg)
+        {{
+            // Exit markers are recognised by the format string, so only use "%s" if we have to
+            if(msg.find('%')==std::string::npos){{
+                sprovider_handler_log(0, msg.c_str());
+            }}else{{
+                sprovider_handler_log(0, "%s", msg.c_str());
+            }}
+        }}
+
+        static void stop_application()
+        {{
+            sprovider_supervisor_stop_application();
+        }}
+
+        static std::string get_output_directory(std::string suffix="")
+        {{
+            char *tmp=getenv("TMP");
+            if(tmp==0){{
+                post("Couldn't create supervisor directory.");
+                return {{}};
+            }}
+            std::string res=std::string(tmp)+"/supervisor_dir_XXXXXX";
+            if(0==mkdtemp(&res[0])){{
+                post("Couldn't create supervisor directory.");
+                return "";
+            }}
+            return res;
+        }}
+    }};
+
+    struct properties_t
+    {{
+    {S(st.properties_code)}
+    }};
+
+    struct state_t
+    {{
+    {S(st.state_code)}
+    }};
+
+    static properties_t _properties;
+    static state_t _state;
+
+    static const properties_t * const supervisorProperties=&_properties;
+    static state_t * const supervisorState=&_state;
+
+    static void on_init(const void *_gpV)
+    {{
+        const GRAPH_PROPERTIES_T *graphProperties=(const GRAPH_PROPERTIES_T*)_gpV;
+        //////////////////
+        {S(st.init_handler)}
+        //////////////////
+    }}
+
+    static void on_recv(const void *_gpV, const void *_msgV, void *_replyV, void *_bcastV, bool *_rtsReply, bool *_rtsBcast)
+    {{
+        typedef {mt.id}_message_t MESSAGE_T;
+        const GRAPH_PROPERTIES_T *graphProperties=(const GRAPH_PROPERTIES_T*)_gpV;
+        const MESSAGE_T *message=(const MESSAGE_T*)_msgV;
+        MESSAGE_T *reply=(MESSAGE_T*)_replyV;
+        MESSAGE_T *bcast=(MESSAGE_T*)_bcastV;
+        bool &__rtsReply=*_rtsReply;
+        bool &__rtsBcast=*_rtsBcast;
+        #define RTSREPLY() __rtsReply = true
+        #define RTSBCAST() __rtsBcast = true
+        //////////////////
+        {S(receive_handler)}
+        //////////////////
+        #undef RTSREPLY
+        #undef RTSBCAST
+    }}
+
+    static void on_supervisor_idle(const void *_gpV)
+    {{
+        const GRAPH_PROPERTIES_T *graphProperties=(const GRAPH_PROPERTIES_T*)_gpV;
+        //////////////////
+        {S(st.on_supervisor_idle_handler)}
+        //////////////////
+    }}
+
+    static void on_stop(const void *_gpV)
+    {{
+        const GRAPH_PROPERTIES_T *graphProperties=(const GRAPH_PROPERTIES_T*)_gpV;
+        //////////////////
+        {S(st.on_stop_handler)}
+        //////////////////
+    }}
+
+    }}; // namespace sprovider_supervisor_{st.id}
+
+    static void sprovider_supervisor_init(const void *_gpV)
+    {{ sprovider_supervisor_{st.id}::on_init(_gpV); }}
+
+    static void sprovider_supervisor_recv(const void *_gpV, const void *_msgV, void *_replyV, void *_bcastV, bool *_rtsReply, bool *_rtsBcast)
+    {{ sprovider_supervisor_{st.id}::on_recv(_gpV, _msgV, _replyV, _bcastV, _rtsReply, _rtsBcast); }}
+
+    static void sprovider_supervisor_idle(const void *_gpV)
+    {{ sprovider_supervisor_{st.id}::on_supervisor_idle(_gpV); }}
+
+    static void sprovider_supervisor_stop(const void *_gpV)
+    {{ sprovider_supervisor_{st.id}::on_stop(_gpV); }}
+    """)
 
+
+def render_graph_type_as_sprovider(gt:GraphType, options:RenderOptions):
     dst=options.dst
 
     dst.write(f"""
@@ -549,6 +887,7 @@ def render_graph_type_as_sprovider(gt:GraphType, options:RenderOptions):
 
     render_graph_type_structs_as_sprovider(gt, options)
     render_graph_type_handlers_as_sprovider(gt, options)
+    render_graph_type_supervisor_as_sprovider(gt, options)
     render_graph_type_info_as_sprovider(gt, options)
 
     dst.write("#endif\n\n")
@@ -565,6 +904,8 @@ def render_graph_type_info_as_sprovider(gt:GraphType, options:RenderOptions):
     has_any_device_idle=any(non_trivial_handler(dt.on_device_idle_handler) for dt in gt.device_types.values())
     has_any_indexed_send=any( any(op.is_indexed for op in dt.outputs_by_index) for dt in gt.device_types.values() )
 
+    spec=options.specialisation
+
     dst.write(f"""
     SPROVIDER_GLOBAL_CONST int SPROVIDER_DEVICE_TYPE_COUNT = {len(gt.device_types)};
 
@@ -574,7 +915,9 @@ def render_graph_type_info_as_sprovider(gt:GraphType, options:RenderOptions):
         {1 if has_any_device_idle else 0},
         {1 if has_any_indexed_send else 0},
         {size(gt.properties)},
-        {size_pad(gt.properties)}
+        {size_pad(gt.properties)},
+        {1 if len(gt.supervisor_types)>0 else 0},
+        {"&sprovider_specialised_graph_properties" if spec is not None and spec.graph_properties is not None else "nullptr"}
     }};
 
     SPROVIDER_GLOBAL_CONST sprovider_device_info_t SPROVIDER_DEVICE_TYPE_INFO[SPROVIDER_DEVICE_TYPE_COUNT] = {{
@@ -614,6 +957,8 @@ def render_graph_type_info_as_sprovider(gt:GraphType, options:RenderOptions):
                 {size(ip.state)},
                 {size_pad(ip.state)},
                 {size_pad(ip.properties)+size_pad(ip.state)},
+                {1 if ip.is_supervisor_implicit_pin else 0},
+                {0 if is_used_input(dt, ip, options) else 1}
             }}
             """)
 
@@ -629,13 +974,17 @@ def render_graph_type_info_as_sprovider(gt:GraphType, options:RenderOptions):
                 {j},
                 {size(mt.message)},
                 {size_pad(mt.message)},
-                {1 if op.is_indexed else 0}              
+                {1 if op.is_indexed else 0},
+                {1 if op.is_supervisor_implicit_pin else 0}
             }}
             """)
 
 
         dst.write(f"""
-        }}
+        }},
+        {1 if is_batch_device_type(dt, options) else 0}, // has_batch
+        {0 if is_used_device_type(dt, options) else 1}, // specialised_unused
+        {f"&sprovider_specialised_{dt.id}_properties" if spec is not None and dt.id in spec.device_properties else "nullptr"} // specialised_properties
         }}
         """)
     dst.write(f"""
@@ -652,8 +1001,45 @@ def render_graph_type_info_as_sprovider(gt:GraphType, options:RenderOptions):
 
 if __name__=="__main__":
     options=RenderOptions()
-
-    path=sys.argv[1]
-    gt=load_graph_type(path,path)
+    specialise=False
+    specialise_devices=False
+
+    usage="render_graph_as_sprovider.py [--batch all|id,id,...] [--specialise] [--specialise-devices] graph.xml\n"
+
+    args=sys.argv[1:]
+    while len(args)>0 and args[0].startswith("--"):
+        if args[0]=="--batch" and len(args)>1:
+            # Comma separated list of device type ids, or "all"
+            for id in args[1].split(","):
+                options.batch_device_types.add("*" if id=="all" else id)
+            args=args[2:]
+        elif args[0]=="--specialise":
+            specialise=True
+            args=args[1:]
+        elif args[0]=="--specialise-devices":
+            specialise=True
+            specialise_devices=True
+            args=args[1:]
+        else:
+            sys.stderr.write(usage)
+            sys.exit(1)
+    if len(args)!=1:
+        sys.stderr.write(usage)
+        sys.exit(1)
+
+    path=args[0]
+    if specialise:
+        (gt,gi)=load_graph(path,path)
+        if gi is None:
+            sys.stderr.write("Specialisation needs a graph instance, but the file only contains a graph type.\n")
+            sys.exit(1)
+        options.specialisation=Specialisation(gi, specialise_devices)
+        spec=options.specialisation
+        sys.stderr.write(f"Specialising for instance {gi.id}: graph properties {'baked' if spec.graph_properties is not None else 'empty'}, "
+            f"{len(spec.used_device_types)} of {len(gt.device_types)} device types used, "
+            f"{len(spec.device_properties)} with uniform properties baked, "
+            f"{len(spec.used_inputs)} of {sum(len(dt.inputs_by_index) for dt in gt.device_types.values())} input pins used.\n")
+    else:
+        gt=load_graph_type(path,path)
 
     render_graph_type_as_sprovider(gt, options)
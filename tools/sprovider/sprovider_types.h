@@ -11,6 +11,30 @@
 
 #define SPROVIDER_ALWAYS_INLINE inline __attribute__((always_inline))
 
+/* Marks the loop in batch handlers as having no dependencies between
+   iterations, so that the compiler is free to vectorise across devices. */
+#if defined(__clang__)
+#define SPROVIDER_BATCH_LOOP _Pragma("clang loop vectorize(enable)")
+#elif defined(__GNUC__)
+#define SPROVIDER_BATCH_LOOP _Pragma("GCC ivdep")
+#else
+#define SPROVIDER_BATCH_LOOP
+#endif
+
+#if defined(__GNUC__)
+#define SPROVIDER_RESTRICT __restrict__
+#else
+#define SPROVIDER_RESTRICT
+#endif
+
+/* Storage for graph instance values that are baked into a specialised provider. They need to
+   be compile-time constants so that the compiler can fold them into the handlers. */
+#if __OPENCL__
+#define SPROVIDER_SPECIALISED_CONST __constant
+#else
+#define SPROVIDER_SPECIALISED_CONST static constexpr
+#endif
+
 #ifndef SPROVIDER_ENABLE_FUNCTION_POINTERS
 #if __OPENCL__
 #define SPROVIDER_ENABLE_FUNCTION_POINTERS 0
@@ -81,6 +105,11 @@ typedef bool active_flag_t;
 
 
     All *_padded refer to the size padded up to 4 bytes.
+
+    A provider can be specialised for one graph instance, in which case the specialised_* fields
+    say what was baked into the handlers. The environment must check that the instance it loads
+    matches, as the handlers no longer look at the values it passes in. Providers that aren't
+    specialised leave them all zero.
  */
 
 struct sprovider_input_info_t
@@ -94,6 +123,8 @@ struct sprovider_input_info_t
     unsigned state_size;
     unsigned state_size_padded;
     unsigned properties_state_size_padded;
+    bool is_supervisor; // Implicit input from the supervisor
+    bool specialised_unused; // Receive handler was removed, as no edges in the instance go to this pin
 };
 
 struct sprovider_output_info_t
@@ -103,6 +134,7 @@ struct sprovider_output_info_t
     unsigned message_size;
     unsigned message_size_padded;
     bool is_indexed;
+    bool is_supervisor; // Implicit output to the supervisor
 };
 
 struct sprovider_device_info_t
@@ -120,6 +152,9 @@ struct sprovider_device_info_t
     unsigned output_count;
     sprovider_input_info_t inputs[32];
     sprovider_output_info_t outputs[32];
+    bool has_batch; // True if sprovider_calc_rts_batch is supported for this type
+    bool specialised_unused; // Handlers were removed, as the instance has no devices of this type
+    const void *specialised_properties; // If non-null, properties of every device of this type in the instance
 };
 
 struct sprovider_graph_info_t
@@ -130,6 +165,8 @@ struct sprovider_graph_info_t
     bool has_any_indexed_send; // True if there is any output on any device that is indexed
     unsigned properties_size;
     unsigned properties_size_padded;
+    bool has_supervisor; // True if the graph type has a supervisor type
+    const void *specialised_properties; // If non-null, graph instance properties the handlers use
 };
 
 
@@ -178,6 +215,22 @@ static active_flag_t sprovider_do_recv(void *_ctxt, unsigned _device_type_index,
 */
 static active_flag_t sprovider_try_send_or_compute(void *_ctxt, unsigned _device_type_index, const void *gp, void *dp_ds, int *action_taken, int *output_port, unsigned *message_size, int *sendIndex, void *m);
 
+/* Identical to sprovider_try_send_or_compute, except that rts and requestCompute are
+    supplied by the caller rather than being calculated. They must be exactly what
+    sprovider_calc_rts (or sprovider_calc_rts_batch) would return for the current device state. */
+static active_flag_t sprovider_send_or_compute_with_rts(void *_ctxt, unsigned _device_type_index, const void *gp, void *dp_ds, uint32_t rts, bool requestCompute, int *action_taken, int *output_port, unsigned *message_size, int *sendIndex, void *m);
+
+/* Calculates rts and requestCompute for n devices of the same type, where the properties and
+    state of device i start at ((char*)dp_ds_base)+i*stride. The loop over devices has no
+    dependencies between iterations, so if the rts handler is simple arithmetic the compiler
+    can execute it in lockstep using SIMD.
+
+    Returns false (and writes nothing) if the device type has no batch handler, in which case
+    the caller needs to fall back to sprovider_calc_rts. SPROVIDER_DEVICE_TYPE_INFO[].has_batch
+    says ahead of time which types are supported.
+*/
+static bool sprovider_calc_rts_batch(void *_ctxt, unsigned _device_type_index, const void *gp, unsigned n, const void *dp_ds_base, unsigned stride, uint32_t *rts, bool *requestCompute);
+
 /* It is the caller's responsibility to make sure that the given handler is
 value for the current device state. */
 static active_flag_t sprovider_do_send(void *_ctxt, unsigned _device_type_index, unsigned _pin_index, const void *gp, void *dp_ds, bool *doSend, int *sendIndex, void *m);
@@ -198,6 +251,28 @@ static active_flag_t sprovider_do_device_idle(void *_ctxt, unsigned _device_type
 static active_flag_t sprovider_do_init(void *_ctxt, unsigned _device_type_index, const void *gp, void *dp_ds);
 
 
+/* Supervisor handlers. There is a single supervisor instance, so the supervisor
+    properties and state live inside the provider. All supervisor handlers must be
+    called from one thread at a time, and are only present if SPROVIDER_GRAPH_TYPE_INFO.has_supervisor
+    is true (otherwise they do nothing).
+
+    sprovider_supervisor_recv handles a message from a device's supervisor implicit output. If
+    *rtsReply is set on exit then reply should be delivered to the sending device's supervisor
+    implicit input, and if *rtsBcast is set then bcast should be delivered to all devices with
+    a supervisor implicit input. Both flags should be false on entry.
+*/
+static void sprovider_supervisor_init(const void *gp);
+
+static void sprovider_supervisor_recv(const void *gp, const void *m, void *reply, void *bcast, bool *rtsReply, bool *rtsBcast);
+
+static void sprovider_supervisor_idle(const void *gp);
+
+static void sprovider_supervisor_stop(const void *gp);
+
+/* Called by the supervisor if it wants the application to finish. Must be supplied by the environment. */
+void sprovider_supervisor_stop_application();
+
+
 
 ////////////////////////////////////////////////////////////////////
 // This section is stuff that must be generated
@@ -1,4 +1,5 @@
 #include "graph_dom.hpp"
+#include "compact_graph_dom.hpp"
 
 #include "xml_pull_parser.hpp"
 #include "graph_persist_sax_writer.hpp"
@@ -7,6 +8,16 @@
 #include <iostream>
 #include <fstream>
 
+#include <sys/resource.h>
+
+// Peak resident memory so far, so the two DOMs can be compared once loaded
+static long peak_rss_kb()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss; // Kilobytes on linux
+}
+
 int main(int argc, char *argv[])
 {
   try{
@@ -15,6 +26,14 @@ int main(int argc, char *argv[])
     filepath src("/dev/stdin");
     filepath dst("/dev/stdout");
 
+    // Round trip through CompactGraphDOM rather than GraphDOM
+    bool compact=false;
+    if(argc>1 && !strcmp(argv[1], "--compact")){
+      compact=true;
+      argc--;
+      argv++;
+    }
+
     if(argc>1){
       src=filepath(argv[1]);
     }
@@ -22,12 +41,23 @@ int main(int argc, char *argv[])
       dst=filepath(argv[2]);
     }
 
-    GraphDOMBuilder builder;
-    loadGraphPull(nullptr, src, &builder);
-
     auto sink=createSAXWriterOnFile(dst.c_str());
 
-    save(builder.g, sink.get() );
+    if(compact){
+      CompactGraphDOMBuilder builder(true);
+      loadGraphPull(nullptr, src, &builder);
+      validate_graph(builder.g);
+      fprintf(stderr, "Devices = %zu, edges = %zu, payloads = %zu, memory = %zu bytes\n",
+        builder.g.device_count(), builder.g.edge_count(), builder.g.payloads.size(), builder.g.memory_usage());
+      fprintf(stderr, "Loaded, peak rss = %ld KB\n", peak_rss_kb());
+      save(std::move(builder.g), sink.get() );
+    }else{
+      GraphDOMBuilder builder;
+      loadGraphPull(nullptr, src, &builder);
+      fprintf(stderr, "Loaded, peak rss = %ld KB\n", peak_rss_kb());
+
+      save(builder.g, sink.get() );
+    }
 
     fprintf(stderr, "Done\n");
 
@@ -0,0 +1,35 @@
+load bats_helpers
+
+setup() {
+    make_target bin/test_graph_dom bin/generate_graph_instance bin/topologically_compare_graph_instances
+}
+
+@test "test_graph_dom --compact round trips generated graphs" {
+    WD=$(make_test_wd)
+    for spec in clock_tree:4,2,10 storm:64,16,64 gals_heat:16 ; do
+        bin/generate_graph_instance $spec --v4 $WD/in.xml
+        bin/test_graph_dom --compact $WD/in.xml $WD/compact.xml
+        bin/topologically_compare_graph_instances $WD/in.xml $WD/compact.xml
+        bin/test_graph_dom $WD/in.xml $WD/dom.xml
+        bin/topologically_compare_graph_instances $WD/compact.xml $WD/dom.xml
+    done
+}
+
+@test "test_graph_dom --compact uses less memory than GraphDOM once loaded" {
+    WD=$(make_test_wd)
+    bin/generate_graph_instance gals_heat:200 --v4 $WD/big.xml
+
+    run bin/test_graph_dom --compact $WD/big.xml $WD/compact.xml
+    [[ $status -eq 0 ]]
+    local compact_kb=$(echo "$output" | sed -n 's/^Loaded, peak rss = \([0-9]*\) KB$/\1/p')
+    local reported_kb=$(( $(echo "$output" | sed -n 's/^.*memory = \([0-9]*\) bytes$/\1/p') / 1024 ))
+
+    run bin/test_graph_dom $WD/big.xml $WD/dom.xml
+    [[ $status -eq 0 ]]
+    local dom_kb=$(echo "$output" | sed -n 's/^Loaded, peak rss = \([0-9]*\) KB$/\1/p')
+
+    >&3 echo "# compact reported ${reported_kb} KB, peak ${compact_kb} KB; GraphDOM peak ${dom_kb} KB"
+    # The estimate can't be more than what was actually resident
+    [[ $reported_kb -gt 0 && $reported_kb -le $compact_kb ]]
+    [[ $compact_kb -lt $dom_kb ]]
+}
@@ -0,0 +1,112 @@
+#define RAPIDJSON_HAS_STDSTRING 1
+#include "graph.hpp"
+
+#include "graph_persist_hash_topology_impl.hpp"
+
+/* Hashes a graph split over several hashers: devices are dealt out in turn,
+   and edges are dealt out with a different stride, so most edges end up in
+   a part which never saw the devices at either end. */
+class SplitGraphHasher
+  : public GraphLoadEvents
+{
+private:
+  std::vector<uint64_t> m_idHashes;
+  uint64_t m_edgeCount=0;
+public:
+  std::vector<std::shared_ptr<GraphPersistHashTopology>> parts;
+
+  SplitGraphHasher(unsigned n, unsigned bucketBits)
+  {
+    for(unsigned i=0; i<n; i++){
+      parts.push_back(std::make_shared<GraphPersistHashTopology>(bucketBits));
+    }
+  }
+
+  uint64_t onBeginGraphInstance(
+    const GraphTypePtr &graph,
+    const std::string &id,
+    const TypedDataPtr &properties,
+    rapidjson::Document &&metadata
+  ) override
+  {
+    for(auto &p : parts){
+      p->onBeginGraphInstance(graph, id, properties, rapidjson::Document());
+    }
+    return 0;
+  }
+
+  uint64_t onDeviceInstance
+  (
+   uint64_t graphInst,
+   const DeviceTypePtr &dt,
+   const std::string &id,
+   const TypedDataPtr &properties,
+   const TypedDataPtr &state,
+   rapidjson::Document &&metadata
+  ) override
+  {
+    uint64_t index=m_idHashes.size();
+    m_idHashes.push_back(GraphPersistHashTopology::hash_id(id));
+    parts[index%parts.size()]->onDeviceInstance(graphInst, dt, id, properties, state);
+    return index;
+  }
+
+  void onEdgeInstance
+  (
+   uint64_t graphInst,
+   uint64_t dstDevInst, const DeviceTypePtr &dstDevType, const InputPinPtr &dstPin,
+   uint64_t srcDevInst,  const DeviceTypePtr &srcDevType, const OutputPinPtr &srcPin,
+   int sendIndex,
+   const TypedDataPtr &properties,
+   const TypedDataPtr &state,
+   rapidjson::Document &&metadata
+  ) override
+  {
+    auto &p=parts[(m_edgeCount++ * 7 + 1)%parts.size()];
+    p->add_edge(m_idHashes.at(dstDevInst), dstPin, m_idHashes.at(srcDevInst), srcPin, sendIndex, properties, state);
+  }
+};
+
+int main(int argc, char *argv[])
+{
+  try{
+    if(argc<2){
+      fprintf(stderr, "test_graph_persist_hash_topology graph.xml\n");
+      exit(1);
+    }
+    filepath srcPath(argv[1]);
+
+    GraphPersistHashTopology whole(8);
+    loadGraphPull(nullptr, srcPath, &whole);
+
+    for(unsigned n : {1u, 2u, 5u}){
+      SplitGraphHasher split(n, 8);
+      loadGraphPull(nullptr, srcPath, &split);
+
+      GraphPersistHashTopology &merged=*split.parts[0];
+      for(unsigned i=1; i<n; i++){
+        merged.merge(*split.parts[i]);
+      }
+
+      if(merged.get_hash()!=whole.get_hash() || merged.get_buckets()!=whole.get_buckets()){
+        throw std::runtime_error("Merging "+std::to_string(n)+" parts doesn't match the whole graph\n"+whole.report(merged));
+      }
+      if(n>1){
+        // Merging a part twice counts it twice
+        merged.merge(*split.parts[1]);
+        if(merged.get_hash()==whole.get_hash()){
+          throw std::runtime_error("Overlapping merge gave the same hash.");
+        }
+      }
+    }
+
+    fprintf(stderr, "Merged hashes match.\n");
+    return 0;
+  }catch(std::exception &e){
+    std::cerr<<"Exception : "<<e.what()<<"\n";
+    exit(1);
+  }catch(...){
+    std::cerr<<"Exception of unknown type\n";
+    exit(1);
+  }
+}
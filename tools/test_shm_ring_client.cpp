@@ -0,0 +1,89 @@
+#include "inproc_ring_connection.hpp"
+
+#include <iostream>
+
+#pragma pack(push,1)
+struct msg_message_t
+{
+  uint32_t payload1;
+  float payload2;
+};
+#pragma pack(pop)
+
+/* Out-of-process version of the test_external_ping_pong external, which
+   talks to a simulator started with --external SHM:<name>. The device type
+   pattern used to bind outsider_0 can be changed to check that the simulator
+   rejects bad bindings. */
+int main(int argc, char *argv[])
+{
+  try{
+    if(argc<2){
+      fprintf(stderr, "test_shm_ring_client name [outsider-type-pattern]\n");
+      exit(1);
+    }
+    std::string name=argv[1];
+    std::string typePattern= argc>2 ? argv[2] : "outsider";
+
+    // The simulator might not have created the segment yet
+    std::unique_ptr<ShmRingClient> pServices;
+    for(unsigned i=0; !pServices; i++){
+      try{
+        pServices.reset(new ShmRingClient(name));
+      }catch(std::exception &){
+        if(i>=100){
+          throw;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+    }
+    auto &services=*pServices;
+
+    services.check_interface_hash_value();
+
+    services.connect(
+      "test_external_ping_pong",
+      "test_external_ping_pong_inst_1",
+      {
+        {"outsider_0",typePattern}
+      }
+    );
+
+    auto outsider_0=services.get_device_address("outsider_0");
+
+    std::vector<uint8_t> msgG;
+    for(unsigned i=0; i<10; i++){
+      msgG.resize(sizeof(msg_message_t));
+      auto msg=(msg_message_t*)&(msgG[0]);
+      msg->payload1=i+1;
+      msg->payload2=i*i;
+
+      services.wait_until(InProcessBinaryUpstreamConnection::Events::CAN_SEND);
+      services.send(makeEndpoint(outsider_0, poets_pin_index_t{0}), msgG, UINT_MAX);
+
+      services.wait_until(InProcessBinaryUpstreamConnection::Events::CAN_RECV);
+      poets_endpoint_address_t source;
+      unsigned sendIndex;
+      if(!services.recv(source, msgG, sendIndex)){
+        throw std::runtime_error("Expected a message.");
+      }
+
+      msg=(msg_message_t*)&(msgG[0]);
+      if(msgG.size()!=sizeof(msg_message_t) || msg->payload1!=i+1 || msg->payload2!=i*i){
+        throw std::runtime_error("Received the wrong message.");
+      }
+    }
+
+    std::vector<uint8_t> hmG(sizeof(halt_message_type), 0);
+    while(!services.send(makeEndpoint(outsider_0, poets_pin_index_t{1}), hmG)){
+      services.wait_until(InProcessBinaryUpstreamConnection::Events::CAN_SEND);
+    }
+    services.flush();
+
+  }catch(std::exception &e){
+    std::cerr<<"Exception : "<<e.what()<<"\n";
+    exit(1);
+  }catch(...){
+    std::cerr<<"Exception of unknown type\n";
+    exit(1);
+  }
+}
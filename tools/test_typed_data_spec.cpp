@@ -1,6 +1,12 @@
 #include "typed_data_spec.hpp"
+#include "typed_data_codec.hpp"
+#include "graph.hpp"
 
 #include <limits>
+#include <random>
+#include <sstream>
+#include <cstring>
+#include <cmath>
 
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/prettywriter.h"
@@ -260,6 +266,260 @@ void test_array_in_tuple()
     assert(tmp.z==0);
 }
 
+/* Differential tests of TypedDataCodec against the element tree, which is what
+   TypedDataSpecImpl uses when POETS_TYPED_DATA_INTERPRETED is defined. */
+
+std::string tree_to_json(const TypedDataSpecElementTuplePtr &ts, const std::vector<char> &value)
+{
+    rapidjson::Document doc;
+    return str(ts->binaryToJSON(value.data(), value.size(), doc.GetAllocator()));
+}
+
+std::string tree_to_xml_v4(const TypedDataSpecElementTuplePtr &ts, const std::vector<char> &value)
+{
+    std::stringstream acc;
+    ts->binaryToXmlV4Value(value.data(), value.size(), acc, 0);
+    return acc.str();
+}
+
+/* Simple values are ones every parser gets exactly: small dyadic floats, and
+   64-bit integers that fit in a double. Otherwise anything finite goes,
+   including the extremes of each type. */
+void fill_random(const TypedDataSpecElement *e, char *p, std::mt19937_64 &rng, bool simple)
+{
+    if(auto t=dynamic_cast<const TypedDataSpecElementTuple*>(e)){
+        for(const auto &m : *t){
+            fill_random(m.get(), p, rng, simple);
+            p+=m->getPayloadSize();
+        }
+        return;
+    }
+    if(auto a=dynamic_cast<const TypedDataSpecElementArray*>(e)){
+        auto elt=a->getElementType();
+        for(unsigned i=0; i<a->getElementCount(); i++){
+            fill_random(elt.get(), p+i*elt->getPayloadSize(), rng, simple);
+        }
+        return;
+    }
+
+    auto s=dynamic_cast<const TypedDataSpecElementScalar*>(e);
+    assert(s);
+    const std::string &type=s->getTypeName();
+    unsigned cb=s->getPayloadSize();
+
+    // Often leave it as the default, so that members are left out of the JSON
+    if(rng()%3==0){
+        s->createBinaryDefault(p, cb);
+        return;
+    }
+
+    if(type=="float" || type=="double"){
+        double v;
+        if(simple){
+            v=((int)(rng()%20001)-10000)/16.0;
+        }else{
+            switch(rng()%6){
+            case 0: v = type=="float" ? std::numeric_limits<float>::max() : std::numeric_limits<double>::max(); break;
+            case 1: v = type=="float" ? std::numeric_limits<float>::lowest() : std::numeric_limits<double>::lowest(); break;
+            case 2: v = type=="float" ? std::numeric_limits<float>::denorm_min() : std::numeric_limits<double>::denorm_min(); break;
+            case 3: v = -0.0; break;
+            default: v = ldexp( (double)(int64_t)rng() / 9223372036854775808.0, (int)(rng()%121)-60 ); break;
+            }
+        }
+        if(type=="float"){
+            float f=(float)v;
+            memcpy(p, &f, 4);
+        }else{
+            memcpy(p, &v, 8);
+        }
+        return;
+    }
+
+    bool isSigned = type=="char" || type.compare(0,3,"int")==0;
+    uint64_t bits=rng();
+    if(simple && cb==8){
+        bits &= (1ull<<53)-1;
+        if(isSigned && (rng()&1)){
+            bits = -bits;
+        }
+    }else if(!simple && rng()%3==0){
+        // Extremes, which are the most likely to go wrong with a detour through double
+        bits = isSigned ? (1ull<<(8*cb-1)) - (rng()&1) : ~0ull - (rng()&1);
+    }
+    memcpy(p, &bits, cb); // Little-endian, so this is the bottom bits
+}
+
+void check_codec_against_tree(const TypedDataSpecElementTuplePtr &ts, const std::vector<char> &value, bool xml, bool treeReads)
+{
+    TypedDataCodec codec(ts);
+    unsigned cb=ts->getPayloadSize();
+    assert(value.size()==cb);
+
+    std::string json=codec.binaryToJSON(value.data(), cb);
+    if(json!=tree_to_json(ts, value)){
+        std::cerr<<"codec = "<<json<<"\ntree = "<<tree_to_json(ts, value)<<"\n";
+        assert(0);
+    }
+
+    std::vector<char> got(cb);
+    ts->createBinaryDefault(got.data(), cb);
+    codec.JSONToBinary(json.c_str(), got.data(), cb, false);
+    assert(got==value);
+
+    if(treeReads){
+        std::vector<char> fromTree(cb);
+        rapidjson::Document doc;
+        doc.Parse(json.c_str());
+        ts->JSONToBinary(doc, fromTree.data(), cb);
+        assert(fromTree==value);
+    }
+
+    if(xml){
+        std::string text=codec.binaryToXmlV4Value(value.data(), cb);
+        if(text!=tree_to_xml_v4(ts, value)){
+            std::cerr<<"codec = "<<text<<"\ntree = "<<tree_to_xml_v4(ts, value)<<"\n";
+            assert(0);
+        }
+
+        ts->createBinaryDefault(got.data(), cb);
+        codec.xmlV4ValueToBinary(text.c_str(), got.data(), cb);
+        assert(got==value);
+
+        if(treeReads){
+            std::vector<char> fromTree(cb);
+            std::stringstream src(text);
+            ts->xmlV4ValueToBinary(src, fromTree.data(), cb, false, 0);
+            assert(fromTree==value);
+        }
+    }
+}
+
+void test_codec_against_tree()
+{
+    std::mt19937_64 rng(1);
+
+    // Every scalar type apart from char, which has no XML v4 form
+    auto scalars=makeTuple("s", {
+        makeScalar("u8", "uint8_t", "3"),
+        makeScalar("u16", "uint16_t"),
+        makeScalar("u32", "uint32_t", "7"),
+        makeScalar("u64", "uint64_t"),
+        makeScalar("i8", "int8_t", "-2"),
+        makeScalar("i16", "int16_t"),
+        makeScalar("i32", "int32_t"),
+        makeScalar("i64", "int64_t", "-5"),
+        makeScalar("f", "float", "1.5"),
+        makeScalar("d", "double")
+    });
+
+    /* Without 64-bit integers, as the element tree doesn't skip their suffix when reading XML.
+       Array elements have no defaults of their own, as arrays default to zero but trim
+       trailing elements equal to the element default, so those wouldn't round trip. */
+    auto nested=makeTuple("n", {
+        makeScalar("a", "uint8_t"),
+        makeArray("b", 3, makeTuple("_", {
+            makeScalar("x", "int16_t"),
+            makeArray("y", 2, makeScalar("_", "float"))
+        })),
+        makeTuple("c", {
+            makeScalar("d", "double", "0.25"),
+            makeArray("e", 4, makeScalar("_", "uint32_t")),
+            makeTuple("empty", {})
+        }),
+        makeArray("g", 2, makeArray("_", 3, makeScalar("_", "int32_t")))
+    });
+
+    auto chars=makeTuple("c", {
+        makeScalar("c", "char"),
+        makeArray("s", 5, makeScalar("_", "char"))
+    });
+
+    for(unsigned i=0; i<200; i++){
+        for(bool simple : {true, false}){
+            std::vector<char> value(scalars->getPayloadSize());
+            fill_random(scalars.get(), value.data(), rng, simple);
+            check_codec_against_tree(scalars, value, true, false);
+
+            value.resize(nested->getPayloadSize());
+            fill_random(nested.get(), value.data(), rng, simple);
+            check_codec_against_tree(nested, value, true, simple);
+
+            // The element tree can't read char from JSON
+            value.resize(chars->getPayloadSize());
+            fill_random(chars.get(), value.data(), rng, simple);
+            check_codec_against_tree(chars, value, false, false);
+        }
+    }
+
+    // All defaults, which is the empty object
+    std::vector<char> value(nested->getPayloadSize());
+    nested->createBinaryDefault(value.data(), value.size());
+    check_codec_against_tree(nested, value, true, true);
+}
+
+/* Behaviour change: the element tree reads every JSON number as a double, so
+   64-bit integers above 2^53 were rounded. The codec reads them exactly. */
+void test_codec_64bit_extremes()
+{
+    auto ts=makeTuple("t", {
+        makeScalar("u", "uint64_t"),
+        makeScalar("i", "int64_t"),
+        makeArray("a", 3, makeScalar("_", "int64_t"))
+    });
+    TypedDataCodec codec(ts);
+
+#pragma pack(push,1)
+    struct{
+        uint64_t u;
+        int64_t i;
+        int64_t a[3];
+    } tmp, got;
+#pragma pack(pop)
+    assert(sizeof(tmp)==ts->getPayloadSize());
+
+    tmp.u=std::numeric_limits<uint64_t>::max();
+    tmp.i=std::numeric_limits<int64_t>::min();
+    tmp.a[0]=std::numeric_limits<int64_t>::max();
+    tmp.a[1]=std::numeric_limits<int64_t>::max()-1;
+    tmp.a[2]=(1ll<<53)+1;
+
+    std::string json=codec.binaryToJSON((const char*)&tmp, sizeof(tmp));
+    std::vector<char> value((const char*)&tmp, (const char*)&tmp+sizeof(tmp));
+    assert(json==tree_to_json(ts, value));
+    ts->createBinaryDefault((char*)&got, sizeof(got));
+    codec.JSONToBinary(json.c_str(), (char*)&got, sizeof(got), false);
+    assert(!memcmp(&tmp, &got, sizeof(tmp)));
+
+    // Values from v3 files are the members without the braces
+    ts->createBinaryDefault((char*)&got, sizeof(got));
+    codec.JSONToBinary(R"("u": 18446744073709551614, "a": [0, -9223372036854775807])", (char*)&got, sizeof(got), true);
+    assert(got.u==18446744073709551614ull);
+    assert(got.i==0);
+    assert(got.a[1]==-9223372036854775807ll);
+
+    // The codec also takes C suffixes within arrays, which the element tree didn't
+    std::string text=codec.binaryToXmlV4Value((const char*)&tmp, sizeof(tmp));
+    assert(text==tree_to_xml_v4(ts, value));
+    ts->createBinaryDefault((char*)&got, sizeof(got));
+    codec.xmlV4ValueToBinary(text.c_str(), (char*)&got, sizeof(got));
+    assert(!memcmp(&tmp, &got, sizeof(tmp)));
+}
+
+#ifndef POETS_TYPED_DATA_INTERPRETED
+/* Behaviour change: TypedDataSpecImpl writes a null value as the default,
+   where the element tree threw because of the size mismatch. */
+void test_impl_null_is_default()
+{
+    TypedDataSpecImpl spec(makeTuple("_", {
+        makeScalar("x", "uint32_t", "7"),
+        makeArray("y", 2, makeScalar("_", "float"))
+    }));
+
+    assert(spec.toJSON(TypedDataPtr())==spec.toJSON(spec.create()));
+    assert(spec.toXmlV4ValueSpec(TypedDataPtr())==spec.toXmlV4ValueSpec(spec.create()));
+}
+#endif
+
 int main()
 
 {
@@ -295,5 +555,11 @@ int main()
     test_object_dual<char,float>("char","float");
     
     test_array_in_tuple();
+
+    test_codec_against_tree();
+    test_codec_64bit_extremes();
+#ifndef POETS_TYPED_DATA_INTERPRETED
+    test_impl_null_is_default();
+#endif
 }
 
@@ -2,6 +2,7 @@
 #include "graph.hpp"
 
 #include "graph_persist_hash_topology_impl.hpp"
+#include "graph_persist_topology_diff.hpp"
 
 
 int main(int argc, char *argv[])
@@ -10,6 +11,14 @@ int main(int argc, char *argv[])
     filepath refSrcFileName("-");
     filepath otherSrcFileName("");
 
+    // With --diff, a mismatch is followed by a list of the differing devices and edges
+    bool showDiff=false;
+    if(argc>1 && !strcmp(argv[1], "--diff")){
+      showDiff=true;
+      argc--;
+      argv++;
+    }
+
     if(argc>1){
       refSrcFileName=std::string(argv[1]);
     }
@@ -18,7 +27,10 @@ int main(int argc, char *argv[])
       otherSrcFileName=std::string(argv[2]);
     }
 
-    check_graph_instances_topologically_similar(refSrcFileName.c_str(), otherSrcFileName.c_str(), true);
+    if(!check_graph_instances_topologically_similar(refSrcFileName.c_str(), otherSrcFileName.c_str(), !showDiff)){
+      diff_graph_instances_streaming(nullptr, refSrcFileName, otherSrcFileName);
+      throw std::runtime_error("Graphs are not topologically similar");
+    }
 
     fprintf(stderr, "Graph typess match topologically.\n");
     return 0;
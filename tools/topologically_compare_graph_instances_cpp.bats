@@ -73,3 +73,38 @@ function setup_file {
         done
     done
 }
+
+@test "Check v4 graphs with devices and edges shuffled are topologically the same" {
+    local WD=$(get_bats_file_wd)
+    local T=$(make_test_wd)
+
+    for i in ${WD}/*.v4.xml ; do
+        local s=${T}/$(basename ${i%.v4.xml}).shuffled.v4.xml
+        # v4 writes one element per line, so shuffle the DevI lines among themselves, and the same for EdgeI
+        python3 - $i $s <<'PYEOF'
+import random, sys
+lines=open(sys.argv[1]).read().split('\n')
+random.seed(1)
+for tag in ('<DevI ', '<EdgeI '):
+    pos=[k for k,l in enumerate(lines) if l.lstrip().startswith(tag)]
+    vals=[lines[k] for k in pos]
+    random.shuffle(vals)
+    for k,v in zip(pos,vals):
+        lines[k]=v
+open(sys.argv[2],'w').write('\n'.join(lines))
+PYEOF
+        run cmp -s $i $s
+        [ "$status" -ne 0 ]
+        run bin/topologically_compare_graph_instances $i $s
+        [ "$status" -eq 0 ]
+    done
+}
+
+@test "Check hashes of parts of a graph merge to the hash of the whole graph" {
+    local WD=$(get_bats_file_wd)
+    make_target bin/test_graph_persist_hash_topology
+
+    for i in ${WD}/ct_4.v4.xml ${WD}/is_5.v3.xml ${WD}/gh_6.v4.xml ; do
+        bin/test_graph_persist_hash_topology $i
+    done
+}
@@ -1,8 +1,21 @@
 #define RAPIDJSON_HAS_STDSTRING 1
-#include "graph_dom.hpp"
+#include "compact_graph_dom.hpp"
 
 #include "xml_pull_parser.hpp"
 #include "graph_provider_helpers.hpp"
+#include "graph_persist_topology_diff.hpp"
+
+void usage()
+{
+  fprintf(stderr, "topologically_diff_graph_instances [options] ref.xml got.xml\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  --streaming : Compare devices and edges via sorted runs on disk, rather than loading both graphs.\n");
+  fprintf(stderr, "                All device ids are still held in memory, so memory is O(devices) but not O(edges).\n");
+  fprintf(stderr, "  --memory-mb n : Memory budget for sorting in streaming mode (default 1024).\n");
+  fprintf(stderr, "  --temp-dir path : Where sorted runs are spilled (default $TMPDIR or /tmp).\n");
+  fprintf(stderr, "  --threads n : Sorting threads in streaming mode (default is all cores).\n");
+  exit(1);
+}
 
 int main(int argc, char *argv[])
 {
@@ -10,31 +23,74 @@ int main(int argc, char *argv[])
     filepath refSrcFileName("-");
     filepath otherSrcFileName("");
 
-    if(argc>1){
-      refSrcFileName=std::string(argv[1]);
+    bool streaming=false;
+    streaming_diff_options_t streamingOptions;
+
+    std::vector<std::string> positional;
+    int ai=1;
+    while(ai<argc){
+      if(!strcmp(argv[ai], "--help")){
+        usage();
+      }else if(!strcmp(argv[ai], "--streaming")){
+        streaming=true;
+        ai++;
+      }else if(!strcmp(argv[ai], "--memory-mb")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Missing argument to --memory-mb\n");
+          usage();
+        }
+        streamingOptions.memoryBytes=size_t(strtoull(argv[ai+1], 0, 0))<<20;
+        ai+=2;
+      }else if(!strcmp(argv[ai], "--temp-dir")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Missing argument to --temp-dir\n");
+          usage();
+        }
+        streamingOptions.tempDir=argv[ai+1];
+        ai+=2;
+      }else if(!strcmp(argv[ai], "--threads")){
+        if(ai+1>=argc){
+          fprintf(stderr, "Missing argument to --threads\n");
+          usage();
+        }
+        streamingOptions.threads=strtoul(argv[ai+1], 0, 0);
+        ai+=2;
+      }else{
+        positional.push_back(argv[ai]);
+        ai++;
+      }
     }
 
-    if(argc>2){
-      otherSrcFileName=std::string(argv[2]);
+    if(positional.size()>0){
+      refSrcFileName=positional[0];
+    }
+
+    if(positional.size()>1){
+      otherSrcFileName=positional[1];
     }
 
     RegistryImpl registry;
 
-    GraphDOMBuilder builder_ref;
+    if(streaming){
+      auto differences=diff_graph_instances_streaming(&registry, refSrcFileName, otherSrcFileName, streamingOptions);
+      return differences==0 ? 0 : 1;
+    }
+
+    CompactGraphDOMBuilder builder_ref;
     loadGraphPull(&registry, refSrcFileName, &builder_ref);
-    GraphDOM ref{std::move(builder_ref.g)};
+    const CompactGraphDOM &ref=builder_ref.g;
 
-    GraphDOMBuilder builder_got;
+    CompactGraphDOMBuilder builder_got;
     loadGraphPull(&registry, otherSrcFileName, &builder_got);
-    GraphDOM got{std::move(builder_got.g)};
+    const CompactGraphDOM &got=builder_got.g;
 
     int differences=0;
 
-    auto ref_devices=ref.get_sorted_devices();
-    auto got_devices=got.get_sorted_devices();
+    const auto &ref_devices=ref.sortedDevices;
+    const auto &got_devices=got.sortedDevices;
 
     if(ref_devices.size()!=got_devices.size()){
-      fprintf(stderr, "Ref has %u devices, while got has %u\n", ref_devices.size(), got_devices.size());
+      fprintf(stderr, "Ref has %zu devices, while got has %zu\n", ref_devices.size(), got_devices.size());
       differences++;
     }
 
@@ -68,26 +124,36 @@ int main(int argc, char *argv[])
       }
     };
 
-    auto c_ref=ref.devices.begin(), e_ref=ref.devices.end();
-    auto c_got=got.devices.begin(), e_got=got.devices.end();
+    auto c_ref=ref_devices.begin(), e_ref=ref_devices.end();
+    auto c_got=got_devices.begin(), e_got=got_devices.end();
 
     while(c_ref!=e_ref && c_got!=e_got){
-      if(c_ref->first < c_got->first){
-        fprintf(stderr, "< device %s\n", c_ref->first.c_str());
+      std::string id_ref(ref.device_id(*c_ref)), id_got(got.device_id(*c_got));
+      if(id_ref < id_got){
+        fprintf(stderr, "< device %s\n", id_ref.c_str());
         ++c_ref;
         ++differences;
-      }else if(c_ref->first > c_got->first){
-        fprintf(stderr, "> device %s\n", c_got->first.c_str());
+      }else if(id_ref > id_got){
+        fprintf(stderr, "> device %s\n", id_got.c_str());
         ++c_got;
         ++differences;
       }else{
-        fprintf(stderr, "= device %s\n", c_ref->first.c_str());
-        diff_data(c_ref->second.type->getPropertiesSpec(), c_ref->second.properties, c_got->second.properties, c_ref->first, "properties");
-        diff_data(c_ref->second.type->getStateSpec(), c_ref->second.state, c_got->second.state, c_ref->first, "state");
+        fprintf(stderr, "= device %s\n", id_ref.c_str());
+        const auto &type=ref.device_type(*c_ref);
+        diff_data(type->getPropertiesSpec(), ref.device_properties(*c_ref), got.device_properties(*c_got), id_ref, "properties");
+        diff_data(type->getStateSpec(), ref.device_state(*c_ref), got.device_state(*c_got), id_ref, "state");
         ++c_got;
         ++c_ref;
       }
     }
+    for(; c_ref!=e_ref; ++c_ref){
+      fprintf(stderr, "< device %s\n", std::string(ref.device_id(*c_ref)).c_str());
+      ++differences;
+    }
+    for(; c_got!=e_got; ++c_got){
+      fprintf(stderr, "> device %s\n", std::string(got.device_id(*c_got)).c_str());
+      ++differences;
+    }
     
     return differences==0 ? 0 : 1;
   }catch(std::exception &e){
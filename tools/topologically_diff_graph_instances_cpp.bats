@@ -73,3 +73,39 @@ function setup_file {
         done
     done
 }
+
+@test "Check streaming diff agrees with the in-memory diff" {
+    local WD=$(get_bats_file_wd)
+
+    for i in ${WD}/ct_*.v4.xml ${WD}/is_4.v3.xml ; do
+        for j in ${WD}/ct_3.v3.xml ${WD}/ct_5.v4.xml ; do
+            run bin/topologically_diff_graph_instances $i $j
+            local status_ref=$status
+            local devices_ref=$(echo "$output" | grep -E '^[<>] device' || true)
+
+            run bin/topologically_diff_graph_instances --streaming --memory-mb 1 --threads 2 $i $j
+            [ "$status" -eq "$status_ref" ]
+            [ "$devices_ref" == "$(echo "$output" | grep -E '^[<>] device' || true)" ]
+        done
+    done
+}
+
+@test "Check both diffs report a changed property, and streaming diff reports a missing edge" {
+    local WD=$(get_bats_file_wd)
+    local T=$(make_test_wd)
+
+    # Change the fanout of the root, and drop one edge
+    sed -e '/<DevI id="root" type="root">/{n;s/"fanout": 2/"fanout": 3/}' \
+        -e '/<EdgeI path="root_0:ack_in-root_0_0:ack_out"/d' \
+        ${WD}/ct_4.v3.xml > ${T}/ct_4_changed.v3.xml
+
+    run bin/topologically_diff_graph_instances ${WD}/ct_4.v3.xml ${T}/ct_4_changed.v3.xml
+    [ "$status" -ne 0 ]
+    echo "$output" | grep -Fx "<> Thing root properties"
+
+    run bin/topologically_diff_graph_instances --streaming --memory-mb 1 --threads 2 ${WD}/ct_4.v3.xml ${T}/ct_4_changed.v3.xml
+    [ "$status" -ne 0 ]
+    echo "$output" | grep -Fx "<> Thing root properties"
+    echo "$output" | grep -Fx "< edge root_0:ack_in-root_0_0:ack_out"
+    [ $(echo "$output" | grep -c -E '^(<|>|<>) ') -eq 2 ]
+}